@@ -0,0 +1,152 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common_util.h"
+#include "tree_abstraction.h"
+
+// Measure time to collect code blocks and abstract them with increasing size
+// of source file. A function with N if statements has a compound statement
+// with N children, and nested if statements make a tree of depth N, so time
+// per code block should stay flat as N grows if collection and abstraction
+// are linear. A real source file (such as amalgamated sqlite3.c) can also be
+// given.
+
+namespace {
+struct BenchmarkArgs {
+  std::string source_file_ = "";
+  size_t max_statements_ = 64000;
+  size_t num_repetitions_ = 5;
+};
+
+double ElapsedSecs(const Timer& timer) {
+  struct timeval diff = timer.TimerDiffToTimeval();
+  return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+// Source code of a function with num_statements if statements, which are
+// nested if nested is true.
+std::string GenerateSource(size_t num_statements, bool nested) {
+  std::ostringstream source;
+  source << "int foo(int x, int* p) {\n";
+  for (size_t i = 0; i < num_statements; i++) {
+    source << "  if (x > " << i << " && !p[" << i << "]) "
+           << (nested ? "{\n" : "x++;\n");
+  }
+  if (nested) {
+    for (size_t i = 0; i < num_statements; i++) source << "}\n";
+  }
+  source << "  return x;\n}\n";
+  return source.str();
+}
+
+void RunBenchmark(const std::string& name, const std::string& source,
+                  const BenchmarkArgs& args) {
+  Timer parse_timer;
+  parse_timer.StartTimer();
+  ManagedTSTree tree = GetTSTree<LANGUAGE_C>(source);
+  parse_timer.StopTimer();
+
+  double collect_secs = 0, abstract_secs = 0;
+  size_t num_code_blocks = 0;
+  MultiLevelAbstraction abstraction;
+  for (size_t i = 0; i < args.num_repetitions_; i++) {
+    code_blocks_t code_blocks;
+    Timer collect_timer;
+    collect_timer.StartTimer();
+    CollectCodeBlocksOfInterest<LANGUAGE_C>(tree, code_blocks);
+    collect_timer.StopTimer();
+    collect_secs += ElapsedSecs(collect_timer);
+
+    Timer abstract_timer;
+    abstract_timer.StartTimer();
+    for (const auto& code_block : code_blocks) {
+      MultiLevelAbstractor<LANGUAGE_C>::Abstract(code_block, abstraction);
+    }
+    abstract_timer.StopTimer();
+    abstract_secs += ElapsedSecs(abstract_timer);
+    num_code_blocks = code_blocks.size();
+  }
+
+  size_t num_blocks = std::max<size_t>(1, num_code_blocks) *
+                      args.num_repetitions_;
+  std::cout << name << " bytes=" << source.size()
+            << " code_blocks=" << num_code_blocks
+            << " parse=" << ElapsedSecs(parse_timer) << "s"
+            << " collect_ns/block=" << collect_secs * 1e9 / num_blocks
+            << " abstract_ns/block=" << abstract_secs * 1e9 / num_blocks
+            << std::endl;
+}
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  BenchmarkArgs args;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:n:r:")) != -1) {
+    switch (opt) {
+      case 'f': args.source_file_ = FormatPath(optarg); break;
+      case 'n': args.max_statements_ = std::max(1, atoi(optarg)); break;
+      case 'r': args.num_repetitions_ = std::max(1, atoi(optarg)); break;
+      default:
+        std::cerr << "Usage: " << argv[0] << std::endl
+                  << "  [-f C_source_file]               (default: none)"
+                  << std::endl
+                  << "  [-n max_number_of_if_statements] (default: 64000)"
+                  << std::endl
+                  << "  [-r number_of_repetitions]       (default: 5)"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+  }
+
+  try {
+    if (args.source_file_ != "") {
+      std::ifstream ifs(args.source_file_.c_str());
+      if (!ifs.is_open()) {
+        throw cf_file_access_exception("Open failed:" + args.source_file_);
+      }
+      std::stringstream buffer;
+      buffer << ifs.rdbuf();
+      RunBenchmark(args.source_file_, buffer.str(), args);
+    }
+
+    // 1000, 2000, 4000, ... max_statements
+    for (bool nested : {false, true}) {
+      for (size_t num_statements = 1000;
+           num_statements <= args.max_statements_; num_statements *= 2) {
+        RunBenchmark(std::string(nested ? "nested" : "sequential") +
+                     " statements=" + std::to_string(num_statements),
+                     GenerateSource(num_statements, nested), args);
+      }
+    }
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
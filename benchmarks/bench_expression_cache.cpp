@@ -0,0 +1,135 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "common_util.h"
+#include "expression_cache.h"
+
+// Measure throughput of cache hits with increasing number of threads. All the
+// threads look up expressions that are in the cache, which is the common case
+// when scanning a big repository.
+
+namespace {
+struct BenchmarkArgs {
+  size_t max_threads_ = std::max(1u, std::thread::hardware_concurrency());
+  size_t num_expressions_ = 10000;
+  size_t num_lookups_per_thread_ = 2000000;
+};
+
+double RunLookups(NearestExpressionsCache& cache,
+    const std::vector<std::string>& expressions,
+    const std::vector<NearestExpressionsCache::KeyHash>& hashes,
+    size_t num_threads, size_t num_lookups_per_thread) {
+  auto lookup_fn = [&](size_t thread_num) {
+    std::minstd_rand random(thread_num);
+    CompactNearestExpressions nearest_expressions;
+    for (size_t i = 0; i < num_lookups_per_thread; i++) {
+      size_t index = random() % expressions.size();
+      cache.LookUp(expressions[index], hashes[index], nearest_expressions);
+    }
+  };
+
+  Timer timer;
+  timer.StartTimer();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.push_back(std::thread(lookup_fn, i));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  timer.StopTimer();
+
+  struct timeval diff = timer.TimerDiffToTimeval();
+  double secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+  return (num_threads * num_lookups_per_thread) / secs / 1000000.0;
+}
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  BenchmarkArgs args;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:k:n:")) != -1) {
+    switch (opt) {
+      case 'j': args.max_threads_ = std::max(1, atoi(optarg)); break;
+      case 'k': args.num_expressions_ = std::max(1, atoi(optarg)); break;
+      case 'n': args.num_lookups_per_thread_ = std::max(1, atoi(optarg));
+                break;
+      default:
+        std::cerr << "Usage: " << argv[0] << std::endl
+                  << "  [-j max_number_of_threads] (default: num_cpus)"
+                  << std::endl
+                  << "  [-k number_of_cached_expressions] (default: 10000)"
+                  << std::endl
+                  << "  [-n number_of_lookups_per_thread] (default: 2000000)"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+  }
+
+  // Expressions that look like compacted expressions.
+  std::vector<std::string> expressions;
+  std::vector<NearestExpressionsCache::KeyHash> hashes;
+  for (size_t i = 0; i < args.num_expressions_; i++) {
+    expressions.push_back("(1 (2 (\"==\") (" + std::to_string(i % 97) +
+                          ") (" + std::to_string(i) + ")))");
+    hashes.push_back(NearestExpressionsCache::Hash(expressions.back()));
+  }
+  CompactNearestExpressions nearest_expressions = {
+    {kBaseExpressionID, 0}, {1, 1}, {2, 1}, {3, 2}, {4, 2}};
+
+  const size_t kMemoryBudget = 1024 * 1024 * 1024;
+  for (size_t num_shards : {static_cast<size_t>(1),
+                            NearestExpressionsCache::kDefaultNumShards}) {
+    NearestExpressionsCache cache(kMemoryBudget, num_shards);
+    for (size_t i = 0; i < expressions.size(); i++) {
+      cache.Insert(expressions[i], hashes[i], nearest_expressions);
+    }
+
+    // 1, 2, 4, ... max_threads
+    std::vector<size_t> thread_counts;
+    for (size_t num_threads = 1; num_threads < args.max_threads_;
+         num_threads *= 2) {
+      thread_counts.push_back(num_threads);
+    }
+    thread_counts.push_back(args.max_threads_);
+
+    double single_thread_throughput = 0;
+    for (size_t num_threads : thread_counts) {
+      double throughput = RunLookups(cache, expressions, hashes, num_threads,
+                                     args.num_lookups_per_thread_);
+      if (num_threads == 1)
+        single_thread_throughput = throughput;
+      std::cout << "shards=" << num_shards << " threads=" << num_threads
+                << " lookups/s=" << throughput << "M"
+                << " speedup=" << throughput / single_thread_throughput
+                << std::endl;
+    }
+  }
+  return 0;
+}
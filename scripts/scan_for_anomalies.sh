@@ -12,9 +12,20 @@ function print_usage() {
   else
     echo " [-j number_of_scanning_threads]            (default: num_cpus_on_systems)"
   fi
+  echo " [-r number_of_file_reading_threads]        (default: 4)"
+  echo " [-k number_of_parsing_threads]             (default: 1)"
   echo " [-o output_log_dir]                        (default: /tmp)"
   echo " [-a anomaly_threshold]                     (default: 3.0)"
   echo " [-l source_language_number]                (default: 1 (C), supported: 1 (C), 2 (Verilog), 3 (PHP), 4 (C++)"
+  echo " [-p persistent_cache_file]                 (default: none)"
+  echo " [-z persistent_cache_max_size_in_MB]       (default: 1024)"
+  echo " [-u]                                       (search unique expressions of all files once, in a second phase)"
+  echo " [-f result_format]                         (default: none, supported: jsonl, sarif)"
+  echo " [-q]                                       (report potential anomalies only)"
+  echo " [-S scan_server_socket]                    (default: none, scan with a running cf_scan_server)"
+  echo "With -S, options that cf_scan_server was started with apply; only -d, -l"
+  echo "(which files to send, should match the -l of the server), -j (number of"
+  echo "connections) and -o can be used."
 
   exit
 }
@@ -30,28 +41,54 @@ else
 fi
 ANOMALY_THRESHOLD=3
 LANGUAGE=1
+PERSISTENT_CACHE_FILE=""
+PERSISTENT_CACHE_MAX_SIZE=1024
+NUM_READ_THREADS=4
+NUM_PARSE_THREADS=1
+DEDUPLICATE_ARGS=""
+RESULT_FORMAT=""
+ANOMALIES_ONLY_ARGS=""
+SCAN_SERVER_SOCKET=""
+# Options that do not apply to a scan with a running cf_scan_server, which
+# uses the options it was started with.
+SERVER_OPTIONS=""
 
-while getopts d:t:o:c:n:j:a:l: flag
+while getopts d:t:o:c:n:j:r:k:a:l:p:z:uf:qS: flag
 do
   case "${flag}" in
     d) SCAN_DIR=${OPTARG};;
-    t) TRAIN_FILE=${OPTARG};;
+    t) TRAIN_FILE=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -t";;
     o) OUTPUT_DIR=${OPTARG};;
-    c) MAX_AUTOCORRECT_COST=${OPTARG};;
-    n) MAX_AUTOCORRECT_RESULTS=${OPTARG};;
+    c) MAX_AUTOCORRECT_COST=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -c";;
+    n) MAX_AUTOCORRECT_RESULTS=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -n";;
     j) NUM_SCAN_THREADS=${OPTARG};;
-    a) ANOMALY_THRESHOLD=${OPTARG};;
+    r) NUM_READ_THREADS=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -r";;
+    k) NUM_PARSE_THREADS=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -k";;
+    a) ANOMALY_THRESHOLD=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -a";;
     l) LANGUAGE=${OPTARG};;
+    p) PERSISTENT_CACHE_FILE=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -p";;
+    z) PERSISTENT_CACHE_MAX_SIZE=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -z";;
+    u) DEDUPLICATE_ARGS="-u"; SERVER_OPTIONS="${SERVER_OPTIONS} -u";;
+    f) RESULT_FORMAT=${OPTARG}; SERVER_OPTIONS="${SERVER_OPTIONS} -f";;
+    q) ANOMALIES_ONLY_ARGS="-q"; SERVER_OPTIONS="${SERVER_OPTIONS} -q";;
+    S) SCAN_SERVER_SOCKET=${OPTARG};;
   esac
 done
 
-if [ "${SCAN_DIR}" = "" ] || [ "${TRAIN_FILE}" = "" ] ||
-   [ ! -d "${SCAN_DIR}" ] || [ ! -f "${TRAIN_FILE}" ]
+if [ "${SCAN_DIR}" = "" ] || [ ! -d "${SCAN_DIR}" ] ||
+   ( [ "${SCAN_SERVER_SOCKET}" = "" ] &&
+     ( [ "${TRAIN_FILE}" = "" ] || [ ! -f "${TRAIN_FILE}" ] ) )
 then
   echo "ERROR: $0 requires training data file and a directory to scan for anomalies"
   print_usage $0
 fi
 
+if [ "${SCAN_SERVER_SOCKET}" != "" ] && [ "${SERVER_OPTIONS}" != "" ]
+then
+  echo "ERROR:${SERVER_OPTIONS} cannot be used with -S; cf_scan_server uses the options it was started with"
+  print_usage $0
+fi
+
 if [ ! -d "${OUTPUT_DIR}" ]
 then
   echo "ERROR: output directory is not a directory."
@@ -81,13 +118,39 @@ fi
 
 SCRIPTS_DIR=`dirname $0`
 
+# Server has loaded the training data already; it is configured when it is
+# started, so only the files to scan are sent to it.
+if [ "${SCAN_SERVER_SOCKET}" != "" ];
+then
+  ${SCRIPTS_DIR}/../bin/cf_scan_client -S ${SCAN_SERVER_SOCKET} \
+  -s ${SCAN_FILE_LIST} \
+  -j ${NUM_SCAN_THREADS} > ${OUTPUT_DIR}/thread_0.log
+  rm ${SCAN_FILE_LIST}
+  exit
+fi
+
+PERSISTENT_CACHE_ARGS=""
+if [ "${PERSISTENT_CACHE_FILE}" != "" ];
+then
+  PERSISTENT_CACHE_ARGS="-p ${PERSISTENT_CACHE_FILE} -z ${PERSISTENT_CACHE_MAX_SIZE}"
+fi
+
+RESULT_FORMAT_ARGS=""
+if [ "${RESULT_FORMAT}" != "" ];
+then
+  RESULT_FORMAT_ARGS="-f ${RESULT_FORMAT}"
+fi
+
 ${SCRIPTS_DIR}/../bin/cf_file_scanner -t ${TRAIN_FILE} \
 -s ${SCAN_FILE_LIST} \
 -c ${MAX_AUTOCORRECT_COST} \
 -n ${MAX_AUTOCORRECT_RESULTS} \
 -j ${NUM_SCAN_THREADS} \
+-r ${NUM_READ_THREADS} \
+-k ${NUM_PARSE_THREADS} \
 -o ${OUTPUT_DIR} \
 -a ${ANOMALY_THRESHOLD} \
--l ${LANGUAGE}
+-l ${LANGUAGE} ${PERSISTENT_CACHE_ARGS} ${DEDUPLICATE_ARGS} ${RESULT_FORMAT_ARGS} \
+${ANOMALIES_ONLY_ARGS}
 
 rm ${SCAN_FILE_LIST}
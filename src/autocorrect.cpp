@@ -18,27 +18,55 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include <math.h>
-#include <thread>  // NOLINT [build/c++11]
+#include <algorithm>
+#include <mutex>  // NOLINT [build/c++11]
+#include <utility>
+#include <vector>
 #include "trie.h"
 
 NearestExpressions Trie::SearchNearestExpressions(
     const NearestExpression::Expression& expression,
     NearestExpression::Cost max_cost,
-    size_t max_threads) const {
+    size_t num_threads) const {
+  thread_local TokenSequence tokens;
+  ExpressionCompacter::Get().Compact(expression, tokens);
+  return SearchNearestExpressions(tokens, max_cost, num_threads);
+}
+
+NearestExpressions Trie::SearchNearestExpressions(
+    const TokenSequence& short_expr,
+    NearestExpression::Cost max_cost,
+    size_t num_threads) const {
+  // Calling thread is one of the threads.
+  ThreadPool thread_pool(std::max<size_t>(1, num_threads) - 1);
+  return SearchNearestExpressions(short_expr, max_cost, thread_pool);
+}
+
+NearestExpressions Trie::SearchNearestExpressions(
+    const NearestExpression::Expression& expression,
+    NearestExpression::Cost max_cost,
+    ThreadPool& thread_pool) const {
+  thread_local TokenSequence tokens;
+  ExpressionCompacter::Get().Compact(expression, tokens);
+  return SearchNearestExpressions(tokens, max_cost, thread_pool);
+}
+
+NearestExpressions Trie::SearchNearestExpressions(
+    const TokenSequence& short_expr,
+    NearestExpression::Cost max_cost,
+    ThreadPool& thread_pool) const {
   enum SearchNearestExpressionAlgorithm {
     TRIE_TRAVERSAL,
     CANDIDATE_GENERATION,
     SYMMETRIC_DELETE
   } algorithm = TRIE_TRAVERSAL;
 
-  std::string short_expr = ExpressionCompacter::Get().Compact(expression);
   NearestExpressions short_nearest_expressions;
 
   switch (algorithm) {
     case TRIE_TRAVERSAL:
       short_nearest_expressions = SearchNearestExpressionsUsingTrieTraversal(
-                                    short_expr, max_cost, max_threads);
+                                    short_expr, max_cost, thread_pool);
       break;
     case CANDIDATE_GENERATION:
       short_nearest_expressions =
@@ -53,13 +81,84 @@ NearestExpressions Trie::SearchNearestExpressions(
   }
 
   // Let's expand shortened expressions
+  return ExpandNearestExpressions(short_nearest_expressions);
+}
+
+std::vector<NearestExpressions> Trie::SearchNearestExpressionsInBatch(
+    const std::vector<NearestExpression::Expression>& expressions,
+    NearestExpression::Cost max_cost) const {
+  std::vector<TokenSequence> short_exprs(expressions.size());
+  for (size_t i = 0; i < expressions.size(); i++) {
+    ExpressionCompacter::Get().Compact(expressions[i], short_exprs[i]);
+  }
+  return SearchNearestExpressionsInBatch(short_exprs, max_cost);
+}
+
+std::vector<NearestExpressions> Trie::SearchNearestExpressionsInBatch(
+    const std::vector<TokenSequence>& short_exprs,
+    NearestExpression::Cost max_cost) const {
+  auto short_results = SearchNearestExpressionsInBatchUsingTrieTraversal(
+                          short_exprs, max_cost);
+  std::vector<NearestExpressions> results;
+  results.reserve(short_results.size());
+  for (const auto& short_nearest_expressions : short_results) {
+    results.push_back(ExpandNearestExpressions(short_nearest_expressions));
+  }
+  return results;
+}
+
+std::vector<NearestExpressions> Trie::SearchNearestExpressionsOfTrainingSet(
+    size_t begin, size_t end, NearestExpression::Cost max_cost) const {
+  end = std::min(end, all_trie_paths.size());
+  // Expressions in trie are already shortened.
+  std::vector<TokenSequence> short_exprs;
+  for (size_t i = begin; i < end; i++) {
+    short_exprs.push_back(all_trie_paths[i].first);
+  }
+
+  auto short_results = SearchNearestExpressionsInBatchUsingTrieTraversal(
+                          short_exprs, max_cost);
+  std::vector<NearestExpressions> results;
+  results.reserve(short_results.size());
+  for (const auto& short_nearest_expressions : short_results) {
+    results.push_back(ExpandNearestExpressions(short_nearest_expressions));
+  }
+  return results;
+}
+
+NearestExpression Trie::GetExpression(size_t index) const {
+  cf_assert(index < all_trie_paths.size(),
+            "Expression index out of range:" + std::to_string(index));
+  const auto& path_occurrences = all_trie_paths[index];
+  const NearestExpression::Cost kZeroCost = 0;
+  return NearestExpression(
+      ExpressionCompacter::Get().Expand(path_occurrences.first), kZeroCost,
+      path_occurrences.second,
+      static_cast<NearestExpression::PatternID>(index));
+}
+
+NearestExpression::NumOccurrences Trie::GetNumOccurrences(size_t index) const {
+  cf_assert(index < all_trie_paths.size(),
+            "Expression index out of range:" + std::to_string(index));
+  return all_trie_paths[index].second;
+}
+
+NearestExpressions Trie::ExpandNearestExpressions(
+    const NearestExpressions& short_nearest_expressions) const {
   NearestExpressions nearest_expressions;
-  for (auto short_nearest_expression : short_nearest_expressions) {
-    std::string long_expression = ExpressionCompacter::Get().Expand(
-                                    short_nearest_expression.GetExpression());
+  nearest_expressions.reserve(short_nearest_expressions.size());
+  for (const auto& short_nearest_expression : short_nearest_expressions) {
+    // Expressions found in trie are identified by their pattern IDs.
+    NearestExpression::PatternID pattern_id =
+      short_nearest_expression.GetPatternID();
+    std::string long_expression =
+      pattern_id == NearestExpression::kInvalidPatternID ?
+      short_nearest_expression.GetExpression() :
+      ExpressionCompacter::Get().Expand(all_trie_paths[pattern_id].first);
     nearest_expressions.push_back(NearestExpression(long_expression,
                                 short_nearest_expression.GetCost(),
-                                short_nearest_expression.GetNumOccurrences()));
+                                short_nearest_expression.GetNumOccurrences(),
+                                short_nearest_expression.GetPatternID()));
   }
   return nearest_expressions;
 }
@@ -73,19 +172,19 @@ NearestExpressions Trie::SearchNearestExpressions(
 // https://medium.com/@wolfgarbe/1000x-faster-spelling-correction-algorithm-2012-8701fcd87a5f
 
 void Trie::GenerateExpressionCombinationsUsingDelete(
-    const NearestExpression::Expression& target,
+    const TokenSequence& target,
     NearestExpression::Cost max_cost,
     ExpressionCombinationsAtCost& combinations) const {
   // Using unordered_map to handle duplicate keys.
   auto perform_deletes_for_distance_one = [&](
-      const NearestExpression::Expression& expression,
+      const TokenSequence& expression,
       NearestExpression::Cost current_cost) {
     for (size_t i = 0; i < expression.size(); i++) {
       // O(N) deletions
-      NearestExpression::Expression expression_with_char_delete = expression;
-      expression_with_char_delete.erase(i, current_cost);
-      std::pair<NearestExpression::Expression,
-                NearestExpression::Cost> expression_cost(
+      TokenSequence expression_with_char_delete = expression;
+      expression_with_char_delete.erase(expression_with_char_delete.begin() +
+                                        i);
+      std::pair<TokenSequence, NearestExpression::Cost> expression_cost(
                                   expression_with_char_delete, current_cost);
       // duplicate keys will be removed by insert.
       combinations.insert(expression_cost);
@@ -98,16 +197,21 @@ void Trie::GenerateExpressionCombinationsUsingDelete(
   NearestExpression::Cost current_cost = 0;
   combinations[target] = current_cost;
   for (current_cost = 1; current_cost <= max_cost; current_cost++) {
+    // Collect the expressions first since deletes are inserted into
+    // combinations.
+    std::vector<TokenSequence> expressions_n_minus_1;
     for (const auto& expression_n_minus_1 : combinations) {
       if (expression_n_minus_1.second == current_cost - 1)
-        perform_deletes_for_distance_one(expression_n_minus_1.first,
-                                         current_cost);
+        expressions_n_minus_1.push_back(expression_n_minus_1.first);
+    }
+    for (const auto& expression_n_minus_1 : expressions_n_minus_1) {
+      perform_deletes_for_distance_one(expression_n_minus_1, current_cost);
     }
   }
 }
 
 NearestExpressions Trie::SearchNearestExpressionUsingSymmetricDelete(
-    const NearestExpression::Expression& target,
+    const TokenSequence& target,
     NearestExpression::Cost max_cost) const {
   NearestExpressions result;
 
@@ -124,7 +228,8 @@ NearestExpressions Trie::SearchNearestExpressionUsingSymmetricDelete(
         std::string expression = "";
         result.push_back(NearestExpression(expression, combination.second));
 
-        std::cout << "Found combination: " << combination.first
+        std::cout << "Found combination: "
+                  << ExpressionCompacter::Get().Expand(combination.first)
                   << " at cost:" << combination.second
                   << " line no: " << line_no
                   << std::endl;
@@ -144,20 +249,21 @@ NearestExpressions Trie::SearchNearestExpressionUsingSymmetricDelete(
 // Algorithm performs in O(N) time, where N is length of the target expression.
 // Algorithm performance does not depend on size of trie/dictionary.
 NearestExpressions Trie::SearchNearestExpressionsUsingCandidateGeneration(
-    const NearestExpression::Expression& target,
+    const TokenSequence& target,
     NearestExpression::Cost max_cost) const {
   NearestExpressions result;
 
-  NearestExpressionSet nearest_expressions;
+  ExpressionCombinationsAtCost nearest_expressions;
   GenerateCandidateExpressions(target, max_cost, nearest_expressions);
   for (const auto& nearest_expression : nearest_expressions) {
     // If edited expression is a valid expression then keep it.
-    auto expression = nearest_expression.GetExpression();
-    NearestExpression::Cost cost = nearest_expression.GetCost();
+    NearestExpression::Cost cost = nearest_expression.second;
     NearestExpression::NumOccurrences occurrences;
+    NearestExpression::PatternID pattern_id;
     float confidence;
-    if (LookUpShortExpr(expression, occurrences, confidence)) {
-      result.push_back(NearestExpression(expression, cost, occurrences));
+    if (LookUpShortExpr(nearest_expression.first, occurrences, confidence,
+                        &pattern_id)) {
+      result.push_back(NearestExpression("", cost, occurrences, pattern_id));
     }
   }
   nearest_expressions.clear();
@@ -166,36 +272,38 @@ NearestExpressions Trie::SearchNearestExpressionsUsingCandidateGeneration(
 }
 
 void Trie::GenerateCandidateExpressions(
-    const NearestExpression::Expression& target,
+    const TokenSequence& target,
     NearestExpression::Cost max_cost,
-    NearestExpressionSet& result) const {
-  // Using set instead of vector to filter out duplicate edits.
+    ExpressionCombinationsAtCost& result) const {
+  // Using map instead of vector to filter out duplicate edits.
 
   auto perform_edits_for_distance_one = [&](
-      const NearestExpression::Expression& expression,
+      const TokenSequence& expression,
       NearestExpression::Cost current_cost) {
     for (size_t i = 0; i < expression.size(); i++) {
       for (const auto& c : alphabets_) { /* O(N) replacements */
-        NearestExpression::Expression expression_with_char_replace = expression;
-        // Replacement - perform character replacements that are 1-edit away.
-        expression_with_char_replace.replace(i, current_cost, current_cost, c);
-        result.insert(NearestExpression(expression_with_char_replace,
-                                        current_cost));
+        TokenSequence expression_with_char_replace = expression;
+        // Replacement - perform token replacements that are 1-edit away.
+        expression_with_char_replace[i] = c;
+        result.insert(std::make_pair(expression_with_char_replace,
+                                     current_cost));
       }
 
       for (const auto& c : alphabets_) { /* O(N+1) insertions */
-        NearestExpression::Expression expression_with_char_insert = expression;
-        // Insert - Insert a character leading to 1-edit distance.
-        expression_with_char_insert.insert(i, current_cost, c);
-        result.insert(NearestExpression(expression_with_char_insert,
-                                        current_cost));
+        TokenSequence expression_with_char_insert = expression;
+        // Insert - Insert a token leading to 1-edit distance.
+        expression_with_char_insert.insert(
+          expression_with_char_insert.begin() + i, c);
+        result.insert(std::make_pair(expression_with_char_insert,
+                                     current_cost));
       }
 
       // O(N) deletions
-      NearestExpression::Expression expression_with_char_delete = expression;
-      expression_with_char_delete.erase(i, current_cost);
-      result.insert(NearestExpression(expression_with_char_delete,
-                                      current_cost));
+      TokenSequence expression_with_char_delete = expression;
+      expression_with_char_delete.erase(expression_with_char_delete.begin() +
+                                        i);
+      result.insert(std::make_pair(expression_with_char_delete,
+                                   current_cost));
     }
   };
 
@@ -203,12 +311,16 @@ void Trie::GenerateCandidateExpressions(
   // from ExpressionEdits that are N-1 distance away by performing 1-cost
   // edit distance.
   NearestExpression::Cost current_cost = 0;
-  result.insert(NearestExpression(target, current_cost));
+  result.insert(std::make_pair(target, current_cost));
   for (current_cost = 1; current_cost <= max_cost; current_cost++) {
+    // Collect the expressions first since edits are inserted into result.
+    std::vector<TokenSequence> expressions_n_minus_1;
     for (const auto& expression_n_minus_1 : result) {
-      if (expression_n_minus_1.GetCost() == current_cost - 1)
-        perform_edits_for_distance_one(expression_n_minus_1.GetExpression(),
-                                       current_cost);
+      if (expression_n_minus_1.second == current_cost - 1)
+        expressions_n_minus_1.push_back(expression_n_minus_1.first);
+    }
+    for (const auto& expression_n_minus_1 : expressions_n_minus_1) {
+      perform_edits_for_distance_one(expression_n_minus_1, current_cost);
     }
   }
 }
@@ -221,68 +333,136 @@ void Trie::GenerateCandidateExpressions(
 //
 // Algorithm performs in O(N) time, where N is number of words in dictionary.
 NearestExpressions Trie::SearchNearestExpressionsUsingTrieTraversal(
-    const NearestExpression::Expression& target,
+    const TokenSequence& target,
     NearestExpression::Cost max_cost,
-    size_t max_threads) const {
+    ThreadPool& thread_pool) const {
   // Visit every expression from training dataset/trie and check if
   // it is within max_cost edit distance. If it is, then add to
   // result set.
-  std::atomic<size_t> path_index(0);
+  //
+  // Trie paths are split into chunks that run on the thread pool, so idle
+  // workers of the pool help with the search. A few chunks per worker let
+  // workers that are busy with other tasks join late without leaving the
+  // others waiting.
+  const size_t kMinPathsPerChunk = 256;
+  const size_t kChunksPerWorker = 4;
+  size_t paths_per_chunk = std::max(kMinPathsPerChunk, all_trie_paths.size() /
+                             (kChunksPerWorker *
+                              (thread_pool.GetNumWorkers() + 1)));
+
   NearestExpressions nearest_expressions;
-  std::shared_mutex mutex;
-  auto calculate_edit_distance_fn = [&]() {
-    while (path_index.load() < all_trie_paths.size()) {
-      const auto& path_occurrences = all_trie_paths[path_index.load()];
-      path_index++;
-      const std::string& trie_path = path_occurrences.first;
+  std::mutex mutex;
+  auto calculate_edit_distance_fn = [&](size_t begin, size_t end) {
+    NearestExpressions chunk_nearest_expressions;
+    for (size_t current_index = begin; current_index < end; current_index++) {
+      const auto& path_occurrences = all_trie_paths[current_index];
+      const TokenSequence& trie_path = path_occurrences.first;
       size_t num_occurrences = path_occurrences.second;
 
       NearestExpression::Cost current_cost =
-          CalculateEditDistance(trie_path, target);
+          CalculateBoundedEditDistance(trie_path, target, max_cost);
       if (current_cost <= max_cost) {
-        std::unique_lock lock(mutex);
-        nearest_expressions.push_back(NearestExpression(trie_path,
-                                      current_cost, num_occurrences));
+        // Expression is expanded later from its pattern ID.
+        chunk_nearest_expressions.push_back(NearestExpression("",
+                                            current_cost, num_occurrences,
+                                            current_index));
       }
     }
+    if (chunk_nearest_expressions.empty()) return;
+    std::unique_lock lock(mutex);
+    nearest_expressions.insert(nearest_expressions.end(),
+                               chunk_nearest_expressions.begin(),
+                               chunk_nearest_expressions.end());
   };
+  thread_pool.ParallelFor(0, all_trie_paths.size(), paths_per_chunk,
+                          calculate_edit_distance_fn);
+
+  return nearest_expressions;
+}
+
+std::vector<NearestExpressions>
+Trie::SearchNearestExpressionsInBatchUsingTrieTraversal(
+    const std::vector<TokenSequence>& targets,
+    NearestExpression::Cost max_cost) const {
+  std::vector<NearestExpressions> results(targets.size());
+
+  // Swapping the loops of calling SearchNearestExpressionsUsingTrieTraversal
+  // for every target lets us read every trie path only once per batch.
+  for (size_t path_index = 0; path_index < all_trie_paths.size();
+       path_index++) {
+    const TokenSequence& trie_path = all_trie_paths[path_index].first;
+    size_t num_occurrences = all_trie_paths[path_index].second;
 
-  std::vector<std::thread> edit_distance_calculator_threads;
-  // Restricting the number of threads that we use for autocorrect
-  // because the max_threads specified by the user would need to fit within the
-  // multiplicative effect of performing parallel scan, where every scan
-  // performs parallel autocorrect.
-  size_t sqrt_max_threads = static_cast<size_t>(
-    sqrtf(static_cast<float>(max_threads)));
-  for (size_t i = 0; i < sqrt_max_threads; i++) {
-    edit_distance_calculator_threads.push_back(std::thread(
-                                                calculate_edit_distance_fn));
+    for (size_t i = 0; i < targets.size(); i++) {
+      NearestExpression::Cost current_cost =
+          CalculateBoundedEditDistance(trie_path, targets[i], max_cost);
+      if (current_cost <= max_cost) {
+        results[i].push_back(NearestExpression("", current_cost,
+                                               num_occurrences, path_index));
+      }
+    }
   }
-  for (auto& calculator_thread : edit_distance_calculator_threads) {
-    calculator_thread.join();
+  return results;
+}
+
+NearestExpression::Cost Trie::CalculateBoundedEditDistance(
+    const TokenSequence& source, const TokenSequence& target,
+    NearestExpression::Cost max_cost) const {
+  // Edit distance is at least the difference in lengths of the expressions.
+  size_t length_difference = source.size() > target.size() ?
+                             source.size() - target.size() :
+                             target.size() - source.size();
+  if (length_difference > max_cost)
+    return max_cost + 1;
+
+  // Rows are reused across calls to avoid allocating them for every trie path.
+  thread_local std::vector<NearestExpression::Cost> previous_row;
+  thread_local std::vector<NearestExpression::Cost> current_row;
+  previous_row.resize(target.size() + 1);
+  current_row.resize(target.size() + 1);
+  for (size_t i = 0; i < target.size() + 1; i++)
+    previous_row[i] = i;
+
+  size_t num_chars_read = 1;
+  for (const TokenID& source_char : source) {
+    current_row[0] = num_chars_read++;
+    NearestExpression::Cost row_min = current_row[0];
+    for (size_t i = 1; i < target.size() + 1; i++) {
+      NearestExpression::Cost substitution_cost =
+        source_char != target[i - 1] ? 1 : 0;
+      current_row[i] = std::min(std::min(current_row[i - 1] + 1,
+                                         previous_row[i] + 1),
+                                previous_row[i - 1] + substitution_cost);
+      row_min = std::min(row_min, current_row[i]);
+    }
+    // Distances never decrease from one row to the next, so we can stop once
+    // all the entries in a row exceed max_cost.
+    if (row_min > max_cost)
+      return max_cost + 1;
+    std::swap(previous_row, current_row);
   }
 
-  return nearest_expressions;
+  return std::min(previous_row[target.size()], max_cost + 1);
 }
 
 // Calculate edit distance between source and target expressions.
-NearestExpression::Cost Trie::CalculateEditDistance(const std::string& source,
-    const std::string& target) const {
+NearestExpression::Cost Trie::CalculateEditDistance(
+    const TokenSequence& source, const TokenSequence& target) const {
   // Edit distance is calculated by using (M+1)*(N+1) table, where M is length
   // of source and N is length of target. We don't need to allocate
   // whole M*N table though - to calculate a row, we just need its predecessor
   // row. In other words, we can only calculate whole table using 2*N memory.
 
   // Initialize table's row 0 to calculate distance between "" and target.
-  std::vector<NearestExpression::Cost> current_row(target.length() + 1);
-  for (size_t i = 0; i < target.length() + 1; i++)
+  std::vector<NearestExpression::Cost> current_row(target.size() + 1);
+  for (size_t i = 0; i < target.size() + 1; i++)
     current_row[i] = i;
 
   // Save edit distances for current row so that we can use it calculate
   // edit distances for next row.
   auto previous_row = current_row;
   size_t num_chars_read = 1;
-  for (const char& source_char : source) {
+  for (const TokenID& source_char : source) {
     current_row[0] = num_chars_read++;
 
     // cost of inserting, deleting or replacing one char
@@ -296,7 +476,7 @@ NearestExpression::Cost Trie::CalculateEditDistance(const std::string& source,
       return std::min(std::min(a, b), c);
     };
 
-    for (size_t i = 1; i < target.length() + 1; i++) {
+    for (size_t i = 1; i < target.size() + 1; i++) {
       NearestExpression::Cost substitution_cost = kNoEditCost;
       if (source_char != target[i - 1])
         substitution_cost = kReplaceCost;
@@ -307,6 +487,6 @@ NearestExpression::Cost Trie::CalculateEditDistance(const std::string& source,
     previous_row = current_row;
   }
 
-  return current_row[target.length()];
+  return current_row[target.size()];
 }
 
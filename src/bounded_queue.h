@@ -0,0 +1,192 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_BOUNDED_QUEUE_H_
+#define SRC_BOUNDED_QUEUE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>  // NOLINT [build/c++11]
+#include <mutex>  // NOLINT [build/c++11]
+#include <thread>  // NOLINT [build/c++11]
+#include <utility>
+#include <vector>
+
+/// Multi-producer multi-consumer FIFO queue that holds at most capacity
+/// items. Producers block while the queue is full, which keeps a fast
+/// producer from running arbitrarily far ahead of its consumers.
+///
+/// Once the queue is closed, pushes fail and pops drain the remaining items
+/// and then fail, which is how producers tell consumers that they are done.
+/// Close the queue only after all the producers are done, or to abandon the
+/// items that are still being pushed.
+///
+/// Pushes and pops are lock-free: the queue is a ring buffer in which every
+/// cell has a sequence number that says whether it is ready to be written or
+/// read (Vyukov's bounded MPMC queue). Only threads that have to wait, for an
+/// item or for room, take a lock to sleep on a condition variable.
+template <typename T>
+class BoundedQueue {
+ public:
+  /// Capacity is rounded up to a power of 2.
+  explicit BoundedQueue(size_t capacity) {
+    size_t num_cells = 1;
+    while (num_cells < capacity) num_cells *= 2;
+    cells_ = std::vector<Cell>(num_cells);
+    for (size_t i = 0; i < num_cells; i++) {
+      cells_[i].sequence_.store(i, std::memory_order_relaxed);
+    }
+    mask_ = num_cells - 1;
+  }
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  /// Blocks while the queue is full. Returns false, without pushing item, if
+  /// the queue is closed.
+  bool Push(T&& item) {
+    while (true) {
+      if (closed_.load(std::memory_order_acquire)) return false;
+      if (TryPush(item)) {
+        WakeUpWaiters();
+        return true;
+      }
+      Wait([&] { return closed_.load() || !IsFull(); });
+    }
+  }
+
+  /// Blocks while the queue is empty and open. Returns false if the queue is
+  /// closed and empty.
+  bool Pop(T& item) {
+    while (true) {
+      if (TryPop(item)) {
+        WakeUpWaiters();
+        return true;
+      }
+      if (closed_.load(std::memory_order_acquire)) {
+        // Items pushed before closing are visible now.
+        if (!TryPop(item)) return false;
+        WakeUpWaiters();
+        return true;
+      }
+      Wait([&] { return closed_.load() || !IsEmpty(); });
+    }
+  }
+
+  void Close() {
+    closed_.store(true, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::unique_lock lock(mutex_);
+    condition_.notify_all();
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence_{0};
+    T item_;
+  };
+
+  // Cell at position pos is ready to be written if its sequence is pos, and
+  // ready to be read if its sequence is pos + 1.
+  bool TryPush(T& item) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence_.load(std::memory_order_acquire);
+      if (sequence == pos) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          cell.item_ = std::move(item);
+          cell.sequence_.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (sequence < pos) {
+        return false;  // Full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool TryPop(T& item) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence_.load(std::memory_order_acquire);
+      if (sequence == pos + 1) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          item = std::move(cell.item_);
+          cell.sequence_.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (sequence < pos + 1) {
+        return false;  // Empty
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool IsFull() const {
+    size_t pos = enqueue_pos_.load();
+    return cells_[pos & mask_].sequence_.load() < pos;
+  }
+  bool IsEmpty() const {
+    size_t pos = dequeue_pos_.load();
+    return cells_[pos & mask_].sequence_.load() < pos + 1;
+  }
+
+  // Sleep until is_ready returns true. Waiters are counted before checking
+  // is_ready, and wakers check the count after changing the queue, so a
+  // waiter either sees the change or is woken up.
+  template <typename IsReady>
+  void Wait(const IsReady& is_ready) {
+    // Waits are usually short, so yield once before going to sleep.
+    std::this_thread::yield();
+    if (is_ready()) return;
+    std::unique_lock lock(mutex_);
+    num_waiters_.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    condition_.wait(lock, is_ready);
+    num_waiters_.fetch_sub(1);
+  }
+
+  void WakeUpWaiters() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (num_waiters_.load() == 0) return;
+    std::unique_lock lock(mutex_);
+    condition_.notify_all();
+  }
+
+  std::vector<Cell> cells_;
+  size_t mask_ = 0;
+  // Producers and consumers update different positions, so keep them on
+  // different cache lines.
+  alignas(64) std::atomic<size_t> enqueue_pos_{0};
+  alignas(64) std::atomic<size_t> dequeue_pos_{0};
+  alignas(64) std::atomic<bool> closed_{false};
+
+  std::atomic<size_t> num_waiters_{0};
+  std::mutex mutex_;
+  std::condition_variable condition_;
+};
+
+#endif  // SRC_BOUNDED_QUEUE_H_
@@ -23,6 +23,7 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "common_util.h"
@@ -37,17 +38,22 @@ struct CFDumpArgs {
 
 template <Language G>
 void DumpCodeBlocks(const code_blocks_t&
-    code_blocks, const std::string& source_file_contents,
+    code_blocks, std::string_view source_file_contents,
     TreeLevel level, size_t contributor_id) {
+  // Both levels are abstracted in a single traversal of the code block.
+  MultiLevelAbstraction abstraction;
+  std::string code_block_l1, code_block_l2;
   for (auto code_block : code_blocks) {
-    std::string code_block_l1, code_block_l2;
-    try {
-      code_block_l1 = NodeToString<LEVEL_ONE, G>(code_block);
-      code_block_l2 = NodeToString<LEVEL_TWO, G>(code_block);
-    } catch (std::exception& e) {
-      // We just skip this expression.
-      continue;
-    }
+    MultiLevelAbstractor<G>::Abstract(code_block, abstraction);
+    // We just skip expressions without level 2 abstraction.
+    if (!abstraction.has_level_two_) continue;
+
+    code_block_l1.clear();
+    code_block_l2.clear();
+    ExpressionCompacter::Get().Expand(abstraction.level_one_tokens_.data(),
+      abstraction.level_one_tokens_.size(), code_block_l1);
+    ExpressionCompacter::Get().Expand(abstraction.level_two_tokens_.data(),
+      abstraction.level_two_tokens_.size(), code_block_l2);
 
     std::cout << "//" << OriginalSourceExpression(code_block,
                          source_file_contents) << std::endl;
@@ -63,9 +69,9 @@ void DumpCodeBlocks(const code_blocks_t&
 template <Language G>
 void DumpCodeBlocksFromSourceFile(const CFDumpArgs& command_args) {
   ManagedTSTree ts_tree;
-  std::string source_file_contents;
+  MappedFile source_file;
   try {
-    ts_tree = GetTSTree<G>(command_args.source_file_, source_file_contents);
+    ts_tree = GetTSTree<G>(command_args.source_file_, source_file);
   } catch(std::string& error) {
     std::cerr << error << " in " << command_args.source_file_
               << "... skipping" << std::endl;
@@ -76,7 +82,7 @@ void DumpCodeBlocksFromSourceFile(const CFDumpArgs& command_args) {
   code_blocks.clear();
   CollectCodeBlocksOfInterest<G>(ts_tree, code_blocks);
 
-  DumpCodeBlocks<G>(code_blocks, source_file_contents,
+  DumpCodeBlocks<G>(code_blocks, source_file.contents(),
                                 command_args.level_,
                                 command_args.github_contributor_id_);
 }
@@ -18,15 +18,17 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include <math.h>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <string>
-#include <thread>  // NOLINT [build/c++11]
 
 #include "exception.h"
+#include "result_sink.h"
+#include "scan_pipeline.h"
 #include "train_and_scan_util.h"
 #include "trie.h"
+#include "two_phase_scan.h"
 
 struct FileScannerArgs {
   std::string train_dataset_ = "";
@@ -34,6 +36,13 @@ struct FileScannerArgs {
   std::string eval_source_file_list_ = "";
   Language eval_file_language_ = LANGUAGE_C;
   std::string log_dir_ = "/tmp/";
+  std::string persistent_cache_file_ = "";
+  size_t num_reader_threads_ = FilePrefetcher::kDefaultNumReaders;
+  size_t num_parser_threads_ = 1;
+  bool deduplicate_expressions_ = false;
+  /// Format of results written to log_dir_/results.<format>, or "" for
+  /// reporting results in the text logs.
+  std::string result_format_ = "";
   TrainAndScanUtil::ScanConfig scan_config_;
 };
 
@@ -50,6 +59,10 @@ static int handle_command_args(int argc, char* argv[], FileScannerArgs& args) {
            << std::endl
            << "  [-j number_of_scanning_threads]            (default: 1)"
            << std::endl
+           << "  [-r number_of_file_reading_threads]        (default: 4)"
+           << std::endl
+           << "  [-k number_of_parsing_threads]             (default: 1)"
+           << std::endl
            << "  [-o output_log_dir]                        (default: /tmp)"
            << std::endl
            << "  [-a anomaly_threshold]                     (default: 3.0)"
@@ -57,13 +70,29 @@ static int handle_command_args(int argc, char* argv[], FileScannerArgs& args) {
            << "  [-l source_language_number]                (default: 1 (C), "
            << "supported: 1 (C), 2 (Verilog), 3 (PHP), 4 (C++))"
            << std::endl
+           << "  [-m cache_memory_budget_in_MB]             (default: 512)"
+           << std::endl
+           << "  [-p persistent_cache_file]                 (default: none)"
+           << std::endl
+           << "  [-z persistent_cache_max_size_in_MB]       (default: 1024)"
+           << std::endl
+           << "  [-u]                                       (search unique "
+           << "expressions of all files once, in a second phase)"
+           << std::endl
+           << "  [-f result_format]                         (default: none, "
+           << "supported: jsonl, sarif)"
+           << std::endl
+           << "  [-q]                                       (report potential "
+           << "anomalies only)"
+           << std::endl
            << "  [-v log_level ]                            (default: 0, "
            << "{ERROR, 0}, {INFO, 1}, {DEBUG, 2})"
            << std::endl;
   };
 
+  const char* kOptions = "v:t:e:c:n:s:j:r:k:o:a:l:m:p:z:uf:q";
   int opt;
-  while ((opt = getopt(argc, argv, "v:t:e:c:n:s:j:o:a:l:")) != -1) {
+  while ((opt = getopt(argc, argv, kOptions)) != -1) {
     switch (opt) {
       case 't': args.train_dataset_ = optarg; break;
       case 'e': args.eval_source_file_ = FormatPath(optarg); break;
@@ -75,14 +104,34 @@ static int handle_command_args(int argc, char* argv[], FileScannerArgs& args) {
                   std::max(0, atoi(optarg)); break;
       case 'j': args.scan_config_.num_threads_ = std::max(1, atoi(optarg));
                 break;
+      case 'r': args.num_reader_threads_ = std::max(1, atoi(optarg)); break;
+      case 'k': args.num_parser_threads_ = std::max(1, atoi(optarg)); break;
       case 'a': args.scan_config_.anomaly_threshold_ = atof(optarg); break;
+      case 'm': args.scan_config_.cache_memory_budget_ =
+                  static_cast<size_t>(std::max(0, atoi(optarg))) * 1024 * 1024;
+                break;
+      case 'p': args.persistent_cache_file_ = FormatPath(optarg); break;
+      case 'z': args.scan_config_.persistent_cache_max_size_ =
+                  static_cast<size_t>(std::max(0, atoi(optarg))) * 1024 * 1024;
+                break;
+      case 'u': args.deduplicate_expressions_ = true; break;
+      case 'q': args.scan_config_.anomalies_only_ = true; break;
+      case 'f': args.result_format_ = optarg;
+                if (args.result_format_ != "jsonl" &&
+                    args.result_format_ != "sarif") {
+                  print_usage();
+                  return EXIT_FAILURE;
+                }
+                break;
       case 'v': if (atoi(optarg) >= TrainAndScanUtil::LogLevel::MIN &&
                     atoi(optarg) <= TrainAndScanUtil::LogLevel::MAX) {
                   args.scan_config_.log_level_ =
                     static_cast<TrainAndScanUtil::LogLevel>(atoi(optarg));
                 }
                 break;
-      case 'l': args.eval_file_language_ = VerifyLanguage(atoi(optarg)); break;
+      case 'l': args.eval_file_language_ = VerifyLanguage(atoi(optarg));
+                args.scan_config_.language_ = args.eval_file_language_;
+                break;
       default: /* '?' */
           print_usage();
           return EXIT_FAILURE;
@@ -128,77 +177,58 @@ int main(int argc, char* argv[]) {
     TrainAndScanUtil train_and_scan_util(file_scanner_args.scan_config_);
     status = train_and_scan_util.ReadTrainingDatasetFromFile(
                 file_scanner_args.train_dataset_, std::cout);
+    if (file_scanner_args.persistent_cache_file_ != "") {
+      train_and_scan_util.OpenPersistentCache(
+        file_scanner_args.persistent_cache_file_, std::cout);
+    }
 
-    // Perform multi-threaded inference / scan for bugs.
-    std::atomic<size_t> file_index(0);
-    std::atomic<size_t> printed_file_index(-1);
-    size_t tenth_eval_file_names = eval_file_names.size() < 10 ?
-                                   eval_file_names.size() :
-                                   eval_file_names.size() / 10;
-
-    auto thread_scan_fn = [&](const size_t thread_num,
-                              const std::string& log_file_name) {
-      std::ofstream log_file(log_file_name.c_str());
-
-      // Greedy multi-threading: scan next file if current is complete.
-      while (file_index.load() < eval_file_names.size()) {
-        // Grab file to scan for bugs.
-        std::string& eval_file = eval_file_names[file_index.load()];
-        file_index++;
-        log_file << "[TID=" << std::this_thread::get_id() << "] "
-                 << "Scanning File: " << eval_file << std::endl;
-
-        // Scan.
-        switch (file_scanner_args.eval_file_language_) {
-          case LANGUAGE_C:
-            status = train_and_scan_util.ScanFile<LANGUAGE_C>(eval_file,
-                                                              log_file);
-            break;
-          case LANGUAGE_VERILOG:
-            status = train_and_scan_util.ScanFile<LANGUAGE_VERILOG>(eval_file,
-                                                                    log_file);
-            break;
-          case LANGUAGE_PHP:
-            status = train_and_scan_util.ScanFile<LANGUAGE_PHP>(eval_file,
-                                                                log_file);
-            break;
-          case LANGUAGE_CPP:
-            status = train_and_scan_util.ScanFile<LANGUAGE_CPP>(eval_file,
-                                                                log_file);
-            break;
-          default:
-            throw cf_unexpected_situation("Unsupported language:" +
-                                          std::to_string(LanguageToInt(
-                                      file_scanner_args.eval_file_language_)));
-        }
-
-        // Report progress at every 10th % point.
-        if (file_index.load() % tenth_eval_file_names == 0 &&
-            printed_file_index.load() < file_index.load())
-        std::cout << "Scan progress:" << file_index.load() << "/"
-                  << eval_file_names.size() << " ... in progress" << std::endl;
-        std::cout.flush();
-        printed_file_index = file_index.load();
-      }
-
-      log_file.close();
-    };
-
-    // Start scanner threads and wait for join.
-    std::vector<std::thread> scanner_threads;
     std::cout << "Storing logs in " << file_scanner_args.log_dir_ << std::endl;
-    // Restricting the number of threads that we use for parallel scan, because
-    // every scan invokes parallel autocorrect also.
-    size_t sqrt_max_threads = static_cast<size_t>(
-        sqrtf(static_cast<float>(file_scanner_args.scan_config_.num_threads_)));
-    for (size_t i = 0; i < sqrt_max_threads; i++) {
-      std::string log_file_name = file_scanner_args.log_dir_ + "/thread_" +
-                                  std::to_string(i) + ".log";
-      scanner_threads.push_back(std::thread(thread_scan_fn, i, log_file_name));
+    // Results are written in file order by a writer thread of their own.
+    std::unique_ptr<ResultSink> result_sink;
+    if (file_scanner_args.result_format_ != "") {
+      std::string results_file = file_scanner_args.log_dir_ + "/results." +
+                                 file_scanner_args.result_format_;
+      result_sink.reset(new ResultSink(results_file,
+        file_scanner_args.result_format_ == "jsonl" ? ResultSink::JSON_LINES :
+                                                      ResultSink::SARIF));
+      std::cout << "Storing results in " << results_file << std::endl;
     }
-    for (auto& scanner_thread : scanner_threads) {
-      scanner_thread.join();
+
+    if (file_scanner_args.deduplicate_expressions_) {
+      // Collect unique expressions of all the files first, and search every
+      // one of them once.
+      TwoPhaseScan::Config two_phase_config;
+      two_phase_config.num_readers_ = file_scanner_args.num_reader_threads_;
+      two_phase_config.log_dir_ = file_scanner_args.log_dir_;
+      two_phase_config.result_sink_ = result_sink.get();
+      TwoPhaseScan two_phase_scan(train_and_scan_util,
+                                  file_scanner_args.eval_file_language_,
+                                  two_phase_config);
+      two_phase_scan.Run(eval_file_names, std::cout);
+      if (result_sink) result_sink->Close();
+      two_phase_scan.ReportStatistics(std::cout);
+      train_and_scan_util.ClosePersistentCache(std::cout);
+      return 0;
     }
+
+    // Perform multi-threaded inference / scan for bugs. Files are read,
+    // parsed, scanned and logged by separate stages of a pipeline, so that
+    // scanner threads do not wait on I/O or on parsing. Scans and their
+    // autocorrect searches share the num_threads_ workers of the thread pool
+    // of train_and_scan_util.
+    ScanPipeline::Config pipeline_config;
+    pipeline_config.num_readers_ = file_scanner_args.num_reader_threads_;
+    pipeline_config.num_parsers_ = file_scanner_args.num_parser_threads_;
+    pipeline_config.log_dir_ = file_scanner_args.log_dir_;
+    pipeline_config.result_sink_ = result_sink.get();
+
+    ScanPipeline scan_pipeline(train_and_scan_util,
+                               file_scanner_args.eval_file_language_,
+                               pipeline_config);
+    scan_pipeline.Run(eval_file_names, std::cout);
+    if (result_sink) result_sink->Close();
+    scan_pipeline.ReportUtilization(std::cout);
+    train_and_scan_util.ClosePersistentCache(std::cout);
   } catch (std::exception& e) {
     std::cerr << "Error: " << e.what() << std::endl;
   }
@@ -0,0 +1,139 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <unistd.h>
+#ifdef WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif  // WIN32
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include "exception.h"
+#include "language_server.h"
+#include "train_and_scan_util.h"
+
+// Language server that reports potential anomalies of the files open in an
+// editor as diagnostics. It talks to the editor over stdin and stdout, so
+// all the logs go to stderr.
+
+struct LanguageServerArgs {
+  std::string train_dataset_ = "";
+  Language language_ = LANGUAGE_C;
+  std::string persistent_cache_file_ = "";
+  TrainAndScanUtil::ScanConfig scan_config_;
+};
+
+static int handle_command_args(int argc, char* argv[],
+                               LanguageServerArgs& args) {
+  auto print_usage = [&]() {
+    std::cerr << "Usage: " << argv[0] << std::endl
+           << "  -t if_statements_to_train_on " << std::endl
+           << "  [-c max_cost_for_autocorrect]              (default: 2)"
+           << std::endl
+           << "  [-n max_number_of_results_for_autocorrect] (default: 5)"
+           << std::endl
+           << "  [-j number_of_scanning_threads]            (default: 1)"
+           << std::endl
+           << "  [-a anomaly_threshold]                     (default: 3.0)"
+           << std::endl
+           << "  [-l source_language_number]                (default: 1 (C), "
+           << "supported: 1 (C), 2 (Verilog), 3 (PHP), 4 (C++))"
+           << std::endl
+           << "  [-m cache_memory_budget_in_MB]             (default: 512)"
+           << std::endl
+           << "  [-p persistent_cache_file]                 (default: none)"
+           << std::endl
+           << "  [-v log_level ]                            (default: 0, "
+           << "{ERROR, 0}, {INFO, 1}, {DEBUG, 2})"
+           << std::endl;
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "v:t:c:n:j:a:l:m:p:")) != -1) {
+    switch (opt) {
+      case 't': args.train_dataset_ = optarg; break;
+      case 'c': args.scan_config_.max_cost_ = std::max(0, atoi(optarg)); break;
+      case 'n': args.scan_config_.max_autocorrections_ =
+                  std::max(0, atoi(optarg)); break;
+      case 'j': args.scan_config_.num_threads_ = std::max(1, atoi(optarg));
+                break;
+      case 'a': args.scan_config_.anomaly_threshold_ = atof(optarg); break;
+      case 'm': args.scan_config_.cache_memory_budget_ =
+                  static_cast<size_t>(std::max(0, atoi(optarg))) * 1024 * 1024;
+                break;
+      case 'p': args.persistent_cache_file_ = FormatPath(optarg); break;
+      case 'v': if (atoi(optarg) >= TrainAndScanUtil::LogLevel::MIN &&
+                    atoi(optarg) <= TrainAndScanUtil::LogLevel::MAX) {
+                  args.scan_config_.log_level_ =
+                    static_cast<TrainAndScanUtil::LogLevel>(atoi(optarg));
+                }
+                break;
+      case 'l': args.language_ = VerifyLanguage(atoi(optarg));
+                args.scan_config_.language_ = args.language_;
+                break;
+      default: /* '?' */
+          print_usage();
+          return EXIT_FAILURE;
+    }
+  }
+  if (args.train_dataset_ == "") {
+    print_usage();
+    return EXIT_FAILURE;
+  }
+  // Diagnostics are published for potential anomalies only, so the source
+  // of the other code blocks need not be extracted.
+  args.scan_config_.anomalies_only_ = true;
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+  LanguageServerArgs args;
+  int status = handle_command_args(argc, argv, args);
+  if (status != EXIT_SUCCESS) return status;
+
+#ifdef WIN32
+  // Content-Length of messages counts bytes, so newlines must not be
+  // translated.
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif  // WIN32
+
+  try {
+    TrainAndScanUtil train_and_scan_util(args.scan_config_);
+    train_and_scan_util.ReadTrainingDatasetFromFile(args.train_dataset_,
+                                                    std::cerr);
+    if (args.persistent_cache_file_ != "") {
+      train_and_scan_util.OpenPersistentCache(args.persistent_cache_file_,
+                                              std::cerr);
+    }
+
+    LanguageServer server(train_and_scan_util, args.language_);
+    status = server.Run(std::cin, std::cout, std::cerr);
+    train_and_scan_util.ClosePersistentCache(std::cerr);
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return status;
+}
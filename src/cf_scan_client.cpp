@@ -0,0 +1,225 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>  // NOLINT [build/c++11]
+#include <sstream>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "common_util.h"
+#include "exception.h"
+#include "scan_protocol.h"
+
+// Client of cf_scan_server: sends files, sources or expressions to scan and
+// prints the reports, in the order of the requests, on stdout.
+
+struct ScanClientArgs {
+  std::string socket_path_ = scan_protocol::DefaultSocketPath();
+  std::string source_file_ = "";
+  std::string source_file_list_ = "";
+  std::string expression_ = "";
+  /// Name of the source read from stdin.
+  std::string stdin_source_name_ = "";
+  size_t num_connections_ = 1;
+  bool shutdown_server_ = false;
+};
+
+static int handle_command_args(int argc, char* argv[], ScanClientArgs& args) {
+  auto print_usage = [&]() {
+    std::cerr << "Usage: " << argv[0] << std::endl
+           << "  {-e source_file_to_scan |"
+           << "   -s file_containing_list_of_source_files_to_scan |"
+           << std::endl
+           << "   -x expression_to_scan |"
+           << "   -b name_of_source_to_scan_read_from_stdin |"
+           << "   -k (shut the server down)}"
+           << std::endl
+           << "  [-S socket_path]                           (default: "
+           << scan_protocol::DefaultSocketPath() << ")"
+           << std::endl
+           << "  [-j number_of_connections]                 (default: 1)"
+           << std::endl;
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "S:e:s:x:b:j:k")) != -1) {
+    switch (opt) {
+      case 'S': args.socket_path_ = FormatPath(optarg); break;
+      case 'e': args.source_file_ = FormatPath(optarg); break;
+      case 's': args.source_file_list_ = FormatPath(optarg); break;
+      case 'x': args.expression_ = optarg; break;
+      case 'b': args.stdin_source_name_ = optarg; break;
+      case 'j': args.num_connections_ = std::max(1, atoi(optarg)); break;
+      case 'k': args.shutdown_server_ = true; break;
+      default: /* '?' */
+          print_usage();
+          return EXIT_FAILURE;
+    }
+  }
+  if (args.source_file_ == "" && args.source_file_list_ == "" &&
+      args.expression_ == "" && args.stdin_source_name_ == "" &&
+      !args.shutdown_server_) {
+    print_usage();
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Requests, each with the data that follows its line.
+static std::vector<std::string> MakeRequests(const ScanClientArgs& args) {
+  std::vector<std::string> requests;
+  auto add_request = [&](const std::string& name,
+                         const std::string& argument) {
+    // Arguments are sent as a single line.
+    if (argument.find('\n') != std::string::npos) {
+      throw cf_unexpected_situation("Newline in request argument:" +
+                                    argument);
+    }
+    requests.push_back(name + " " + argument + "\n");
+  };
+
+  // Server resolves file paths in its own working directory, so they are
+  // sent absolute.
+  if (args.source_file_ != "") {
+    add_request(scan_protocol::kFileRequest,
+                scan_protocol::MakeAbsolutePath(args.source_file_));
+  }
+  if (args.source_file_list_ != "") {
+    std::ifstream stream(args.source_file_list_.c_str());
+    if (!stream.is_open()) {
+      throw cf_file_access_exception("Open failed:" + args.source_file_list_);
+    }
+    std::string line;
+    while (std::getline(stream, line)) {
+      add_request(scan_protocol::kFileRequest,
+                  scan_protocol::MakeAbsolutePath(FormatPath(line)));
+    }
+  }
+  if (args.expression_ != "") {
+    add_request(scan_protocol::kExpressionRequest, args.expression_);
+  }
+  if (args.stdin_source_name_ != "") {
+    std::ostringstream source;
+    source << std::cin.rdbuf();
+    add_request(scan_protocol::kSourceRequest,
+                std::to_string(source.str().size()) + " " +
+                args.stdin_source_name_);
+    requests.back() += source.str();
+  }
+  return requests;
+}
+
+// Send requests over num_connections connections, and print the reports in
+// the order of the requests. Returns false if some request failed.
+static bool SendRequests(const ScanClientArgs& args,
+                         const std::vector<std::string>& requests) {
+  std::atomic<size_t> next_request(0);
+  std::atomic<bool> is_successful(true);
+
+  // Reports arrive out of order, but we print them in order. Received
+  // reports wait in pending_reports until all the reports before them are
+  // printed.
+  std::mutex output_mutex;
+  std::map<size_t, std::string> pending_reports;
+  size_t next_report_to_print = 0;
+
+  auto add_report = [&](size_t request_index, std::string&& report) {
+    std::unique_lock lock(output_mutex);
+    pending_reports[request_index] = std::move(report);
+    for (auto it = pending_reports.begin();
+         it != pending_reports.end() && it->first == next_report_to_print;
+         it = pending_reports.erase(it)) {
+      std::cout << it->second;
+      next_report_to_print++;
+    }
+  };
+
+  auto connection_fn = [&]() {
+    try {
+      scan_protocol::SocketStream stream(
+        scan_protocol::ConnectToUnixSocket(args.socket_path_));
+      size_t request_index;
+      while ((request_index = next_request.fetch_add(1)) < requests.size()) {
+        bool is_ok;
+        std::string body;
+        if (!stream.Write(requests[request_index]) ||
+            !stream.ReadResponse(is_ok, body)) {
+          // Reports after this one are still printed.
+          add_report(request_index, "");
+          throw cf_file_access_exception("Connection to server lost:" +
+                                         args.socket_path_);
+        }
+        if (!is_ok) {
+          is_successful = false;
+          std::cerr << "Error: " << body << std::endl;
+          body = "";
+        }
+        add_report(request_index, std::move(body));
+      }
+    } catch (std::exception& e) {
+      is_successful = false;
+      std::cerr << "Error: " << e.what() << std::endl;
+    }
+  };
+
+  size_t num_connections = std::min(args.num_connections_, requests.size());
+  std::vector<std::thread> connections;
+  for (size_t i = 0; i < num_connections; i++) {
+    connections.push_back(std::thread(connection_fn));
+  }
+  for (auto& connection : connections) {
+    connection.join();
+  }
+  std::cout.flush();
+  return is_successful;
+}
+
+int main(int argc, char* argv[]) {
+  ScanClientArgs args;
+  int status = handle_command_args(argc, argv, args);
+  if (status != EXIT_SUCCESS) return status;
+
+  // A server that goes away is reported as an error instead of killing us.
+  signal(SIGPIPE, SIG_IGN);
+
+  try {
+    bool is_successful = SendRequests(args, MakeRequests(args));
+    // Server is shut down once the other requests are answered.
+    if (args.shutdown_server_) {
+      is_successful = SendRequests(args,
+        {std::string(scan_protocol::kShutdownRequest) + "\n"}) &&
+        is_successful;
+    }
+    return is_successful ? EXIT_SUCCESS : EXIT_FAILURE;
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+}
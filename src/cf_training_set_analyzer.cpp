@@ -0,0 +1,241 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>  // NOLINT [build/c++11]
+#include <sstream>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "common_util.h"
+#include "exception.h"
+#include "trie.h"
+
+// Analyze expressions from the training dataset against the training dataset
+// itself. Every expression is reported along with its nearest expressions and
+// whether it would be flagged as a potential anomaly. This is useful for
+// auditing noisy training data.
+
+struct AnalyzerArgs {
+  std::string train_dataset_ = "";
+  std::string output_file_ = "";
+  TreeLevel level_ = LEVEL_ONE;
+  NearestExpression::Cost max_cost_ = 2;
+  size_t max_autocorrections_ = 5;
+  size_t num_threads_ = std::max(1u, std::thread::hardware_concurrency());
+  size_t batch_size_ = 64;
+  float anomaly_threshold_ = 3;
+};
+
+static int handle_command_args(int argc, char* argv[], AnalyzerArgs& args) {
+  auto print_usage = [&]() {
+    std::cerr << "Usage: " << argv[0] << std::endl
+           << "  -t training_data " << std::endl
+           << "  [-l tree_level]                            (default: 1, "
+           << "supported: 1 (ONE), 2 (TWO))"
+           << std::endl
+           << "  [-c max_cost_for_autocorrect]              (default: 2)"
+           << std::endl
+           << "  [-n max_number_of_results_for_autocorrect] (default: 5)"
+           << std::endl
+           << "  [-j number_of_threads]                     (default: "
+           << "num_cpus_on_system)"
+           << std::endl
+           << "  [-b number_of_expressions_per_batch]       (default: 64)"
+           << std::endl
+           << "  [-a anomaly_threshold]                     (default: 3.0)"
+           << std::endl
+           << "  [-o output_file]                           (default: stdout)"
+           << std::endl;
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:l:c:n:j:b:a:o:")) != -1) {
+    switch (opt) {
+      case 't': args.train_dataset_ = FormatPath(optarg); break;
+      case 'o': args.output_file_ = FormatPath(optarg); break;
+      case 'l': args.level_ = atoi(optarg) == LEVEL_TWO ? LEVEL_TWO : LEVEL_ONE;
+                break;
+      case 'c': args.max_cost_ = std::max(0, atoi(optarg)); break;
+      case 'n': args.max_autocorrections_ = std::max(0, atoi(optarg)); break;
+      case 'j': args.num_threads_ = std::max(1, atoi(optarg)); break;
+      case 'b': args.batch_size_ = std::max(1, atoi(optarg)); break;
+      case 'a': args.anomaly_threshold_ = atof(optarg); break;
+      default: /* '?' */
+          print_usage();
+          return EXIT_FAILURE;
+    }
+  }
+  if (args.train_dataset_ == "") {
+    print_usage();
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Format analysis result of a single expression as one line of JSON.
+static void FormatResult(const AnalyzerArgs& args, const Trie& trie,
+    const NearestExpression& expression,
+    NearestExpressions& nearest_expressions, std::ostream& out) {
+  trie.SortAndRankResults(nearest_expressions);
+  if (nearest_expressions.size() > args.max_autocorrections_)
+    nearest_expressions.resize(args.max_autocorrections_);
+  bool is_potential_anomaly = trie.IsPotentialAnomaly(nearest_expressions,
+                                  args.anomaly_threshold_);
+
+  out << "{\"level\":\""
+      << (args.level_ == LEVEL_ONE ? LevelToString<LEVEL_ONE>() :
+                                     LevelToString<LEVEL_TWO>())
+      << "\",\"expression\":\""
+      << EscapeJSONString(expression.GetExpression())
+      << "\",\"occurrences\":" << expression.GetNumOccurrences()
+      << ",\"potential_anomaly\":"
+      << (is_potential_anomaly ? "true" : "false")
+      << ",\"nearest_expressions\":[";
+  for (size_t i = 0; i < nearest_expressions.size(); i++) {
+    const auto& nearest_expression = nearest_expressions[i];
+    out << (i > 0 ? "," : "")
+        << "{\"expression\":\""
+        << EscapeJSONString(nearest_expression.GetExpression())
+        << "\",\"cost\":" << nearest_expression.GetCost()
+        << ",\"occurrences\":" << nearest_expression.GetNumOccurrences()
+        << "}";
+  }
+  out << "]}\n";
+}
+
+static void AnalyzeTrainingSet(const AnalyzerArgs& args, const Trie& trie,
+    std::ostream& out) {
+  const size_t num_expressions = trie.GetNumExpressions();
+  const size_t num_batches = (num_expressions + args.batch_size_ - 1) /
+                             args.batch_size_;
+  std::atomic<size_t> batch_index(0);
+  std::atomic<size_t> num_analyzed(0);
+  size_t tenth_num_expressions = std::max<size_t>(1, num_expressions / 10);
+  size_t next_progress_report = tenth_num_expressions;
+
+  // Batches complete out of order, but we write them in order so that the
+  // output is deterministic. Completed batches wait in pending_batches until
+  // all the batches before them are written.
+  std::mutex output_mutex;
+  std::map<size_t, std::string> pending_batches;
+  size_t next_batch_to_write = 0;
+
+  Timer analysis_timer;
+  analysis_timer.StartTimer();
+  auto report_progress = [&](const std::string& status, size_t num_done) {
+    Timer now = analysis_timer;
+    now.StopTimer();
+    struct timeval elapsed = now.TimerDiffToTimeval();
+    double elapsed_secs = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+    std::cerr << "Analysis " << status << ":" << num_done << "/"
+              << num_expressions
+              << " in " << now.TimerDiff() << "s ("
+              << static_cast<size_t>(elapsed_secs > 0 ?
+                                     num_done / elapsed_secs : 0)
+              << " expressions/s)" << std::endl;
+  };
+
+  auto thread_analyze_fn = [&]() {
+    size_t current_batch;
+    while ((current_batch = batch_index.fetch_add(1)) < num_batches) {
+      size_t begin = current_batch * args.batch_size_;
+      size_t end = std::min(begin + args.batch_size_, num_expressions);
+
+      auto batch_results = trie.SearchNearestExpressionsOfTrainingSet(
+                              begin, end, args.max_cost_);
+      std::ostringstream batch_output;
+      for (size_t i = begin; i < end; i++) {
+        FormatResult(args, trie, trie.GetExpression(i),
+                     batch_results[i - begin], batch_output);
+      }
+
+      std::unique_lock lock(output_mutex);
+      pending_batches[current_batch] = batch_output.str();
+      for (auto it = pending_batches.begin();
+           it != pending_batches.end() && it->first == next_batch_to_write;
+           it = pending_batches.erase(it)) {
+        out << it->second;
+        next_batch_to_write++;
+      }
+
+      // Report progress at every 10th % point.
+      size_t num_done = num_analyzed.fetch_add(end - begin) + (end - begin);
+      if (num_done >= next_progress_report) {
+        report_progress("progress", num_done);
+        while (next_progress_report <= num_done)
+          next_progress_report += tenth_num_expressions;
+      }
+    }
+  };
+
+  std::vector<std::thread> analyzer_threads;
+  for (size_t i = 0; i < args.num_threads_; i++) {
+    analyzer_threads.push_back(std::thread(thread_analyze_fn));
+  }
+  for (auto& analyzer_thread : analyzer_threads) {
+    analyzer_thread.join();
+  }
+  out.flush();
+  report_progress("complete", num_analyzed.load());
+}
+
+int main(int argc, char* argv[]) {
+  AnalyzerArgs args;
+
+  int status = handle_command_args(argc, argv, args);
+  if (status != EXIT_SUCCESS) return status;
+
+  try {
+    Trie trie;
+    Timer timer_trie_build;
+    timer_trie_build.StartTimer();
+    if (args.level_ == LEVEL_ONE) {
+      trie.Build<LEVEL_ONE>(args.train_dataset_);
+    } else {
+      trie.Build<LEVEL_TWO>(args.train_dataset_);
+    }
+    timer_trie_build.StopTimer();
+    ExpressionCompacter::Get().Freeze();
+    std::cerr << "Trie build took: " << timer_trie_build.TimerDiff() << "s, "
+              << trie.GetNumExpressions() << " unique expressions"
+              << std::endl;
+
+    if (args.output_file_ != "") {
+      std::ofstream output_file(args.output_file_.c_str());
+      if (!output_file.is_open()) {
+        throw cf_file_access_exception("Open failed:" + args.output_file_);
+      }
+      AnalyzeTrainingSet(args, trie, output_file);
+    } else {
+      AnalyzeTrainingSet(args, trie, std::cout);
+    }
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
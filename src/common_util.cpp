@@ -18,6 +18,14 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // WIN32
+
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -27,7 +35,7 @@
 #include "common_util.h"
 
 template <Language L>
-ManagedTSTree GetTSTree(const std::string& source_code,
+ManagedTSTree GetTSTree(std::string_view source_code,
                         bool report_parse_errors) {
   // Make parser thread-local so that we do not need to delete and recreate it
   // for every file to be parsed.
@@ -35,11 +43,11 @@ ManagedTSTree GetTSTree(const std::string& source_code,
   TSParser* parser = parser_base.GetTSParser();
 
   TSTree *tree = ts_parser_parse_string(parser, nullptr,
-                                        source_code.c_str(),
+                                        source_code.data(),
                                         source_code.length());
   parser_base.ResetTSParser();
   if (report_parse_errors && tree == NULL) {
-    throw cf_parse_error(source_code);
+    throw cf_parse_error(std::string(source_code));
   } else if (tree == NULL) {
     throw cf_unexpected_situation("Parse error");
   }
@@ -50,7 +58,7 @@ ManagedTSTree GetTSTree(const std::string& source_code,
 
   if (report_parse_errors &&
       (ts_node_is_null(root_node) || ts_node_has_error(root_node))) {
-    throw cf_parse_error(source_code);
+    throw cf_parse_error(std::string(source_code));
   }
 
   return ManagedTSTree(tree);
@@ -58,61 +66,154 @@ ManagedTSTree GetTSTree(const std::string& source_code,
 
 template <Language L>
 ManagedTSTree GetTSTree(const std::string& source_file,
-                        std::string& file_contents) {
-  std::ifstream ifs(source_file.c_str());
-  if (!ifs.is_open()) {
-    throw cf_file_access_exception("Could not open " + source_file);
-  }
-
-  std::stringstream buffer;
-  buffer << ifs.rdbuf();
-  file_contents = buffer.str();
+                        MappedFile& source_file_contents) {
+  // Source code is parsed from the mapping (or the buffer) without copying.
+  source_file_contents.Open(source_file);
 
   // We do not report parse errors at file-level. In our case, source code file
   // may contain parse errors. What we look for is control structures do not
   // have parse errors.
   static bool kReportParseError = false;
-  return GetTSTree<L>(file_contents, kReportParseError);
+  return GetTSTree<L>(source_file_contents.contents(), kReportParseError);
 }
 
-// For Verilog language, we are looking for always blocks.
-template <>
-void CollectCodeBlocksOfInterest<LANGUAGE_VERILOG>(const TSNode& node,
-    code_blocks_t& code_blocks) {
-  if (ts_node_is_null(node)) { return; }
+template <Language L>
+ManagedTSTree ReparseTSTree(std::string_view source_code,
+                            const ManagedTSTree& edited_tree) {
+  thread_local ParserBase<L> parser_base;
+  TSParser* parser = parser_base.GetTSParser();
+
+  TSTree *tree = ts_parser_parse_string(parser, edited_tree.get(),
+                                        source_code.data(),
+                                        source_code.length());
+  parser_base.ResetTSParser();
+  if (tree == NULL) {
+    throw cf_unexpected_situation("Parse error");
+  }
+  return ManagedTSTree(tree);
+}
 
-  uint32_t count = ts_node_child_count(node);
-  for (uint32_t i = 0; i < count; i++) {
-    auto child = ts_node_child(node, i);
-    if (ts_node_is_null(child)) continue;
-    if (IsAlwaysBlock(child)) {
-      code_blocks.push_back(child);
+void MappedFile::Open(const std::string& file_name) {
+  Unmap();
+#ifdef WIN32
+  std::ifstream ifs(file_name.c_str(), std::ios::binary);
+  if (!ifs.is_open()) {
+    throw cf_file_access_exception("Could not open " + file_name);
+  }
+  std::stringstream buffer;
+  buffer << ifs.rdbuf();
+  buffer_ = buffer.str();
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#else   // WIN32
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw cf_file_access_exception("Could not open " + file_name);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    close(fd);
+    throw cf_file_access_exception("Could not stat " + file_name);
+  }
+
+  size_t file_size = static_cast<size_t>(file_stat.st_size);
+  if (file_size < kMinMappedSize) {
+    // Capacity of buffer_ is kept across files. mmap does not accept 0
+    // length, so empty files are also read.
+    buffer_.resize(file_size);
+    size_t num_read = 0;
+    while (num_read < file_size) {
+      ssize_t result = read(fd, &buffer_[num_read], file_size - num_read);
+      if (result == -1 && errno == EINTR) continue;
+      if (result == -1) {
+        close(fd);
+        throw cf_file_access_exception("Could not read " + file_name);
+      }
+      if (result == 0) break;  // File shrunk after fstat.
+      num_read += static_cast<size_t>(result);
+    }
+    buffer_.resize(num_read);
+    data_ = buffer_.data();
+    size_ = num_read;
+  } else {
+    void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      throw cf_file_access_exception("Could not map " + file_name);
     }
-    CollectCodeBlocksOfInterest<LANGUAGE_VERILOG>(child, code_blocks);
+    data_ = static_cast<const char*>(mapping);
+    size_ = file_size;
+    is_mapped_ = true;
+  }
+  // Mapping stays valid after closing the file descriptor.
+  close(fd);
+#endif  // WIN32
+}
+
+void MappedFile::WillNeed() const {
+#ifndef WIN32
+  if (is_mapped_) {
+    // This is only a hint, so failures are ignored.
+    madvise(const_cast<char*>(data_), size_, MADV_WILLNEED);
   }
+#endif  // WIN32
 }
 
-// For C, C++, and PHP language, we are looking for control structures
-// such as if statements.
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+  if (this != &other) {
+    Unmap();
+    buffer_ = std::move(other.buffer_);
+    is_mapped_ = other.is_mapped_;
+    size_ = other.size_;
+    data_ = is_mapped_ ? other.data_ : buffer_.data();
+    other.data_ = nullptr;
+    other.size_ = 0;
+    other.is_mapped_ = false;
+  }
+  return *this;
+}
+
+void MappedFile::Unmap() {
+#ifndef WIN32
+  if (is_mapped_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+#endif  // WIN32
+  is_mapped_ = false;
+  data_ = nullptr;
+  size_ = 0;
+}
+
+// Code blocks of interest are captured by the code block query of the
+// language (see GetCodeBlockQuery), in the order of their positions.
 template <Language L>
-void CollectCodeBlocksOfInterest(const TSNode& node,
-    code_blocks_t& code_blocks) {
+void CollectCodeBlocksOfInterest(const TSNode& node, uint32_t start_byte,
+    uint32_t end_byte, code_blocks_t& code_blocks) {
   if (ts_node_is_null(node)) { return; }
 
-  uint32_t count = ts_node_child_count(node);
-  for (uint32_t i = 0; i < count; i++) {
-    auto child = ts_node_child(node, i);
-    if (ts_node_is_null(child)) continue;
-    if (IsIfStatement<L>(child)) {
-      auto if_condition = GetIfConditionNode<L>(child);
-      if (!ts_node_has_error(if_condition)) {
-        code_blocks.push_back(if_condition);
-      }
-    }
-    CollectCodeBlocksOfInterest<L>(child, code_blocks);
+  // Make query thread-local so that we compile it only once per thread.
+  thread_local QueryBase<L> query_base;
+  TSQueryCursor* cursor = query_base.GetTSQueryCursor();
+  ts_query_cursor_set_byte_range(cursor, start_byte, end_byte);
+  ts_query_cursor_exec(cursor, query_base.GetTSQuery(), node);
+
+  TSQueryMatch match;
+  uint32_t capture_index = 0;
+  while (ts_query_cursor_next_capture(cursor, &match, &capture_index)) {
+    const TSQueryCapture& capture = match.captures[capture_index];
+    if (capture.index != query_base.GetCodeBlockCaptureID()) continue;
+    if (query_base.SkipCodeBlocksWithErrors() &&
+        ts_node_has_error(capture.node)) continue;
+    code_blocks.push_back(capture.node);
   }
 }
 
+template <Language L>
+void CollectCodeBlocksOfInterest(const TSNode& node,
+    code_blocks_t& code_blocks) {
+  CollectCodeBlocksOfInterest<L>(node, 0, UINT32_MAX, code_blocks);
+}
+
 template <Language L>
 void CollectCodeBlocksOfInterest(const ManagedTSTree& tree,
     code_blocks_t& code_blocks) {
@@ -120,22 +221,42 @@ void CollectCodeBlocksOfInterest(const ManagedTSTree& tree,
   CollectCodeBlocksOfInterest<L>(root_node, code_blocks);
 }
 
+template <Language L>
+void CollectCodeBlocksOfInterest(const ManagedTSTree& tree,
+    uint32_t start_byte, uint32_t end_byte, code_blocks_t& code_blocks) {
+  auto root_node = ts_tree_root_node(tree.get());
+  CollectCodeBlocksOfInterest<L>(root_node, start_byte, end_byte,
+                                 code_blocks);
+}
+
+template
+ManagedTSTree GetTSTree<LANGUAGE_C>(std::string_view, bool);
+template
+ManagedTSTree GetTSTree<LANGUAGE_VERILOG>(std::string_view, bool);
 template
-ManagedTSTree GetTSTree<LANGUAGE_C>(const std::string&, bool);
+ManagedTSTree GetTSTree<LANGUAGE_PHP>(std::string_view, bool);
 template
-ManagedTSTree GetTSTree<LANGUAGE_VERILOG>(const std::string&, bool);
+ManagedTSTree GetTSTree<LANGUAGE_CPP>(std::string_view, bool);
 template
-ManagedTSTree GetTSTree<LANGUAGE_PHP>(const std::string&, bool);
+ManagedTSTree GetTSTree<LANGUAGE_C>(const std::string&, MappedFile&);
 template
-ManagedTSTree GetTSTree<LANGUAGE_CPP>(const std::string&, bool);
+ManagedTSTree GetTSTree<LANGUAGE_VERILOG>(const std::string&, MappedFile&);
 template
-ManagedTSTree GetTSTree<LANGUAGE_C>(const std::string&, std::string&);
+ManagedTSTree GetTSTree<LANGUAGE_PHP>(const std::string&, MappedFile&);
 template
-ManagedTSTree GetTSTree<LANGUAGE_VERILOG>(const std::string&, std::string&);
+ManagedTSTree GetTSTree<LANGUAGE_CPP>(const std::string&, MappedFile&);
 template
-ManagedTSTree GetTSTree<LANGUAGE_PHP>(const std::string&, std::string&);
+ManagedTSTree ReparseTSTree<LANGUAGE_C>(std::string_view,
+                                        const ManagedTSTree&);
 template
-ManagedTSTree GetTSTree<LANGUAGE_CPP>(const std::string&, std::string&);
+ManagedTSTree ReparseTSTree<LANGUAGE_VERILOG>(std::string_view,
+                                              const ManagedTSTree&);
+template
+ManagedTSTree ReparseTSTree<LANGUAGE_PHP>(std::string_view,
+                                          const ManagedTSTree&);
+template
+ManagedTSTree ReparseTSTree<LANGUAGE_CPP>(std::string_view,
+                                          const ManagedTSTree&);
 template
 void CollectCodeBlocksOfInterest<LANGUAGE_C>(const ManagedTSTree&,
                                              code_blocks_t&);
@@ -148,3 +269,15 @@ void CollectCodeBlocksOfInterest<LANGUAGE_PHP>(const ManagedTSTree &,
 template
 void CollectCodeBlocksOfInterest<LANGUAGE_CPP>(const ManagedTSTree &,
                                                code_blocks_t&);
+template
+void CollectCodeBlocksOfInterest<LANGUAGE_C>(const ManagedTSTree&,
+    uint32_t, uint32_t, code_blocks_t&);
+template
+void CollectCodeBlocksOfInterest<LANGUAGE_VERILOG>(const ManagedTSTree&,
+    uint32_t, uint32_t, code_blocks_t&);
+template
+void CollectCodeBlocksOfInterest<LANGUAGE_PHP>(const ManagedTSTree&,
+    uint32_t, uint32_t, code_blocks_t&);
+template
+void CollectCodeBlocksOfInterest<LANGUAGE_CPP>(const ManagedTSTree&,
+    uint32_t, uint32_t, code_blocks_t&);
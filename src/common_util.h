@@ -23,11 +23,15 @@
 
 #include <sys/time.h>
 #include <tree_sitter/api.h>
+#include <cstdint>
+#include <cstdio>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <sstream>
 #include <memory>
 #include <iostream>
+#include <utility>
 
 #include "parser.h"
 
@@ -61,17 +65,28 @@ class TSTreeDeleter {
 };
 using ManagedTSTree = std::unique_ptr<TSTree, TSTreeDeleter>;
 
+class MappedFile;
+
 /// Parse source code from specified file and return TSNode object for the root
-/// as well as original source code content.
+/// as well as original source code content. Source code is parsed directly
+/// from source_file_contents, which callers can reuse for many files.
 template <Language L>
 ManagedTSTree GetTSTree(const std::string& source_file,
-                        std::string& source_file_contents);
+                        MappedFile& source_file_contents);
 
 /// Parse source code from specified string and return TSNode
 template <Language L>
-ManagedTSTree GetTSTree(const std::string& source_code,
+ManagedTSTree GetTSTree(std::string_view source_code,
                         bool report_parse_errors = false);
 
+/// Parse source_code again after edited_tree, the tree of its previous
+/// version, was updated with ts_tree_edit for the edits that turned that
+/// version into source_code. Subtrees that the edits did not touch are
+/// reused, so that reparsing costs in proportion to the size of the edits.
+template <Language L>
+ManagedTSTree ReparseTSTree(std::string_view source_code,
+                            const ManagedTSTree& edited_tree);
+
 template <Language G>
 void CollectCodeBlocksOfInterest(const TSNode& root_node,
                                  code_blocks_t& code_blocks);
@@ -80,6 +95,94 @@ template <Language G>
 void CollectCodeBlocksOfInterest(const ManagedTSTree& tree,
                                  code_blocks_t& code_blocks);
 
+/// Same as above, but only collect code blocks that intersect with the byte
+/// range [start_byte, end_byte) of the source code.
+template <Language G>
+void CollectCodeBlocksOfInterest(const ManagedTSTree& tree,
+                                 uint32_t start_byte, uint32_t end_byte,
+                                 code_blocks_t& code_blocks);
+
+//----------------------------------------------------------------------------
+// 64-bit FNV-1a hash of a byte sequence. Unlike std::hash, its value is
+// stable across runs and platforms, so it can be stored in files.
+const uint64_t kFNVOffsetBasis = 14695981039346656037ULL;
+inline uint64_t HashBytes(const char* bytes, size_t length,
+                          uint64_t hash = kFNVOffsetBasis) {
+  const uint64_t kFNVPrime = 1099511628211ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= static_cast<unsigned char>(bytes[i]);
+    hash *= kFNVPrime;
+  }
+  return hash;
+}
+
+//----------------------------------------------------------------------------
+// Read-only memory-mapped view of a file. Small files, and all the files
+// where memory mapping is not supported, are read into memory instead.
+class MappedFile {
+ public:
+  MappedFile() {}
+  /// Throws cf_file_access_exception if the file cannot be opened.
+  explicit MappedFile(const std::string& file_name) { Open(file_name); }
+  MappedFile(MappedFile&& other) { *this = std::move(other); }
+  MappedFile& operator=(MappedFile&& other);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { Unmap(); }
+
+  /// Replace the view with a view of file_name. Memory used for reading
+  /// earlier files is reused, so one object can be used for many files.
+  /// Throws cf_file_access_exception if the file cannot be opened.
+  void Open(const std::string& file_name);
+
+  /// Ask the OS to start reading the mapped pages in the background, so that
+  /// they are in memory by the time they are accessed. Files that are read
+  /// instead of mapped are in memory already.
+  void WillNeed() const;
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  std::string_view contents() const { return std::string_view(data_, size_); }
+
+  /// Files smaller than this are read instead of mapped: a single read of a
+  /// small file is cheaper than setting up and tearing down its mapping.
+  static const size_t kMinMappedSize = 64 * 1024;
+
+ private:
+  void Unmap();
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  bool is_mapped_ = false;
+  // Used instead of mapping for small files and on platforms without mmap.
+  std::string buffer_;
+};
+
+//----------------------------------------------------------------------------
+// Escape a string so that it can be embedded in a JSON string literal.
+inline std::string EscapeJSONString(const std::string& str) {
+  std::string escaped;
+  escaped.reserve(str.length());
+  for (char c : str) {
+    switch (c) {
+      case '"':  escaped += "\\\""; break;
+      case '\\': escaped += "\\\\"; break;
+      case '\n': escaped += "\\n"; break;
+      case '\r': escaped += "\\r"; break;
+      case '\t': escaped += "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char unicode_escape[8];
+          snprintf(unicode_escape, sizeof(unicode_escape), "\\u%04x", c);
+          escaped += unicode_escape;
+        } else {
+          escaped += c;
+        }
+    }
+  }
+  return escaped;
+}
+
 //----------------------------------------------------------------------------
 // A simple microsec precision timer for profiling
 
@@ -0,0 +1,347 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <mutex>  // NOLINT [build/c++11]
+
+#include "expression_cache.h"
+
+NearestExpressionsCache::NearestExpressionsCache(size_t memory_budget,
+    size_t num_shards) : shard_bits_(0) {
+  while ((static_cast<size_t>(1) << shard_bits_) < num_shards)
+    shard_bits_++;
+  num_shards = static_cast<size_t>(1) << shard_bits_;
+  for (size_t i = 0; i < num_shards; i++) {
+    shards_.push_back(std::make_unique<Shard>(memory_budget / num_shards));
+  }
+}
+
+NearestExpressionsCache::Statistics
+NearestExpressionsCache::GetStatistics() const {
+  Statistics statistics;
+  for (const auto& shard : shards_) {
+    shard->AddStatistics(statistics);
+  }
+  return statistics;
+}
+
+bool NearestExpressionsCache::Shard::LookUp(const Key& short_expression,
+    KeyHash short_expression_hash,
+    CompactNearestExpressions& nearest_expressions) {
+  // shared lock for concurrent reads
+  std::shared_lock lock(mutex_);
+  const auto iter = Find(short_expression, short_expression_hash);
+  if (iter == cache_.end()) {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  Entry& entry = iter->second;
+  uint8_t frequency = entry.frequency_.load(std::memory_order_relaxed);
+  if (frequency < kMaxFrequency) {
+    // Racy increment is fine: frequency is only a hint for eviction.
+    entry.frequency_.store(frequency + 1, std::memory_order_relaxed);
+  }
+  nearest_expressions = entry.nearest_expressions_;
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void NearestExpressionsCache::Shard::Insert(const Key& short_expression,
+    KeyHash short_expression_hash,
+    const CompactNearestExpressions& nearest_expressions) {
+  // unique lock for writing
+  std::unique_lock lock(mutex_);
+  InsertLocked(short_expression, short_expression_hash, nearest_expressions);
+}
+
+void NearestExpressionsCache::Shard::InsertLocked(const Key& short_expression,
+    KeyHash short_expression_hash,
+    const CompactNearestExpressions& nearest_expressions) {
+  if (Find(short_expression, short_expression_hash) != cache_.end()) {
+    // Another thread has inserted this expression already.
+    return;
+  }
+
+  auto iter = cache_.emplace(std::piecewise_construct,
+                             std::forward_as_tuple(short_expression_hash),
+                             std::forward_as_tuple());
+  Entry& entry = iter->second;
+  entry.key_ = short_expression;
+  entry.nearest_expressions_ = nearest_expressions;
+  entry.charge_ = CalculateCharge(entry);
+  memory_used_ += entry.charge_;
+  insertions_.fetch_add(1, std::memory_order_relaxed);
+
+  QueueItem item = {short_expression_hash, &entry};
+  if (ghost_set_.erase(short_expression_hash) > 0) {
+    // Expression was evicted from small queue recently; it is not a one-hit
+    // wonder.
+    main_queue_.push_back(item);
+  } else {
+    small_queue_memory_used_ += entry.charge_;
+    small_queue_.push_back(item);
+  }
+
+  EvictIfNeeded();
+}
+
+bool NearestExpressionsCache::Shard::LookUpOrSearch(
+    const Key& short_expression, KeyHash short_expression_hash,
+    const SearchFn& search_fn,
+    CompactNearestExpressions& nearest_expressions) {
+  if (LookUp(short_expression, short_expression_hash, nearest_expressions))
+    return true;
+
+  std::promise<CompactNearestExpressions> search_result;
+  {
+    std::unique_lock lock(mutex_);
+    // Some thread may have inserted the expression after our lookup.
+    const auto iter = Find(short_expression, short_expression_hash);
+    if (iter != cache_.end()) {
+      // Our lookup counted a miss, but the expression is found after all.
+      misses_.fetch_sub(1, std::memory_order_relaxed);
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      nearest_expressions = iter->second.nearest_expressions_;
+      return true;
+    }
+
+    auto range = in_flight_searches_.equal_range(short_expression_hash);
+    for (auto in_flight = range.first; in_flight != range.second;
+         ++in_flight) {
+      if (in_flight->second.key_ == short_expression) {
+        // Some thread is searching for the same expression; wait for it.
+        auto result = in_flight->second.result_;
+        lock.unlock();
+        deduplicated_searches_.fetch_add(1, std::memory_order_relaxed);
+        nearest_expressions = result.get();
+        return true;
+      }
+    }
+
+    InFlightSearch in_flight_search = {short_expression,
+                                       search_result.get_future().share()};
+    in_flight_searches_.emplace(short_expression_hash, in_flight_search);
+  }
+
+  // Search without holding the lock.
+  try {
+    nearest_expressions = search_fn();
+  } catch (...) {
+    {
+      std::unique_lock lock(mutex_);
+      EraseInFlightSearch(short_expression, short_expression_hash);
+    }
+    // Let the waiting threads see the same exception.
+    search_result.set_exception(std::current_exception());
+    throw;
+  }
+
+  {
+    std::unique_lock lock(mutex_);
+    EraseInFlightSearch(short_expression, short_expression_hash);
+    InsertLocked(short_expression, short_expression_hash,
+                 nearest_expressions);
+  }
+  search_result.set_value(nearest_expressions);
+  return false;
+}
+
+void NearestExpressionsCache::Shard::EraseInFlightSearch(
+    const Key& short_expression, KeyHash short_expression_hash) {
+  auto range = in_flight_searches_.equal_range(short_expression_hash);
+  for (auto in_flight = range.first; in_flight != range.second;
+       ++in_flight) {
+    if (in_flight->second.key_ == short_expression) {
+      in_flight_searches_.erase(in_flight);
+      return;
+    }
+  }
+}
+
+void NearestExpressionsCache::Shard::AddStatistics(
+    Statistics& statistics) const {
+  statistics.hits_ += hits_.load(std::memory_order_relaxed);
+  statistics.misses_ += misses_.load(std::memory_order_relaxed);
+  statistics.insertions_ += insertions_.load(std::memory_order_relaxed);
+  statistics.evictions_ += evictions_.load(std::memory_order_relaxed);
+  statistics.deduplicated_searches_ +=
+    deduplicated_searches_.load(std::memory_order_relaxed);
+
+  std::shared_lock lock(mutex_);
+  statistics.num_entries_ += cache_.size();
+  statistics.memory_used_ += memory_used_;
+}
+
+NearestExpressionsCache::Shard::Map::iterator
+NearestExpressionsCache::Shard::Find(const Key& key, KeyHash hash) {
+  auto range = cache_.equal_range(hash);
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (iter->second.key_ == key)
+      return iter;
+  }
+  return cache_.end();
+}
+
+NearestExpressionsCache::Shard::Map::iterator
+NearestExpressionsCache::Shard::Find(const QueueItem& item) {
+  auto range = cache_.equal_range(item.hash_);
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (&iter->second == item.entry_)
+      return iter;
+  }
+  return cache_.end();
+}
+
+size_t NearestExpressionsCache::Shard::CalculateCharge(
+    const Entry& entry) const {
+  // Approximate overhead of a hash table node and a queue slot.
+  const size_t kPerEntryOverhead = 4 * sizeof(void*);
+  return sizeof(Map::value_type) + entry.key_.capacity() + kPerEntryOverhead +
+         entry.nearest_expressions_.capacity() *
+         sizeof(CompactNearestExpression);
+}
+
+void NearestExpressionsCache::Shard::EvictIfNeeded() {
+  while (memory_used_ > memory_budget_ && !cache_.empty()) {
+    if (small_queue_memory_used_ * 100 >
+          memory_budget_ * kSmallQueuePercent || main_queue_.empty()) {
+      EvictFromSmallQueue();
+    } else {
+      EvictFromMainQueue();
+    }
+  }
+}
+
+void NearestExpressionsCache::Shard::EvictFromSmallQueue() {
+  while (!small_queue_.empty()) {
+    QueueItem item = small_queue_.front();
+    small_queue_.pop_front();
+    Entry& entry = *item.entry_;
+    small_queue_memory_used_ -= entry.charge_;
+
+    if (entry.frequency_.load(std::memory_order_relaxed) > 0) {
+      // Accessed again after insertion: promote to main queue.
+      entry.frequency_.store(0, std::memory_order_relaxed);
+      main_queue_.push_back(item);
+    } else {
+      InsertIntoGhostQueue(item.hash_);
+      memory_used_ -= entry.charge_;
+      cache_.erase(Find(item));
+      evictions_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+void NearestExpressionsCache::Shard::EvictFromMainQueue() {
+  while (!main_queue_.empty()) {
+    QueueItem item = main_queue_.front();
+    main_queue_.pop_front();
+    Entry& entry = *item.entry_;
+
+    uint8_t frequency = entry.frequency_.load(std::memory_order_relaxed);
+    if (frequency > 0) {
+      // Give the entry another chance.
+      entry.frequency_.store(frequency - 1, std::memory_order_relaxed);
+      main_queue_.push_back(item);
+    } else {
+      memory_used_ -= entry.charge_;
+      cache_.erase(Find(item));
+      evictions_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+void NearestExpressionsCache::Shard::InsertIntoGhostQueue(KeyHash key_hash) {
+  // Ghost queue remembers as many keys as there are entries in main queue.
+  const size_t kMinGhostEntries = 64;
+  size_t max_ghost_entries = std::max(kMinGhostEntries, main_queue_.size());
+  if (ghost_set_.insert(key_hash).second) {
+    ghost_queue_.push_back(key_hash);
+  }
+  while (ghost_queue_.size() > max_ghost_entries) {
+    ghost_set_.erase(ghost_queue_.front());
+    ghost_queue_.pop_front();
+  }
+}
+
+bool NearestExpressionsCache::Compress(
+    const NearestExpression::Expression& base_expression,
+    const NearestExpressions& nearest_expressions,
+    CompactNearestExpressions& compact_expressions) {
+  compact_expressions.clear();
+  compact_expressions.reserve(nearest_expressions.size());
+  for (const auto& nearest_expression : nearest_expressions) {
+    CompactNearestExpression compact_expression;
+    compact_expression.cost_ =
+      static_cast<uint32_t>(nearest_expression.GetCost());
+    if (nearest_expression.GetPatternID() !=
+          NearestExpression::kInvalidPatternID) {
+      compact_expression.pattern_id_ = nearest_expression.GetPatternID();
+    } else if (nearest_expression.GetExpression() == base_expression) {
+      compact_expression.pattern_id_ = kBaseExpressionID;
+    } else {
+      return false;
+    }
+    compact_expressions.push_back(compact_expression);
+  }
+  return true;
+}
+
+NearestExpressions NearestExpressionsCache::Decompress(const Trie& trie,
+    const NearestExpression::Expression& base_expression,
+    const CompactNearestExpressions& compact_expressions) {
+  NearestExpressions nearest_expressions;
+  nearest_expressions.reserve(compact_expressions.size());
+  for (const auto& compact_expression : compact_expressions) {
+    if (compact_expression.pattern_id_ == kBaseExpressionID) {
+      // Base expression is not in training dataset, so no occurrences.
+      const NearestExpression::NumOccurrences kZeroOccurrences = 0;
+      nearest_expressions.push_back(NearestExpression(base_expression,
+          compact_expression.cost_, kZeroOccurrences));
+    } else {
+      NearestExpression expression =
+        trie.GetExpression(compact_expression.pattern_id_);
+      nearest_expressions.push_back(NearestExpression(
+          expression.GetExpression(), compact_expression.cost_,
+          expression.GetNumOccurrences(), expression.GetPatternID()));
+    }
+  }
+  return nearest_expressions;
+}
+
+bool NearestExpressionsCache::IsPotentialAnomaly(const Trie& trie,
+    const CompactNearestExpressions& compact_expressions,
+    float anomaly_threshold) {
+  return Trie::IsPotentialAnomaly(compact_expressions.size(),
+      [&](size_t i) {
+        return static_cast<NearestExpression::Cost>(
+                 compact_expressions[i].cost_);
+      },
+      [&](size_t i) -> NearestExpression::NumOccurrences {
+        // Base expression is not in training dataset, so no occurrences.
+        if (compact_expressions[i].pattern_id_ == kBaseExpressionID) return 0;
+        return trie.GetNumOccurrences(compact_expressions[i].pattern_id_);
+      },
+      anomaly_threshold);
+}
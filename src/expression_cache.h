@@ -0,0 +1,260 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_EXPRESSION_CACHE_H_
+#define SRC_EXPRESSION_CACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>  // NOLINT [build/c++11]
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "trie.h"
+
+/// Nearest expression stored in compact form: instead of the full string of
+/// the expression, we store its index in the training dataset.
+struct CompactNearestExpression {
+  /// Index of the expression in training dataset, or kBaseExpressionID for
+  /// the expression (not from the training dataset) being searched.
+  NearestExpression::PatternID pattern_id_;
+  uint32_t cost_;
+};
+using CompactNearestExpressions = std::vector<CompactNearestExpression>;
+const NearestExpression::PatternID kBaseExpressionID =
+  NearestExpression::kInvalidPatternID;
+
+/// Cache nearest expressions for a given expression so that we
+/// minimize computing nearest expressions over trie for every
+/// given expression. Cache is shared by all the scanner threads.
+///
+/// Cache is bounded by a memory budget. It uses S3-FIFO eviction policy
+/// (Yang et al., "FIFO queues are all you need for cache eviction", SOSP'23):
+/// new expressions enter a small FIFO queue that holds 10% of the budget and
+/// are promoted to a main FIFO queue only if they are looked up again before
+/// they reach the end of the small queue. Expressions seen only once (which
+/// is the case for most of the expressions when scanning a big repository)
+/// thus never evict the expressions that keep repeating.
+///
+/// To let many scanner threads use the cache concurrently, it is split into
+/// shards, each with its own lock and its own share of the memory budget.
+/// Expressions are assigned to shards by their hash, which callers compute
+/// only once per expression.
+class NearestExpressionsCache {
+ public:
+  using KeyHash = size_t;
+
+  struct Statistics {
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t insertions_ = 0;
+    size_t evictions_ = 0;
+    size_t num_entries_ = 0;
+    size_t memory_used_ = 0;
+    /// Number of searches avoided by waiting for another thread that was
+    /// searching nearest expressions of the same expression.
+    size_t deduplicated_searches_ = 0;
+  };
+
+  using SearchFn = std::function<CompactNearestExpressions()>;
+
+  static const size_t kDefaultNumShards = 64;
+
+  /// Number of shards is rounded up to a power of 2.
+  explicit NearestExpressionsCache(size_t memory_budget,
+                                   size_t num_shards = kDefaultNumShards);
+  NearestExpressionsCache(const NearestExpressionsCache&) = delete;
+  NearestExpressionsCache& operator=(const NearestExpressionsCache&) = delete;
+
+  /// Key of the cache for an expression compacted into tokens. Key holds the
+  /// raw bytes of the token IDs.
+  static NearestExpression::Expression MakeKey(const TokenSequence& tokens) {
+    return NearestExpression::Expression(
+             reinterpret_cast<const char*>(tokens.data()),
+             tokens.size() * sizeof(TokenID));
+  }
+
+  /// Hash of an expression used as the key of the cache.
+  static KeyHash Hash(const NearestExpression::Expression& short_expression) {
+    return std::hash<NearestExpression::Expression>()(short_expression);
+  }
+
+  /// Look up nearest expressions of the specified (compacted) expression,
+  /// whose hash is short_expression_hash.
+  bool LookUp(const NearestExpression::Expression& short_expression,
+              KeyHash short_expression_hash,
+              CompactNearestExpressions& nearest_expressions) {
+    return GetShard(short_expression_hash).LookUp(short_expression,
+              short_expression_hash, nearest_expressions);
+  }
+  bool LookUp(const NearestExpression::Expression& short_expression,
+              CompactNearestExpressions& nearest_expressions) {
+    return LookUp(short_expression, Hash(short_expression),
+                  nearest_expressions);
+  }
+
+  /// Insert nearest expressions of the specified (compacted) expression,
+  /// possibly evicting other expressions to stay within the memory budget.
+  void Insert(const NearestExpression::Expression& short_expression,
+              KeyHash short_expression_hash,
+              const CompactNearestExpressions& nearest_expressions) {
+    GetShard(short_expression_hash).Insert(short_expression,
+              short_expression_hash, nearest_expressions);
+  }
+  void Insert(const NearestExpression::Expression& short_expression,
+              const CompactNearestExpressions& nearest_expressions) {
+    Insert(short_expression, Hash(short_expression), nearest_expressions);
+  }
+
+  /// Look up nearest expressions of the specified (compacted) expression. If
+  /// they are not in the cache, then call search_fn to compute them and insert
+  /// them into the cache. If another thread is already computing them, then
+  /// wait for its result instead of calling search_fn. Returns true if
+  /// search_fn was not called.
+  bool LookUpOrSearch(const NearestExpression::Expression& short_expression,
+                      KeyHash short_expression_hash, const SearchFn& search_fn,
+                      CompactNearestExpressions& nearest_expressions) {
+    return GetShard(short_expression_hash).LookUpOrSearch(short_expression,
+              short_expression_hash, search_fn, nearest_expressions);
+  }
+
+  Statistics GetStatistics() const;
+
+  /// Convert nearest expressions of base_expression into compact form.
+  /// Returns false if some expression is neither from the training dataset
+  /// nor the base expression, in which case it cannot be compacted.
+  static bool Compress(const NearestExpression::Expression& base_expression,
+                       const NearestExpressions& nearest_expressions,
+                       CompactNearestExpressions& compact_expressions);
+  /// Opposite of Compress.
+  static NearestExpressions Decompress(const Trie& trie,
+                       const NearestExpression::Expression& base_expression,
+                       const CompactNearestExpressions& compact_expressions);
+  /// Same as Trie::IsPotentialAnomaly over Decompress-ed expressions, but
+  /// without expanding them: only costs and occurrences are needed.
+  static bool IsPotentialAnomaly(const Trie& trie,
+                       const CompactNearestExpressions& compact_expressions,
+                       float anomaly_threshold);
+
+ private:
+  using Key = NearestExpression::Expression;
+
+  /// A shard is an independent S3-FIFO cache. Shards are cache-line aligned
+  /// so that threads working on different shards do not share cache lines.
+  class alignas(64) Shard {
+   public:
+    explicit Shard(size_t memory_budget) : memory_budget_(memory_budget) {}
+
+    bool LookUp(const Key& short_expression, KeyHash short_expression_hash,
+                CompactNearestExpressions& nearest_expressions);
+    void Insert(const Key& short_expression, KeyHash short_expression_hash,
+                const CompactNearestExpressions& nearest_expressions);
+    bool LookUpOrSearch(const Key& short_expression,
+                        KeyHash short_expression_hash,
+                        const SearchFn& search_fn,
+                        CompactNearestExpressions& nearest_expressions);
+    void AddStatistics(Statistics& statistics) const;
+
+   private:
+    struct Entry {
+      Key key_;
+      CompactNearestExpressions nearest_expressions_;
+      /// Number of accesses (capped at kMaxFrequency) since insertion or
+      /// since the entry was last considered for eviction. It is updated
+      /// under shared lock, hence atomic.
+      std::atomic<uint8_t> frequency_{0};
+      size_t charge_ = 0;
+    };
+    /// Hash is precomputed, so the map does not need to hash it again.
+    struct IdentityHash {
+      size_t operator()(KeyHash hash) const { return hash; }
+    };
+    using Map = std::unordered_multimap<KeyHash, Entry, IdentityHash>;
+    /// Queues store pointers to entries of cache_, which stay valid until
+    /// the entry is erased.
+    struct QueueItem {
+      KeyHash hash_;
+      Entry* entry_;
+    };
+    /// Search for nearest expressions that is in progress in some thread.
+    struct InFlightSearch {
+      Key key_;
+      std::shared_future<CompactNearestExpressions> result_;
+    };
+
+    static const uint8_t kMaxFrequency = 3;
+    /// Percentage of memory budget used for the small queue.
+    static const size_t kSmallQueuePercent = 10;
+
+    Map::iterator Find(const Key& key, KeyHash hash);
+    Map::iterator Find(const QueueItem& item);
+    /// Insert when mutex_ is already locked for writing.
+    void InsertLocked(const Key& short_expression,
+                      KeyHash short_expression_hash,
+                      const CompactNearestExpressions& nearest_expressions);
+    void EraseInFlightSearch(const Key& short_expression,
+                             KeyHash short_expression_hash);
+    size_t CalculateCharge(const Entry& entry) const;
+    void EvictIfNeeded();
+    void EvictFromSmallQueue();
+    void EvictFromMainQueue();
+    void InsertIntoGhostQueue(KeyHash key_hash);
+
+    size_t memory_budget_;
+    size_t memory_used_ = 0;
+    size_t small_queue_memory_used_ = 0;
+
+    mutable std::shared_mutex mutex_;
+    Map cache_;
+    std::deque<QueueItem> small_queue_;
+    std::deque<QueueItem> main_queue_;
+    /// Hashes of the keys recently evicted from small queue. Such keys are
+    /// inserted directly into main queue when they are seen again.
+    std::deque<KeyHash> ghost_queue_;
+    std::unordered_set<KeyHash, IdentityHash> ghost_set_;
+    std::unordered_multimap<KeyHash, InFlightSearch, IdentityHash>
+      in_flight_searches_;
+
+    std::atomic<size_t> hits_{0};
+    std::atomic<size_t> misses_{0};
+    std::atomic<size_t> insertions_{0};
+    std::atomic<size_t> evictions_{0};
+    std::atomic<size_t> deduplicated_searches_{0};
+  };
+
+  Shard& GetShard(KeyHash hash) {
+    // Use high bits for selecting shard since low bits select the bucket in
+    // the shard's hash table.
+    return *shards_[(hash >> (sizeof(KeyHash) * 8 - shard_bits_)) &
+                    (shards_.size() - 1)];
+  }
+
+  size_t shard_bits_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+#endif  // SRC_EXPRESSION_CACHE_H_
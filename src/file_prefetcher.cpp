@@ -0,0 +1,92 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>  // NOLINT [build/c++11]
+#include <exception>
+#include <numeric>
+#include <utility>
+
+#include "file_prefetcher.h"
+
+FilePrefetcher::FilePrefetcher(const std::vector<std::string>& file_names,
+    size_t num_readers, size_t max_files_in_flight, bool largest_first)
+  : file_names_(file_names), read_order_(file_names.size()),
+    loaded_files_(max_files_in_flight) {
+  std::iota(read_order_.begin(), read_order_.end(), 0);
+  if (largest_first) {
+    // Files that cannot be looked up are read last; reading them reports
+    // the error.
+    std::vector<off_t> file_sizes(file_names_.size(), 0);
+    for (size_t i = 0; i < file_names_.size(); i++) {
+      struct stat file_stat;
+      if (stat(file_names_[i].c_str(), &file_stat) == 0) {
+        file_sizes[i] = file_stat.st_size;
+      }
+    }
+    std::stable_sort(read_order_.begin(), read_order_.end(),
+                     [&](size_t a, size_t b) {
+                       return file_sizes[a] > file_sizes[b];
+                     });
+  }
+
+  num_readers = std::max<size_t>(1, num_readers);
+  num_running_readers_ = num_readers;
+  for (size_t i = 0; i < num_readers; i++) {
+    readers_.push_back(std::thread(&FilePrefetcher::ReadFiles, this));
+  }
+}
+
+FilePrefetcher::~FilePrefetcher() {
+  // Closing the queue wakes up readers waiting for room in it.
+  loaded_files_.Close();
+  for (auto& reader : readers_) {
+    reader.join();
+  }
+}
+
+void FilePrefetcher::ReadFiles() {
+  size_t position;
+  while ((position = next_read_position_.fetch_add(1)) < read_order_.size()) {
+    size_t file_index = read_order_[position];
+    auto start = std::chrono::steady_clock::now();
+    File file;
+    file.index_ = file_index;
+    file.name_ = file_names_[file_index];
+    try {
+      file.contents_.Open(file.name_);
+      file.contents_.WillNeed();
+    } catch (std::exception& e) {
+      file.error_ = e.what();
+    }
+    read_nanoseconds_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start).count();
+    // Queue is closed only if the prefetcher is being destroyed.
+    if (!loaded_files_.Push(std::move(file))) break;
+  }
+
+  // Last reader to finish tells the consumers that there are no more files.
+  if (num_running_readers_.fetch_sub(1) == 1) {
+    loaded_files_.Close();
+  }
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_FILE_PREFETCHER_H_
+#define SRC_FILE_PREFETCHER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "bounded_queue.h"
+#include "common_util.h"
+
+/// Read files ahead of the threads that scan them, so that scanner threads do
+/// not wait on I/O (e.g., on cold-cache network filesystems). Reader threads
+/// load files into memory and hand them over through a bounded queue, which
+/// limits the number of loaded files waiting to be scanned.
+///
+/// Files are handed over in the order in which their reads complete, which
+/// may differ from the order of file_names. Files can be read largest first,
+/// so that the biggest files, which take the longest to scan, are not left
+/// for the end of the scan when there is no other work left to overlap with
+/// them.
+class FilePrefetcher {
+ public:
+  struct File {
+    /// Index of the file in file_names.
+    size_t index_ = 0;
+    std::string name_;
+    MappedFile contents_;
+    /// Non-empty if the file could not be read.
+    std::string error_;
+  };
+
+  static const size_t kDefaultNumReaders = 4;
+  static const size_t kDefaultMaxFilesInFlight = 64;
+
+  /// file_names must outlive the prefetcher. Reader threads start right
+  /// away. If largest_first is true, sizes of all the files are looked up
+  /// first, and files are read in decreasing order of size.
+  FilePrefetcher(const std::vector<std::string>& file_names,
+                 size_t num_readers = kDefaultNumReaders,
+                 size_t max_files_in_flight = kDefaultMaxFilesInFlight,
+                 bool largest_first = false);
+  FilePrefetcher(const FilePrefetcher&) = delete;
+  FilePrefetcher& operator=(const FilePrefetcher&) = delete;
+  /// Stops reading files that have not been read yet.
+  ~FilePrefetcher();
+
+  /// Get the next loaded file. Blocks until a file is loaded. Returns false
+  /// once all the files have been handed over. Thread-safe.
+  bool Next(File& file) { return loaded_files_.Pop(file); }
+
+  /// Total time that reader threads spent reading files so far, excluding the
+  /// time spent waiting for room in the queue.
+  double GetReadSeconds() const {
+    return read_nanoseconds_.load() / 1000000000.0;
+  }
+
+ private:
+  void ReadFiles();
+
+  const std::vector<std::string>& file_names_;
+  /// Indices of file_names_ in the order in which the files are read.
+  std::vector<size_t> read_order_;
+  std::atomic<size_t> next_read_position_{0};
+  std::atomic<size_t> num_running_readers_{0};
+  std::atomic<uint64_t> read_nanoseconds_{0};
+  BoundedQueue<File> loaded_files_;
+  std::vector<std::thread> readers_;
+};
+
+#endif  // SRC_FILE_PREFETCHER_H_
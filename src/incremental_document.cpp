@@ -0,0 +1,283 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#include "exception.h"
+#include "incremental_document.h"
+
+namespace {
+// Number of bytes of the UTF-8 character starting with lead byte c, and the
+// number of UTF-16 code units that encode it.
+void GetCharacterSize(unsigned char c, size_t& num_bytes,
+                      size_t& num_units) {
+  num_units = 1;
+  if (c < 0x80) {
+    num_bytes = 1;
+  } else if ((c & 0xE0) == 0xC0) {
+    num_bytes = 2;
+  } else if ((c & 0xF0) == 0xE0) {
+    num_bytes = 3;
+  } else if ((c & 0xF8) == 0xF0) {
+    num_bytes = 4;
+    num_units = 2;
+  } else {
+    // Invalid byte is counted as a character of its own.
+    num_bytes = 1;
+  }
+}
+}  // anonymous namespace
+
+LineIndex::LineIndex(std::string_view text) {
+  line_starts_.push_back(0);
+  for (const char* newline = static_cast<const char*>(
+         memchr(text.data(), '\n', text.size()));
+       newline != nullptr;
+       newline = static_cast<const char*>(memchr(newline + 1, '\n',
+         text.data() + text.size() - newline - 1))) {
+    line_starts_.push_back(newline - text.data() + 1);
+  }
+}
+
+size_t LineIndex::GetLineEnd(std::string_view text, size_t line) const {
+  if (line + 1 >= line_starts_.size()) return text.size();
+  size_t end = line_starts_[line + 1] - 1;
+  if (end > line_starts_[line] && text[end - 1] == '\r') end--;
+  return end;
+}
+
+size_t LineIndex::ToOffset(std::string_view text, const Position& position,
+                           Encoding encoding) const {
+  if (position.line_ >= line_starts_.size()) return text.size();
+  size_t offset = line_starts_[position.line_];
+  size_t line_end = GetLineEnd(text, position.line_);
+  if (encoding == UTF8) {
+    return std::min(offset + position.character_, line_end);
+  }
+  size_t num_units = 0;
+  while (offset < line_end) {
+    size_t character_bytes;
+    size_t character_units;
+    GetCharacterSize(text[offset], character_bytes, character_units);
+    if (num_units + character_units > position.character_) break;
+    num_units += character_units;
+    offset = std::min(offset + character_bytes, line_end);
+  }
+  return offset;
+}
+
+LineIndex::Position LineIndex::ToPosition(std::string_view text,
+                                          size_t offset,
+                                          Encoding encoding) const {
+  offset = std::min(offset, text.size());
+  Position position;
+  position.line_ = std::upper_bound(line_starts_.begin(), line_starts_.end(),
+                                    offset) - line_starts_.begin() - 1;
+  size_t line_start = line_starts_[position.line_];
+  if (encoding == UTF8) {
+    position.character_ = offset - line_start;
+    return position;
+  }
+  for (size_t i = line_start; i < offset;) {
+    size_t character_bytes;
+    size_t character_units;
+    GetCharacterSize(text[i], character_bytes, character_units);
+    position.character_ += character_units;
+    i += character_bytes;
+  }
+  return position;
+}
+
+IncrementalDocument::IncrementalDocument(
+    const TrainAndScanUtil& train_and_scan_util, Language language,
+    const std::string& name)
+  : train_and_scan_util_(train_and_scan_util), language_(language),
+    name_(name) {}
+
+void IncrementalDocument::SetText(std::string text, std::ostream& log_file) {
+  text_ = std::move(text);
+  line_index_ = LineIndex(text_);
+  Update(nullptr, log_file);
+}
+
+void IncrementalDocument::Edit(size_t start_byte, size_t end_byte,
+                               std::string_view new_text,
+                               std::ostream& log_file) {
+  end_byte = std::min(end_byte, text_.size());
+  start_byte = std::min(start_byte, end_byte);
+  TSInputEdit edit;
+  edit.start_byte = start_byte;
+  edit.old_end_byte = end_byte;
+  edit.new_end_byte = start_byte + new_text.size();
+  edit.start_point = ToPoint(start_byte);
+  edit.old_end_point = ToPoint(end_byte);
+
+  text_.replace(start_byte, end_byte - start_byte, new_text);
+  line_index_ = LineIndex(text_);
+  edit.new_end_point = ToPoint(edit.new_end_byte);
+  Update(tree_ ? &edit : nullptr, log_file);
+}
+
+TSPoint IncrementalDocument::ToPoint(size_t offset) const {
+  // Columns of tree-sitter points are in bytes.
+  auto position = line_index_.ToPosition(text_, offset, LineIndex::UTF8);
+  return TSPoint{static_cast<uint32_t>(position.line_),
+                 static_cast<uint32_t>(position.character_)};
+}
+
+void IncrementalDocument::Update(const TSInputEdit* edit,
+                                 std::ostream& log_file) {
+  switch (language_) {
+    case LANGUAGE_C:
+      return Update<LANGUAGE_C>(edit, log_file);
+    case LANGUAGE_VERILOG:
+      return Update<LANGUAGE_VERILOG>(edit, log_file);
+    case LANGUAGE_PHP:
+      return Update<LANGUAGE_PHP>(edit, log_file);
+    case LANGUAGE_CPP:
+      return Update<LANGUAGE_CPP>(edit, log_file);
+    default:
+      throw cf_unexpected_situation("Unsupported language:" +
+                                    std::to_string(LanguageToInt(language_)));
+  }
+}
+
+template <Language G>
+void IncrementalDocument::Update(const TSInputEdit* edit,
+                                 std::ostream& log_file) {
+  std::vector<ByteRange> ranges;
+  if (edit == nullptr) {
+    tree_ = GetTSTree<G>(text_);
+    code_blocks_.clear();
+    ranges.push_back(ByteRange(0, UINT32_MAX));
+    ScanRanges<G>(ranges, log_file);
+    return;
+  }
+
+  ts_tree_edit(tree_.get(), edit);
+  ManagedTSTree new_tree = ReparseTSTree<G>(text_, tree_);
+  uint32_t num_changed_ranges = 0;
+  TSRange* changed_ranges = ts_tree_get_changed_ranges(tree_.get(),
+                              new_tree.get(), &num_changed_ranges);
+  for (uint32_t i = 0; i < num_changed_ranges; i++) {
+    ranges.push_back(ByteRange(changed_ranges[i].start_byte,
+                               changed_ranges[i].end_byte));
+  }
+  free(changed_ranges);
+  tree_ = std::move(new_tree);
+  // Changed ranges only cover the changes of the syntactic structure, which
+  // misses edits that keep the structure (e.g., renaming a variable), so the
+  // edited range is always scanned again too. It is never empty, so that
+  // the code block around a deletion is found.
+  ranges.push_back(ByteRange(edit->start_byte,
+                             std::max(edit->new_end_byte,
+                                      edit->start_byte + 1)));
+
+  // Results of code blocks before the edit stay as they are, and the ones
+  // after it move by the change in size. Code blocks that overlap with the
+  // edit or with a changed range are scanned again.
+  int64_t delta = static_cast<int64_t>(edit->new_end_byte) -
+                  static_cast<int64_t>(edit->old_end_byte);
+  size_t num_kept = 0;
+  for (size_t i = 0; i < code_blocks_.size(); i++) {
+    CodeBlockResults& code_block = code_blocks_[i];
+    if (code_block.start_byte_ >= edit->old_end_byte) {
+      code_block.start_byte_ += delta;
+      code_block.end_byte_ += delta;
+    } else if (code_block.end_byte_ > edit->start_byte) {
+      continue;
+    }
+    bool is_changed = std::any_of(ranges.begin(), ranges.end(),
+      [&](const ByteRange& range) {
+        return code_block.start_byte_ < range.second &&
+               code_block.end_byte_ > range.first;
+      });
+    if (is_changed) continue;
+    if (num_kept != i) code_blocks_[num_kept] = std::move(code_block);
+    num_kept++;
+  }
+  code_blocks_.resize(num_kept);
+  ScanRanges<G>(ranges, log_file);
+}
+
+template <Language G>
+void IncrementalDocument::ScanRanges(const std::vector<ByteRange>& ranges,
+                                     std::ostream& log_file) {
+  code_blocks_t code_blocks;
+  for (const auto& range : ranges) {
+    CollectCodeBlocksOfInterest<G>(tree_, range.first, range.second,
+                                   code_blocks);
+  }
+  // Ranges may overlap, and code blocks that still have results may touch
+  // them.
+  auto to_range = [](const code_block_t& code_block) {
+    return ByteRange(ts_node_start_byte(code_block),
+                     ts_node_end_byte(code_block));
+  };
+  auto precedes = [](const CodeBlockResults& code_block,
+                     const ByteRange& range) {
+    return ByteRange(code_block.start_byte_, code_block.end_byte_) < range;
+  };
+  std::sort(code_blocks.begin(), code_blocks.end(),
+    [&](const code_block_t& a, const code_block_t& b) {
+      return to_range(a) < to_range(b);
+    });
+  code_blocks.erase(std::unique(code_blocks.begin(), code_blocks.end(),
+    [&](const code_block_t& a, const code_block_t& b) {
+      return to_range(a) == to_range(b);
+    }), code_blocks.end());
+  code_blocks.erase(std::remove_if(code_blocks.begin(), code_blocks.end(),
+    [&](const code_block_t& code_block) {
+      ByteRange range = to_range(code_block);
+      auto it = std::lower_bound(code_blocks_.begin(), code_blocks_.end(),
+                                 range, precedes);
+      return it != code_blocks_.end() &&
+             ByteRange(it->start_byte_, it->end_byte_) == range;
+    }), code_blocks.end());
+
+  TrainAndScanUtil::ScanSummary summary;
+  std::vector<CodeBlockResults> scanned_code_blocks(code_blocks.size());
+  for (size_t i = 0; i < code_blocks.size(); i++) {
+    scanned_code_blocks[i].start_byte_ = ts_node_start_byte(code_blocks[i]);
+    scanned_code_blocks[i].end_byte_ = ts_node_end_byte(code_blocks[i]);
+    train_and_scan_util_.ScanCodeBlocks<G>(name_, text_, code_blocks, i,
+                                           i + 1, summary, log_file,
+                                           &scanned_code_blocks[i].results_);
+  }
+  num_scanned_code_blocks_ = code_blocks.size();
+
+  std::vector<CodeBlockResults> merged_code_blocks;
+  merged_code_blocks.reserve(code_blocks_.size() + code_blocks.size());
+  std::merge(std::make_move_iterator(code_blocks_.begin()),
+             std::make_move_iterator(code_blocks_.end()),
+             std::make_move_iterator(scanned_code_blocks.begin()),
+             std::make_move_iterator(scanned_code_blocks.end()),
+             std::back_inserter(merged_code_blocks),
+             [](const CodeBlockResults& a, const CodeBlockResults& b) {
+               return ByteRange(a.start_byte_, a.end_byte_) <
+                      ByteRange(b.start_byte_, b.end_byte_);
+             });
+  code_blocks_ = std::move(merged_code_blocks);
+}
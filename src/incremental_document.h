@@ -0,0 +1,130 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_INCREMENTAL_DOCUMENT_H_
+#define SRC_INCREMENTAL_DOCUMENT_H_
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "common_util.h"
+#include "train_and_scan_util.h"
+
+/// Start offsets of the lines of a text, for converting byte offsets to
+/// (line, character) positions used by editors and back.
+class LineIndex {
+ public:
+  /// Unit of the characters of positions: bytes of UTF-8, or code units of
+  /// UTF-16 (which the language server protocol uses by default).
+  enum Encoding { UTF8, UTF16 };
+  /// 0-based position.
+  struct Position {
+    size_t line_ = 0;
+    size_t character_ = 0;
+  };
+
+  explicit LineIndex(std::string_view text = "");
+
+  /// Byte offset of position in text, the text that the index was built
+  /// for. Positions past the end of a line (or of the text) are clamped to
+  /// the end of the line (or of the text).
+  size_t ToOffset(std::string_view text, const Position& position,
+                  Encoding encoding) const;
+  /// Opposite of ToOffset.
+  Position ToPosition(std::string_view text, size_t offset,
+                      Encoding encoding) const;
+  size_t GetNumLines() const { return line_starts_.size(); }
+
+ private:
+  /// End of line line, excluding the line terminator.
+  size_t GetLineEnd(std::string_view text, size_t line) const;
+
+  std::vector<size_t> line_starts_;
+};
+
+/// Source file open in an editor, which is scanned again after every edit.
+/// The tree-sitter tree of the file is kept across edits: an edit is applied
+/// to it with ts_tree_edit before the file is parsed again, so tree-sitter
+/// reuses the subtrees that the edit did not touch. Only the code blocks in
+/// the byte ranges that the edit changed are then abstracted and scanned
+/// again; results of the other code blocks are kept and only moved.
+class IncrementalDocument {
+ public:
+  /// Results of the code block at bytes [start_byte_, end_byte_) of the text.
+  /// Only reported results are kept (see TrainAndScanUtil::ShouldReport).
+  struct CodeBlockResults {
+    uint32_t start_byte_ = 0;
+    uint32_t end_byte_ = 0;
+    std::vector<TrainAndScanUtil::ScanResult> results_;
+  };
+
+  /// The document is empty until SetText. name is used for reports only.
+  IncrementalDocument(const TrainAndScanUtil& train_and_scan_util,
+                      Language language, const std::string& name);
+  IncrementalDocument(const IncrementalDocument&) = delete;
+  IncrementalDocument& operator=(const IncrementalDocument&) = delete;
+
+  /// Replace the whole text, and parse and scan it from scratch.
+  void SetText(std::string text, std::ostream& log_file);
+  /// Replace bytes [start_byte, end_byte) of the text with new_text, and
+  /// scan the code blocks that the edit changed.
+  void Edit(size_t start_byte, size_t end_byte, std::string_view new_text,
+            std::ostream& log_file);
+
+  const std::string& GetText() const { return text_; }
+  const LineIndex& GetLineIndex() const { return line_index_; }
+  /// Code blocks in source order.
+  const std::vector<CodeBlockResults>& GetCodeBlocks() const {
+    return code_blocks_;
+  }
+  /// Number of code blocks scanned by the last SetText or Edit.
+  size_t GetNumScannedCodeBlocks() const { return num_scanned_code_blocks_; }
+
+ private:
+  using ByteRange = std::pair<uint32_t, uint32_t>;
+
+  /// Parse the text and scan its changed code blocks. edit is the edit
+  /// since the last parse, or null to parse from scratch.
+  void Update(const TSInputEdit* edit, std::ostream& log_file);
+  template <Language G>
+  void Update(const TSInputEdit* edit, std::ostream& log_file);
+  /// Scan the code blocks of tree_ that intersect one of ranges and that
+  /// do not have results yet.
+  template <Language G>
+  void ScanRanges(const std::vector<ByteRange>& ranges,
+                  std::ostream& log_file);
+  TSPoint ToPoint(size_t offset) const;
+
+  const TrainAndScanUtil& train_and_scan_util_;
+  Language language_;
+  std::string name_;
+  std::string text_;
+  LineIndex line_index_;
+  ManagedTSTree tree_;
+  std::vector<CodeBlockResults> code_blocks_;
+  size_t num_scanned_code_blocks_ = 0;
+};
+
+#endif  // SRC_INCREMENTAL_DOCUMENT_H_
@@ -0,0 +1,272 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "common_util.h"
+#include "exception.h"
+#include "json.h"
+
+namespace {
+// Recursive-descent parser of a JSON text.
+class JSONParser {
+ public:
+  explicit JSONParser(std::string_view text) : text_(text) {}
+
+  JSONValue ParseText() {
+    JSONValue value = ParseValue();
+    SkipWhitespace();
+    if (position_ != text_.size()) Fail();
+    return value;
+  }
+
+ private:
+  // Nesting deeper than this is rejected, so that malicious input cannot
+  // overflow the stack.
+  static const size_t kMaxDepth = 256;
+
+  [[noreturn]] void Fail() const {
+    throw cf_parse_error("JSON at offset " + std::to_string(position_));
+  }
+
+  void SkipWhitespace() {
+    while (position_ < text_.size() &&
+           (text_[position_] == ' ' || text_[position_] == '\t' ||
+            text_[position_] == '\n' || text_[position_] == '\r')) {
+      position_++;
+    }
+  }
+
+  bool Consume(std::string_view token) {
+    if (text_.substr(position_, token.size()) != token) return false;
+    position_ += token.size();
+    return true;
+  }
+
+  void Expect(char c) {
+    SkipWhitespace();
+    if (position_ >= text_.size() || text_[position_] != c) Fail();
+    position_++;
+  }
+
+  JSONValue ParseValue() {
+    if (++depth_ > kMaxDepth) Fail();
+    SkipWhitespace();
+    if (position_ >= text_.size()) Fail();
+    JSONValue value;
+    char c = text_[position_];
+    if (c == '{') {
+      value = ParseObject();
+    } else if (c == '[') {
+      value = ParseArray();
+    } else if (c == '"') {
+      value = ParseString();
+    } else if (Consume("true")) {
+      value = true;
+    } else if (Consume("false")) {
+      value = false;
+    } else if (Consume("null")) {
+      value = JSONValue();
+    } else {
+      value = ParseNumber();
+    }
+    depth_--;
+    return value;
+  }
+
+  JSONValue ParseObject() {
+    JSONValue::Object object;
+    Expect('{');
+    SkipWhitespace();
+    if (Consume("}")) return object;
+    do {
+      SkipWhitespace();
+      std::string name = ParseString();
+      Expect(':');
+      object.emplace_back(std::move(name), ParseValue());
+      SkipWhitespace();
+    } while (Consume(","));
+    Expect('}');
+    return object;
+  }
+
+  JSONValue ParseArray() {
+    JSONValue::Array array;
+    Expect('[');
+    SkipWhitespace();
+    if (Consume("]")) return array;
+    do {
+      array.push_back(ParseValue());
+      SkipWhitespace();
+    } while (Consume(","));
+    Expect(']');
+    return array;
+  }
+
+  JSONValue ParseNumber() {
+    size_t start = position_;
+    while (position_ < text_.size() &&
+           std::string_view("+-.eE0123456789").find(text_[position_]) !=
+             std::string_view::npos) {
+      position_++;
+    }
+    std::string number(text_.substr(start, position_ - start));
+    char* end = nullptr;
+    double value = strtod(number.c_str(), &end);
+    if (number.empty() || end != number.c_str() + number.size()) Fail();
+    return value;
+  }
+
+  uint32_t ParseHex4() {
+    if (position_ + 4 > text_.size()) Fail();
+    std::string hex(text_.substr(position_, 4));
+    char* end = nullptr;
+    uint32_t value = strtoul(hex.c_str(), &end, 16);
+    if (end != hex.c_str() + 4) Fail();
+    position_ += 4;
+    return value;
+  }
+
+  static void AppendUTF8(uint32_t code_point, std::string& output) {
+    if (code_point < 0x80) {
+      output += static_cast<char>(code_point);
+    } else if (code_point < 0x800) {
+      output += static_cast<char>(0xC0 | (code_point >> 6));
+      output += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+      output += static_cast<char>(0xE0 | (code_point >> 12));
+      output += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+      output += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else {
+      output += static_cast<char>(0xF0 | (code_point >> 18));
+      output += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+      output += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+      output += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+  }
+
+  std::string ParseString() {
+    if (position_ >= text_.size() || text_[position_] != '"') Fail();
+    position_++;
+    std::string string;
+    while (true) {
+      if (position_ >= text_.size()) Fail();
+      char c = text_[position_++];
+      if (c == '"') return string;
+      if (c != '\\') {
+        string += c;
+        continue;
+      }
+      if (position_ >= text_.size()) Fail();
+      char escaped = text_[position_++];
+      switch (escaped) {
+        case '"': string += '"'; break;
+        case '\\': string += '\\'; break;
+        case '/': string += '/'; break;
+        case 'b': string += '\b'; break;
+        case 'f': string += '\f'; break;
+        case 'n': string += '\n'; break;
+        case 'r': string += '\r'; break;
+        case 't': string += '\t'; break;
+        case 'u': {
+          uint32_t code_point = ParseHex4();
+          // Characters outside the basic plane are escaped as surrogate
+          // pairs.
+          if (code_point >= 0xD800 && code_point < 0xDC00 &&
+              Consume("\\u")) {
+            uint32_t low_surrogate = ParseHex4();
+            if (low_surrogate < 0xDC00 || low_surrogate >= 0xE000) Fail();
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) +
+                         (low_surrogate - 0xDC00);
+          }
+          AppendUTF8(code_point, string);
+          break;
+        }
+        default: Fail();
+      }
+    }
+  }
+
+  std::string_view text_;
+  size_t position_ = 0;
+  size_t depth_ = 0;
+};
+}  // anonymous namespace
+
+const JSONValue& JSONValue::operator[](const std::string& name) const {
+  static const JSONValue kNullValue;
+  for (const auto& member : object_) {
+    if (member.first == name) return member.second;
+  }
+  return kNullValue;
+}
+
+std::string JSONValue::ToString() const {
+  std::string output;
+  AppendTo(output);
+  return output;
+}
+
+void JSONValue::AppendTo(std::string& output) const {
+  switch (type_) {
+    case NULL_VALUE: output += "null"; break;
+    case BOOLEAN: output += boolean_ ? "true" : "false"; break;
+    case NUMBER: {
+      // Integers, such as positions and ids, are written without exponent.
+      char number[32];
+      if (std::isfinite(number_) && number_ == std::floor(number_) &&
+          std::fabs(number_) < 1e15) {
+        snprintf(number, sizeof(number), "%.0f", number_);
+      } else {
+        snprintf(number, sizeof(number), "%.17g", number_);
+      }
+      output += number;
+      break;
+    }
+    case STRING:
+      output += "\"" + EscapeJSONString(string_) + "\"";
+      break;
+    case ARRAY:
+      output += "[";
+      for (size_t i = 0; i < array_.size(); i++) {
+        if (i > 0) output += ",";
+        array_[i].AppendTo(output);
+      }
+      output += "]";
+      break;
+    case OBJECT:
+      output += "{";
+      for (size_t i = 0; i < object_.size(); i++) {
+        if (i > 0) output += ",";
+        output += "\"" + EscapeJSONString(object_[i].first) + "\":";
+        object_[i].second.AppendTo(output);
+      }
+      output += "}";
+      break;
+  }
+}
+
+JSONValue JSONValue::Parse(std::string_view text) {
+  return JSONParser(text).ParseText();
+}
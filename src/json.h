@@ -0,0 +1,86 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_JSON_H_
+#define SRC_JSON_H_
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// Minimal JSON value, enough for the messages of the language server
+/// protocol (see LanguageServer). Numbers are doubles, and members of an
+/// object keep the order in which they were added.
+class JSONValue {
+ public:
+  enum Type {
+    NULL_VALUE,
+    BOOLEAN,
+    NUMBER,
+    STRING,
+    ARRAY,
+    OBJECT
+  };
+  using Array = std::vector<JSONValue>;
+  using Object = std::vector<std::pair<std::string, JSONValue>>;
+
+  JSONValue() {}
+  JSONValue(bool boolean) : type_(BOOLEAN), boolean_(boolean) {}  // NOLINT
+  JSONValue(double number) : type_(NUMBER), number_(number) {}  // NOLINT
+  JSONValue(int number) : type_(NUMBER), number_(number) {}  // NOLINT
+  JSONValue(size_t number) : type_(NUMBER), number_(number) {}  // NOLINT
+  JSONValue(const char* string) : type_(STRING), string_(string) {}  // NOLINT
+  JSONValue(std::string string)  // NOLINT
+    : type_(STRING), string_(std::move(string)) {}
+  JSONValue(Array array)  // NOLINT
+    : type_(ARRAY), array_(std::move(array)) {}
+  JSONValue(Object object)  // NOLINT
+    : type_(OBJECT), object_(std::move(object)) {}
+
+  Type GetType() const { return type_; }
+  bool IsNull() const { return type_ == NULL_VALUE; }
+  /// Getters return false, 0 or empty values if the value is of another
+  /// type, so that optional members can be read without checking first.
+  bool GetBoolean() const { return type_ == BOOLEAN && boolean_; }
+  double GetNumber() const { return type_ == NUMBER ? number_ : 0; }
+  const std::string& GetString() const { return string_; }
+  const Array& GetArray() const { return array_; }
+  const Object& GetObject() const { return object_; }
+  /// Member of an object, or a null value if there is no such member.
+  const JSONValue& operator[](const std::string& name) const;
+
+  std::string ToString() const;
+  /// Throws cf_parse_error if text is not a single JSON value.
+  static JSONValue Parse(std::string_view text);
+
+ private:
+  void AppendTo(std::string& output) const;
+
+  Type type_ = NULL_VALUE;
+  bool boolean_ = false;
+  double number_ = 0;
+  std::string string_;
+  Array array_;
+  Object object_;
+};
+
+#endif  // SRC_JSON_H_
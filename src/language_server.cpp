@@ -0,0 +1,298 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <utility>
+
+#include "exception.h"
+#include "language_server.h"
+#include "result_sink.h"
+
+namespace {
+// Error codes of JSON-RPC and of the language server protocol.
+const int kParseError = -32700;
+const int kInvalidRequest = -32600;
+const int kMethodNotFound = -32601;
+const int kInternalError = -32603;
+const int kServerNotInitialized = -32002;
+// Documents are synced by sending only the edits (TextDocumentSyncKind).
+const int kIncrementalSync = 2;
+const int kWarningSeverity = 2;
+
+JSONValue MakeResponse(const JSONValue& id, JSONValue result) {
+  return JSONValue::Object{{"jsonrpc", "2.0"}, {"id", id},
+                           {"result", std::move(result)}};
+}
+
+JSONValue MakeErrorResponse(const JSONValue& id, int code,
+                            const std::string& message) {
+  return JSONValue::Object{{"jsonrpc", "2.0"}, {"id", id},
+                           {"error", JSONValue::Object{
+                             {"code", code}, {"message", message}}}};
+}
+
+JSONValue MakeNotification(const std::string& method, JSONValue params) {
+  return JSONValue::Object{{"jsonrpc", "2.0"}, {"method", method},
+                           {"params", std::move(params)}};
+}
+}  // anonymous namespace
+
+LanguageServer::LanguageServer(const TrainAndScanUtil& train_and_scan_util,
+                               Language language)
+  : train_and_scan_util_(train_and_scan_util), language_(language) {}
+
+bool LanguageServer::ReadMessage(std::istream& input, std::string& content) {
+  const std::string kContentLength = "content-length:";
+  size_t content_length = 0;
+  bool has_content_length = false;
+  std::string line;
+  while (true) {
+    if (!std::getline(input, line)) {
+      if (!has_content_length) return false;
+      throw cf_parse_error("Message header ended early");
+    }
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty()) break;
+    // Header names are case-insensitive. Other headers (Content-Type) are
+    // ignored.
+    std::string name = line.substr(0, kContentLength.size());
+    for (auto& c : name) c = tolower(static_cast<unsigned char>(c));
+    if (name != kContentLength) continue;
+    char* end = nullptr;
+    const char* value = line.c_str() + kContentLength.size();
+    content_length = strtoull(value, &end, 10);
+    if (end == value || content_length > kMaxMessageSize) {
+      throw cf_parse_error("Bad message header: " + line);
+    }
+    has_content_length = true;
+  }
+  if (!has_content_length) {
+    throw cf_parse_error("Message header has no Content-Length");
+  }
+  content.resize(content_length);
+  input.read(&content[0], content_length);
+  return static_cast<size_t>(input.gcount()) == content_length;
+}
+
+void LanguageServer::WriteMessage(const JSONValue& message,
+                                  std::ostream& output) {
+  std::string content = message.ToString();
+  // Flush every message, since the client waits for it.
+  output << "Content-Length: " << content.size() << "\r\n\r\n" << content
+         << std::flush;
+}
+
+int LanguageServer::Run(std::istream& input, std::ostream& output,
+                        std::ostream& log_file) {
+  std::string content;
+  while (ReadMessage(input, content)) {
+    JSONValue message;
+    try {
+      message = JSONValue::Parse(content);
+    } catch (const cf_parse_error& e) {
+      WriteMessage(MakeErrorResponse(JSONValue(), kParseError, e.what()),
+                   output);
+      continue;
+    }
+    if (!HandleMessage(message, output, log_file)) break;
+  }
+  return is_shutdown_requested_ ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+bool LanguageServer::HandleMessage(const JSONValue& message,
+                                   std::ostream& output,
+                                   std::ostream& log_file) {
+  const std::string& method = message["method"].GetString();
+  const JSONValue& id = message["id"];
+  const JSONValue& params = message["params"];
+  // Notifications have no id. Messages without method are responses, and
+  // we send no requests.
+  bool is_request = !id.IsNull();
+  if (method.empty()) return true;
+  if (method == "exit") return false;
+
+  try {
+    if (method == "initialize") {
+      WriteMessage(MakeResponse(id, Initialize(params)), output);
+    } else if (!is_initialized_) {
+      if (is_request) {
+        WriteMessage(MakeErrorResponse(id, kServerNotInitialized,
+                                       "Server not initialized"), output);
+      }
+    } else if (method == "shutdown") {
+      is_shutdown_requested_ = true;
+      documents_.clear();
+      WriteMessage(MakeResponse(id, JSONValue()), output);
+    } else if (is_shutdown_requested_) {
+      if (is_request) {
+        WriteMessage(MakeErrorResponse(id, kInvalidRequest,
+                                       "Server is shut down"), output);
+      }
+    } else if (method == "textDocument/didOpen") {
+      OpenDocument(params, output, log_file);
+    } else if (method == "textDocument/didChange") {
+      ChangeDocument(params, output, log_file);
+    } else if (method == "textDocument/didClose") {
+      CloseDocument(params, output);
+    } else if (is_request) {
+      WriteMessage(MakeErrorResponse(id, kMethodNotFound,
+                                     "Unsupported method: " + method),
+                   output);
+    }
+    // Other notifications (e.g., initialized) need no action.
+  } catch (const std::exception& e) {
+    if (is_request) {
+      WriteMessage(MakeErrorResponse(id, kInternalError, e.what()), output);
+    } else {
+      log_file << "Error: " << method << ": " << e.what() << std::endl;
+    }
+  }
+  return true;
+}
+
+JSONValue LanguageServer::Initialize(const JSONValue& params) {
+  // Positions are in UTF-16 code units, unless the client also supports
+  // UTF-8, which we use without converting.
+  encoding_ = LineIndex::UTF16;
+  const JSONValue& encodings =
+    params["capabilities"]["general"]["positionEncodings"];
+  for (const auto& encoding : encodings.GetArray()) {
+    if (encoding.GetString() == "utf-8") encoding_ = LineIndex::UTF8;
+  }
+  is_initialized_ = true;
+
+  JSONValue::Object capabilities{
+    {"positionEncoding", encoding_ == LineIndex::UTF8 ? "utf-8" : "utf-16"},
+    {"textDocumentSync", JSONValue::Object{{"openClose", true},
+                                           {"change", kIncrementalSync}}}};
+  return JSONValue::Object{
+    {"capabilities", std::move(capabilities)},
+    {"serverInfo", JSONValue::Object{{"name", "cf_language_server"}}}};
+}
+
+void LanguageServer::OpenDocument(const JSONValue& params,
+                                  std::ostream& output,
+                                  std::ostream& log_file) {
+  const JSONValue& text_document = params["textDocument"];
+  const std::string& uri = text_document["uri"].GetString();
+  auto document = std::make_unique<IncrementalDocument>(train_and_scan_util_,
+                                                        language_, uri);
+  Timer timer;
+  timer.StartTimer();
+  document->SetText(text_document["text"].GetString(), log_file);
+  timer.StopTimer();
+  LogUpdate(uri, *document, timer, log_file);
+  PublishDiagnostics(uri, document.get(), output);
+  documents_[uri] = std::move(document);
+}
+
+void LanguageServer::ChangeDocument(const JSONValue& params,
+                                    std::ostream& output,
+                                    std::ostream& log_file) {
+  const std::string& uri = params["textDocument"]["uri"].GetString();
+  auto it = documents_.find(uri);
+  if (it == documents_.end()) {
+    throw cf_unexpected_situation("Document is not open: " + uri);
+  }
+  IncrementalDocument& document = *it->second;
+
+  // Positions of a change are in the text left by the changes before it.
+  Timer timer;
+  timer.StartTimer();
+  for (const auto& change : params["contentChanges"].GetArray()) {
+    const JSONValue& range = change["range"];
+    if (range.IsNull()) {
+      document.SetText(change["text"].GetString(), log_file);
+    } else {
+      document.Edit(ToOffset(document, range["start"]),
+                    ToOffset(document, range["end"]),
+                    change["text"].GetString(), log_file);
+    }
+  }
+  timer.StopTimer();
+  LogUpdate(uri, document, timer, log_file);
+  PublishDiagnostics(uri, &document, output);
+}
+
+void LanguageServer::CloseDocument(const JSONValue& params,
+                                   std::ostream& output) {
+  const std::string& uri = params["textDocument"]["uri"].GetString();
+  documents_.erase(uri);
+  // Diagnostics of closed documents are cleared by publishing none.
+  PublishDiagnostics(uri, nullptr, output);
+}
+
+void LanguageServer::PublishDiagnostics(const std::string& uri,
+    const IncrementalDocument* document, std::ostream& output) const {
+  JSONValue::Array diagnostics;
+  if (document) {
+    for (const auto& code_block : document->GetCodeBlocks()) {
+      for (const auto& result : code_block.results_) {
+        if (!result.is_potential_anomaly_) continue;
+        JSONValue::Object range{
+          {"start", ToLSPPosition(*document, code_block.start_byte_)},
+          {"end", ToLSPPosition(*document, code_block.end_byte_)}};
+        diagnostics.push_back(JSONValue::Object{
+          {"range", std::move(range)},
+          {"severity", kWarningSeverity},
+          {"source", "ControlFlag"},
+          {"message", ResultSink::FormatAnomalyMessage(result)}});
+      }
+    }
+  }
+  WriteMessage(MakeNotification("textDocument/publishDiagnostics",
+                                JSONValue::Object{
+                                  {"uri", uri},
+                                  {"diagnostics", std::move(diagnostics)}}),
+               output);
+}
+
+JSONValue LanguageServer::ToLSPPosition(const IncrementalDocument& document,
+                                        size_t offset) const {
+  auto position = document.GetLineIndex().ToPosition(document.GetText(),
+                                                     offset, encoding_);
+  return JSONValue::Object{{"line", position.line_},
+                           {"character", position.character_}};
+}
+
+size_t LanguageServer::ToOffset(const IncrementalDocument& document,
+                                const JSONValue& position) const {
+  LineIndex::Position line_index_position;
+  line_index_position.line_ =
+    static_cast<size_t>(std::max(0.0, position["line"].GetNumber()));
+  line_index_position.character_ =
+    static_cast<size_t>(std::max(0.0, position["character"].GetNumber()));
+  return document.GetLineIndex().ToOffset(document.GetText(),
+                                          line_index_position, encoding_);
+}
+
+void LanguageServer::LogUpdate(const std::string& uri,
+                               const IncrementalDocument& document,
+                               const Timer& timer,
+                               std::ostream& log_file) const {
+  if (train_and_scan_util_.GetScanConfig().log_level_ <
+      TrainAndScanUtil::LogLevel::INFO) return;
+  log_file << "Scanned " << document.GetNumScannedCodeBlocks() << " of "
+           << document.GetCodeBlocks().size() << " code blocks of " << uri
+           << " in " << timer.TimerDiff() << "s" << std::endl;
+}
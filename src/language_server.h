@@ -0,0 +1,92 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_LANGUAGE_SERVER_H_
+#define SRC_LANGUAGE_SERVER_H_
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "incremental_document.h"
+#include "json.h"
+#include "train_and_scan_util.h"
+
+/// Server of the language server protocol (LSP) that reports potential
+/// anomalies of the documents open in an editor as diagnostics. Messages
+/// are JSON-RPC messages preceded by a Content-Length header, read from and
+/// written to streams (stdin and stdout of cf_language_server).
+///
+/// Every open document is an IncrementalDocument, and edits are synced
+/// incrementally, so after an edit only the code blocks that it changed
+/// are parsed and scanned again before diagnostics are published.
+class LanguageServer {
+ public:
+  /// Documents are parsed as language language, whatever their languageId.
+  LanguageServer(const TrainAndScanUtil& train_and_scan_util,
+                 Language language);
+
+  /// Serve messages read from input until the exit notification or the end
+  /// of input. Returns the exit code required by the protocol: EXIT_SUCCESS
+  /// if shutdown was requested before, and EXIT_FAILURE otherwise.
+  int Run(std::istream& input, std::ostream& output, std::ostream& log_file);
+
+  /// Read content of a message. Returns false at the end of input. Throws
+  /// cf_parse_error if the header of the message is malformed.
+  static bool ReadMessage(std::istream& input, std::string& content);
+  static void WriteMessage(const JSONValue& message, std::ostream& output);
+
+ private:
+  /// Largest content of a message that we read.
+  static const size_t kMaxMessageSize = 256 * 1024 * 1024;
+
+  /// Returns false on the exit notification.
+  bool HandleMessage(const JSONValue& message, std::ostream& output,
+                     std::ostream& log_file);
+  JSONValue Initialize(const JSONValue& params);
+  void OpenDocument(const JSONValue& params, std::ostream& output,
+                    std::ostream& log_file);
+  void ChangeDocument(const JSONValue& params, std::ostream& output,
+                      std::ostream& log_file);
+  void CloseDocument(const JSONValue& params, std::ostream& output);
+  /// Publish potential anomalies of document, or no diagnostics if document
+  /// is null (i.e., it is closed).
+  void PublishDiagnostics(const std::string& uri,
+                          const IncrementalDocument* document,
+                          std::ostream& output) const;
+  JSONValue ToLSPPosition(const IncrementalDocument& document,
+                          size_t offset) const;
+  size_t ToOffset(const IncrementalDocument& document,
+                  const JSONValue& position) const;
+  void LogUpdate(const std::string& uri, const IncrementalDocument& document,
+                 const Timer& timer, std::ostream& log_file) const;
+
+  const TrainAndScanUtil& train_and_scan_util_;
+  Language language_;
+  LineIndex::Encoding encoding_ = LineIndex::UTF16;
+  bool is_initialized_ = false;
+  bool is_shutdown_requested_ = false;
+  std::unordered_map<std::string, std::unique_ptr<IncrementalDocument>>
+    documents_;
+};
+
+#endif  // SRC_LANGUAGE_SERVER_H_
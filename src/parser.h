@@ -22,9 +22,13 @@
 #define SRC_PARSER_H_
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <thread>  // NOLINT [build/c++11]
+#include <vector>
 
 #include "tree_sitter/api.h"
 #include "exception.h"
@@ -106,6 +110,92 @@ class ParserBase {
   TSParser* parser_ = NULL;
 };
 
+// Tree-sitter query that captures code blocks of interest of a language as
+// @code_block. Scanning new constructs only needs a new pattern here.
+struct CodeBlockQuery {
+  const char* source_;
+  // Skip captured code blocks that contain parse errors.
+  bool skip_code_blocks_with_errors_;
+};
+
+template <Language L> inline CodeBlockQuery GetCodeBlockQuery();
+// For C, C++, and PHP language, we are looking for control structures
+// such as if statements.
+template <> inline CodeBlockQuery GetCodeBlockQuery<LANGUAGE_C>() {
+  return {"(if_statement condition: (_) @code_block)", true};
+}
+template <> inline CodeBlockQuery GetCodeBlockQuery<LANGUAGE_CPP>() {
+  return {"(if_statement condition: (_) @code_block)", true};
+}
+template <> inline CodeBlockQuery GetCodeBlockQuery<LANGUAGE_PHP>() {
+  return {"(if_statement condition: (_) @code_block)", true};
+}
+// For Verilog language, we are looking for always blocks.
+template <> inline CodeBlockQuery GetCodeBlockQuery<LANGUAGE_VERILOG>() {
+  return {"(always_construct) @code_block", false};
+}
+
+// Compiled code block query of a language along with a cursor to execute it.
+// Like ParserBase, it is meant to be thread-local: the query is compiled once
+// per thread and the cursor is reused for every tree.
+template<Language L>
+class QueryBase {
+ public:
+  QueryBase() {
+    const CodeBlockQuery code_block_query = GetCodeBlockQuery<L>();
+    const std::string source = code_block_query.source_;
+    uint32_t error_offset = 0;
+    TSQueryError error_type = TSQueryErrorNone;
+    query_ = ts_query_new(GetTSLanguage<L>(), source.c_str(),
+                          source.length(), &error_offset, &error_type);
+    // Query compilation can fail if the query uses node types or fields that
+    // the language does not have.
+    if (query_ == NULL) {
+      throw cf_unexpected_situation("Compiling query failed at offset " +
+                                    std::to_string(error_offset) + ":" +
+                                    source);
+    }
+
+    const std::string kCodeBlockCapture = "code_block";
+    for (uint32_t i = 0; i < ts_query_capture_count(query_); i++) {
+      uint32_t length = 0;
+      const char* name = ts_query_capture_name_for_id(query_, i, &length);
+      if (kCodeBlockCapture.compare(0, std::string::npos, name, length) == 0)
+        code_block_capture_id_ = i;
+    }
+    skip_code_blocks_with_errors_ =
+      code_block_query.skip_code_blocks_with_errors_;
+    cursor_ = ts_query_cursor_new();
+  }
+
+  ~QueryBase() {
+    if (cursor_ != NULL) {
+      ts_query_cursor_delete(cursor_);
+      cursor_ = NULL;
+    }
+    if (query_ != NULL) {
+      ts_query_delete(query_);
+      query_ = NULL;
+    }
+  }
+
+  const TSQuery* GetTSQuery() const { return query_; }
+  TSQueryCursor* GetTSQueryCursor() { return cursor_; }
+  uint32_t GetCodeBlockCaptureID() const { return code_block_capture_id_; }
+  bool SkipCodeBlocksWithErrors() const {
+    return skip_code_blocks_with_errors_;
+  }
+
+ private:
+  QueryBase(const QueryBase& query_base) = delete;
+  QueryBase& operator=(const QueryBase& query_base) = delete;
+
+  TSQuery* query_ = NULL;
+  TSQueryCursor* cursor_ = NULL;
+  uint32_t code_block_capture_id_ = UINT32_MAX;
+  bool skip_code_blocks_with_errors_ = false;
+};
+
 /////////////////////////////////////////////////////////////////////
 //  Language-specific functions
 inline bool IsTSNodeofType(const TSNode& node, const std::string type) {
@@ -113,108 +203,184 @@ inline bool IsTSNodeofType(const TSNode& node, const std::string type) {
           0 == type.compare(ts_node_type(node)));
 }
 
-template <Language L> inline bool IsIfStatement(const TSNode& node);
-template <Language L> inline TSNode GetIfConditionNode(
-                                                const TSNode& if_statement);
-
-template <> inline bool IsIfStatement<LANGUAGE_C>(const TSNode& node) {
-  return IsTSNodeofType(node, "if_statement");
-}
-template <> inline bool IsIfStatement<LANGUAGE_VERILOG>(const TSNode& node) {
-  return IsTSNodeofType(node, "conditional_statement");
-}
-template <> inline bool IsIfStatement<LANGUAGE_PHP>(const TSNode& node) {
-  return IsTSNodeofType(node, "if_statement");
-}
-template <> inline bool IsIfStatement<LANGUAGE_CPP>(const TSNode& node) {
-  return IsTSNodeofType(node, "if_statement");
-}
-inline bool IsCommentNode(const TSNode& node) {
-  return IsTSNodeofType(node, "comment");
+// Walk node and its named descendants in pre-order without recursion. A
+// named node is a named descendant if all the nodes between it and node are
+// named, i.e., the named descendants are the named children of node, their
+// named children and so on. enter_fn is called on entering a node, and
+// leave_fn after walking all its named descendants.
+template <typename EnterFn, typename LeaveFn>
+inline void WalkNamedSubtree(const TSNode& node, EnterFn enter_fn,
+                             LeaveFn leave_fn) {
+  TSTreeCursor cursor = ts_tree_cursor_new(node);
+  enter_fn(node);
+  uint32_t depth = 0;
+  bool descend = true;
+  while (true) {
+    if (descend && ts_tree_cursor_goto_first_child(&cursor)) {
+      depth++;
+    } else {
+      // All the named descendants of the current node are walked.
+      TSNode current = ts_tree_cursor_current_node(&cursor);
+      if (depth == 0) {
+        leave_fn(current);
+        break;
+      }
+      if (ts_node_is_named(current)) leave_fn(current);
+      if (!ts_tree_cursor_goto_next_sibling(&cursor)) {
+        ts_tree_cursor_goto_parent(&cursor);
+        depth--;
+        descend = false;
+        continue;
+      }
+    }
+    // Anonymous nodes (and their descendants) are skipped.
+    TSNode current = ts_tree_cursor_current_node(&cursor);
+    descend = ts_node_is_named(current);
+    if (descend) enter_fn(current);
+  }
+  ts_tree_cursor_delete(&cursor);
 }
-// This method differs from ts_node_string in that it prints some details such
-// as variable names, identifiers and constants that are important for our
-// purpose.
-template <Language L> bool IsIdentifier(const TSNode& node);
-template <Language L> bool IsLiteral(const TSNode& node);
-template <Language L> bool IsPrimitiveType(const TSNode& node);
 
-template <> inline bool IsIdentifier<LANGUAGE_C>(const TSNode& node) {
-  return IsTSNodeofType(node, "identifier");
-}
-template <>
-inline bool IsLiteral<LANGUAGE_C>(const TSNode& node) {
-  return IsTSNodeofType(node, "number_literal");
-}
-template <>
-inline bool IsPrimitiveType<LANGUAGE_C>(const TSNode& node) {
-  return IsTSNodeofType(node, "primitive_type");
-}
-template <> inline bool IsIdentifier<LANGUAGE_CPP>(const TSNode& node) {
-  return IsTSNodeofType(node, "identifier");
+// Types of nodes that we are interested in. Symbols of a language are
+// classified into node kinds once by their names, so that a node is
+// classified by looking up its symbol instead of comparing strings.
+enum NodeKind : uint8_t {
+  NODE_KIND_OTHER = 0,
+  NODE_KIND_COMMENT,
+  NODE_KIND_IDENTIFIER,
+  NODE_KIND_LITERAL,
+  NODE_KIND_PRIMITIVE_TYPE,
+  NODE_KIND_PARENTHESIZED_EXPRESSION,
+  NODE_KIND_CONDITION_CLAUSE,
+  NODE_KIND_BINARY_EXPRESSION,
+  NODE_KIND_ASSIGNMENT_EXPRESSION,
+  NODE_KIND_UNARY_EXPRESSION,
+  NODE_KIND_POINTER_EXPRESSION,
+  NODE_KIND_CALL_EXPRESSION,
+  NODE_KIND_FIELD_EXPRESSION,
+  NODE_KIND_SUBSCRIPT_EXPRESSION,
+};
+
+struct NodeKindName {
+  const char* name_;
+  NodeKind kind_;
+};
+
+// Names of node types of language L and their kinds.
+template <Language L> inline std::vector<NodeKindName> GetNodeKindNames();
+
+// Names of expression types, which are same for all the languages.
+inline std::vector<NodeKindName> GetExpressionKindNames() {
+  return {
+    {"parenthesized_expression", NODE_KIND_PARENTHESIZED_EXPRESSION},
+    {"condition_clause", NODE_KIND_CONDITION_CLAUSE},
+    {"binary_expression", NODE_KIND_BINARY_EXPRESSION},
+    {"assignment_expression", NODE_KIND_ASSIGNMENT_EXPRESSION},
+    {"unary_expression", NODE_KIND_UNARY_EXPRESSION},
+    {"pointer_expression", NODE_KIND_POINTER_EXPRESSION},
+    {"call_expression", NODE_KIND_CALL_EXPRESSION},
+    {"field_expression", NODE_KIND_FIELD_EXPRESSION},
+    {"subscript_expression", NODE_KIND_SUBSCRIPT_EXPRESSION},
+  };
 }
+
 template <>
-inline bool IsLiteral<LANGUAGE_CPP>(const TSNode& node) {
-  return IsTSNodeofType(node, "number_literal");
+inline std::vector<NodeKindName> GetNodeKindNames<LANGUAGE_C>() {
+  return {
+    {"comment", NODE_KIND_COMMENT},
+    {"identifier", NODE_KIND_IDENTIFIER},
+    {"number_literal", NODE_KIND_LITERAL},
+    {"primitive_type", NODE_KIND_PRIMITIVE_TYPE},
+  };
 }
 template <>
-inline bool IsPrimitiveType<LANGUAGE_CPP>(const TSNode& node) {
-  return IsTSNodeofType(node, "primitive_type");
+inline std::vector<NodeKindName> GetNodeKindNames<LANGUAGE_CPP>() {
+  return GetNodeKindNames<LANGUAGE_C>();
 }
 template <>
-inline bool IsIdentifier<LANGUAGE_VERILOG>(const TSNode& node) {
-  return IsTSNodeofType(node, "simple_identifier");
+inline std::vector<NodeKindName> GetNodeKindNames<LANGUAGE_PHP>() {
+  return {
+    {"comment", NODE_KIND_COMMENT},
+  };
 }
-// TODO(nhasabni): complete this for Verilog if needed.
-template <>
-inline bool IsLiteral<LANGUAGE_VERILOG>(const TSNode& node) { return false; }
+// TODO(nhasabni): add literals for Verilog if needed.
 template <>
-inline bool IsPrimitiveType<LANGUAGE_VERILOG>(const TSNode& node) {
-  return false;
-}
-// Verilog specific
-inline bool IsAlwaysBlock(const TSNode& node) {
-  return (IsTSNodeofType(node, "always_construct"));
+inline std::vector<NodeKindName> GetNodeKindNames<LANGUAGE_VERILOG>() {
+  return {
+    {"comment", NODE_KIND_COMMENT},
+    {"simple_identifier", NODE_KIND_IDENTIFIER},
+  };
 }
 
-template <>
-inline TSNode GetIfConditionNode<LANGUAGE_C>(const TSNode& if_statement) {
-  const std::string& kIfCondition = "condition";
-  return ts_node_child_by_field_name(if_statement,
-                      kIfCondition.c_str(), kIfCondition.length());
-}
-template <>
-inline TSNode GetIfConditionNode<LANGUAGE_CPP>(const TSNode& if_statement) {
-  const std::string& kIfCondition = "condition";
-  return ts_node_child_by_field_name(if_statement,
-                      kIfCondition.c_str(), kIfCondition.length());
-}
-template <>
-inline TSNode GetIfConditionNode<LANGUAGE_VERILOG>(const TSNode& if_statement) {
-  const std::string& kIfCondition = "cond_predicate";
-  // TreeSitter verilog parser does not support gathering node child with field
-  // name. Hence this logic.
-  uint32_t count = ts_node_child_count(if_statement);
-  for (uint32_t i = 0; i < count; i++) {
-    auto child = ts_node_child(if_statement, i);
-    if (0 == kIfCondition.compare(ts_node_type(child))) {
-      return child;
+// Node kind of every symbol of language L. Several symbols may have the same
+// name (e.g., aliases), so we classify all the symbols rather than resolving
+// a single symbol per name with ts_language_symbol_for_name.
+template <Language L>
+class NodeKinds {
+ public:
+  static const NodeKinds& Get() {
+    static const NodeKinds node_kinds;
+    return node_kinds;
+  }
+
+  NodeKind Of(const TSNode& node) const {
+    if (ts_node_is_null(node)) return NODE_KIND_OTHER;
+    TSSymbol symbol = ts_node_symbol(node);
+    return symbol < kinds_.size() ? kinds_[symbol] : NODE_KIND_OTHER;
+  }
+  bool Is(const TSNode& node, NodeKind kind) const {
+    return Of(node) == kind;
+  }
+  /// ID of the "operator" field of expressions, or 0 if the language has no
+  /// such field.
+  TSFieldId GetOperatorFieldID() const { return operator_field_id_; }
+
+ private:
+  NodeKinds() {
+    const TSLanguage* language = GetTSLanguage<L>();
+    std::vector<NodeKindName> names = GetNodeKindNames<L>();
+    std::vector<NodeKindName> expression_names = GetExpressionKindNames();
+    names.insert(names.end(), expression_names.begin(),
+                 expression_names.end());
+
+    kinds_.resize(ts_language_symbol_count(language), NODE_KIND_OTHER);
+    for (size_t symbol = 0; symbol < kinds_.size(); symbol++) {
+      const char* symbol_name = ts_language_symbol_name(language, symbol);
+      if (symbol_name == NULL) continue;
+      for (const auto& name : names) {
+        if (strcmp(name.name_, symbol_name) == 0) {
+          kinds_[symbol] = name.kind_;
+          break;
+        }
+      }
     }
+
+    const std::string kOperator = "operator";
+    operator_field_id_ = ts_language_field_id_for_name(language,
+                           kOperator.c_str(), kOperator.length());
   }
-  TSNode condition_node;
-  return condition_node;
-  // TODO(nhasabni): This requires common_util.h, which creates cyclic
-  // dependency.
-  // throw cf_parse_error("if statement without cond_predicate node");
+
+  std::vector<NodeKind> kinds_;
+  TSFieldId operator_field_id_ = 0;
+};
+
+template <Language L> inline bool IsCommentNode(const TSNode& node) {
+  return NodeKinds<L>::Get().Is(node, NODE_KIND_COMMENT);
 }
-template <>
-inline TSNode GetIfConditionNode<LANGUAGE_PHP>(const TSNode& if_statement) {
-  const std::string& kIfCondition = "condition";
-  return ts_node_child_by_field_name(if_statement,
-                      kIfCondition.c_str(), kIfCondition.length());
+// This method differs from ts_node_string in that it prints some details such
+// as variable names, identifiers and constants that are important for our
+// purpose.
+template <Language L> inline bool IsIdentifier(const TSNode& node) {
+  return NodeKinds<L>::Get().Is(node, NODE_KIND_IDENTIFIER);
+}
+template <Language L> inline bool IsLiteral(const TSNode& node) {
+  return NodeKinds<L>::Get().Is(node, NODE_KIND_LITERAL);
+}
+template <Language L> inline bool IsPrimitiveType(const TSNode& node) {
+  return NodeKinds<L>::Get().Is(node, NODE_KIND_PRIMITIVE_TYPE);
 }
 
-std::string OriginalSourceExpression(const TSNode&, const std::string&);
+std::string OriginalSourceExpression(const TSNode&, std::string_view);
 
 template <Language L>
 inline std::string NodeToConcreteSyntaxTree(const TSNode& node,
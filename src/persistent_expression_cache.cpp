@@ -0,0 +1,342 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "exception.h"
+#include "persistent_expression_cache.h"
+
+namespace {
+const char kMagic[8] = "CFCACHE";
+}  // namespace
+
+PersistentExpressionCache::PersistentExpressionCache(
+    const std::string& file_name, const Config& config, size_t max_file_size)
+  : file_name_(file_name), config_(config), max_file_size_(max_file_size) {
+  journal_ = std::tmpfile();
+  if (journal_ == nullptr) {
+    throw cf_file_access_exception("Could not create temporary file for " +
+                                   file_name_);
+  }
+  if (Load()) {
+    load_status_ = LoadStatus::LOADED;
+  }
+}
+
+PersistentExpressionCache::~PersistentExpressionCache() {
+  if (journal_ != nullptr) {
+    fclose(journal_);
+  }
+}
+
+bool PersistentExpressionCache::Load() {
+  try {
+    mapped_file_ = MappedFile(file_name_);
+  } catch (cf_file_access_exception&) {
+    load_status_ = LoadStatus::NOT_FOUND;
+    return false;
+  }
+
+  auto invalidate = [&]() {
+    mapped_file_ = MappedFile();
+    load_status_ = LoadStatus::INVALIDATED;
+    return false;
+  };
+
+  FileHeader header;
+  if (mapped_file_.size() < sizeof(header)) return invalidate();
+  memcpy(&header, mapped_file_.data(), sizeof(header));
+
+  // Any change in the training dataset or in the config that affects the
+  // results invalidates the whole file.
+  if (memcmp(header.magic_, kMagic, sizeof(kMagic)) != 0 ||
+      header.version_ != kVersion ||
+      header.model_fingerprint_ != config_.model_fingerprint_ ||
+      header.vocabulary_size_ != config_.vocabulary_size_ ||
+      header.max_cost_ != config_.max_cost_ ||
+      header.max_autocorrections_ != config_.max_autocorrections_)
+    return invalidate();
+
+  // Check that index and entries lie within the file.
+  if (header.index_offset_ < sizeof(header) ||
+      header.index_offset_ % alignof(IndexEntry) != 0 ||
+      header.index_offset_ > mapped_file_.size() ||
+      header.num_entries_ > (mapped_file_.size() - header.index_offset_) /
+                            sizeof(IndexEntry))
+    return invalidate();
+  num_loaded_entries_ = header.num_entries_;
+  const IndexEntry* index = GetIndex();
+  for (size_t i = 0; i < num_loaded_entries_; i++) {
+    if (index[i].level_ >= LEVEL_MAX ||
+        index[i].data_offset_ < sizeof(header) ||
+        index[i].data_offset_ > header.index_offset_ ||
+        EntryDataSize(index[i]) >
+          header.index_offset_ - index[i].data_offset_) {
+      num_loaded_entries_ = 0;
+      return invalidate();
+    }
+  }
+  loaded_entry_used_.reset(new std::atomic<bool>[num_loaded_entries_]());
+  return true;
+}
+
+const PersistentExpressionCache::IndexEntry*
+PersistentExpressionCache::GetIndex() const {
+  if (num_loaded_entries_ == 0) return nullptr;
+  FileHeader header;
+  memcpy(&header, mapped_file_.data(), sizeof(header));
+  return reinterpret_cast<const IndexEntry*>(mapped_file_.data() +
+                                             header.index_offset_);
+}
+
+bool PersistentExpressionCache::LookUp(TreeLevel level,
+    const NearestExpression::Expression& short_expression,
+    KeyHash short_expression_hash,
+    CompactNearestExpressions& nearest_expressions) const {
+  const IndexEntry* begin = GetIndex();
+  const IndexEntry* end = begin + num_loaded_entries_;
+  if (begin == nullptr) return false;
+
+  auto key_of = [](const IndexEntry& entry) {
+    return std::make_pair(entry.level_, entry.hash_);
+  };
+  auto key = std::make_pair(static_cast<uint16_t>(level),
+                            short_expression_hash);
+  auto it = std::lower_bound(begin, end, key,
+      [&](const IndexEntry& entry, const std::pair<uint16_t, KeyHash>& key) {
+        return key_of(entry) < key;
+      });
+  for (; it != end && key_of(*it) == key; ++it) {
+    const char* data = mapped_file_.data() + it->data_offset_;
+    if (it->key_length_ != short_expression.length() ||
+        memcmp(data, short_expression.data(), it->key_length_) != 0)
+      continue;
+
+    nearest_expressions.resize(it->num_values_);
+    memcpy(nearest_expressions.data(), data + KeySize(it->key_length_),
+           it->num_values_ * sizeof(CompactNearestExpression));
+    loaded_entry_used_[it - begin].store(true, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+bool PersistentExpressionCache::IsStableKey(
+    const NearestExpression::Expression& short_expression) const {
+  // Key holds token IDs (see NearestExpressionsCache::MakeKey).
+  if (short_expression.length() % sizeof(TokenID) != 0) return false;
+  for (size_t i = 0; i < short_expression.length(); i += sizeof(TokenID)) {
+    TokenID token_id;
+    memcpy(&token_id, short_expression.data() + i, sizeof(token_id));
+    if (ExpressionCompacter::IsWordTokenID(token_id) &&
+        ExpressionCompacter::GetWordIndex(token_id) >=
+          config_.vocabulary_size_)
+      return false;
+  }
+  return true;
+}
+
+void PersistentExpressionCache::Record(TreeLevel level,
+    const NearestExpression::Expression& short_expression,
+    KeyHash short_expression_hash,
+    const CompactNearestExpressions& nearest_expressions) {
+  if (!IsStableKey(short_expression) ||
+      nearest_expressions.size() > UINT16_MAX ||
+      short_expression.length() > UINT32_MAX)
+    return;
+
+  IndexEntry entry;
+  entry.hash_ = short_expression_hash;
+  entry.data_offset_ = 0;
+  entry.key_length_ = static_cast<uint32_t>(short_expression.length());
+  entry.num_values_ = static_cast<uint16_t>(nearest_expressions.size());
+  entry.level_ = static_cast<uint16_t>(level);
+
+  std::string data(EntryDataSize(entry), '\0');
+  memcpy(&data[0], short_expression.data(), short_expression.length());
+  memcpy(&data[KeySize(entry.key_length_)], nearest_expressions.data(),
+         nearest_expressions.size() * sizeof(CompactNearestExpression));
+
+  std::unique_lock lock(journal_mutex_);
+  if (fwrite(&entry, sizeof(entry), 1, journal_) == 1 &&
+      fwrite(data.data(), data.size(), 1, journal_) == 1) {
+    num_recorded_entries_++;
+  }
+}
+
+size_t PersistentExpressionCache::Save() {
+  std::unique_lock lock(journal_mutex_);
+
+  // Collect loaded and recorded entries without their data. Loaded entries
+  // are stored from the least recently used one, so their position in the
+  // file gives their recency. Loaded entries that this run looked up and
+  // recorded entries are more recent than all the others.
+  std::vector<SaveEntry> entries;
+  entries.reserve(num_loaded_entries_ + num_recorded_entries_);
+  const IndexEntry* loaded_index = GetIndex();
+  for (size_t i = 0; i < num_loaded_entries_; i++) {
+    uint64_t recency = loaded_index[i].data_offset_;
+    if (loaded_entry_used_[i].load(std::memory_order_relaxed))
+      recency += mapped_file_.size();
+    entries.push_back({loaded_index[i], false, recency});
+  }
+
+  fflush(journal_);
+  rewind(journal_);
+  IndexEntry entry;
+  for (size_t i = 0; i < num_recorded_entries_; i++) {
+    if (fread(&entry, sizeof(entry), 1, journal_) != 1)
+      break;
+    entry.data_offset_ = ftell(journal_);
+    entries.push_back({entry, true, 2 * mapped_file_.size() + i});
+    if (fseek(journal_, EntryDataSize(entry), SEEK_CUR) != 0)
+      break;
+  }
+
+  // An expression could be searched more than once by a run if it was
+  // evicted from the in-memory cache, so we drop duplicates before writing
+  // any data. Entries with the same hash are considered duplicates; 64-bit
+  // hash collisions between different expressions only cost us a cache miss
+  // in the next run. Loaded entries come first so that they win over
+  // duplicates recorded by this run, but they take the recency of the most
+  // recent duplicate.
+  auto key_of = [](const SaveEntry& entry) {
+    return std::make_pair(entry.index_entry_.level_,
+                          entry.index_entry_.hash_);
+  };
+  std::stable_sort(entries.begin(), entries.end(),
+      [&](const SaveEntry& a, const SaveEntry& b) {
+        return key_of(a) < key_of(b);
+      });
+  size_t num_unique_entries = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (num_unique_entries > 0 &&
+        key_of(entries[num_unique_entries - 1]) == key_of(entries[i])) {
+      SaveEntry& kept_entry = entries[num_unique_entries - 1];
+      kept_entry.recency_ = std::max(kept_entry.recency_,
+                                     entries[i].recency_);
+      continue;
+    }
+    entries[num_unique_entries++] = entries[i];
+  }
+  entries.resize(num_unique_entries);
+
+  // Drop least recently used entries until the file fits in its maximum
+  // size.
+  std::sort(entries.begin(), entries.end(),
+      [](const SaveEntry& a, const SaveEntry& b) {
+        return a.recency_ < b.recency_;
+      });
+  auto file_size = [](size_t data_size, size_t num_entries) {
+    size_t index_offset = sizeof(FileHeader) + data_size;
+    index_offset += (alignof(IndexEntry) -
+                     index_offset % alignof(IndexEntry)) %
+                    alignof(IndexEntry);
+    return index_offset + num_entries * sizeof(IndexEntry);
+  };
+  size_t data_size = 0;
+  for (const auto& entry : entries) {
+    data_size += EntryDataSize(entry.index_entry_);
+  }
+  size_t num_dropped_entries = 0;
+  while (num_dropped_entries < entries.size() &&
+         file_size(data_size, entries.size() - num_dropped_entries) >
+           max_file_size_) {
+    data_size -= EntryDataSize(entries[num_dropped_entries].index_entry_);
+    num_dropped_entries++;
+  }
+  entries.erase(entries.begin(), entries.begin() + num_dropped_entries);
+
+  // Write into a temporary file and rename it so that the cache file is
+  // replaced atomically.
+  std::string temporary_file_name = file_name_ + ".tmp." +
+                                    std::to_string(getpid());
+  std::ofstream out(temporary_file_name.c_str(),
+                    std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    throw cf_file_access_exception("Open failed:" + temporary_file_name);
+  }
+
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  uint64_t offset = sizeof(header);
+
+  std::vector<IndexEntry> index;
+  index.reserve(entries.size());
+  std::string data;
+  for (const auto& entry : entries) {
+    IndexEntry index_entry = entry.index_entry_;
+    size_t size = EntryDataSize(index_entry);
+    if (entry.recorded_) {
+      data.resize(size);
+      if (fseek(journal_, index_entry.data_offset_, SEEK_SET) != 0 ||
+          fread(&data[0], size, 1, journal_) != 1)
+        continue;
+      out.write(data.data(), size);
+    } else {
+      out.write(mapped_file_.data() + index_entry.data_offset_, size);
+    }
+    index_entry.data_offset_ = offset;
+    offset += size;
+    index.push_back(index_entry);
+  }
+  fseek(journal_, 0, SEEK_END);
+
+  std::sort(index.begin(), index.end(),
+      [](const IndexEntry& a, const IndexEntry& b) {
+        return std::make_pair(a.level_, a.hash_) <
+               std::make_pair(b.level_, b.hash_);
+      });
+
+  const std::string kPadding(alignof(IndexEntry), '\0');
+  size_t padding = (alignof(IndexEntry) - offset % alignof(IndexEntry)) %
+                   alignof(IndexEntry);
+  out.write(kPadding.data(), padding);
+  offset += padding;
+  out.write(reinterpret_cast<const char*>(index.data()),
+            index.size() * sizeof(IndexEntry));
+
+  memcpy(header.magic_, kMagic, sizeof(kMagic));
+  header.version_ = kVersion;
+  header.max_cost_ = config_.max_cost_;
+  header.model_fingerprint_ = config_.model_fingerprint_;
+  header.vocabulary_size_ = config_.vocabulary_size_;
+  header.max_autocorrections_ = config_.max_autocorrections_;
+  header.num_entries_ = index.size();
+  header.index_offset_ = offset;
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.close();
+
+  if (!out || std::rename(temporary_file_name.c_str(),
+                          file_name_.c_str()) != 0) {
+    std::remove(temporary_file_name.c_str());
+    throw cf_file_access_exception("Write failed:" + file_name_);
+  }
+  return index.size();
+}
@@ -0,0 +1,187 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_PERSISTENT_EXPRESSION_CACHE_H_
+#define SRC_PERSISTENT_EXPRESSION_CACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>  // NOLINT [build/c++11]
+#include <string>
+
+#include "common_util.h"
+#include "expression_cache.h"
+
+/// Cache of nearest expressions that is stored on disk and shared across
+/// scans. Repeated scans of the same code base with the same training
+/// dataset thus do not need to search nearest expressions of expressions
+/// that were already searched by an earlier scan.
+///
+/// Entries are keyed by level and compacted expression (see
+/// NearestExpressionsCache::MakeKey). The file is bound
+/// to a model fingerprint (hash of the training dataset), vocabulary size of
+/// the expression compacter, max cost and max number of autocorrections; a
+/// file created with a different value of any of them is discarded.
+///
+/// File layout (native byte order):
+///   FileHeader | entry data ... | IndexEntry[num_entries]
+/// where entry data is the key followed by its nearest expressions and the
+/// index is sorted by (level, hash) so that it can be binary searched
+/// directly in the memory-mapped file. Entry data is stored from the least
+/// recently used entry to the most recently used one, so that Save can drop
+/// the least recently used entries when the file grows beyond its maximum
+/// size.
+class PersistentExpressionCache {
+ public:
+  using KeyHash = uint64_t;
+
+  struct Config {
+    uint64_t model_fingerprint_ = 0;
+    uint64_t vocabulary_size_ = 0;
+    uint32_t max_cost_ = 0;
+    uint32_t max_autocorrections_ = 0;
+  };
+
+  enum class LoadStatus {
+    /// File was loaded.
+    LOADED,
+    /// File did not exist. It will be created by Save.
+    NOT_FOUND,
+    /// File was created for another config or is corrupt. It will be
+    /// overwritten by Save.
+    INVALIDATED
+  };
+
+  static const size_t kDefaultMaxFileSize = 1024 * 1024 * 1024;
+
+  /// Open cache file. Throws cf_file_access_exception if a temporary file
+  /// for recording new entries cannot be created.
+  PersistentExpressionCache(const std::string& file_name,
+                            const Config& config,
+                            size_t max_file_size = kDefaultMaxFileSize);
+  PersistentExpressionCache(const PersistentExpressionCache&) = delete;
+  PersistentExpressionCache& operator=(const PersistentExpressionCache&) =
+    delete;
+  ~PersistentExpressionCache();
+
+  /// Stable hash of a (compacted) expression used as the key of the cache.
+  static KeyHash Hash(const NearestExpression::Expression& short_expression) {
+    return HashBytes(short_expression.data(), short_expression.length());
+  }
+
+  LoadStatus GetLoadStatus() const { return load_status_; }
+  size_t GetNumLoadedEntries() const { return num_loaded_entries_; }
+  size_t GetNumRecordedEntries() const { return num_recorded_entries_; }
+
+  /// Look up nearest expressions of the specified (compacted) expression in
+  /// the loaded file. Entry that is found counts as used by this run.
+  /// Thread-safe.
+  bool LookUp(TreeLevel level,
+              const NearestExpression::Expression& short_expression,
+              KeyHash short_expression_hash,
+              CompactNearestExpressions& nearest_expressions) const;
+
+  /// Record nearest expressions of the specified (compacted) expression so
+  /// that they are written by Save. Expressions containing tokens that were
+  /// not seen during training are not recorded because their IDs depend on
+  /// the order in which scanner threads see them. Thread-safe.
+  void Record(TreeLevel level,
+              const NearestExpression::Expression& short_expression,
+              KeyHash short_expression_hash,
+              const CompactNearestExpressions& nearest_expressions);
+
+  /// Write loaded and recorded entries to the cache file. Duplicate entries
+  /// are written once, and least recently used entries are dropped to keep
+  /// the file within its maximum size. File is replaced atomically, so
+  /// concurrent scans never see a partially written file. Returns the number
+  /// of entries written. Throws cf_file_access_exception on failure.
+  size_t Save();
+
+ private:
+  static const uint32_t kVersion = 2;
+
+  struct FileHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t max_cost_;
+    uint64_t model_fingerprint_;
+    uint64_t vocabulary_size_;
+    uint32_t max_autocorrections_;
+    uint32_t reserved_;
+    uint64_t num_entries_;
+    uint64_t index_offset_;
+  };
+
+  struct IndexEntry {
+    KeyHash hash_;
+    uint64_t data_offset_;
+    uint32_t key_length_;
+    uint16_t num_values_;
+    uint16_t level_;
+  };
+
+  /// Key is padded so that nearest expressions are aligned.
+  static size_t KeySize(size_t key_length) {
+    return (key_length + alignof(CompactNearestExpression) - 1) &
+           ~(alignof(CompactNearestExpression) - 1);
+  }
+  static size_t EntryDataSize(const IndexEntry& entry) {
+    return KeySize(entry.key_length_) +
+           entry.num_values_ * sizeof(CompactNearestExpression);
+  }
+
+  /// Entry to be written by Save.
+  struct SaveEntry {
+    /// data_offset_ is the offset of the data in the loaded file or in the
+    /// journal.
+    IndexEntry index_entry_;
+    bool recorded_;
+    /// Entries are written in ascending order of recency, and the ones with
+    /// the lowest recency are dropped first.
+    uint64_t recency_;
+  };
+
+  bool Load();
+  bool IsStableKey(const NearestExpression::Expression& short_expression)
+    const;
+  const IndexEntry* GetIndex() const;
+
+  std::string file_name_;
+  Config config_;
+  LoadStatus load_status_ = LoadStatus::NOT_FOUND;
+  size_t num_loaded_entries_ = 0;
+  MappedFile mapped_file_;
+  size_t max_file_size_;
+  /// Whether a loaded entry (by its position in the index) was looked up by
+  /// this run.
+  std::unique_ptr<std::atomic<bool>[]> loaded_entry_used_;
+
+  /// Recorded entries are appended to a temporary file instead of being
+  /// kept in memory. Every record is an IndexEntry (whose data_offset_ is
+  /// unused) followed by entry data.
+  std::mutex journal_mutex_;
+  FILE* journal_ = nullptr;
+  size_t num_recorded_entries_ = 0;
+};
+
+#endif  // SRC_PERSISTENT_EXPRESSION_CACHE_H_
@@ -41,48 +41,10 @@ void Trie::SortAndRankResults(NearestExpressions& nearest_expressions) const {
             sort_expressions_by_score);
 }
 
-// Expression is a potential anomaly if its occurrences at cost 0 are lesser
-// than the occurrences of all the nearest expressions at other costs.
 bool Trie::IsPotentialAnomaly(const NearestExpressions& expressions,
                               float anomaly_threshold) const {
-  const NearestExpression::Cost kZeroCost = 0;
-  NearestExpression base_expression;
-  bool base_expression_found = false;
-
-  for (const auto& expression : expressions) {
-    if (expression.GetCost() == kZeroCost) {
-      base_expression = expression;
-      base_expression_found = true;
-      break;
-    }
-  }
-
-  // We should have atleast base expression and one more expression with
-  // non-zero cost.
-  if (base_expression_found == false ||
-      expressions.size() <= 1)
-    return false;
-
-  bool exprs_with_non_zero_cost_found = false;
-  for (const auto& expression : expressions) {
-    if (expression.GetCost() != kZeroCost) {
-      exprs_with_non_zero_cost_found = true;
-      break;
-    }
-  }
-  if (!exprs_with_non_zero_cost_found)
-    return false;
-
-  // Perform check based on anomaly threshold.
-  for (const auto& expression : expressions) {
-    if (expression.GetCost() == kZeroCost) continue;
-
-    float occurrences_percent =
-          (static_cast<float>(base_expression.GetNumOccurrences() * 100)) /
-          static_cast<float>(expression.GetNumOccurrences());
-    if (occurrences_percent > anomaly_threshold)
-      return false;
-  }
-
-  return true;
+  return IsPotentialAnomaly(expressions.size(),
+      [&](size_t i) { return expressions[i].GetCost(); },
+      [&](size_t i) { return expressions[i].GetNumOccurrences(); },
+      anomaly_threshold);
 }
@@ -0,0 +1,312 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <string>
+#include <utility>
+
+#include "common_util.h"
+#include "exception.h"
+#include "result_sink.h"
+
+namespace {
+const char* kToolName = "ControlFlag";
+const char* kToolInformationURI = "https://github.com/IntelLabs/control-flag";
+const char* kAnomalyRuleID = "potential-anomaly";
+
+std::string LevelName(TreeLevel level) {
+  return level == LEVEL_ONE ? LevelToString<LEVEL_ONE>() :
+                              LevelToString<LEVEL_TWO>();
+}
+}  // anonymous namespace
+
+ResultSink::ResultSink(const std::string& output_file, Format format,
+                       size_t max_queued_files, size_t max_pending_bytes)
+  : output_file_name_(output_file), output_file_(output_file.c_str()),
+    format_(format), queued_files_(std::max<size_t>(1, max_queued_files)),
+    max_pending_bytes_(max_pending_bytes) {
+  if (!output_file_.is_open()) {
+    throw cf_file_access_exception("Open failed:" + output_file);
+  }
+  if (format_ == SARIF) {
+    buffer_ += std::string("{\"version\":\"2.1.0\",\"$schema\":")
+            + "\"https://json.schemastore.org/sarif-2.1.0.json\","
+            + "\"runs\":[{\"tool\":{\"driver\":{\"name\":\"" + kToolName
+            + "\",\"informationUri\":\"" + kToolInformationURI
+            + "\",\"rules\":[{\"id\":\"" + kAnomalyRuleID
+            + "\",\"shortDescription\":{\"text\":"
+            + "\"Potential anomaly in a control-flow condition\"}}]}},"
+            + "\"results\":[";
+  }
+  writer_ = std::thread([this]() { WriteLoop(); });
+}
+
+ResultSink::~ResultSink() {
+  // Destructors must not throw; callers that want to know whether the
+  // results were written call Close.
+  try {
+    Close();
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+  }
+}
+
+void ResultSink::Add(FileResults&& file_results) {
+  queued_files_.Push(std::move(file_results));
+}
+
+void ResultSink::Close() {
+  if (is_closed_) return;
+  is_closed_ = true;
+  // Writer thread writes the queued files before it stops.
+  queued_files_.Close();
+  writer_.join();
+  if (format_ == SARIF) buffer_ += "]}]}\n";
+  WriteBuffer();
+  output_file_.close();
+  if (spill_file_ != nullptr) {
+    fclose(spill_file_);
+    spill_file_ = nullptr;
+  }
+  if (output_file_.fail() || is_spill_read_failed_) {
+    throw cf_file_access_exception("Write failed:" + output_file_name_);
+  }
+}
+
+void ResultSink::WriteLoop() {
+  FileResults file_results;
+  while (queued_files_.Pop(file_results)) {
+    size_t file_index = file_results.file_index_;
+    PendingFile pending_file;
+    FormatFile(file_results, pending_file.output_);
+    file_results = FileResults();
+    if (file_index != next_file_index_) {
+      // Files are scanned out of order (e.g., largest first), so many files
+      // may wait for a file with a smaller index.
+      pending_bytes_ += pending_file.output_.size();
+      pending_files_[file_index] = std::move(pending_file);
+      if (pending_bytes_ > max_pending_bytes_) SpillPendingFiles();
+      continue;
+    }
+
+    AppendFile(pending_file.output_);
+    next_file_index_++;
+    // Write the files that the written ones were waiting for.
+    for (auto it = pending_files_.begin();
+         it != pending_files_.end() && it->first == next_file_index_;
+         it = pending_files_.erase(it)) {
+      AppendPendingFile(it->second);
+      next_file_index_++;
+      if (buffer_.size() >= kWriteChunkSize) WriteBuffer();
+    }
+    if (buffer_.size() >= kWriteChunkSize) WriteBuffer();
+  }
+  // Files missing from the sequence of indices are never added, so the
+  // files after them are written in order once there are no more files.
+  for (auto& pending_file : pending_files_) {
+    AppendPendingFile(pending_file.second);
+    if (buffer_.size() >= kWriteChunkSize) WriteBuffer();
+  }
+  pending_files_.clear();
+}
+
+void ResultSink::FormatFile(const FileResults& file_results,
+                            std::string& output) const {
+  if (format_ == JSON_LINES) {
+    FormatJSONLines(file_results, output);
+  } else {
+    bool is_first_result = true;
+    FormatSARIFResults(file_results, is_first_result, output);
+  }
+}
+
+void ResultSink::AppendFile(const std::string& output) {
+  if (output.empty()) return;
+  // SARIF results of a file were formatted as if they were the first ones.
+  if (format_ == SARIF) {
+    if (!is_first_result_) buffer_ += ",";
+    is_first_result_ = false;
+  }
+  buffer_ += output;
+}
+
+void ResultSink::AppendPendingFile(PendingFile& pending_file) {
+  if (!pending_file.is_spilled_) {
+    pending_bytes_ -= pending_file.output_.size();
+    AppendFile(pending_file.output_);
+    return;
+  }
+  std::string output(pending_file.spill_size_, '\0');
+  if (fseek(spill_file_, static_cast<long>(pending_file.spill_offset_),
+            SEEK_SET) != 0 ||
+      fread(&output[0], output.size(), 1, spill_file_) != 1) {
+    is_spill_read_failed_ = true;
+    return;
+  }
+  AppendFile(output);
+}
+
+void ResultSink::SpillPendingFiles() {
+  if (spill_file_ == nullptr) {
+    spill_file_ = std::tmpfile();
+    if (spill_file_ == nullptr) {
+      // Results are still written, but pending files stay in memory.
+      std::cerr << "Warning: could not create temporary file for results of "
+                << output_file_name_ << std::endl;
+      max_pending_bytes_ = static_cast<size_t>(-1);
+      return;
+    }
+  }
+  if (fseek(spill_file_, 0, SEEK_END) != 0) return;
+  // Files with the largest indices are written last, so they are spilled
+  // first.
+  for (auto it = pending_files_.rbegin();
+       it != pending_files_.rend() && pending_bytes_ > max_pending_bytes_ / 2;
+       ++it) {
+    PendingFile& pending_file = it->second;
+    if (pending_file.is_spilled_ || pending_file.output_.empty()) continue;
+    long offset = ftell(spill_file_);
+    if (offset < 0 ||
+        fwrite(pending_file.output_.data(), pending_file.output_.size(), 1,
+               spill_file_) != 1) {
+      // Keep the remaining files in memory.
+      return;
+    }
+    pending_file.is_spilled_ = true;
+    pending_file.spill_offset_ = static_cast<uint64_t>(offset);
+    pending_file.spill_size_ = pending_file.output_.size();
+    pending_bytes_ -= pending_file.spill_size_;
+    std::string().swap(pending_file.output_);
+    num_spilled_files_++;
+  }
+}
+
+void ResultSink::WriteBuffer() {
+  output_file_.write(buffer_.data(), buffer_.size());
+  buffer_.clear();
+}
+
+void ResultSink::FormatJSONLines(const FileResults& file_results,
+                                 std::string& output) {
+  std::string file_name = EscapeJSONString(file_results.file_name_);
+  if (file_results.error_ != "") {
+    output += "{\"file\":\"" + file_name + "\",\"error\":\"" +
+              EscapeJSONString(file_results.error_) + "\"}\n";
+    return;
+  }
+  for (const auto& result : file_results.results_) {
+    const auto& verdict = *result.verdict_;
+    // Positions are 1-based, as in compiler diagnostics.
+    output += "{\"file\":\"" + file_name +
+              "\",\"line\":" + std::to_string(result.row_ + 1) +
+              ",\"column\":" + std::to_string(result.column_ + 1) +
+              ",\"source\":\"" + EscapeJSONString(result.source_expression_) +
+              "\",\"level\":\"" + LevelName(result.level_) +
+              "\",\"expression\":\"" + EscapeJSONString(verdict.expression_) +
+              "\",\"found_in_training_dataset\":" +
+              (verdict.found_in_training_dataset_ ? "true" : "false") +
+              ",\"potential_anomaly\":" +
+              (result.is_potential_anomaly_ ? "true" : "false") +
+              ",\"nearest_expressions\":[";
+    for (size_t i = 0; i < verdict.nearest_expressions_.size(); i++) {
+      const auto& nearest_expression = verdict.nearest_expressions_[i];
+      output += std::string(i > 0 ? "," : "") + "{\"expression\":\"" +
+                EscapeJSONString(nearest_expression.GetExpression()) +
+                "\",\"cost\":" +
+                std::to_string(nearest_expression.GetCost()) +
+                ",\"occurrences\":" +
+                std::to_string(nearest_expression.GetNumOccurrences()) + "}";
+    }
+    output += "]}\n";
+  }
+}
+
+std::string ResultSink::FormatAnomalyMessage(
+    const TrainAndScanUtil::ScanResult& result) {
+  const auto& verdict = *result.verdict_;
+  std::string message = "Level " + LevelName(result.level_) +
+                        " expression " + verdict.expression_ +
+                        " is a potential anomaly.";
+  for (const auto& nearest_expression : verdict.nearest_expressions_) {
+    message += " Did you mean: " + nearest_expression.GetExpression() +
+               " (editing cost " +
+               std::to_string(nearest_expression.GetCost()) +
+               ", occurrences " +
+               std::to_string(nearest_expression.GetNumOccurrences()) +
+               ")?";
+  }
+  return message;
+}
+
+void ResultSink::FormatSARIFResults(const FileResults& file_results,
+                                    bool& is_first_result,
+                                    std::string& output) {
+  // SARIF results are findings, so only potential anomalies are reported.
+  std::string artifact_location;
+  for (const auto& result : file_results.results_) {
+    if (!result.is_potential_anomaly_) continue;
+    if (artifact_location.empty()) {
+      artifact_location = FormatSARIFArtifactLocation(file_results.file_name_);
+    }
+    std::string message = FormatAnomalyMessage(result);
+    output += std::string(is_first_result ? "" : ",") +
+              "{\"ruleId\":\"" + kAnomalyRuleID +
+              "\",\"ruleIndex\":0,\"level\":\"warning\",\"message\":{" +
+              "\"text\":\"" + EscapeJSONString(message) +
+              "\"},\"locations\":[{\"physicalLocation\":{" +
+              "\"artifactLocation\":" + artifact_location +
+              ",\"region\":{\"startLine\":" +
+              std::to_string(result.row_ + 1) +
+              ",\"startColumn\":" + std::to_string(result.column_ + 1) +
+              ",\"snippet\":{\"text\":\"" +
+              EscapeJSONString(result.source_expression_) + "\"}}}}]}";
+    is_first_result = false;
+  }
+}
+
+std::string ResultSink::FormatSARIFArtifactLocation(
+    const std::string& file_name) {
+  std::string path = file_name;
+  std::replace(path.begin(), path.end(), '\\', '/');
+  // Windows paths start with a drive letter.
+  bool has_drive = path.size() >= 2 && path[1] == ':' &&
+                   isalpha(static_cast<unsigned char>(path[0]));
+  bool is_absolute = has_drive || (!path.empty() && path[0] == '/');
+
+  const char* kHexDigits = "0123456789ABCDEF";
+  std::string uri = is_absolute ? (has_drive ? "file:///" : "file://") : "";
+  for (size_t i = 0; i < path.size(); i++) {
+    unsigned char c = static_cast<unsigned char>(path[i]);
+    if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~' ||
+        c == '/' || (has_drive && i == 1)) {
+      uri += static_cast<char>(c);
+    } else {
+      uri += '%';
+      uri += kHexDigits[c >> 4];
+      uri += kHexDigits[c & 0xf];
+    }
+  }
+  // Characters of the URI need no JSON escaping.
+  return "{\"uri\":\"" + uri + "\"" +
+         (is_absolute ? "" : ",\"uriBaseId\":\"%SRCROOT%\"") + "}";
+}
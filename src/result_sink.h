@@ -0,0 +1,153 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_RESULT_SINK_H_
+#define SRC_RESULT_SINK_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "bounded_queue.h"
+#include "train_and_scan_util.h"
+
+/// Scan results of a file.
+struct FileResults {
+  /// Position of the file in the list of scanned files.
+  size_t file_index_ = 0;
+  std::string file_name_;
+  /// Error found while reading or parsing the file, if any.
+  std::string error_;
+  std::vector<TrainAndScanUtil::ScanResult> results_;
+};
+
+/// Write scan results to a file in a structured format that tools can read
+/// without parsing the free-text scan logs:
+///
+///   JSON_LINES: one JSON object per line for every scanned level of every
+///               code block, and for every file that could not be scanned.
+///   SARIF:      a SARIF 2.1.0 log with a result for every potential anomaly.
+///
+/// Scanner threads hand over results of a file with Add, which only queues
+/// them. A dedicated writer thread formats them and writes them in chunks,
+/// so scanner threads neither format nor wait for the disk. Files are
+/// scanned out of order, but the writer writes them in the order of their
+/// file indices, so the output does not depend on the number of threads.
+/// Formatted files that wait for files with smaller indices are kept in
+/// memory up to max_pending_bytes, and the others are spilled to a
+/// temporary file until their turn comes.
+class ResultSink {
+ public:
+  enum Format {
+    JSON_LINES,
+    SARIF
+  };
+
+  static const size_t kDefaultMaxQueuedFiles = 256;
+  static const size_t kDefaultMaxPendingBytes = 64 * 1024 * 1024;
+
+  /// Throws cf_file_access_exception if output_file cannot be opened.
+  ResultSink(const std::string& output_file, Format format,
+             size_t max_queued_files = kDefaultMaxQueuedFiles,
+             size_t max_pending_bytes = kDefaultMaxPendingBytes);
+  ResultSink(const ResultSink&) = delete;
+  ResultSink& operator=(const ResultSink&) = delete;
+  /// Closes the sink if Close was not called.
+  ~ResultSink();
+
+  /// Thread-safe. Blocks while max_queued_files files are queued. Results of
+  /// a file are written once the results of all the files with smaller
+  /// indices are written, or at Close.
+  void Add(FileResults&& file_results);
+  /// Write the remaining results and close the output file. Must not be
+  /// called concurrently with Add. Throws cf_file_access_exception if the
+  /// results could not be written.
+  void Close();
+
+  /// Append results of a file to output as JSON lines.
+  static void FormatJSONLines(const FileResults& file_results,
+                              std::string& output);
+  /// Append potential anomalies of a file to output as SARIF results,
+  /// separated by ",". is_first_result says whether no result was appended
+  /// before, and is updated.
+  static void FormatSARIFResults(const FileResults& file_results,
+                                 bool& is_first_result, std::string& output);
+  /// Message describing a potential anomaly and its suggested corrections.
+  static std::string FormatAnomalyMessage(
+      const TrainAndScanUtil::ScanResult& result);
+  /// SARIF artifactLocation object of a scanned file: a percent-encoded
+  /// "file" URI for an absolute path, or a percent-encoded relative URI with
+  /// respect to the %SRCROOT% base for a relative path.
+  static std::string FormatSARIFArtifactLocation(const std::string& file_name);
+
+  /// Number of formatted files that were spilled to the temporary file.
+  size_t GetNumSpilledFiles() const { return num_spilled_files_; }
+
+ private:
+  /// Output is written when this many bytes are buffered.
+  static const size_t kWriteChunkSize = 1024 * 1024;
+
+  /// Formatted output of a file that waits for files with smaller indices.
+  struct PendingFile {
+    std::string output_;
+    bool is_spilled_ = false;
+    /// Position of the output in spill_file_, if it is spilled.
+    uint64_t spill_offset_ = 0;
+    size_t spill_size_ = 0;
+  };
+
+  void WriteLoop();
+  /// Format file_results into output, as if no result was written before.
+  void FormatFile(const FileResults& file_results, std::string& output) const;
+  /// Append formatted output of the next file to buffer_.
+  void AppendFile(const std::string& output);
+  void AppendPendingFile(PendingFile& pending_file);
+  /// Spill in-memory pending files, from the one needed last, until at
+  /// most half of max_pending_bytes_ are kept in memory.
+  void SpillPendingFiles();
+  void WriteBuffer();
+
+  std::string output_file_name_;
+  std::ofstream output_file_;
+  Format format_;
+  BoundedQueue<FileResults> queued_files_;
+  size_t max_pending_bytes_;
+  bool is_closed_ = false;
+
+  /// Used by the writer thread only.
+  std::map<size_t, PendingFile> pending_files_;
+  /// Bytes of the pending files kept in memory.
+  size_t pending_bytes_ = 0;
+  FILE* spill_file_ = nullptr;
+  size_t num_spilled_files_ = 0;
+  bool is_spill_read_failed_ = false;
+  size_t next_file_index_ = 0;
+  bool is_first_result_ = true;
+  std::string buffer_;
+
+  std::thread writer_;
+};
+
+#endif  // SRC_RESULT_SINK_H_
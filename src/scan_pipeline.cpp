@@ -0,0 +1,289 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <chrono>  // NOLINT [build/c++11]
+#include <condition_variable>  // NOLINT [build/c++11]
+#include <fstream>
+#include <iterator>
+#include <iomanip>
+#include <memory>
+#include <mutex>  // NOLINT [build/c++11]
+#include <sstream>
+#include <thread>  // NOLINT [build/c++11]
+#include <utility>
+
+#include "bounded_queue.h"
+#include "exception.h"
+#include "scan_pipeline.h"
+
+namespace {
+// Add the lifetime of the timer to busy_nanoseconds.
+class BusyTimer {
+ public:
+  explicit BusyTimer(std::atomic<uint64_t>& busy_nanoseconds)
+    : busy_nanoseconds_(busy_nanoseconds),
+      start_(std::chrono::steady_clock::now()) {}
+  ~BusyTimer() {
+    busy_nanoseconds_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start_).count();
+  }
+
+ private:
+  std::atomic<uint64_t>& busy_nanoseconds_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+double ToSeconds(uint64_t nanoseconds) {
+  return nanoseconds / 1000000000.0;
+}
+}  // anonymous namespace
+
+void ScanPipeline::Run(const std::vector<std::string>& file_names,
+                       std::ostream& progress_out) {
+  switch (language_) {
+    case LANGUAGE_C:
+      RunStages<LANGUAGE_C>(file_names, progress_out);
+      break;
+    case LANGUAGE_VERILOG:
+      RunStages<LANGUAGE_VERILOG>(file_names, progress_out);
+      break;
+    case LANGUAGE_PHP:
+      RunStages<LANGUAGE_PHP>(file_names, progress_out);
+      break;
+    case LANGUAGE_CPP:
+      RunStages<LANGUAGE_CPP>(file_names, progress_out);
+      break;
+    default:
+      throw cf_unexpected_situation("Unsupported language:" +
+                                    std::to_string(LanguageToInt(language_)));
+  }
+}
+
+template <Language G>
+void ScanPipeline::RunStages(const std::vector<std::string>& file_names,
+                             std::ostream& progress_out) {
+  auto start = std::chrono::steady_clock::now();
+  const size_t num_parsers = std::max<size_t>(1, config_.num_parsers_);
+  const size_t max_pending_scans = std::max<size_t>(1,
+                                                    config_.queue_capacity_);
+  const size_t code_blocks_per_task = std::max<size_t>(1,
+    train_and_scan_util_.GetScanConfig().code_blocks_per_task_);
+  ThreadPool& thread_pool = train_and_scan_util_.GetThreadPool();
+  const double pool_busy_seconds_at_start = thread_pool.GetBusySeconds();
+
+  // Log files are opened upfront so that we do not scan if we cannot write.
+  std::vector<std::ofstream> log_files;
+  for (size_t i = 0; i < thread_pool.GetNumWorkers(); i++) {
+    std::string log_file_name = config_.log_dir_ + "/thread_" +
+                                std::to_string(i) + ".log";
+    log_files.emplace_back(log_file_name.c_str());
+    if (!log_files.back().is_open()) {
+      throw cf_file_access_exception("Open failed:" + log_file_name);
+    }
+  }
+
+  BoundedQueue<ScannedFile> scanned_files(config_.queue_capacity_);
+  std::atomic<size_t> num_running_parsers(num_parsers);
+  std::atomic<uint64_t> parse_nanoseconds(0);
+  std::atomic<uint64_t> write_nanoseconds(0);
+  // Scans submitted to the thread pool and not finished yet. Parsers wait
+  // when there are too many of them, so that parsed files do not pile up
+  // in memory.
+  std::mutex pending_scans_mutex;
+  std::condition_variable pending_scans_changed;
+  size_t num_pending_scans = 0;
+
+  FilePrefetcher file_prefetcher(file_names, config_.num_readers_,
+                                 config_.queue_capacity_,
+                                 config_.largest_files_first_);
+
+  // Scan task_index-th task of code blocks of parsed_file. Last task of the
+  // file hands over its report to the writer.
+  auto scan_fn = [&](const std::shared_ptr<ParsedFile>& parsed_file,
+                     size_t task_index) {
+    if (parsed_file->is_parsed_) {
+      size_t begin = task_index * code_blocks_per_task;
+      std::ostringstream log;
+      // Last task of the file must run even if this one fails, so that the
+      // file is handed over to the writer.
+      try {
+        train_and_scan_util_.ScanCodeBlocks<G>(parsed_file->file_.name_,
+          parsed_file->file_.contents_.contents(), parsed_file->code_blocks_,
+          begin, begin + code_blocks_per_task,
+          parsed_file->task_summaries_[task_index], log,
+          config_.result_sink_ ? &parsed_file->task_results_[task_index] :
+                                 nullptr);
+      } catch (std::exception& e) {
+        log << "Error:" << e.what() << " ... skipping" << std::endl;
+      }
+      parsed_file->task_logs_[task_index] = log.str();
+    }
+    if (parsed_file->num_remaining_tasks_.fetch_sub(1) != 1) return;
+
+    if (config_.result_sink_) {
+      FileResults file_results;
+      file_results.file_index_ = parsed_file->file_.index_;
+      file_results.file_name_ = parsed_file->file_.name_;
+      if (parsed_file->file_.error_ != "") {
+        file_results.error_ = parsed_file->file_.error_;
+      } else if (!parsed_file->is_parsed_) {
+        file_results.error_ = "Parse failed";
+      }
+      for (auto& task_results : parsed_file->task_results_) {
+        file_results.results_.insert(file_results.results_.end(),
+          std::make_move_iterator(task_results.begin()),
+          std::make_move_iterator(task_results.end()));
+      }
+      config_.result_sink_->Add(std::move(file_results));
+    }
+
+    ScannedFile scanned_file;
+    scanned_file.scanner_index_ = thread_pool.GetCurrentWorkerIndex();
+    std::ostringstream log;
+    log << "[TID=" << std::this_thread::get_id() << "] "
+        << "Scanning File: " << parsed_file->file_.name_ << std::endl;
+    log << parsed_file->log_;
+    if (parsed_file->is_parsed_) {
+      TrainAndScanUtil::ScanSummary summary;
+      for (size_t i = 0; i < parsed_file->task_logs_.size(); i++) {
+        log << parsed_file->task_logs_[i];
+        summary.Add(parsed_file->task_summaries_[i]);
+      }
+      train_and_scan_util_.ReportScanSummary(parsed_file->file_.name_,
+                                             summary, log);
+    }
+    scanned_file.log_ = log.str();
+    scanned_files.Push(std::move(scanned_file));
+  };
+
+  auto parse_fn = [&]() {
+    FilePrefetcher::File file;
+    while (file_prefetcher.Next(file)) {
+      auto parsed_file = std::make_shared<ParsedFile>();
+      {
+        BusyTimer timer(parse_nanoseconds);
+        std::ostringstream log;
+        if (file.error_ != "") {
+          log << "Error:" << file.error_ << " ... skipping" << std::endl;
+        } else {
+          parsed_file->is_parsed_ = train_and_scan_util_.ParseFile<G>(
+                                      file.contents_.contents(),
+                                      parsed_file->ts_tree_,
+                                      parsed_file->code_blocks_, log);
+        }
+        parsed_file->log_ = log.str();
+        parsed_file->file_ = std::move(file);
+      }
+
+      size_t num_tasks = std::max<size_t>(1,
+        (parsed_file->code_blocks_.size() + code_blocks_per_task - 1) /
+        code_blocks_per_task);
+      parsed_file->task_logs_.resize(num_tasks);
+      parsed_file->task_summaries_.resize(num_tasks);
+      parsed_file->task_results_.resize(num_tasks);
+      parsed_file->num_remaining_tasks_ = num_tasks;
+      for (size_t task_index = 0; task_index < num_tasks; task_index++) {
+        {
+          std::unique_lock lock(pending_scans_mutex);
+          pending_scans_changed.wait(lock, [&]() {
+            return num_pending_scans < max_pending_scans;
+          });
+          num_pending_scans++;
+        }
+        thread_pool.Submit([&, parsed_file, task_index]() {
+          scan_fn(parsed_file, task_index);
+          // Notify under the lock: RunStages may return as soon as the last
+          // scan is seen as finished.
+          std::unique_lock lock(pending_scans_mutex);
+          num_pending_scans--;
+          pending_scans_changed.notify_all();
+        });
+      }
+    }
+    // Last parser tells the writer that there are no more files once all
+    // the scans are done.
+    if (num_running_parsers.fetch_sub(1) == 1) {
+      std::unique_lock lock(pending_scans_mutex);
+      pending_scans_changed.wait(lock, [&]() {
+        return num_pending_scans == 0;
+      });
+      scanned_files.Close();
+    }
+  };
+
+  auto write_fn = [&]() {
+    size_t tenth_file_names = std::max<size_t>(1, file_names.size() / 10);
+    size_t num_written = 0;
+    ScannedFile scanned_file;
+    while (scanned_files.Pop(scanned_file)) {
+      {
+        BusyTimer timer(write_nanoseconds);
+        log_files[scanned_file.scanner_index_] << scanned_file.log_;
+      }
+      // Report progress at every 10th % point.
+      if (++num_written % tenth_file_names == 0) {
+        progress_out << "Scan progress:" << num_written << "/"
+                     << file_names.size() << " ... in progress" << std::endl;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_parsers; i++) {
+    workers.push_back(std::thread(parse_fn));
+  }
+  workers.push_back(std::thread(write_fn));
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  for (auto& log_file : log_files) {
+    log_file.close();
+  }
+
+  wall_seconds_ = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+  num_files_ = file_names.size();
+  stage_statistics_ = {
+    {"read", std::max<size_t>(1, config_.num_readers_),
+     file_prefetcher.GetReadSeconds()},
+    {"parse", num_parsers, ToSeconds(parse_nanoseconds.load())},
+    {"scan", thread_pool.GetNumWorkers(),
+     thread_pool.GetBusySeconds() - pool_busy_seconds_at_start},
+    {"write", 1, ToSeconds(write_nanoseconds.load())}
+  };
+}
+
+void ScanPipeline::ReportUtilization(std::ostream& out) const {
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(2)
+         << "Pipeline: " << num_files_ << " files in " << wall_seconds_
+         << "s" << std::endl;
+  for (const auto& stage : stage_statistics_) {
+    double utilization = wall_seconds_ > 0 ?
+      100 * stage.busy_seconds_ / (wall_seconds_ * stage.num_workers_) : 0;
+    report << "Stage " << stage.name_ << ": workers=" << stage.num_workers_
+           << " busy=" << stage.busy_seconds_ << "s"
+           << " utilization=" << std::setprecision(1) << utilization << "%"
+           << std::setprecision(2) << std::endl;
+  }
+  out << report.str();
+}
@@ -0,0 +1,130 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_SCAN_PIPELINE_H_
+#define SRC_SCAN_PIPELINE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "common_util.h"
+#include "file_prefetcher.h"
+#include "result_sink.h"
+#include "train_and_scan_util.h"
+
+/// Scan files in a pipeline of stages, so that a slow step for one file (e.g.,
+/// an expensive autocorrect search) does not stall the other steps for the
+/// other files:
+///
+///   read -> parse -> scan -> write
+///
+/// read loads files (see FilePrefetcher), parse parses them and collects
+/// their code blocks, scan abstracts code blocks and looks them up in the
+/// training dataset, and write writes the scan reports to log files. Stages
+/// are connected by bounded queues, so a stage that cannot keep up slows
+/// down the stages before it instead of letting work pile up in memory.
+///
+/// read, parse and write run on their own threads. Scans run as tasks on the
+/// thread pool of TrainAndScanUtil, whose workers also run the nearest
+/// expression searches of the scans, so the number of threads doing the
+/// expensive work is exactly the size of that pool.
+///
+/// Wall-clock time of a scan is often set by a few giant (e.g., generated)
+/// files. So files are read largest first, and code blocks of a file with
+/// many of them are scanned in separate tasks (see
+/// ScanConfig::code_blocks_per_task_), which idle workers pick up.
+/// Reports of the tasks are put together in source order.
+class ScanPipeline {
+ public:
+  struct Config {
+    size_t num_readers_ = FilePrefetcher::kDefaultNumReaders;
+    size_t num_parsers_ = 1;
+    /// Read files in decreasing order of size.
+    bool largest_files_first_ = true;
+    /// Capacity of the queue in front of every stage.
+    size_t queue_capacity_ = 64;
+    /// Report of a file scanned by worker i of the thread pool is written to
+    /// log_dir_/thread_i.log.
+    std::string log_dir_ = "/tmp/";
+    /// If set, results of the code blocks are added to result_sink_
+    /// instead of being reported in the log files, which then only have
+    /// errors and summaries.
+    ResultSink* result_sink_ = nullptr;
+  };
+
+  ScanPipeline(const TrainAndScanUtil& train_and_scan_util,
+               Language language, const Config& config)
+    : train_and_scan_util_(train_and_scan_util), language_(language),
+      config_(config) {}
+
+  /// Scan files and wait for the scan to complete. Progress is reported on
+  /// progress_out.
+  void Run(const std::vector<std::string>& file_names,
+           std::ostream& progress_out);
+
+  /// Print how busy the workers of every stage were during the last run. The
+  /// stage with the highest utilization bounds the throughput of the scan.
+  void ReportUtilization(std::ostream& out) const;
+
+ private:
+  struct ParsedFile {
+    FilePrefetcher::File file_;
+    bool is_parsed_ = false;
+    ManagedTSTree ts_tree_;
+    code_blocks_t code_blocks_;
+    /// Errors found while parsing.
+    std::string log_;
+    /// Reports and counts of the scan tasks of the file, in source order.
+    std::vector<std::string> task_logs_;
+    std::vector<TrainAndScanUtil::ScanSummary> task_summaries_;
+    std::vector<std::vector<TrainAndScanUtil::ScanResult>> task_results_;
+    /// Last scan task to finish puts the report of the file together.
+    std::atomic<size_t> num_remaining_tasks_{0};
+  };
+  struct ScannedFile {
+    size_t scanner_index_ = 0;
+    std::string log_;
+  };
+
+  /// Time spent by the workers of a stage on processing items.
+  struct StageStatistics {
+    std::string name_;
+    size_t num_workers_ = 0;
+    double busy_seconds_ = 0;
+  };
+
+  template <Language G>
+  void RunStages(const std::vector<std::string>& file_names,
+                 std::ostream& progress_out);
+
+  const TrainAndScanUtil& train_and_scan_util_;
+  Language language_;
+  Config config_;
+
+  double wall_seconds_ = 0;
+  size_t num_files_ = 0;
+  std::vector<StageStatistics> stage_statistics_;
+};
+
+#endif  // SRC_SCAN_PIPELINE_H_
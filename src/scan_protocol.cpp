@@ -0,0 +1,253 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "exception.h"
+#include "scan_protocol.h"
+
+namespace scan_protocol {
+namespace {
+const size_t kReadChunkSize = 64 * 1024;
+
+sockaddr_un MakeAddress(const std::string& socket_path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    throw cf_file_access_exception("Socket path too long:" + socket_path);
+  }
+  strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+  return address;
+}
+
+int CreateSocket(const std::string& socket_path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw cf_file_access_exception("Socket creation failed:" + socket_path +
+                                   ":" + strerror(errno));
+  }
+  return fd;
+}
+
+// Create directory accessible by the user only, unless it exists. Existing
+// directory must be such a directory too, so that other users cannot
+// replace the socket in it.
+void CreatePrivateDirectory(const std::string& directory) {
+  if (mkdir(directory.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+    throw cf_file_access_exception("Directory creation failed:" + directory +
+                                   ":" + strerror(errno));
+  }
+  struct stat directory_stat;
+  if (lstat(directory.c_str(), &directory_stat) != 0 ||
+      !S_ISDIR(directory_stat.st_mode) ||
+      directory_stat.st_uid != geteuid() ||
+      (directory_stat.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+    throw cf_file_access_exception("Directory not private to the user:" +
+                                   directory);
+  }
+}
+}  // anonymous namespace
+
+std::string DefaultSocketPath() {
+  const char* runtime_directory = getenv("XDG_RUNTIME_DIR");
+  if (runtime_directory != nullptr && runtime_directory[0] != '\0') {
+    return std::string(runtime_directory) + "/cf_scan_server.sock";
+  }
+  return "/tmp/cf_scan_server-" + std::to_string(geteuid()) +
+         "/cf_scan_server.sock";
+}
+
+SocketStream::~SocketStream() {
+  close(fd_);
+}
+
+bool SocketStream::Fill() {
+  if (buffer_position_ > 0) {
+    buffer_.erase(0, buffer_position_);
+    buffer_position_ = 0;
+  }
+  char chunk[kReadChunkSize];
+  ssize_t num_read;
+  do {
+    num_read = read(fd_, chunk, sizeof(chunk));
+  } while (num_read < 0 && errno == EINTR);
+  if (num_read <= 0) return false;
+  buffer_.append(chunk, num_read);
+  return true;
+}
+
+bool SocketStream::ReadLine(std::string& line) {
+  size_t end;
+  while ((end = buffer_.find('\n', buffer_position_)) == std::string::npos) {
+    // Do not buffer a line without end.
+    if (buffer_.size() - buffer_position_ > kMaxLineSize || !Fill())
+      return false;
+  }
+  if (end - buffer_position_ > kMaxLineSize) return false;
+  line.assign(buffer_, buffer_position_, end - buffer_position_);
+  buffer_position_ = end + 1;
+  return true;
+}
+
+bool SocketStream::ReadBytes(size_t num_bytes, std::string& bytes) {
+  while (buffer_.size() - buffer_position_ < num_bytes) {
+    if (!Fill()) return false;
+  }
+  bytes.assign(buffer_, buffer_position_, num_bytes);
+  buffer_position_ += num_bytes;
+  return true;
+}
+
+bool SocketStream::Write(std::string_view data) {
+  while (!data.empty()) {
+    ssize_t num_written = write(fd_, data.data(), data.size());
+    if (num_written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data.remove_prefix(num_written);
+  }
+  return true;
+}
+
+bool SocketStream::ReadResponse(bool& is_ok, std::string& body) {
+  std::string line;
+  if (!ReadLine(line)) return false;
+  std::string name;
+  std::string argument;
+  ParseRequest(line, name, argument);
+  if (name == kErrorResponse) {
+    is_ok = false;
+    body = argument;
+    return true;
+  }
+  if (name != kOKResponse) return false;
+  is_ok = true;
+  return ReadBytes(strtoull(argument.c_str(), nullptr, 10), body);
+}
+
+bool SocketStream::WriteOKResponse(std::string_view report) {
+  // Header and report are written at once, so that a small report takes a
+  // single write.
+  std::string response = std::string(kOKResponse) + " " +
+                         std::to_string(report.size()) + "\n";
+  response.append(report);
+  return Write(response);
+}
+
+bool SocketStream::WriteErrorResponse(const std::string& message) {
+  std::string response = std::string(kErrorResponse) + " " + message;
+  // Messages are a single line.
+  for (char& c : response) {
+    if (c == '\n' || c == '\r') c = ' ';
+  }
+  return Write(response + "\n");
+}
+
+bool IsAbsolutePath(const std::string& path) {
+  return !path.empty() && path[0] == '/';
+}
+
+std::string MakeAbsolutePath(const std::string& path) {
+  if (IsAbsolutePath(path)) return path;
+  char working_directory[PATH_MAX];
+  if (getcwd(working_directory, sizeof(working_directory)) == nullptr) {
+    throw cf_file_access_exception(std::string("Working directory not "
+                                   "found:") + strerror(errno));
+  }
+  return std::string(working_directory) + "/" + path;
+}
+
+void ParseRequest(const std::string& line, std::string& name,
+                  std::string& argument) {
+  size_t space = line.find(' ');
+  name = line.substr(0, space);
+  argument = space == std::string::npos ? "" : line.substr(space + 1);
+}
+
+int ListenOnUnixSocket(const std::string& socket_path) {
+  sockaddr_un address = MakeAddress(socket_path);
+  if (socket_path == DefaultSocketPath()) {
+    CreatePrivateDirectory(socket_path.substr(0, socket_path.rfind('/')));
+  }
+  // Socket file of a server that is gone is left behind, and stops us from
+  // binding. Remove it, unless a server is listening on it.
+  int probe_fd = CreateSocket(socket_path);
+  bool is_in_use = connect(probe_fd, reinterpret_cast<sockaddr*>(&address),
+                           sizeof(address)) == 0;
+  close(probe_fd);
+  if (is_in_use) {
+    throw cf_file_access_exception("Server already running on:" +
+                                   socket_path);
+  }
+  unlink(socket_path.c_str());
+
+  // Nobody can connect before we listen, so restricting the socket file
+  // after binding it is not racy.
+  int fd = CreateSocket(socket_path);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    std::string error = strerror(errno);
+    close(fd);
+    throw cf_file_access_exception("Listen failed:" + socket_path + ":" +
+                                   error);
+  }
+  return fd;
+}
+
+int ConnectToUnixSocket(const std::string& socket_path) {
+  sockaddr_un address = MakeAddress(socket_path);
+  int fd = CreateSocket(socket_path);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address),
+              sizeof(address)) != 0) {
+    std::string error = strerror(errno);
+    close(fd);
+    throw cf_file_access_exception("Connect failed:" + socket_path + ":" +
+                                   error);
+  }
+  return fd;
+}
+
+bool GetPeerUID(int fd, uid_t& uid) {
+#if defined(SO_PEERCRED)
+  ucred credentials;
+  socklen_t size = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) != 0)
+    return false;
+  uid = credentials.uid;
+  return true;
+#else
+  gid_t gid;
+  return getpeereid(fd, &uid, &gid) == 0;
+#endif
+}
+}  // namespace scan_protocol
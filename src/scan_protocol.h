@@ -0,0 +1,118 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_SCAN_PROTOCOL_H_
+#define SRC_SCAN_PROTOCOL_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <string_view>
+
+/// Protocol between the scan daemon (cf_scan_server) and its clients over a
+/// local Unix socket. A client sends requests of one line each:
+///
+///   FILE <path>                   scan the file at path, which must be
+///                                 absolute: the daemon does not run in
+///                                 the working directory of the client
+///   SOURCE <num_bytes> <name>     scan the num_bytes bytes of source code
+///                                 that follow the line, as file name
+///   EXPRESSION <expression>       scan a single expression
+///   SHUTDOWN                      stop the daemon
+///
+/// Requests of a connection are answered in order. An answer is either
+/// "OK <num_bytes>" followed by a report of num_bytes bytes, or a line
+/// "ERROR <message>".
+///
+/// Socket is accessible only by the user who runs the daemon, and the daemon
+/// serves only the connections of that user.
+namespace scan_protocol {
+const char kFileRequest[] = "FILE";
+const char kSourceRequest[] = "SOURCE";
+const char kExpressionRequest[] = "EXPRESSION";
+const char kShutdownRequest[] = "SHUTDOWN";
+const char kOKResponse[] = "OK";
+const char kErrorResponse[] = "ERROR";
+
+/// Sources bigger than this are rejected.
+const size_t kMaxSourceSize = 256 * 1024 * 1024;
+/// Request and response lines longer than this break the connection.
+const size_t kMaxLineSize = 1024 * 1024;
+
+/// Socket in $XDG_RUNTIME_DIR if it is set, or else in a directory of the
+/// user in /tmp, which ListenOnUnixSocket creates accessible by the user
+/// only.
+std::string DefaultSocketPath();
+
+/// Buffered reads and writes of a connected socket, which is closed when
+/// the stream is destroyed. Methods return false once the connection is
+/// closed or broken.
+class SocketStream {
+ public:
+  explicit SocketStream(int fd) : fd_(fd) {}
+  SocketStream(const SocketStream&) = delete;
+  SocketStream& operator=(const SocketStream&) = delete;
+  ~SocketStream();
+
+  /// Read a line without its '\n'. Returns false if the line is longer
+  /// than kMaxLineSize.
+  bool ReadLine(std::string& line);
+  bool ReadBytes(size_t num_bytes, std::string& bytes);
+  bool Write(std::string_view data);
+
+  /// Read an answer. is_ok tells whether it is a report or an error, and
+  /// body is the report or the error message.
+  bool ReadResponse(bool& is_ok, std::string& body);
+  bool WriteOKResponse(std::string_view report);
+  bool WriteErrorResponse(const std::string& message);
+
+  int GetFD() const { return fd_; }
+
+ private:
+  /// Read more data into buffer_. Returns false if there is none.
+  bool Fill();
+
+  int fd_;
+  std::string buffer_;
+  size_t buffer_position_ = 0;
+};
+
+/// Whether path is absolute, as FILE requests require.
+bool IsAbsolutePath(const std::string& path);
+/// path if it is absolute, or else path in the working directory. Throw
+/// cf_file_access_exception if the working directory cannot be found.
+std::string MakeAbsolutePath(const std::string& path);
+
+/// Split a request line into its name and its argument.
+void ParseRequest(const std::string& line, std::string& name,
+                  std::string& argument);
+
+/// Throw cf_file_access_exception on failure. Socket file is created
+/// accessible by the user only. Directory of DefaultSocketPath is created if
+/// it is missing, and must be accessible by the user only.
+int ListenOnUnixSocket(const std::string& socket_path);
+int ConnectToUnixSocket(const std::string& socket_path);
+/// User of the process on the other end of the connected socket fd. Returns
+/// false if it cannot be found.
+bool GetPeerUID(int fd, uid_t& uid);
+}  // namespace scan_protocol
+
+#endif  // SRC_SCAN_PROTOCOL_H_
@@ -0,0 +1,186 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+
+#include "exception.h"
+#include "scan_server.h"
+
+using scan_protocol::SocketStream;
+
+void ScanServer::Run(std::ostream& log) {
+  int listen_fd = scan_protocol::ListenOnUnixSocket(config_.socket_path_);
+  {
+    std::unique_lock lock(mutex_);
+    listen_fd_ = listen_fd;
+    // Stop may have been called before we started listening.
+    if (is_stopping_) shutdown(listen_fd_, SHUT_RDWR);
+  }
+  log << "Listening on " << config_.socket_path_ << std::endl;
+
+  const size_t max_connections =
+    std::max<size_t>(1, config_.max_connections_);
+  while (true) {
+    {
+      // Connections beyond the limit wait in the backlog of the socket.
+      std::unique_lock lock(mutex_);
+      connection_closed_.wait(lock, [&]() {
+        return is_stopping_ || connection_fds_.size() < max_connections;
+      });
+      if (is_stopping_) break;
+    }
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;  // Stopped
+    }
+    uid_t peer_uid;
+    if (!scan_protocol::GetPeerUID(fd, peer_uid) || peer_uid != geteuid()) {
+      SocketStream stream(fd);
+      stream.WriteErrorResponse("Permission denied");
+      log << "Rejected connection of another user" << std::endl;
+      continue;
+    }
+    std::unique_lock lock(mutex_);
+    if (is_stopping_) {
+      close(fd);
+      break;
+    }
+    connection_fds_.insert(fd);
+    std::thread([this, fd]() { HandleConnection(fd); }).detach();
+  }
+
+  // Connection threads are detached, so wait until they are all done with
+  // this object.
+  Stop();
+  std::unique_lock lock(mutex_);
+  connection_closed_.wait(lock, [&]() { return connection_fds_.empty(); });
+  close(listen_fd_);
+  listen_fd_ = -1;
+  unlink(config_.socket_path_.c_str());
+  log << "Stopped listening on " << config_.socket_path_ << std::endl;
+}
+
+void ScanServer::Stop() {
+  std::unique_lock lock(mutex_);
+  if (is_stopping_) return;
+  is_stopping_ = true;
+  // Shutting the sockets down wakes up the threads blocked on them.
+  if (listen_fd_ >= 0) shutdown(listen_fd_, SHUT_RDWR);
+  for (int fd : connection_fds_) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  // Run may wait for a connection to be closed before accepting more.
+  connection_closed_.notify_all();
+}
+
+void ScanServer::HandleConnection(int fd) {
+  SocketStream stream(fd);
+  std::string line;
+  bool is_shutdown_requested = false;
+  while (!is_shutdown_requested && stream.ReadLine(line)) {
+    is_shutdown_requested = !HandleRequest(stream, line);
+  }
+  if (is_shutdown_requested) Stop();
+
+  // Notify under the lock: Run may return, and the server be destroyed, as
+  // soon as it sees that there are no connections. Stream closes fd after
+  // it is erased, so Stop does not shut down a closed socket.
+  std::unique_lock lock(mutex_);
+  connection_fds_.erase(fd);
+  connection_closed_.notify_all();
+}
+
+bool ScanServer::HandleRequest(SocketStream& stream,
+                               const std::string& line) const {
+  std::string name;
+  std::string argument;
+  scan_protocol::ParseRequest(line, name, argument);
+  switch (language_) {
+    case LANGUAGE_C:
+      return HandleRequest<LANGUAGE_C>(stream, name, argument);
+    case LANGUAGE_VERILOG:
+      return HandleRequest<LANGUAGE_VERILOG>(stream, name, argument);
+    case LANGUAGE_PHP:
+      return HandleRequest<LANGUAGE_PHP>(stream, name, argument);
+    case LANGUAGE_CPP:
+      return HandleRequest<LANGUAGE_CPP>(stream, name, argument);
+    default:
+      throw cf_unexpected_situation("Unsupported language:" +
+                                    std::to_string(LanguageToInt(language_)));
+  }
+}
+
+template <Language G>
+bool ScanServer::HandleRequest(SocketStream& stream, const std::string& name,
+                               const std::string& argument) const {
+  if (name == scan_protocol::kShutdownRequest) {
+    stream.WriteOKResponse("");
+    return false;
+  }
+
+  std::ostringstream report;
+  try {
+    if (name == scan_protocol::kFileRequest) {
+      std::string file_name = FormatPath(argument);
+      // Relative path would be resolved in our working directory, which is
+      // not the one of the client.
+      if (!scan_protocol::IsAbsolutePath(file_name)) {
+        stream.WriteErrorResponse("File path not absolute:" + argument);
+        return true;
+      }
+      train_and_scan_util_.ScanFile<G>(file_name, report);
+    } else if (name == scan_protocol::kSourceRequest) {
+      std::string file_name;
+      size_t num_bytes = strtoull(argument.c_str(), nullptr, 10);
+      size_t space = argument.find(' ');
+      if (space != std::string::npos) file_name = argument.substr(space + 1);
+      if (num_bytes > scan_protocol::kMaxSourceSize) {
+        stream.WriteErrorResponse("Source too big:" +
+                                  std::to_string(num_bytes));
+        // Rest of the connection cannot be parsed, so close it.
+        shutdown(stream.GetFD(), SHUT_RDWR);
+        return true;
+      }
+      std::string source;
+      if (!stream.ReadBytes(num_bytes, source)) return true;
+      train_and_scan_util_.ScanFile<G>(file_name, source, report);
+    } else if (name == scan_protocol::kExpressionRequest) {
+      train_and_scan_util_.ScanExpression<G>(argument, report);
+    } else {
+      stream.WriteErrorResponse("Unknown request:" + name);
+      return true;
+    }
+  } catch (std::exception& e) {
+    stream.WriteErrorResponse(e.what());
+    return true;
+  }
+  stream.WriteOKResponse(report.str());
+  return true;
+}
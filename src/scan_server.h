@@ -0,0 +1,92 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_SCAN_SERVER_H_
+#define SRC_SCAN_SERVER_H_
+
+#include <condition_variable>  // NOLINT [build/c++11]
+#include <iostream>
+#include <mutex>  // NOLINT [build/c++11]
+#include <string>
+#include <unordered_set>
+
+#include "common_util.h"
+#include "scan_protocol.h"
+#include "train_and_scan_util.h"
+
+/// Daemon that scans files, sources and expressions on request (see
+/// scan_protocol.h), so that the training dataset is loaded once and the
+/// expression caches stay warm across scans, e.g., of the few files changed
+/// by every CI job.
+///
+/// Every connection is served by a thread of its own, and at most
+/// Config::max_connections_ connections are served at once; others wait
+/// until one of them is closed. Big files are scanned in parallel on the
+/// thread pool of TrainAndScanUtil, which is shared by all the connections.
+/// Connections of other users are rejected.
+class ScanServer {
+ public:
+  static const size_t kDefaultMaxConnections = 64;
+
+  struct Config {
+    std::string socket_path_ = scan_protocol::DefaultSocketPath();
+    size_t max_connections_ = kDefaultMaxConnections;
+  };
+
+  ScanServer(const TrainAndScanUtil& train_and_scan_util, Language language,
+             const Config& config)
+    : train_and_scan_util_(train_and_scan_util), language_(language),
+      config_(config) {}
+  ScanServer(const ScanServer&) = delete;
+  ScanServer& operator=(const ScanServer&) = delete;
+
+  /// Listen on the socket and serve requests until a SHUTDOWN request or
+  /// Stop. Returns once all the connections are closed. Throws
+  /// cf_file_access_exception if the socket cannot be listened on. Messages
+  /// about the server are written to log.
+  void Run(std::ostream& log);
+  /// Thread-safe. Stop accepting connections and close the open ones.
+  void Stop();
+
+ private:
+  void HandleConnection(int fd);
+  /// Answer to a request. Returns false if the request is SHUTDOWN.
+  bool HandleRequest(scan_protocol::SocketStream& stream,
+                     const std::string& line) const;
+  template <Language G>
+  bool HandleRequest(scan_protocol::SocketStream& stream,
+                     const std::string& name,
+                     const std::string& argument) const;
+
+  const TrainAndScanUtil& train_and_scan_util_;
+  Language language_;
+  Config config_;
+
+  std::mutex mutex_;
+  /// Notified when a connection is closed, or the server is stopping.
+  std::condition_variable connection_closed_;
+  int listen_fd_ = -1;
+  bool is_stopping_ = false;
+  /// Sockets of the open connections, which Stop shuts down.
+  std::unordered_set<int> connection_fds_;
+};
+
+#endif  // SRC_SCAN_SERVER_H_
@@ -0,0 +1,236 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <chrono>  // NOLINT [build/c++11]
+#include <exception>
+#include <iostream>
+#include <utility>
+
+#include "thread_pool.h"
+
+namespace {
+// Pool and index of the worker running on the current thread.
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local size_t current_worker_index = ThreadPool::kNotAWorker;
+}  // anonymous namespace
+
+ThreadPool::ThreadPool(size_t num_workers) {
+  for (size_t i = 0; i < num_workers; i++) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  for (size_t i = 0; i < num_workers; i++) {
+    threads_.push_back(std::thread(&ThreadPool::RunWorker, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock lock(external_mutex_);
+    stop_ = true;
+  }
+  wake_up_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+  // Without workers, tasks submitted to the pool are run here.
+  Task task;
+  while (PopExternalTask(task)) RunTask(task);
+}
+
+size_t ThreadPool::GetCurrentWorkerIndex() const {
+  return current_pool == this ? current_worker_index : kNotAWorker;
+}
+
+void ThreadPool::Submit(Task task) {
+  size_t worker_index = GetCurrentWorkerIndex();
+  if (worker_index != kNotAWorker) {
+    PushToWorker(worker_index, std::move(task));
+    return;
+  }
+  {
+    std::unique_lock lock(external_mutex_);
+    external_tasks_.push_back(std::move(task));
+    num_queued_tasks_++;
+  }
+  wake_up_.notify_one();
+}
+
+void ThreadPool::PushToWorker(size_t worker_index, Task task) {
+  Worker& worker = *workers_[worker_index];
+  {
+    std::unique_lock lock(worker.mutex_);
+    worker.tasks_.push_back(std::move(task));
+  }
+  num_queued_tasks_++;
+  WakeUpWorker();
+}
+
+void ThreadPool::WakeUpWorker() {
+  // Taking the mutex orders this with the check of num_queued_tasks_ by a
+  // worker that is about to sleep, so that the wake-up is not lost.
+  { std::unique_lock lock(external_mutex_); }
+  wake_up_.notify_one();
+}
+
+bool ThreadPool::PopOrStealTask(size_t worker_index, Task& task) {
+  if (num_queued_tasks_.load() == 0) return false;
+  if (worker_index != kNotAWorker) {
+    // Newest task of own deque is the most likely to be in cache.
+    Worker& worker = *workers_[worker_index];
+    std::unique_lock lock(worker.mutex_);
+    if (!worker.tasks_.empty()) {
+      task = std::move(worker.tasks_.back());
+      worker.tasks_.pop_back();
+      num_queued_tasks_--;
+      return true;
+    }
+  }
+  // Steal the oldest task, which is likely the biggest, starting from the
+  // next worker so that thieves spread over the victims.
+  size_t num_workers = workers_.size();
+  size_t start = worker_index == kNotAWorker ? 0 : worker_index + 1;
+  for (size_t i = 0; i < num_workers; i++) {
+    Worker& victim = *workers_[(start + i) % num_workers];
+    std::unique_lock lock(victim.mutex_);
+    if (!victim.tasks_.empty()) {
+      task = std::move(victim.tasks_.front());
+      victim.tasks_.pop_front();
+      num_queued_tasks_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::PopExternalTask(Task& task) {
+  std::unique_lock lock(external_mutex_);
+  if (external_tasks_.empty()) return false;
+  task = std::move(external_tasks_.front());
+  external_tasks_.pop_front();
+  num_queued_tasks_--;
+  return true;
+}
+
+void ThreadPool::RunTask(const Task& task) {
+  // Nobody waits for a submitted task, so its exception can only be
+  // reported. ParallelFor loops catch exceptions of their chunks themselves.
+  try {
+    task();
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+  } catch (...) {
+    std::cerr << "Error: unknown exception in thread pool task" << std::endl;
+  }
+}
+
+void ThreadPool::RunWorker(size_t worker_index) {
+  current_pool = this;
+  current_worker_index = worker_index;
+
+  Task task;
+  while (true) {
+    if (PopOrStealTask(worker_index, task) || PopExternalTask(task)) {
+      auto start = std::chrono::steady_clock::now();
+      RunTask(task);
+      task = nullptr;
+      busy_nanoseconds_ += std::chrono::duration_cast<
+                             std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start)
+                             .count();
+      continue;
+    }
+
+    std::unique_lock lock(external_mutex_);
+    wake_up_.wait(lock, [this] {
+      return stop_ || num_queued_tasks_.load() > 0;
+    });
+    if (stop_ && num_queued_tasks_.load() == 0) return;
+  }
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, size_t grain_size,
+    const std::function<void(size_t, size_t)>& fn) {
+  if (begin >= end) return;
+  if (grain_size == 0) grain_size = 1;
+  size_t num_chunks = (end - begin + grain_size - 1) / grain_size;
+  size_t worker_index = GetCurrentWorkerIndex();
+  size_t num_helpers = workers_.size() -
+                       (worker_index != kNotAWorker ? 1 : 0);
+  if (num_chunks == 1 || num_helpers == 0) {
+    for (size_t chunk_begin = begin; chunk_begin < end;
+         chunk_begin += grain_size) {
+      fn(chunk_begin, std::min(chunk_begin + grain_size, end));
+    }
+    return;
+  }
+
+  // Chunks are claimed from the loop state by the calling thread and by
+  // helper tasks that idle workers steal. Helpers may run after the loop
+  // has returned, hence the state is shared with them.
+  auto loop = std::make_shared<Loop>();
+  loop->fn_ = &fn;
+  loop->begin_ = begin;
+  loop->end_ = end;
+  loop->grain_size_ = grain_size;
+  loop->num_chunks_ = num_chunks;
+  loop->num_remaining_chunks_ = num_chunks;
+  for (size_t i = 0; i < std::min(num_chunks - 1, num_helpers); i++) {
+    // Callers from outside the pool spread their helpers over the workers.
+    size_t target_index = worker_index != kNotAWorker ? worker_index :
+                          next_worker_.fetch_add(1) % workers_.size();
+    PushToWorker(target_index, [loop]() { loop->RunChunks(); });
+  }
+
+  // Caller runs chunks of this loop only, and then waits for the chunks that
+  // helpers are running. Running other tasks here could deadlock: a task
+  // that waits for something that a caller up the stack is doing (e.g., a
+  // search for the same expression, see NearestExpressionsCache) would
+  // never see it done.
+  loop->RunChunks();
+  {
+    std::unique_lock lock(loop->mutex_);
+    loop->done_.wait(lock, [&]() {
+      return loop->num_remaining_chunks_.load() == 0;
+    });
+  }
+  if (loop->first_exception_) std::rethrow_exception(loop->first_exception_);
+}
+
+void ThreadPool::Loop::RunChunks() {
+  while (true) {
+    size_t chunk = next_chunk_.fetch_add(1);
+    if (chunk >= num_chunks_) return;
+    size_t chunk_begin = begin_ + chunk * grain_size_;
+    // Chunks must not throw, so that the loop waits for all of them; first
+    // exception is rethrown by ParallelFor.
+    try {
+      (*fn_)(chunk_begin, std::min(chunk_begin + grain_size_, end_));
+    } catch (...) {
+      std::unique_lock lock(mutex_);
+      if (!first_exception_) first_exception_ = std::current_exception();
+    }
+    if (num_remaining_chunks_.fetch_sub(1) == 1) {
+      std::unique_lock lock(mutex_);
+      done_.notify_all();
+    }
+  }
+}
@@ -0,0 +1,137 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_THREAD_POOL_H_
+#define SRC_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>  // NOLINT [build/c++11]
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>  // NOLINT [build/c++11]
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+/// Work-stealing pool of a fixed number of worker threads, shared by all the
+/// parallel work of a run: coarse tasks (e.g., scanning a file) and the
+/// fine-grained loops nested in them (e.g., searching for nearest
+/// expressions). Nested loops are split into chunks that idle workers steal,
+/// so cores do not sit idle when only a few coarse tasks are running.
+///
+/// Every worker has its own deque of tasks. A worker runs tasks from the back
+/// of its own deque, and when its deque is empty, it takes tasks submitted
+/// from outside the pool or steals tasks from the front of the deques of
+/// other workers.
+class ThreadPool {
+ public:
+  using Task = std::function<void()>;
+  /// Index of a thread that is not a worker of the pool.
+  static const size_t kNotAWorker = static_cast<size_t>(-1);
+
+  /// Pool with 0 workers runs ParallelFor loops in the calling thread.
+  explicit ThreadPool(size_t num_workers);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  /// Runs the tasks that are still queued and then stops the workers.
+  ~ThreadPool();
+
+  size_t GetNumWorkers() const { return workers_.size(); }
+  /// Index of the calling thread in [0, GetNumWorkers()) if it is a worker
+  /// of this pool, kNotAWorker otherwise.
+  size_t GetCurrentWorkerIndex() const;
+
+  /// Run task on some worker. Exception thrown by the task is reported on
+  /// std::cerr, since nobody waits for the task.
+  void Submit(Task task);
+
+  /// Call fn(chunk_begin, chunk_end) for chunks of [begin, end) of at most
+  /// grain_size elements in parallel, and return once all the chunks are
+  /// done. Calling thread runs chunks too, so this can be called from tasks
+  /// of the pool (and from outside the pool) without deadlocking. While
+  /// waiting, the calling thread runs chunks of this loop only, never other
+  /// tasks of the pool. If some chunks throw, the first exception is
+  /// rethrown once all the chunks are done.
+  void ParallelFor(size_t begin, size_t end, size_t grain_size,
+                   const std::function<void(size_t, size_t)>& fn);
+
+  /// Total time that workers spent running tasks.
+  double GetBusySeconds() const {
+    return busy_nanoseconds_.load() / 1000000000.0;
+  }
+
+ private:
+  /// Workers are cache-line aligned so that a worker pushing to and popping
+  /// from its own deque does not share cache lines with other workers.
+  struct alignas(64) Worker {
+    std::mutex mutex_;
+    std::deque<Task> tasks_;
+  };
+
+  /// State of a ParallelFor loop. Chunks are claimed in order by the
+  /// calling thread and by helper tasks queued for other workers.
+  struct Loop {
+    const std::function<void(size_t, size_t)>* fn_ = nullptr;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    size_t grain_size_ = 1;
+    size_t num_chunks_ = 0;
+    std::atomic<size_t> next_chunk_{0};
+    std::atomic<size_t> num_remaining_chunks_{0};
+    /// Protects first_exception_ and waiting for the chunks.
+    std::mutex mutex_;
+    std::condition_variable done_;
+    std::exception_ptr first_exception_;
+
+    /// Run chunks until no chunk is left to claim.
+    void RunChunks();
+  };
+
+  void RunWorker(size_t worker_index);
+  static void RunTask(const Task& task);
+  /// Push task to the deque of worker_index and wake up a sleeping worker.
+  void PushToWorker(size_t worker_index, Task task);
+  /// Pop a task from the deque of worker_index (if it is a worker) or steal
+  /// one from another worker. Tasks submitted from outside the pool are
+  /// taken by PopExternalTask.
+  bool PopOrStealTask(size_t worker_index, Task& task);
+  bool PopExternalTask(Task& task);
+  void WakeUpWorker();
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+
+  /// Tasks submitted from outside the pool. Also protects sleeping.
+  std::mutex external_mutex_;
+  std::deque<Task> external_tasks_;
+  std::condition_variable wake_up_;
+  bool stop_ = false;
+
+  /// Number of tasks in all the deques, used to decide whether to sleep.
+  std::atomic<size_t> num_queued_tasks_{0};
+  /// Worker that receives the next chunk submitted from outside the pool.
+  std::atomic<size_t> next_worker_{0};
+  std::atomic<uint64_t> busy_nanoseconds_{0};
+};
+
+#endif  // SRC_THREAD_POOL_H_
@@ -18,6 +18,11 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
 #include "train_and_scan_util.h"
 #include "trie.h"
 #include "common_util.h"
@@ -26,12 +31,68 @@
 // Explicit instantiation of templates
 template int TrainAndScanUtil::ScanFile<LANGUAGE_C>(
   const std::string& test_file, std::ostream& log_file) const;
+template int TrainAndScanUtil::ScanFile<LANGUAGE_C>(
+  const std::string& test_file, std::string_view source_file_contents,
+  std::ostream& log_file) const;
 template int TrainAndScanUtil::ScanFile<LANGUAGE_VERILOG>(
   const std::string& test_file, std::ostream& log_file) const;
+template int TrainAndScanUtil::ScanFile<LANGUAGE_VERILOG>(
+  const std::string& test_file, std::string_view source_file_contents,
+  std::ostream& log_file) const;
 template int TrainAndScanUtil::ScanFile<LANGUAGE_PHP>(
   const std::string& test_file, std::ostream& log_file) const;
+template int TrainAndScanUtil::ScanFile<LANGUAGE_PHP>(
+  const std::string& test_file, std::string_view source_file_contents,
+  std::ostream& log_file) const;
 template int TrainAndScanUtil::ScanFile<LANGUAGE_CPP>(
   const std::string& test_file, std::ostream& log_file) const;
+template int TrainAndScanUtil::ScanFile<LANGUAGE_CPP>(
+  const std::string& test_file, std::string_view source_file_contents,
+  std::ostream& log_file) const;
+template bool TrainAndScanUtil::ParseFile<LANGUAGE_C>(
+  std::string_view source_file_contents, ManagedTSTree& ts_tree,
+  code_blocks_t& code_blocks, std::ostream& log_file) const;
+template int TrainAndScanUtil::ScanCodeBlocks<LANGUAGE_C>(
+  const std::string& test_file, std::string_view source_file_contents,
+  const code_blocks_t& code_blocks, std::ostream& log_file) const;
+template void TrainAndScanUtil::ScanCodeBlocks<LANGUAGE_C>(
+  const std::string& test_file, std::string_view source_file_contents,
+  const code_blocks_t& code_blocks, size_t begin, size_t end,
+  ScanSummary& summary, std::ostream& log_file,
+  std::vector<ScanResult>* results) const;
+template bool TrainAndScanUtil::ParseFile<LANGUAGE_VERILOG>(
+  std::string_view source_file_contents, ManagedTSTree& ts_tree,
+  code_blocks_t& code_blocks, std::ostream& log_file) const;
+template int TrainAndScanUtil::ScanCodeBlocks<LANGUAGE_VERILOG>(
+  const std::string& test_file, std::string_view source_file_contents,
+  const code_blocks_t& code_blocks, std::ostream& log_file) const;
+template void TrainAndScanUtil::ScanCodeBlocks<LANGUAGE_VERILOG>(
+  const std::string& test_file, std::string_view source_file_contents,
+  const code_blocks_t& code_blocks, size_t begin, size_t end,
+  ScanSummary& summary, std::ostream& log_file,
+  std::vector<ScanResult>* results) const;
+template bool TrainAndScanUtil::ParseFile<LANGUAGE_PHP>(
+  std::string_view source_file_contents, ManagedTSTree& ts_tree,
+  code_blocks_t& code_blocks, std::ostream& log_file) const;
+template int TrainAndScanUtil::ScanCodeBlocks<LANGUAGE_PHP>(
+  const std::string& test_file, std::string_view source_file_contents,
+  const code_blocks_t& code_blocks, std::ostream& log_file) const;
+template void TrainAndScanUtil::ScanCodeBlocks<LANGUAGE_PHP>(
+  const std::string& test_file, std::string_view source_file_contents,
+  const code_blocks_t& code_blocks, size_t begin, size_t end,
+  ScanSummary& summary, std::ostream& log_file,
+  std::vector<ScanResult>* results) const;
+template bool TrainAndScanUtil::ParseFile<LANGUAGE_CPP>(
+  std::string_view source_file_contents, ManagedTSTree& ts_tree,
+  code_blocks_t& code_blocks, std::ostream& log_file) const;
+template int TrainAndScanUtil::ScanCodeBlocks<LANGUAGE_CPP>(
+  const std::string& test_file, std::string_view source_file_contents,
+  const code_blocks_t& code_blocks, std::ostream& log_file) const;
+template void TrainAndScanUtil::ScanCodeBlocks<LANGUAGE_CPP>(
+  const std::string& test_file, std::string_view source_file_contents,
+  const code_blocks_t& code_blocks, size_t begin, size_t end,
+  ScanSummary& summary, std::ostream& log_file,
+  std::vector<ScanResult>* results) const;
 template int TrainAndScanUtil::ScanExpression<LANGUAGE_C>(
   const std::string& expression, std::ostream& log_file) const;
 template int TrainAndScanUtil::ScanExpression<LANGUAGE_VERILOG>(
@@ -40,28 +101,54 @@ template int TrainAndScanUtil::ScanExpression<LANGUAGE_PHP>(
   const std::string& expression, std::ostream& log_file) const;
 template int TrainAndScanUtil::ScanExpression<LANGUAGE_CPP>(
   const std::string& expression, std::ostream& log_file) const;
-
-template <TreeLevel L, Language G>
-void TrainAndScanUtil::ReportPossibleCorrections(const Trie& trie,
-    const std::string& code_block_str,
-    bool found_in_training_dataset,
+template void TrainAndScanUtil::ComputeVerdicts<LEVEL_ONE>(
+  const std::vector<TokenSequence>& expressions,
+  std::vector<ExpressionVerdict>& verdicts) const;
+template void TrainAndScanUtil::ComputeVerdicts<LEVEL_TWO>(
+  const std::vector<TokenSequence>& expressions,
+  std::vector<ExpressionVerdict>& verdicts) const;
+template bool TrainAndScanUtil::ReportVerdict<LEVEL_ONE>(
+  const ExpressionVerdict& verdict, std::string_view location,
+  std::ostream& log_file) const;
+template bool TrainAndScanUtil::ReportVerdict<LEVEL_TWO>(
+  const ExpressionVerdict& verdict, std::string_view location,
+  std::ostream& log_file) const;
+
+template <TreeLevel L>
+void TrainAndScanUtil::ComputeVerdict(const Trie& trie,
+    const TokenSequence& expression_tokens, ExpressionVerdict& verdict,
     std::ostream& log_file) const {
-  // We maintain different expression cacne per level since
-  // there is no sharing of expressions between different
-  // trie levels.
-  static NearestExpressionsCache<L> expression_cache(scan_config_);
-
-  // Search for nearest expressions based on edit distance.
-  NearestExpressions nearest_expressions;
+  float confidence = 0.0;
+  size_t num_occurrences = 0;
+  // Verdict is computed from tokens and compact nearest expressions only;
+  // strings are expanded only if the verdict is reported.
+  verdict.expression_tokens_ = expression_tokens;
+  verdict.found_in_training_dataset_ = trie.LookUp(expression_tokens,
+                                         num_occurrences, confidence);
+  const bool found_in_training_dataset = verdict.found_in_training_dataset_;
+
+  NearestExpressionsCache& expression_cache = GetExpressionCache<L>();
+  // Cache is keyed by compacted expressions to keep it small.
+  std::string short_expression =
+    NearestExpressionsCache::MakeKey(expression_tokens);
+  auto short_expression_hash = NearestExpressionsCache::Hash(short_expression);
+  PersistentExpressionCache::KeyHash persistent_hash = persistent_cache_ ?
+    PersistentExpressionCache::Hash(short_expression) : 0;
+
+  // Search nearest expressions over trie only if they are not cached.
+  auto search_fn = [&]() {
+    CompactNearestExpressions search_result;
+    // Earlier scans may have searched this expression already.
+    if (persistent_cache_ && persistent_cache_->LookUp(L, short_expression,
+                                 persistent_hash, search_result)) {
+      return search_result;
+    }
 
-  // Lookup in cache. If that fails, insert into cache.
-  if (expression_cache.LookUp(code_block_str,
-                              nearest_expressions) == false) {
+    // Search for nearest expressions based on edit distance.
     Timer timer_trie_search;
     timer_trie_search.StartTimer();
-    nearest_expressions = trie.SearchNearestExpressions(
-          code_block_str, scan_config_.max_cost_,
-          scan_config_.num_threads_);
+    NearestExpressions nearest_expressions = trie.SearchNearestExpressions(
+          expression_tokens, scan_config_.max_cost_, thread_pool_);
     timer_trie_search.StopTimer();
 
     if (scan_config_.log_level_ >= LogLevel::DEBUG) {
@@ -69,116 +156,213 @@ void TrainAndScanUtil::ReportPossibleCorrections(const Trie& trie,
                << timer_trie_search.TimerDiff() << " secs" << std::endl;
     }
 
-    if (!found_in_training_dataset) {
-      // If the expression is not found in the training dataset then we
-      // will have to store the base expression at cost 0 in the nearest
-      // expressions so that autocorrection works fine.
-      const NearestExpression::Cost kZeroCost = 0;
-      const NearestExpression::NumOccurrences kZeroOccurrences = 0;
-      nearest_expressions.push_back(NearestExpression(code_block_str,
-                                   kZeroCost,
-                                   kZeroOccurrences));
+    RankNearestExpressions(trie,
+                           ExpressionCompacter::Get().Expand(expression_tokens),
+                           found_in_training_dataset, nearest_expressions,
+                           search_result);
+    if (persistent_cache_) {
+      persistent_cache_->Record(L, short_expression, persistent_hash,
+                                search_result);
     }
+    return search_result;
+  };
 
-    // Sort and rank results based on distance and occurrence.
-    trie.SortAndRankResults(nearest_expressions);
+  // If some other thread searched (or is searching) for this expression, then
+  // we just use its result.
+  expression_cache.LookUpOrSearch(short_expression, short_expression_hash,
+                                  search_fn,
+                                  verdict.compact_nearest_expressions_);
 
-    // Select only max results asked by the user.
-    if (nearest_expressions.size() > scan_config_.max_autocorrections_)
-      nearest_expressions.resize(scan_config_.max_autocorrections_);
+  verdict.is_potential_anomaly_ = NearestExpressionsCache::IsPotentialAnomaly(
+                                    trie, verdict.compact_nearest_expressions_,
+                                    scan_config_.anomaly_threshold_);
+}
 
-    expression_cache.Insert(code_block_str, nearest_expressions);
+void TrainAndScanUtil::RankNearestExpressions(const Trie& trie,
+    const std::string& expression, bool found_in_training_dataset,
+    NearestExpressions& nearest_expressions,
+    CompactNearestExpressions& compact_nearest_expressions) const {
+  if (!found_in_training_dataset) {
+    // If the expression is not found in the training dataset then we
+    // will have to store the base expression at cost 0 in the nearest
+    // expressions so that autocorrection works fine.
+    const NearestExpression::Cost kZeroCost = 0;
+    const NearestExpression::NumOccurrences kZeroOccurrences = 0;
+    nearest_expressions.push_back(NearestExpression(expression,
+                                 kZeroCost,
+                                 kZeroOccurrences));
   }
 
-  auto print_autocorrect_results = [&]() {
-    for (auto nearest_expression : nearest_expressions) {
-      log_file << "Did you mean:" << nearest_expression.GetExpression()
-               << " with editing cost:" << nearest_expression.GetCost()
-               << " and occurrences: " << nearest_expression.GetNumOccurrences()
-               << std::endl;
+  // Sort and rank results based on distance and occurrence.
+  trie.SortAndRankResults(nearest_expressions);
+
+  // Select only max results asked by the user.
+  if (nearest_expressions.size() > scan_config_.max_autocorrections_)
+    nearest_expressions.resize(scan_config_.max_autocorrections_);
+
+  cf_assert(NearestExpressionsCache::Compress(expression,
+              nearest_expressions, compact_nearest_expressions),
+            "Nearest expressions not from training dataset for:" +
+            expression);
+}
+
+template <TreeLevel L>
+void TrainAndScanUtil::ComputeVerdicts(
+    const std::vector<TokenSequence>& expressions,
+    std::vector<ExpressionVerdict>& verdicts) const {
+  const Trie& trie = GetTrie<L>();
+  NearestExpressionsCache& expression_cache = GetExpressionCache<L>();
+  verdicts.clear();
+  verdicts.resize(expressions.size());
+
+  // Batch of expressions is searched in a single traversal of the trie, and
+  // batches are searched in parallel.
+  const size_t kExpressionsPerBatch = 64;
+  thread_pool_.ParallelFor(0, expressions.size(), kExpressionsPerBatch,
+                           [&](size_t begin, size_t end) {
+    std::vector<size_t> indices_to_search;
+    std::vector<TokenSequence> expressions_to_search;
+    for (size_t i = begin; i < end; i++) {
+      ExpressionVerdict& verdict = verdicts[i];
+      float confidence = 0.0;
+      size_t num_occurrences = 0;
+      verdict.expression_tokens_ = expressions[i];
+      verdict.found_in_training_dataset_ = trie.LookUp(expressions[i],
+                                             num_occurrences, confidence);
+
+      std::string short_expression =
+        NearestExpressionsCache::MakeKey(expressions[i]);
+      if (!expression_cache.LookUp(short_expression,
+                                   verdict.compact_nearest_expressions_) &&
+          !(persistent_cache_ && persistent_cache_->LookUp(L,
+              short_expression,
+              PersistentExpressionCache::Hash(short_expression),
+              verdict.compact_nearest_expressions_))) {
+        indices_to_search.push_back(i);
+        expressions_to_search.push_back(expressions[i]);
+      }
     }
-    log_file << std::endl;
-  };
 
-  bool is_potential_anomaly = trie.IsPotentialAnomaly(nearest_expressions,
-                                              scan_config_.anomaly_threshold_);
+    std::vector<NearestExpressions> search_results;
+    if (!expressions_to_search.empty()) {
+      search_results = trie.SearchNearestExpressionsInBatch(
+                         expressions_to_search, scan_config_.max_cost_);
+    }
+    for (size_t j = 0; j < indices_to_search.size(); j++) {
+      const TokenSequence& expression = expressions_to_search[j];
+      ExpressionVerdict& verdict = verdicts[indices_to_search[j]];
+      CompactNearestExpressions& compact_nearest_expressions =
+        verdict.compact_nearest_expressions_;
+      RankNearestExpressions(trie,
+                             ExpressionCompacter::Get().Expand(expression),
+                             verdict.found_in_training_dataset_,
+                             search_results[j], compact_nearest_expressions);
+
+      std::string short_expression =
+        NearestExpressionsCache::MakeKey(expression);
+      expression_cache.Insert(short_expression, compact_nearest_expressions);
+      if (persistent_cache_) {
+        persistent_cache_->Record(L, short_expression,
+                                  PersistentExpressionCache::Hash(
+                                    short_expression),
+                                  compact_nearest_expressions);
+      }
+    }
 
-  /* Expressions missing from the training data at LEVEL_ONE are not reported
-   * as anomaly if they are not missing at LEVEL_TWO. */
-  if ((L == LEVEL_ONE && found_in_training_dataset && is_potential_anomaly) ||
-      (L == LEVEL_TWO && is_potential_anomaly)) {
-    log_file << "Expression is Potential anomaly" << std::endl;
-    print_autocorrect_results();
-  } else {
-    log_file << "Expression is Okay" << std::endl;
-    if (scan_config_.log_level_ >= LogLevel::INFO) {
-      print_autocorrect_results();
+    for (size_t i = begin; i < end; i++) {
+      verdicts[i].is_potential_anomaly_ =
+        NearestExpressionsCache::IsPotentialAnomaly(trie,
+          verdicts[i].compact_nearest_expressions_,
+          scan_config_.anomaly_threshold_);
     }
-  }
+  });
 }
 
-template <TreeLevel L, Language G>
-bool TrainAndScanUtil::ScanExpressionForAnomaly(const Trie& trie,
-    const code_block_t& code_block,
-    std::ostream& log_file) const {
-  float confidence = 0.0;
-  size_t num_occurrences = 0;
-  std::string code_block_str = NodeToString<L, G>(
-                                            code_block);
-  bool found_in_training_dataset = trie.LookUp(code_block_str,
-                                          num_occurrences, confidence);
+TrainAndScanUtil::ExpandedVerdict TrainAndScanUtil::ExpandVerdict(
+    TreeLevel level, const ExpressionVerdict& verdict) const {
+  const Trie& trie = level == LEVEL_ONE ? GetTrie<LEVEL_ONE>() :
+                                          GetTrie<LEVEL_TWO>();
+  ExpandedVerdict expanded_verdict;
+  expanded_verdict.expression_ = ExpressionCompacter::Get().Expand(
+                                   verdict.expression_tokens_);
+  expanded_verdict.found_in_training_dataset_ =
+    verdict.found_in_training_dataset_;
+  expanded_verdict.nearest_expressions_ = NearestExpressionsCache::Decompress(
+    trie, expanded_verdict.expression_, verdict.compact_nearest_expressions_);
+  return expanded_verdict;
+}
 
-  // Pretty print
-  auto print_details = [&](const std::string& status) {
-    try {
-      log_file << "Level:" << LevelToString<L>()
-             << " Expression:" << code_block_str
-             << " " << status
-             << " in training dataset: ";
-    } catch(std::exception& e) {
-      // NodeToString can throw exception. Just skip printing in that case.
-    }
-  };
-  print_details(found_in_training_dataset ? "found" : "not found");
+std::string TrainAndScanUtil::FormatSourceLocation(
+    const std::string& test_file, std::string_view source_file_contents,
+    const code_block_t& code_block) {
+  if (test_file == "" || source_file_contents.empty()) return "";
+  TSPoint start = ts_node_start_point(code_block);
+  return FormatSourceLocation(test_file, start.row, start.column,
+           OriginalSourceExpression(code_block, source_file_contents));
+}
 
-  // Suggest expressions that are close to current expression.
-  ReportPossibleCorrections<L, G>(trie, code_block_str,
-                                  found_in_training_dataset, log_file);
-  return found_in_training_dataset;
+std::string TrainAndScanUtil::FormatSourceLocation(
+    const std::string& test_file, size_t row, size_t column,
+    const std::string& source_expression) {
+  if (test_file == "") return "";
+  return "Source file: " + test_file + ":" + std::to_string(row) + ":" +
+         std::to_string(column) + ":" + source_expression;
 }
 
-template <TreeLevel L, Language G>
-bool TrainAndScanUtil::ScanExpressionForAnomaly(const Trie& trie,
-    const std::string& source_file_contents,
-    const code_block_t& code_block,
+template <TreeLevel L>
+bool TrainAndScanUtil::ScanExpressionForAnomaly(
+    std::string_view source_file_contents,
+    const code_block_t& code_block, const ExpressionVerdict& verdict,
     std::ostream& log_file, const std::string& test_file) const {
-  float confidence = 0.0;
-  size_t num_occurrences = 0;
-  std::string code_block_str = NodeToString<L, G>(code_block);
-  bool found_in_training_dataset = trie.LookUp(code_block_str,
-                                               num_occurrences, confidence);
+  // Most code blocks are okay, so do not format their location unless it is
+  // reported.
+  if (!ShouldReport(L, verdict)) return verdict.found_in_training_dataset_;
+  return ReportVerdict<L>(verdict, FormatSourceLocation(test_file,
+                            source_file_contents, code_block), log_file);
+}
 
-  // Pretty print
+template <TreeLevel L>
+bool TrainAndScanUtil::ReportVerdict(const ExpressionVerdict& verdict,
+    std::string_view location, std::ostream& log_file) const {
+  if (!ShouldReport(L, verdict)) return verdict.found_in_training_dataset_;
+  const ExpandedVerdict expanded_verdict = ExpandVerdict(L, verdict);
+
+  // Pretty print. Reports end lines with '\n' instead of std::endl, so that
+  // writing them to a file does not flush it at every line.
   auto print_details = [&](const std::string& status) {
     log_file << "Level:" << LevelToString<L>()
-             << " Expression:" << code_block_str
+             << " Expression:" << expanded_verdict.expression_
              << " " << status
              << " in training dataset: ";
 
-    if (test_file != "" && source_file_contents != "") {
-      TSPoint start = ts_node_start_point(code_block);
-      log_file << "Source file: " << test_file << ":"
-               << start.row << ":" << start.column << ":";
-      log_file << OriginalSourceExpression(code_block,
-                   source_file_contents) << std::endl;
+    if (!location.empty()) {
+      log_file << location << "\n";
     }
   };
-  print_details(found_in_training_dataset ? "found" : "not found");
+  print_details(verdict.found_in_training_dataset_ ? "found" : "not found");
 
   // Suggest expressions that are close to current expression.
-  ReportPossibleCorrections<L, G>(trie, code_block_str,
-                                  found_in_training_dataset, log_file);
-  return found_in_training_dataset;
+  auto print_autocorrect_results = [&]() {
+    for (const auto& nearest_expression :
+         expanded_verdict.nearest_expressions_) {
+      log_file << "Did you mean:" << nearest_expression.GetExpression()
+               << " with editing cost:" << nearest_expression.GetCost()
+               << " and occurrences: " << nearest_expression.GetNumOccurrences()
+               << "\n";
+    }
+    log_file << "\n";
+  };
+
+  if (IsReportedAnomaly(L, verdict)) {
+    log_file << "Expression is Potential anomaly\n";
+    print_autocorrect_results();
+  } else {
+    log_file << "Expression is Okay\n";
+    if (scan_config_.log_level_ >= LogLevel::INFO) {
+      print_autocorrect_results();
+    }
+  }
+  return verdict.found_in_training_dataset_;
 }
 
 template <Language G>
@@ -200,9 +384,15 @@ int TrainAndScanUtil::ScanExpression(const std::string& expression,
     return 0;
   }
 
+  thread_local TokenSequence expression_tokens;
+  ExpressionVerdict verdict;
   for (auto expression : code_blocks) {
-     ScanExpressionForAnomaly<LEVEL_ONE, G>(trie_level1_, "", expression,
-                                            log_file, "");
+     expression_tokens.clear();
+     NodeToTokens<LEVEL_ONE, G>(expression, expression_tokens);
+     ComputeVerdict<LEVEL_ONE>(trie_level1_, expression_tokens, verdict,
+                               log_file);
+     ScanExpressionForAnomaly<LEVEL_ONE>("", expression, verdict, log_file,
+                                         "");
   }
   return 0;
 }
@@ -210,68 +400,236 @@ int TrainAndScanUtil::ScanExpression(const std::string& expression,
 template <Language G>
 int TrainAndScanUtil::ScanFile(const std::string& test_file,
     std::ostream& log_file) const {
-  // Test it on if statements from evaluation source file.a
-  ManagedTSTree ts_tree;
-  std::string source_file_contents;
+  // Source file is mapped (or read into a buffer that is reused across the
+  // files scanned by this thread) and parsed without copying.
+  thread_local MappedFile source_file;
   try {
-    ts_tree = GetTSTree<G>(test_file, source_file_contents);
+    source_file.Open(test_file);
   } catch (std::exception& e) {
     log_file << "Error:" << e.what() << " ... skipping" << std::endl;
     return 0;
   }
+  return ScanFile<G>(test_file, source_file.contents(), log_file);
+}
 
+template <Language G>
+int TrainAndScanUtil::ScanFile(const std::string& test_file,
+    std::string_view source_file_contents, std::ostream& log_file) const {
+  // Test it on if statements from evaluation source file.a
+  ManagedTSTree ts_tree;
   code_blocks_t code_blocks;
+  if (!ParseFile<G>(source_file_contents, ts_tree, code_blocks, log_file))
+    return 0;
+  return ScanCodeBlocks<G>(test_file, source_file_contents, code_blocks,
+                           log_file);
+}
+
+template <Language G>
+bool TrainAndScanUtil::ParseFile(std::string_view source_file_contents,
+    ManagedTSTree& ts_tree, code_blocks_t& code_blocks,
+    std::ostream& log_file) const {
+  try {
+    // We do not report parse errors at file-level. Source file may contain
+    // parse errors; what we look for is that control structures do not.
+    const bool kReportParseErrors = false;
+    ts_tree = GetTSTree<G>(source_file_contents, kReportParseErrors);
+  } catch (std::exception& e) {
+    log_file << "Error:" << e.what() << " ... skipping" << std::endl;
+    return false;
+  }
+
+  code_blocks.clear();
   CollectCodeBlocksOfInterest<G>(ts_tree, code_blocks);
+  return true;
+}
+
+void TrainAndScanUtil::ScanSummary::Add(const ScanSummary& other) {
+  num_total_expressions_ += other.num_total_expressions_;
+  num_expressions_found_ += other.num_expressions_found_;
+  num_expressions_not_found_ += other.num_expressions_not_found_;
+  level1_hit_ += other.level1_hit_;
+  level1_miss_ += other.level1_miss_;
+  level2_hit_ += other.level2_hit_;
+  level2_miss_ += other.level2_miss_;
+}
+
+template <Language G>
+int TrainAndScanUtil::ScanCodeBlocks(const std::string& test_file,
+    std::string_view source_file_contents, const code_blocks_t& code_blocks,
+    std::ostream& log_file) const {
+  const size_t code_blocks_per_task = std::max<size_t>(1,
+                                        scan_config_.code_blocks_per_task_);
+  const size_t num_tasks = (code_blocks.size() + code_blocks_per_task - 1) /
+                           code_blocks_per_task;
+  ScanSummary summary;
+  if (num_tasks <= 1) {
+    ScanCodeBlocks<G>(test_file, source_file_contents, code_blocks, 0,
+                      code_blocks.size(), summary, log_file);
+  } else {
+    // Tasks write to their own logs, which are merged in source order.
+    std::vector<std::string> task_logs(num_tasks);
+    std::vector<ScanSummary> task_summaries(num_tasks);
+    thread_pool_.ParallelFor(0, num_tasks, 1,
+                             [&](size_t begin_task, size_t end_task) {
+      for (size_t i = begin_task; i < end_task; i++) {
+        std::ostringstream task_log;
+        ScanCodeBlocks<G>(test_file, source_file_contents, code_blocks,
+                          i * code_blocks_per_task,
+                          (i + 1) * code_blocks_per_task,
+                          task_summaries[i], task_log);
+        task_logs[i] = task_log.str();
+      }
+    });
+    for (size_t i = 0; i < num_tasks; i++) {
+      log_file << task_logs[i];
+      summary.Add(task_summaries[i]);
+    }
+  }
+  ReportScanSummary(test_file, summary, log_file);
+  return 0;
+}
+
+template <Language G>
+void TrainAndScanUtil::ScanCodeBlocks(const std::string& test_file,
+    std::string_view source_file_contents, const code_blocks_t& code_blocks,
+    size_t begin, size_t end, ScanSummary& summary,
+    std::ostream& log_file, std::vector<ScanResult>* results) const {
+  // Both levels are abstracted in a single traversal of the code block.
+  thread_local MultiLevelAbstraction abstraction;
+  for (size_t i = begin; i < end && i < code_blocks.size(); i++) {
+    const code_block_t& code_block = code_blocks[i];
+    // Code blocks of the same shape have the same verdict, so we abstract
+    // and search only the first code block of every shape.
+    uint64_t code_block_hash = 0;
+    bool is_hashed = code_block_verdicts_.IsEnabled() &&
+                     HashCodeBlock<G>(code_block, code_block_hash);
+    std::shared_ptr<const CodeBlockVerdict> verdict;
+    if (is_hashed) verdict = code_block_verdicts_.LookUp(code_block_hash);
+    if (!verdict) {
+      auto new_verdict = std::make_shared<CodeBlockVerdict>();
+      MultiLevelAbstractor<G>::Abstract(code_block, abstraction);
+      ComputeVerdict<LEVEL_ONE>(trie_level1_, abstraction.level_one_tokens_,
+                                new_verdict->level_one_, log_file);
+      new_verdict->has_level_two_ = abstraction.has_level_two_;
+      if (abstraction.has_level_two_) {
+        ComputeVerdict<LEVEL_TWO>(trie_level2_, abstraction.level_two_tokens_,
+                                  new_verdict->level_two_, log_file);
+      }
+      if (is_hashed) code_block_verdicts_.Insert(code_block_hash, new_verdict);
+      verdict = std::move(new_verdict);
+    }
 
-  size_t num_expressions_found = 0;
-  size_t num_expressions_not_found = 0;
-  size_t num_total_expressions = 0;
-  size_t level1_hit = 0, level1_miss = 0;
-  size_t level2_hit = 0, level2_miss = 0;
-
-  for (auto code_block : code_blocks) {
-    bool is_level1_hit = ScanExpressionForAnomaly<LEVEL_ONE, G>(trie_level1_,
-                          source_file_contents, code_block, log_file,
-                          test_file);
-    bool is_level2_hit = ScanExpressionForAnomaly<LEVEL_TWO, G>(trie_level2_,
-                          source_file_contents, code_block, log_file,
-                          test_file);
+    bool is_level1_hit;
+    bool is_level2_hit;
+    if (results) {
+      AddScanResults(source_file_contents, code_block, verdict, *results);
+      is_level1_hit = verdict->level_one_.found_in_training_dataset_;
+      is_level2_hit = verdict->has_level_two_ &&
+                      verdict->level_two_.found_in_training_dataset_;
+    } else {
+      is_level1_hit = ScanExpressionForAnomaly<LEVEL_ONE>(
+                        source_file_contents, code_block,
+                        verdict->level_one_, log_file, test_file);
+      // Code blocks without level 2 abstraction are only scanned at level 1.
+      is_level2_hit = verdict->has_level_two_ &&
+                      ScanExpressionForAnomaly<LEVEL_TWO>(
+                        source_file_contents, code_block,
+                        verdict->level_two_, log_file, test_file);
+    }
     if (is_level1_hit) {
-      level1_hit++;
+      summary.level1_hit_++;
     } else {
-      level1_miss++;
+      summary.level1_miss_++;
     }
     if (is_level2_hit) {
-      level2_hit++;
+      summary.level2_hit_++;
     } else {
-      level2_miss++;
+      summary.level2_miss_++;
     }
     if (is_level1_hit || is_level2_hit) {
-      num_expressions_found++;
+      summary.num_expressions_found_++;
     } else {
-      num_expressions_not_found++;
+      summary.num_expressions_not_found_++;
     }
-    num_total_expressions++;
+    summary.num_total_expressions_++;
   }
+}
 
+void TrainAndScanUtil::AddScanResults(std::string_view source_file_contents,
+    const code_block_t& code_block,
+    const std::shared_ptr<const CodeBlockVerdict>& verdict,
+    std::vector<ScanResult>& results) const {
+  bool should_report_level_one = ShouldReport(LEVEL_ONE, verdict->level_one_);
+  bool should_report_level_two = verdict->has_level_two_ &&
+                                 ShouldReport(LEVEL_TWO, verdict->level_two_);
+  if (!should_report_level_one && !should_report_level_two) return;
+
+  TSPoint start = ts_node_start_point(code_block);
+  ScanResult result;
+  result.row_ = start.row;
+  result.column_ = start.column;
+  result.source_expression_ = OriginalSourceExpression(code_block,
+                                                       source_file_contents);
+  if (should_report_level_one) {
+    result.level_ = LEVEL_ONE;
+    result.verdict_ = std::make_shared<const ExpandedVerdict>(
+                        ExpandVerdict(LEVEL_ONE, verdict->level_one_));
+    result.is_potential_anomaly_ = IsReportedAnomaly(LEVEL_ONE,
+                                                     verdict->level_one_);
+    results.push_back(result);
+  }
+  if (should_report_level_two) {
+    result.level_ = LEVEL_TWO;
+    result.verdict_ = std::make_shared<const ExpandedVerdict>(
+                        ExpandVerdict(LEVEL_TWO, verdict->level_two_));
+    result.is_potential_anomaly_ = IsReportedAnomaly(LEVEL_TWO,
+                                                     verdict->level_two_);
+    results.push_back(std::move(result));
+  }
+}
+
+void TrainAndScanUtil::ReportScanSummary(const std::string& test_file,
+    const ScanSummary& summary, std::ostream& log_file) const {
   if (scan_config_.log_level_ >= LogLevel::DEBUG) {
     log_file  << "SUMMARY " << test_file
               << ":Total/Found/Not_found/L1_hit/L1_miss/L2_hit/L2_miss="
-              << num_total_expressions << ","
-              << num_expressions_found << ","
-              << num_expressions_not_found << ","
-              << level1_hit << "," << level1_miss << ","
-              << level2_hit << "," << level2_miss
-              << std::endl;
+              << summary.num_total_expressions_ << ","
+              << summary.num_expressions_found_ << ","
+              << summary.num_expressions_not_found_ << ","
+              << summary.level1_hit_ << "," << summary.level1_miss_ << ","
+              << summary.level2_hit_ << "," << summary.level2_miss_ << "\n";
   }
+}
 
-  return 0;
+TrainAndScanUtil::~TrainAndScanUtil() {
+  if (scan_config_.log_level_ < LogLevel::DEBUG)
+    return;
+
+  auto print_statistics = [](const std::string& level,
+                             const NearestExpressionsCache& cache) {
+    auto statistics = cache.GetStatistics();
+    std::cout << "ExpressionCache " << level << " statistics: "
+              << "hit/miss/eviction="
+              << statistics.hits_ << "/" << statistics.misses_ << "/"
+              << statistics.evictions_
+              << " deduplicated_searches=" << statistics.deduplicated_searches_
+              << " entries=" << statistics.num_entries_
+              << " memory=" << statistics.memory_used_ << "B" << std::endl;
+  };
+  print_statistics(LevelToString<LEVEL_ONE>(), expression_cache_level1_);
+  print_statistics(LevelToString<LEVEL_TWO>(), expression_cache_level2_);
+
+  auto verdict_statistics = code_block_verdicts_.GetStatistics();
+  std::cout << "CodeBlockVerdicts statistics: hit/miss="
+            << verdict_statistics.hits_ << "/" << verdict_statistics.misses_
+            << " entries=" << verdict_statistics.num_entries_ << std::endl;
 }
 
 int TrainAndScanUtil::ReadTrainingDatasetFromFile(
       const std::string& train_dataset,
       std::ostream& log_file) {
   log_file << "Training: start." << std::endl;
+  SeedVocabulary(scan_config_.language_);
 
   timer_trie_build_level1_.StartTimer();
   trie_level1_.Build<LEVEL_ONE>(train_dataset);
@@ -285,6 +643,47 @@ int TrainAndScanUtil::ReadTrainingDatasetFromFile(
   log_file << "Trie L2 build took: "
             << timer_trie_build_level2_.TimerDiff() << "s" << std::endl;
 
+  // Scanner threads only look up the vocabulary of the training dataset, so
+  // we make lookups lock-free.
+  ExpressionCompacter::Get().Freeze();
   log_file << "Training: complete." << std::endl;
   return 0;
 }
+
+void TrainAndScanUtil::OpenPersistentCache(const std::string& cache_file,
+                                           std::ostream& log_file) {
+  PersistentExpressionCache::Config config;
+  config.model_fingerprint_ = trie_level1_.GetModelFingerprint();
+  config.vocabulary_size_ = ExpressionCompacter::Get().GetVocabularySize();
+  config.max_cost_ = static_cast<uint32_t>(scan_config_.max_cost_);
+  config.max_autocorrections_ =
+    static_cast<uint32_t>(scan_config_.max_autocorrections_);
+  persistent_cache_.reset(new PersistentExpressionCache(cache_file, config,
+                            scan_config_.persistent_cache_max_size_));
+
+  switch (persistent_cache_->GetLoadStatus()) {
+    case PersistentExpressionCache::LoadStatus::LOADED:
+      log_file << "Persistent cache: loaded "
+               << persistent_cache_->GetNumLoadedEntries()
+               << " entries from " << cache_file << std::endl;
+      break;
+    case PersistentExpressionCache::LoadStatus::NOT_FOUND:
+      log_file << "Persistent cache: " << cache_file
+               << " not found, will be created" << std::endl;
+      break;
+    case PersistentExpressionCache::LoadStatus::INVALIDATED:
+      log_file << "Persistent cache: " << cache_file << " was created for "
+               << "another training dataset or config, will be overwritten"
+               << std::endl;
+      break;
+  }
+}
+
+void TrainAndScanUtil::ClosePersistentCache(std::ostream& log_file) {
+  if (!persistent_cache_) return;
+  size_t num_recorded_entries = persistent_cache_->GetNumRecordedEntries();
+  size_t num_entries = persistent_cache_->Save();
+  log_file << "Persistent cache: stored " << num_entries << " entries ("
+           << num_recorded_entries << " new)" << std::endl;
+  persistent_cache_.reset();
+}
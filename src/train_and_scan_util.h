@@ -23,15 +23,19 @@
 
 #include <tree_sitter/api.h>
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <string>
-#include <atomic>
-#include <shared_mutex>
-#include <mutex>  // NOLINT [build/c++11]
-#include <unordered_map>
+#include <string_view>
+#include <vector>
 
 #include "trie.h"
 #include "common_util.h"
+#include "expression_cache.h"
+#include "persistent_expression_cache.h"
+#include "thread_pool.h"
+#include "verdict_table.h"
 
 //----------------------------------------------------------------------------
 // Class that provides Train and Scan functions of ControlFlag system
@@ -49,40 +53,235 @@ class TrainAndScanUtil {
     size_t max_cost_ = 2;
     TreeLevel max_level_ = LEVEL_MAX;
     size_t max_autocorrections_ = 5;
+    /// Number of worker threads that scan files and search for nearest
+    /// expressions.
     size_t num_threads_ = 1;
     float anomaly_threshold_ = 3;
     LogLevel log_level_ = LogLevel::ERROR;
+    /// Memory budget (in bytes) of expression caches of all levels.
+    size_t cache_memory_budget_ = 512 * 1024 * 1024;
+    /// Maximum size (in bytes) of the persistent cache file. Least recently
+    /// used entries are dropped when the file is saved.
+    size_t persistent_cache_max_size_ =
+      PersistentExpressionCache::kDefaultMaxFileSize;
+    /// Language of the source files to scan.
+    Language language_ = LANGUAGE_C;
+    /// Maximum number of code block shapes whose verdicts are remembered
+    /// during a scan. 0 disables reusing verdicts.
+    size_t max_code_block_verdicts_ = 64 * 1024;
+    /// Code blocks of a file are scanned in tasks of at most this many code
+    /// blocks, which run in parallel on the thread pool.
+    size_t code_blocks_per_task_ = 256;
+    /// Report only potential anomalies. Code blocks that are okay are only
+    /// counted: their source is neither extracted nor formatted.
+    bool anomalies_only_ = false;
+  };
+
+  /// Counts of the code blocks scanned by ScanCodeBlocks.
+  struct ScanSummary {
+    size_t num_total_expressions_ = 0;
+    size_t num_expressions_found_ = 0;
+    size_t num_expressions_not_found_ = 0;
+    size_t level1_hit_ = 0;
+    size_t level1_miss_ = 0;
+    size_t level2_hit_ = 0;
+    size_t level2_miss_ = 0;
+
+    void Add(const ScanSummary& other);
+  };
+
+  /// Result of scanning the level L abstraction of a code block. It depends
+  /// only on the abstraction, and not on where the code block is. Most code
+  /// blocks are not reported, so the verdict is kept in compact form: tokens
+  /// of the abstraction and compact nearest expressions. It is expanded (see
+  /// ExpandVerdict) only when it is reported.
+  struct ExpressionVerdict {
+    TokenSequence expression_tokens_;
+    bool found_in_training_dataset_ = false;
+    bool is_potential_anomaly_ = false;
+    CompactNearestExpressions compact_nearest_expressions_;
+  };
+
+  /// Expanded form of ExpressionVerdict, as reported.
+  struct ExpandedVerdict {
+    std::string expression_;
+    bool found_in_training_dataset_ = false;
+    NearestExpressions nearest_expressions_;
+  };
+
+  /// Result of scanning the level level_ abstraction of a code block, for
+  /// callers that report results in a structured form (see ResultSink).
+  struct ScanResult {
+    TreeLevel level_ = LEVEL_ONE;
+    /// Position (0-based) of the code block in the source file.
+    size_t row_ = 0;
+    size_t column_ = 0;
+    std::string source_expression_;
+    /// See IsReportedAnomaly.
+    bool is_potential_anomaly_ = false;
+    std::shared_ptr<const ExpandedVerdict> verdict_;
   };
 
   friend class NearestExpressionCache;
 
-  explicit TrainAndScanUtil(const ScanConfig& config) : scan_config_(config) {}
+  explicit TrainAndScanUtil(const ScanConfig& config) : scan_config_(config),
+    expression_cache_level1_(config.cache_memory_budget_ / 2),
+    expression_cache_level2_(config.cache_memory_budget_ / 2),
+    code_block_verdicts_(config.max_code_block_verdicts_),
+    thread_pool_(std::max<size_t>(1, config.num_threads_)) {}
+  ~TrainAndScanUtil();
 
   int ReadTrainingDatasetFromFile(const std::string& train_dataset,
                                   std::ostream& log_file);
+  /// Use nearest expressions stored in cache_file by earlier scans, and
+  /// store the newly computed ones in it at ClosePersistentCache. Must be
+  /// called after ReadTrainingDatasetFromFile.
+  void OpenPersistentCache(const std::string& cache_file,
+                           std::ostream& log_file);
+  void ClosePersistentCache(std::ostream& log_file);
+
+  /// Scan a file. Code blocks of a big file are split into tasks that run in
+  /// parallel; their reports are written to log_file in source order, so
+  /// the report does not depend on the number of threads.
   template <Language G>
   int ScanFile(const std::string& test_file, std::ostream& log_file) const;
+  /// Same as above, but scan source_file_contents, the contents of test_file
+  /// that the caller loaded already (e.g., using FilePrefetcher).
+  template <Language G>
+  int ScanFile(const std::string& test_file,
+               std::string_view source_file_contents,
+               std::ostream& log_file) const;
+  /// Steps of ScanFile, for callers that run them separately (e.g., as
+  /// stages of a pipeline). ParseFile parses source_file_contents and
+  /// collects its code blocks; it returns false, after logging the error, if
+  /// the file cannot be parsed. ScanCodeBlocks scans the code blocks, which
+  /// need ts_tree and source_file_contents to be alive.
+  template <Language G>
+  bool ParseFile(std::string_view source_file_contents,
+                 ManagedTSTree& ts_tree, code_blocks_t& code_blocks,
+                 std::ostream& log_file) const;
+  template <Language G>
+  int ScanCodeBlocks(const std::string& test_file,
+                     std::string_view source_file_contents,
+                     const code_blocks_t& code_blocks,
+                     std::ostream& log_file) const;
+  /// Scan code_blocks[begin, end) only and add their counts to summary, so
+  /// that code blocks of a big file can be scanned in separate tasks. Once
+  /// all the code blocks are scanned, ReportScanSummary reports the sum.
+  /// If results is not null, results of the code blocks are appended to it
+  /// instead of being reported on log_file.
+  template <Language G>
+  void ScanCodeBlocks(const std::string& test_file,
+                      std::string_view source_file_contents,
+                      const code_blocks_t& code_blocks,
+                      size_t begin, size_t end, ScanSummary& summary,
+                      std::ostream& log_file,
+                      std::vector<ScanResult>* results = nullptr) const;
+  void ReportScanSummary(const std::string& test_file,
+                         const ScanSummary& summary,
+                         std::ostream& log_file) const;
+
   template <Language G>
   int ScanExpression(const std::string& expression,
                      std::ostream& log_file) const;
 
+  /// Same as ComputeVerdict for many level L expressions at once, for
+  /// callers that collect the expressions of many files before scanning
+  /// them. Expressions that are not in the caches are searched in batches
+  /// (see Trie::SearchNearestExpressionsInBatch) that run in parallel on the
+  /// thread pool. Every expression is searched once, so expressions should
+  /// be unique.
+  template <TreeLevel L>
+  void ComputeVerdicts(const std::vector<TokenSequence>& expressions,
+                       std::vector<ExpressionVerdict>& verdicts) const;
+  /// Report verdict of a level L expression found at location (see
+  /// FormatSourceLocation). Returns true if the expression is found in the
+  /// training dataset.
+  template <TreeLevel L>
+  bool ReportVerdict(const ExpressionVerdict& verdict,
+                     std::string_view location, std::ostream& log_file) const;
+  /// Expand verdict of a level level expression for reporting it.
+  ExpandedVerdict ExpandVerdict(TreeLevel level,
+                                const ExpressionVerdict& verdict) const;
+  /// Whether the level level verdict is reported as a potential anomaly.
+  /// Expressions missing from the training data at LEVEL_ONE are not
+  /// reported as anomaly if they are not missing at LEVEL_TWO.
+  static bool IsReportedAnomaly(TreeLevel level,
+                                const ExpressionVerdict& verdict) {
+    return (level == LEVEL_ONE && verdict.found_in_training_dataset_ &&
+            verdict.is_potential_anomaly_) ||
+           (level == LEVEL_TWO && verdict.is_potential_anomaly_);
+  }
+  /// Whether the level level verdict is reported at all: every verdict is,
+  /// unless ScanConfig::anomalies_only_ is set. Callers check it before
+  /// formatting the location of the code block and expanding the verdict.
+  bool ShouldReport(TreeLevel level, const ExpressionVerdict& verdict) const {
+    return !scan_config_.anomalies_only_ || IsReportedAnomaly(level, verdict);
+  }
+  /// Location of code_block as reported in scan reports, or "" if test_file
+  /// or source_file_contents is empty.
+  static std::string FormatSourceLocation(const std::string& test_file,
+                                          std::string_view source_file_contents,
+                                          const code_block_t& code_block);
+  /// Same as above for a code block at (row, column) whose source is
+  /// source_expression.
+  static std::string FormatSourceLocation(const std::string& test_file,
+                                          size_t row, size_t column,
+                                          const std::string& source_expression);
+
+  /// Pool of scan_config_.num_threads_ workers used for searching nearest
+  /// expressions. Callers scanning many files run their scans on it too, so
+  /// that scans and searches share the same threads.
+  ThreadPool& GetThreadPool() const { return thread_pool_; }
+  const ScanConfig& GetScanConfig() const { return scan_config_; }
+
  private:
-  template <TreeLevel L, Language G>
-  void ReportPossibleCorrections(const Trie& trie,
-      const std::string& code_block_str, bool found_in_training_dataset,
-      std::ostream& log_file) const;
+  struct CodeBlockVerdict {
+    ExpressionVerdict level_one_;
+    ExpressionVerdict level_two_;
+    bool has_level_two_ = false;
+  };
 
-  template <TreeLevel L, Language G>
-  bool ScanExpressionForAnomaly(const Trie& trie,
-      const code_block_t& code_block,
-      std::ostream& log_file) const;
+  /// Look up expression_tokens, the tokens of a level L abstraction, in the
+  /// trie and search for its nearest expressions.
+  template <TreeLevel L>
+  void ComputeVerdict(const Trie& trie, const TokenSequence& expression_tokens,
+      ExpressionVerdict& verdict, std::ostream& log_file) const;
+  /// Turn nearest_expressions found by a search for expression into the
+  /// reported ones: add expression itself if it is not in the training
+  /// dataset, rank them and keep the best max_autocorrections_ of them.
+  /// Their compact form is stored in compact_nearest_expressions.
+  void RankNearestExpressions(const Trie& trie, const std::string& expression,
+      bool found_in_training_dataset, NearestExpressions& nearest_expressions,
+      CompactNearestExpressions& compact_nearest_expressions) const;
 
-  template <TreeLevel L, Language G>
-  bool ScanExpressionForAnomaly(const Trie& trie,
-      const std::string& source_file_contents,
-      const code_block_t& code_block,
+  /// Report verdict of the level L abstraction of code_block. Returns true
+  /// if the expression is found in the training dataset.
+  template <TreeLevel L>
+  bool ScanExpressionForAnomaly(std::string_view source_file_contents,
+      const code_block_t& code_block, const ExpressionVerdict& verdict,
       std::ostream& log_file, const std::string& test_file) const;
 
+  /// Append results of both levels of code_block that are reported (see
+  /// ShouldReport) to results.
+  void AddScanResults(std::string_view source_file_contents,
+      const code_block_t& code_block,
+      const std::shared_ptr<const CodeBlockVerdict>& verdict,
+      std::vector<ScanResult>& results) const;
+
+  // We maintain different expression cache per level since
+  // there is no sharing of expressions between different
+  // trie levels.
+  template <TreeLevel L>
+  NearestExpressionsCache& GetExpressionCache() const {
+    return L == LEVEL_ONE ? expression_cache_level1_ :
+                            expression_cache_level2_;
+  }
+  template <TreeLevel L>
+  const Trie& GetTrie() const {
+    return L == LEVEL_ONE ? trie_level1_ : trie_level2_;
+  }
+
  private:
   Trie trie_level1_;
   Trie trie_level2_;
@@ -90,52 +289,18 @@ class TrainAndScanUtil {
   Timer timer_trie_build_level2_;
 
   ScanConfig scan_config_;
-};
 
-/// Cache nearest expressions for a given expression so that we
-/// minimize computing nearest expressions over trie for every
-/// given expression. Cache is shared by all the scanner threads.
-template <TreeLevel L>
-class NearestExpressionsCache {
- public:
-    bool LookUp(const NearestExpression::Expression& code_block,
-                NearestExpressions& nearest_expressions) {
-      // shared lock for concurrent reads
-      std::shared_lock lock(mutex_);
-      const auto iter = cache_.find(code_block);
-      if (iter == cache_.end()) {
-        miss_++;
-        return false;
-      } else {
-        nearest_expressions = iter->second;
-        hit_++;
-        return true;
-      }
-    }
-
-    void Insert(const NearestExpression::Expression& code_block,
-                NearestExpressions& nearest_expressions) {
-      // unique lock for writing
-      std::unique_lock lock(mutex_);
-      cache_[code_block] = nearest_expressions;
-    }
-
-    explicit NearestExpressionsCache(
-      const TrainAndScanUtil::ScanConfig& scan_config) :
-      hit_(0), miss_(0), log_level_(scan_config.log_level_) {}
-    ~NearestExpressionsCache() {
-      if (log_level_ == TrainAndScanUtil::LogLevel::DEBUG)
-        std::cout << "ExpressionCache statistics: hit/miss="
-                  << hit_.load() << "/" << miss_.load() << std::endl;
-    }
-
- private:
-    std::shared_mutex mutex_;
-    std::unordered_map<NearestExpression::Expression,
-                       NearestExpressions> cache_;
-    std::atomic<size_t> hit_;
-    std::atomic<size_t> miss_;
-    TrainAndScanUtil::LogLevel log_level_;
+  /// Caches are shared by all the scanner threads.
+  mutable NearestExpressionsCache expression_cache_level1_;
+  mutable NearestExpressionsCache expression_cache_level2_;
+  /// On-disk cache shared across scans. Consulted on misses in the
+  /// in-memory caches.
+  std::unique_ptr<PersistentExpressionCache> persistent_cache_;
+  /// Verdicts of the code blocks scanned so far, keyed by their shapes.
+  mutable VerdictTable<CodeBlockVerdict> code_block_verdicts_;
+  /// Declared last so that the workers stop before the state they use is
+  /// destroyed.
+  mutable ThreadPool thread_pool_;
 };
 
 #endif  // SRC_TRAIN_AND_SCAN_UTIL_H_
@@ -18,62 +18,168 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <cstdlib>
+#include <string>
+#include <utility>
+
 #include "tree_abstraction.h"
 
 // Convert binary_expression into be. Convert identifier into id.
-std::string ExpressionCompacter::GetID(
-    const ExpressionCompacter::Token& token) {
+ExpressionCompacter::ID ExpressionCompacter::GetID(std::string_view token) {
+  if (IsFrozen()) {
+    ID id = LookUpFrozenID(token);
+    if (id != kInvalidID) return id;
+
+    // Unseen tokens are rare and repeat within a scan, so every thread
+    // remembers the ones it has already seen to avoid taking the lock again.
+    thread_local std::unordered_map<Token, ID> overflow_token_id_map;
+    Token token_string(token);
+    auto it = overflow_token_id_map.find(token_string);
+    if (it != overflow_token_id_map.end()) return it->second;
+    id = GetIDLocked(token);
+    overflow_token_id_map[token_string] = id;
+    return id;
+  }
+  return GetIDLocked(token);
+}
+
+ExpressionCompacter::ID ExpressionCompacter::GetIDLocked(
+    std::string_view token) {
   std::unique_lock lock(mutex_);
 
-  const auto it = token_id_map_.find(token);
-  std::string id = "";
-  if (it == token_id_map_.end()) {
-    token_id_map_[token] = current_id_.load();
-    id_token_map_[current_id_.load()] = token;
-    id = IDToString(current_id_);
-    ++current_id_;
-  } else {
-    id = IDToString(it->second);
+  // Vocabulary may have been frozen while we were waiting for the lock.
+  if (IsFrozen()) {
+    ID id = LookUpFrozenID(token);
+    if (id != kInvalidID) return id;
   }
 
+  Token token_string(token);
+  const auto it = token_id_map_.find(token_string);
+  if (it != token_id_map_.end()) return it->second;
+
+  ID id = current_id_.load();
+  token_id_map_[token_string] = id;
+  id_token_map_[id] = token_string;
+  ++current_id_;
   return id;
 }
 
-std::string ExpressionCompacter::GetToken(const std::string& id_string) {
-  std::unique_lock lock(mutex_);
+void ExpressionCompacter::AppendToken(ID id, std::string& result) {
+  if (IsFrozen()) {
+    if (id < frozen_tokens_.size()) {
+      result += frozen_tokens_[id];
+      return;
+    }
+
+    thread_local std::unordered_map<ID, Token> overflow_id_token_map;
+    auto it = overflow_id_token_map.find(id);
+    if (it == overflow_id_token_map.end()) {
+      it = overflow_id_token_map.emplace(id, GetTokenLocked(id)).first;
+    }
+    result += it->second;
+    return;
+  }
+  result += GetTokenLocked(id);
+}
+
+ExpressionCompacter::Token ExpressionCompacter::GetTokenLocked(ID id) {
+  std::shared_lock lock(mutex_);
 
-  ID id = StringToID(id_string);
+  if (IsFrozen() && id < frozen_tokens_.size()) return frozen_tokens_[id];
   auto it = id_token_map_.find(id);
   cf_assert(it != id_token_map_.end(),
-            "ExpressionCompactor:Missing ID" + id_string);
+            "ExpressionCompactor:Missing ID" + std::to_string(id));
   return it->second;
 }
 
+void ExpressionCompacter::Freeze() {
+  std::unique_lock lock(mutex_);
+  if (IsFrozen()) return;
+
+  const size_t num_tokens = current_id_.load();
+  frozen_tokens_.resize(num_tokens);
+  for (auto& id_token : id_token_map_) {
+    frozen_tokens_[id_token.first] = std::move(id_token.second);
+  }
+
+  // Keeping the table at most half full keeps probe sequences short.
+  size_t capacity = 16;
+  while (capacity < 2 * num_tokens) capacity *= 2;
+  frozen_table_.assign(capacity, FrozenSlot{0, kInvalidID});
+  for (ID id = 0; id < num_tokens; id++) {
+    const Token& token = frozen_tokens_[id];
+    uint64_t hash = HashBytes(token.data(), token.length());
+    size_t slot = hash & (capacity - 1);
+    while (frozen_table_[slot].id_ != kInvalidID)
+      slot = (slot + 1) & (capacity - 1);
+    frozen_table_[slot] = FrozenSlot{hash, id};
+  }
+
+  // From now on the maps only hold the tokens seen after freezing.
+  token_id_map_.clear();
+  id_token_map_.clear();
+  is_frozen_.store(true, std::memory_order_release);
+}
+
+ExpressionCompacter::ID ExpressionCompacter::LookUpFrozenID(
+    std::string_view token) const {
+  const size_t mask = frozen_table_.size() - 1;
+  uint64_t hash = HashBytes(token.data(), token.length());
+  for (size_t slot = hash & mask; frozen_table_[slot].id_ != kInvalidID;
+       slot = (slot + 1) & mask) {
+    const FrozenSlot& frozen_slot = frozen_table_[slot];
+    if (frozen_slot.hash_ == hash && frozen_tokens_[frozen_slot.id_] == token)
+      return frozen_slot.id_;
+  }
+  return kInvalidID;
+}
+
+// Convert an expression such as
+// "(parenthesized_expression (binary_expression ("%") (non_terminal_expression)
+// (number_literal)))" into a sequence of token IDs, in which every word and
+// every other character is a token.
+void ExpressionCompacter::AppendCompacted(std::string_view source,
+                                          TokenSequence& tokens) {
+  for (size_t i = 0; i < source.length();) {
+    if (IsWordChar(source[i])) {
+      size_t token_begin = i;
+      while (i < source.length() && IsWordChar(source[i])) i++;
+      ID id = GetID(source.substr(token_begin, i - token_begin));
+      tokens.push_back(static_cast<TokenID>(kNumReservedIDs + id));
+    } else {
+      tokens.push_back(static_cast<unsigned char>(source[i]));
+      i++;
+    }
+  }
+}
+
+void ExpressionCompacter::Expand(const TokenID* tokens, size_t num_tokens,
+                                 std::string& result) {
+  for (size_t i = 0; i < num_tokens; i++) {
+    if (IsWordTokenID(tokens[i])) {
+      AppendToken(GetWordIndex(tokens[i]), result);
+    } else {
+      result += static_cast<char>(tokens[i]);
+    }
+  }
+}
+
 // Convert an expression such as
 // "(parenthesized_expression (binary_expression ("%") (non_terminal_expression)
 // (number_literal)))" into "(ID (ID ("%") (ID) (ID))): by shortening words
 // and multi-words.
 std::string ExpressionCompacter::Compact(const std::string& source) {
-  std::string result;
+  thread_local TokenSequence tokens;
+  Compact(source, tokens);
 
-  Token token = "";
-  for (size_t i = 0; i < source.length(); i++) {
-    char c = source[i];
-    if (std::isalnum(c) || c == '_') {
-      token += c;
-    } else if (token.length() > 0) {
-      // If c marks the end of a token, then process the token.
-      result += GetID(token);
-      token = "";  // reset token
-      result += c;
+  std::string result;
+  for (TokenID token : tokens) {
+    if (IsWordTokenID(token)) {
+      result += std::to_string(GetWordIndex(token));
     } else {
-      result += c;
+      result += static_cast<char>(token);
     }
   }
-
-  if (token.length() > 0)
-    result += GetID(token);
-
   return result;
 }
 
@@ -82,22 +188,96 @@ std::string ExpressionCompacter::Compact(const std::string& source) {
 std::string ExpressionCompacter::Expand(const std::string& source) {
   std::string result;
 
-  std::string id = "";
-  for (size_t i = 0; i < source.length(); i++) {
-    char c = source[i];
-    if (std::isdigit(c)) {
-      id += c;
-    } else if (id.length() > 0) {
+  ID id = 0;
+  bool in_id = false;
+  for (char c : source) {
+    if (std::isdigit(static_cast<unsigned char>(c))) {
+      id = id * 10 + (c - '0');
+      in_id = true;
+    } else {
       // if c marks an end of an ID, then map ID back into token.
-      result += GetToken(id);
-      id = "";  // reset ID
+      if (in_id) AppendToken(id, result);
+      id = 0;
+      in_id = false;
       result += c;  // copy c to output.
-    } else {
-      result += c;  // otherwise, just copy c to output.
     }
   }
 
-  if (id.length() > 0)
-    result += GetToken(id);
+  if (in_id)
+    AppendToken(id, result);
   return result;
 }
+
+//----------------------------------------------------------------------------
+SymbolVocabulary::SymbolVocabulary(const TSLanguage* language) {
+  ExpressionCompacter& compacter = ExpressionCompacter::Get();
+  const uint32_t num_symbols = ts_language_symbol_count(language);
+
+  // Symbol names come first so that their IDs follow symbol order.
+  name_offsets_.push_back(0);
+  for (TSSymbol symbol = 0; symbol < num_symbols; symbol++) {
+    compacter.AppendCompacted(ts_language_symbol_name(language, symbol),
+                              name_tokens_);
+    name_offsets_.push_back(static_cast<uint32_t>(name_tokens_.size()));
+  }
+
+  // Field names are printed by ts_node_string, and markers are used by
+  // abstraction.
+  const uint32_t num_fields = ts_language_field_count(language);
+  TokenSequence tokens;
+  for (TSFieldId field_id = 1; field_id <= num_fields; field_id++) {
+    const char* field_name = ts_language_field_name_for_id(language,
+                                                           field_id);
+    if (field_name != nullptr)
+      compacter.Compact(field_name, tokens);
+  }
+  const char* kMarkers[] = {"non_terminal_expression", "ERROR", "MISSING"};
+  for (const char* marker : kMarkers) {
+    compacter.Compact(marker, tokens);
+  }
+
+  quoted_name_offsets_.push_back(0);
+  for (TSSymbol symbol = 0; symbol < num_symbols; symbol++) {
+    const std::string name = ts_language_symbol_name(language, symbol);
+    compacter.AppendCompacted("(\"" + name + "\")", quoted_name_tokens_);
+    quoted_name_offsets_.push_back(
+      static_cast<uint32_t>(quoted_name_tokens_.size()));
+  }
+
+  const std::string kOperator = "operator";
+  operator_field_id_ = ts_language_field_id_for_name(language,
+                         kOperator.c_str(), kOperator.length());
+}
+
+void SymbolVocabulary::AppendNodeType(const TSNode& node,
+                                      TokenSequence& tokens) const {
+  TSSymbol symbol = ts_node_symbol(node);
+  if (static_cast<size_t>(symbol) + 1 < name_offsets_.size()) {
+    AppendRange(name_tokens_, name_offsets_[symbol], name_offsets_[symbol + 1],
+                tokens);
+  } else {
+    // Built-in symbols such as ERROR are not counted in the language.
+    ExpressionCompacter::Get().AppendCompacted(ts_node_type(node), tokens);
+  }
+}
+
+void SymbolVocabulary::AppendOperator(const TSNode& node,
+                                      TokenSequence& tokens) const {
+  if (operator_field_id_ == 0) return;
+  TSNode op = ts_node_child_by_field_id(node, operator_field_id_);
+  if (ts_node_is_null(op)) return;
+
+  TSSymbol symbol = ts_node_symbol(op);
+  if (!ts_node_is_named(op) && !ts_node_is_missing(op) &&
+      ts_node_child_count(op) == 0 &&
+      static_cast<size_t>(symbol) + 1 < quoted_name_offsets_.size()) {
+    // ts_node_string prints an anonymous leaf node as ("name").
+    AppendRange(quoted_name_tokens_, quoted_name_offsets_[symbol],
+                quoted_name_offsets_[symbol + 1], tokens);
+  } else {
+    char* node_string = ts_node_string(op);
+    ExpressionCompacter::Get().AppendCompacted(node_string, tokens);
+    free(node_string);
+  }
+  tokens.push_back(' ');
+}
@@ -24,18 +24,17 @@
 #include <tree_sitter/api.h>
 
 #include <atomic>
+#include <cctype>
+#include <cstdint>
 #include <mutex>  // NOLINT [build/c++11]
 #include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
-#include <regex> // NOLINT [build/c++11]
 
 #include "common_util.h"
 
-// Forward decl
-bool IsCommentNode(const TSNode& node);
-
 enum TreeLevel {
   LEVEL_MIN = 0,   // Basic Tree-sitter print
   LEVEL_ONE = 1,   // Same as MAX level. Diff is printing operators also.
@@ -75,15 +74,64 @@ template <> inline std::string LevelToString<LEVEL_MAX>() { return "MAX"; }
 //
 // We want to have single expression shortening scheme for training and
 // inference.
+// Compacted expression as a sequence of token IDs. Single non-word characters
+// (such as parentheses, spaces and operators) are their own IDs (below
+// ExpressionCompacter::kNumReservedIDs), while words get IDs above that.
+using TokenID = uint32_t;
+using TokenSequence = std::vector<TokenID>;
+
 class ExpressionCompacter {
  public:
-  // Compact a full expression by mapping words into IDs
+  // Number of IDs reserved for single non-word characters.
+  static const TokenID kNumReservedIDs = 256;
+
+  // Compact a full expression by mapping words into IDs. Tokens are written
+  // into the caller-supplied buffer, which is cleared first.
+  void Compact(const std::string& source, TokenSequence& tokens) {
+    tokens.clear();
+    AppendCompacted(source, tokens);
+  }
+  // Same as Compact, but appends tokens to the buffer.
+  void AppendCompacted(std::string_view source, TokenSequence& tokens);
+
+  // Opposite of Compact - convert token IDs back into original string. The
+  // string is appended to result.
+  void Expand(const TokenID* tokens, size_t num_tokens, std::string& result);
+  std::string Expand(const TokenSequence& tokens) {
+    std::string result;
+    Expand(tokens.data(), tokens.size(), result);
+    return result;
+  }
+
+  // Compact a full expression into a string in which words are replaced by
+  // their indices in decimal, such as "(1 (0) (0))". Prefer the token
+  // sequence version, which does not need to encode and parse the indices.
   std::string Compact(const std::string& source);
 
   // Opposite of Compact - convert IDs back into original strings
   // Input would be a shortened expression like: (1 (0) (0))
   std::string Expand(const std::string& source);
 
+  // Freeze the vocabulary seen so far (i.e., after training) into an
+  // immutable hash table, after which Compact and Expand look up known tokens
+  // without taking any lock. Tokens seen after freezing are assigned IDs
+  // through a slower overflow path. Freezing again is a no-op.
+  void Freeze();
+  bool IsFrozen() const { return is_frozen_.load(std::memory_order_acquire); }
+
+  // Number of words seen so far. Words are assigned indices in the order they
+  // are seen, so indices less than the vocabulary size right after training
+  // are the same across runs over the same training dataset.
+  size_t GetVocabularySize() const { return current_id_.load(); }
+
+  static bool IsWordTokenID(TokenID token_id) {
+    return token_id >= kNumReservedIDs;
+  }
+  // Index of the word with the specified token ID.
+  static size_t GetWordIndex(TokenID token_id) {
+    return token_id - kNumReservedIDs;
+  }
+
   // Singleton - we want to have a common shortening scheme across training and
   // multi-threaded inference.
   static ExpressionCompacter& Get() {
@@ -95,25 +143,135 @@ class ExpressionCompacter {
   ExpressionCompacter() : current_id_(0) {}
 
   using Token = std::string;
+  // Index of a word in the vocabulary
   using ID = size_t;
 
-  inline std::string IDToString(ID id) const { return std::to_string(id); }
-  inline ID StringToID(const std::string& id) const { return std::stoul(id); }
+  static bool IsWordChar(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  }
 
-  // Get ID in string format corresponding to token.
-  std::string GetID(const Token& token);
-  // Get token in string format corresponding to ID given in string format.
-  std::string GetToken(const std::string& id_string);
+  // Get index of a word, adding it to the vocabulary if it is new.
+  ID GetID(std::string_view token);
+  // Append word with the specified index to result.
+  void AppendToken(ID id, std::string& result);
+
+  // Slow paths of GetID and AppendToken that take mutex_. After freezing,
+  // they are used only for tokens that are not in the frozen vocabulary.
+  ID GetIDLocked(std::string_view token);
+  Token GetTokenLocked(ID id);
+
+  // Slot of the frozen hash table. Slots are never modified after freezing.
+  struct FrozenSlot {
+    uint64_t hash_;
+    ID id_;
+  };
+  static const ID kInvalidID = static_cast<ID>(-1);
+  // Returns kInvalidID if token is not in the frozen vocabulary.
+  ID LookUpFrozenID(std::string_view token) const;
 
   std::shared_mutex mutex_;
   std::atomic<ID> current_id_;
+  // Vocabulary before freezing and overflow vocabulary after freezing.
   std::unordered_map<Token, ID> token_id_map_;
   std::unordered_map<ID, Token> id_token_map_;
+
+  // Frozen vocabulary: open-addressing table (with linear probing) kept at
+  // most half full, and tokens indexed by their IDs.
+  std::atomic<bool> is_frozen_{false};
+  std::vector<FrozenSlot> frozen_table_;
+  std::vector<Token> frozen_tokens_;
 };
 
+//----------------------------------------------------------------------------
+// Token IDs of the symbols (node types) of a tree-sitter language.
+//
+// Constructing the vocabulary of a language adds the names of all its
+// symbols and fields, and the markers used by abstraction, to
+// ExpressionCompacter in symbol order. Doing so before training makes the IDs
+// of all the words generated by abstraction known at startup and independent
+// of the training dataset. It also lets abstraction emit the tokens of a node
+// from its ts_node_symbol() without building and hashing strings.
+class SymbolVocabulary {
+ public:
+  explicit SymbolVocabulary(const TSLanguage* language);
+  SymbolVocabulary(const SymbolVocabulary&) = delete;
+  SymbolVocabulary& operator=(const SymbolVocabulary&) = delete;
+
+  template <Language G>
+  static const SymbolVocabulary& Get() {
+    static SymbolVocabulary vocabulary(GetTSLanguage<G>());
+    return vocabulary;
+  }
+
+  // Append tokens of ts_node_type(node).
+  void AppendNodeType(const TSNode& node, TokenSequence& tokens) const;
+  // Append tokens of AppendOperatorString(node).
+  void AppendOperator(const TSNode& node, TokenSequence& tokens) const;
+
+ private:
+  static void AppendRange(const TokenSequence& source, uint32_t begin,
+                          uint32_t end, TokenSequence& tokens) {
+    tokens.insert(tokens.end(), source.begin() + begin, source.begin() + end);
+  }
+
+  // Tokens of name of symbol i are in
+  // [name_offsets_[i], name_offsets_[i + 1]) of name_tokens_, and tokens of
+  // ("name") (i.e., how an anonymous node is printed by ts_node_string) are
+  // in [quoted_name_offsets_[i], quoted_name_offsets_[i + 1]) of
+  // quoted_name_tokens_.
+  TokenSequence name_tokens_;
+  std::vector<uint32_t> name_offsets_;
+  TokenSequence quoted_name_tokens_;
+  std::vector<uint32_t> quoted_name_offsets_;
+  TSFieldId operator_field_id_ = 0;
+};
+
+// Add the symbols of language to the vocabulary of ExpressionCompacter. To
+// keep IDs of the symbols independent of the training dataset, call this
+// before training.
+inline void SeedVocabulary(Language language) {
+  switch (language) {
+    case LANGUAGE_C: SymbolVocabulary::Get<LANGUAGE_C>(); break;
+    case LANGUAGE_VERILOG: SymbolVocabulary::Get<LANGUAGE_VERILOG>(); break;
+    case LANGUAGE_PHP: SymbolVocabulary::Get<LANGUAGE_PHP>(); break;
+    case LANGUAGE_CPP: SymbolVocabulary::Get<LANGUAGE_CPP>(); break;
+  }
+}
+
+// Append full string corresponding to TSNode to buffer. Specializations
+// write into the buffer directly, so that callers can reuse one buffer (e.g.,
+// per thread) for all the code blocks.
+template <TreeLevel L, Language G>
+inline void AppendNodeString(const TSNode& conditional_expression,
+                             std::string& buffer);
+
 // Return full string corresponding to TSNode
 template <TreeLevel L, Language G>
-inline std::string NodeToString(const TSNode& conditional_expression);
+inline std::string NodeToString(const TSNode& conditional_expression) {
+  std::string ret;
+  AppendNodeString<L, G>(conditional_expression, ret);
+  return ret;
+}
+
+// Same as above, but writes the string into buffer, reusing its capacity,
+// and returns a view of it. The view is valid until buffer is modified.
+template <TreeLevel L, Language G>
+inline std::string_view NodeToString(const TSNode& conditional_expression,
+                                     std::string& buffer) {
+  buffer.clear();
+  AppendNodeString<L, G>(conditional_expression, buffer);
+  return buffer;
+}
+
+// Append compacted tokens of NodeToString<L, G>(conditional_expression) to
+// tokens. Specializations emit the tokens directly from node symbols.
+template <TreeLevel L, Language G>
+inline void NodeToTokens(const TSNode& conditional_expression,
+                         TokenSequence& tokens) {
+  thread_local std::string buffer;
+  ExpressionCompacter::Get().AppendCompacted(
+    NodeToString<L, G>(conditional_expression, buffer), tokens);
+}
 
 // Return shortened string corresponding to TSNode
 template <TreeLevel L, Language G>
@@ -124,44 +282,40 @@ inline std::string NodeToShortString(const TSNode& conditional_expression) {
 // ---------------------------------------------------------------------------
 // Basic tree-sitter print with no modification.
 template <>
-inline std::string NodeToString<LEVEL_MIN, LANGUAGE_C>(
-    const TSNode& conditional_expression) {
-  std::string condition_string;
+inline void AppendNodeString<LEVEL_MIN, LANGUAGE_C>(
+    const TSNode& conditional_expression, std::string& buffer) {
   char* node_string = ts_node_string(conditional_expression);
-  condition_string = node_string;
+  buffer += node_string;
 
   // ts_node_string API mallocs memory for string that we need to free.
   free(node_string);
-  return condition_string;
 }
 
 template <>
-inline std::string NodeToString<LEVEL_MIN, LANGUAGE_VERILOG>(
-    const TSNode& conditional_expression) {
-  return NodeToString<LEVEL_MIN, LANGUAGE_C>(conditional_expression);
+inline void AppendNodeString<LEVEL_MIN, LANGUAGE_VERILOG>(
+    const TSNode& conditional_expression, std::string& buffer) {
+  AppendNodeString<LEVEL_MIN, LANGUAGE_C>(conditional_expression, buffer);
 }
 
 template <>
-inline std::string NodeToString<LEVEL_MIN, LANGUAGE_PHP>(
-    const TSNode& conditional_expression) {
-  return NodeToString<LEVEL_MIN, LANGUAGE_C>(conditional_expression);
+inline void AppendNodeString<LEVEL_MIN, LANGUAGE_PHP>(
+    const TSNode& conditional_expression, std::string& buffer) {
+  AppendNodeString<LEVEL_MIN, LANGUAGE_C>(conditional_expression, buffer);
 }
 
 // ---------------------------------------------------------------------------
 
-inline std::string AbstractTerminalString(const TSNode& node) {
-  std::string ret;
+inline void AppendAbstractTerminalString(const TSNode& node,
+                                         std::string& buffer) {
   if (ts_node_named_child_count(node) == 0)
-    ret = ts_node_type(node);
+    buffer += ts_node_type(node);
   else
-    ret = "non_terminal_expression";
-
-  return ret;
+    buffer += "non_terminal_expression";
 }
 
-inline std::string AbstractBinaryExpressionString(const TSNode&
-    binary_expression) {
-  std::string ret;
+template <Language G>
+inline void AppendAbstractBinaryExpressionString(const TSNode&
+    binary_expression, std::string& buffer) {
   // Interesting enough, TreeSitter allows binary_expression to have
   // more than 2 children, by allowing comment node to be part of
   // the binary_expression children.
@@ -174,7 +328,7 @@ inline std::string AbstractBinaryExpressionString(const TSNode&
   size_t num_comment_nodes = 0;
   for (uint32_t i = 0; i < ts_node_named_child_count(binary_expression); i++) {
     TSNode node = ts_node_named_child(binary_expression, i);
-    if (IsCommentNode(node)) {
+    if (IsCommentNode<G>(node)) {
       num_comment_nodes++;
       continue;
     } else if (!is_lhs_set) {
@@ -192,15 +346,16 @@ inline std::string AbstractBinaryExpressionString(const TSNode&
          num_comment_nodes + 2, "Binary expression has less than 2 children:",
          binary_expression);
 
-  ret += "(" + AbstractTerminalString(lhs) + ") ";
-  ret += "(" + AbstractTerminalString(rhs) + ")";
-
-  return ret;
+  buffer += "(";
+  AppendAbstractTerminalString(lhs, buffer);
+  buffer += ") (";
+  AppendAbstractTerminalString(rhs, buffer);
+  buffer += ")";
 }
 
-inline std::string AbstractUnaryExpressionString(
-    const TSNode& unary_expression) {
-  std::string ret;
+template <Language G>
+inline void AppendAbstractUnaryExpressionString(
+    const TSNode& unary_expression, std::string& buffer) {
   cf_assert(ts_node_named_child_count(unary_expression) >= 1,
             "Unary expression has less than 1 children: ",
             unary_expression);
@@ -210,7 +365,7 @@ inline std::string AbstractUnaryExpressionString(
   size_t num_comment_nodes = 0;
   for (uint32_t i = 0; i < ts_node_named_child_count(unary_expression); i++) {
     TSNode node = ts_node_named_child(unary_expression, i);
-    if (IsCommentNode(node)) {
+    if (IsCommentNode<G>(node)) {
       num_comment_nodes++;
       continue;
     } else if (!is_arg_set) {
@@ -224,13 +379,14 @@ inline std::string AbstractUnaryExpressionString(
          unary_expression);
 
   // argument
-  ret += "(" + AbstractTerminalString(arg) + ")";
-  return ret;
+  buffer += "(";
+  AppendAbstractTerminalString(arg, buffer);
+  buffer += ")";
 }
 
-inline std::string AbstractSubscriptExpressionString(
-    const TSNode& subscript_expression) {
-  std::string ret;
+template <Language G>
+inline void AppendAbstractSubscriptExpressionString(
+    const TSNode& subscript_expression, std::string& buffer) {
   cf_assert(ts_node_named_child_count(subscript_expression) >= 2,
             "Subscript expression has less than 2 children:",
             subscript_expression);
@@ -241,7 +397,7 @@ inline std::string AbstractSubscriptExpressionString(
   for (uint32_t i = 0;
        i < ts_node_named_child_count(subscript_expression); i++) {
     TSNode node = ts_node_named_child(subscript_expression, i);
-    if (IsCommentNode(node)) {
+    if (IsCommentNode<G>(node)) {
       num_comment_nodes++;
       continue;
     } else if (!is_arg1_set) {
@@ -261,204 +417,560 @@ inline std::string AbstractSubscriptExpressionString(
             subscript_expression);
 
   // argument
-  ret += "(" + AbstractTerminalString(arg1) + ") ";
+  buffer += "(";
+  AppendAbstractTerminalString(arg1, buffer);
   // index
-  ret += "(" + AbstractTerminalString(arg2) + ")";
-  return ret;
+  buffer += ") (";
+  AppendAbstractTerminalString(arg2, buffer);
+  buffer += ")";
 }
 
+// Source code of node without newlines. source_file_contents is typically a
+// view of the mapped source file.
 inline std::string OriginalSourceExpression(
     const TSNode& node,
-    const std::string& source_file_contents) {
+    std::string_view source_file_contents) {
   size_t start_byte = ts_node_start_byte(node);
   size_t end_byte =  ts_node_end_byte(node);
 
-  int length = end_byte - start_byte;
-  std::string substr = source_file_contents.substr(start_byte, length);
-  std::string substr_nonewline =  regex_replace(substr, std::regex("\n"), "");
-  return regex_replace(substr_nonewline, std::regex("\r"), "");
+  std::string_view substr = source_file_contents.substr(start_byte,
+                              end_byte - start_byte);
+  std::string substr_nonewline;
+  substr_nonewline.reserve(substr.length());
+  for (char c : substr) {
+    if (c != '\n' && c != '\r') substr_nonewline += c;
+  }
+  return substr_nonewline;
 }
 
-inline std::string OpToString(const TSNode& node) {
+// Print operator of an expression along with a trailing space.
+// SymbolVocabulary::AppendOperator should match this function.
+inline void AppendOperatorString(const TSNode& node, std::string& buffer) {
   const std::string& operator_str = "operator";
   TSNode op = ts_node_child_by_field_name(node, operator_str.c_str(),
                                           operator_str.length());
   if (ts_node_is_null(op))
-    return "";
+    return;
   char* node_string = ts_node_string(op);
-  std::string orig_op_string = node_string;
+  buffer += node_string;
   free(node_string);
-  return orig_op_string + " ";
+  buffer += " ";
 }
 
-inline std::string AbstractConditionalExpressionString(const TSNode&
-    conditional_expression_node) {
-  const std::string parenthesized_expression = "parenthesized_expression";
-  const std::string condition_clause = "condition_clause";
-  const std::string binary_expression = "binary_expression";
-  const std::string assignment_expression = "assignment_expression";
-  const std::string unary_expression = "unary_expression";
-  const std::string pointer_expression = "pointer_expression";
-  const std::string call_expression = "call_expression";
-  const std::string field_expression = "field_expression";
-  const std::string subscript_expression = "subscript_expression";
-
-  std::string ret;
-  if (ts_node_named_child_count(conditional_expression_node) != 1) return "";
+template <Language G>
+inline void AppendAbstractConditionalExpressionString(const TSNode&
+    conditional_expression_node, std::string& buffer) {
+  if (ts_node_named_child_count(conditional_expression_node) != 1) return;
   TSNode node = ts_node_named_child(conditional_expression_node, 0);
-  if (parenthesized_expression.compare(ts_node_type(node)) == 0) {
-    ret += "(parenthesized_expression ";
-    ret += AbstractConditionalExpressionString(node);
-    ret += ")";
-  } else if (condition_clause.compare(ts_node_type(node)) == 0) {
-    ret += "(condition_clause ";
-    ret += AbstractConditionalExpressionString(node);
-    ret += ")";
-  } else if (binary_expression.compare(ts_node_type(node)) == 0) {
-    ret += "(binary_expression ";
-    ret += OpToString(node);
-    ret += AbstractBinaryExpressionString(node);
-    ret += ")";
-  } else if (assignment_expression.compare(ts_node_type(node)) == 0) {
-    ret += "(binary_expression ";
-    ret += "(\"=\") ";
-    ret += AbstractBinaryExpressionString(node);
-    ret += ")";
-  } else if (unary_expression.compare(ts_node_type(node)) == 0) {
-    ret += "(unary_expression ";
-    ret += OpToString(node);
-    ret += AbstractUnaryExpressionString(node);
-    ret += ")";
-  } else if (pointer_expression.compare(ts_node_type(node)) == 0) {
-    ret += "(pointer_expression ";
-    ret += AbstractUnaryExpressionString(node);
-    ret += ")";
-  } else if (call_expression.compare(ts_node_type(node)) == 0) {
-    ret += "(call_expression)";
-  } else if (field_expression.compare(ts_node_type(node)) == 0) {
-    ret +=
-      "(field_expression argument: (identifier) field: (field_identifier))";
-  } else if (subscript_expression.compare(ts_node_type(node)) == 0) {
-    ret += "(subscript_expression ";
-    ret += AbstractSubscriptExpressionString(node);
-    ret += ")";
-  } else {
-    ret += "(";
-    ret += AbstractTerminalString(node);
-    ret += ")";
+  switch (NodeKinds<G>::Get().Of(node)) {
+    case NODE_KIND_PARENTHESIZED_EXPRESSION:
+      buffer += "(parenthesized_expression ";
+      AppendAbstractConditionalExpressionString<G>(node, buffer);
+      buffer += ")";
+      break;
+    case NODE_KIND_CONDITION_CLAUSE:
+      buffer += "(condition_clause ";
+      AppendAbstractConditionalExpressionString<G>(node, buffer);
+      buffer += ")";
+      break;
+    case NODE_KIND_BINARY_EXPRESSION:
+      buffer += "(binary_expression ";
+      AppendOperatorString(node, buffer);
+      AppendAbstractBinaryExpressionString<G>(node, buffer);
+      buffer += ")";
+      break;
+    case NODE_KIND_ASSIGNMENT_EXPRESSION:
+      buffer += "(binary_expression ";
+      buffer += "(\"=\") ";
+      AppendAbstractBinaryExpressionString<G>(node, buffer);
+      buffer += ")";
+      break;
+    case NODE_KIND_UNARY_EXPRESSION:
+      buffer += "(unary_expression ";
+      AppendOperatorString(node, buffer);
+      AppendAbstractUnaryExpressionString<G>(node, buffer);
+      buffer += ")";
+      break;
+    case NODE_KIND_POINTER_EXPRESSION:
+      buffer += "(pointer_expression ";
+      AppendAbstractUnaryExpressionString<G>(node, buffer);
+      buffer += ")";
+      break;
+    case NODE_KIND_CALL_EXPRESSION:
+      buffer += "(call_expression)";
+      break;
+    case NODE_KIND_FIELD_EXPRESSION:
+      buffer +=
+        "(field_expression argument: (identifier) field: (field_identifier))";
+      break;
+    case NODE_KIND_SUBSCRIPT_EXPRESSION:
+      buffer += "(subscript_expression ";
+      AppendAbstractSubscriptExpressionString<G>(node, buffer);
+      buffer += ")";
+      break;
+    default:
+      buffer += "(";
+      AppendAbstractTerminalString(node, buffer);
+      buffer += ")";
+      break;
   }
-
-  return ret;
 }
 
 template <>
-inline std::string NodeToString<LEVEL_TWO, LANGUAGE_C>(
-    const TSNode& conditional_expression) {
-  std::string ret;
-
-  const std::string parenthesized_expression = "parenthesized_expression";
-  if (parenthesized_expression.compare(
-      ts_node_type(conditional_expression)) == 0) {
-    ret += "(parenthesized_expression ";
-    ret += AbstractConditionalExpressionString(conditional_expression);
-    ret += ")";
+inline void AppendNodeString<LEVEL_TWO, LANGUAGE_C>(
+    const TSNode& conditional_expression, std::string& buffer) {
+  if (NodeKinds<LANGUAGE_C>::Get().Is(conditional_expression,
+                                      NODE_KIND_PARENTHESIZED_EXPRESSION)) {
+    buffer += "(parenthesized_expression ";
+    AppendAbstractConditionalExpressionString<LANGUAGE_C>(
+      conditional_expression, buffer);
+    buffer += ")";
   } else {
     throw cf_unexpected_situation(
       "Expecting parenthesized_expression at top-level, found:" +
       std::string(ts_node_string(conditional_expression)));
   }
-
-  return ret;
 }
 
 template <>
-inline std::string NodeToString<LEVEL_TWO, LANGUAGE_CPP>(
-    const TSNode& conditional_expression) {
-  std::string ret;
-
-  const std::string condition_clause = "condition_clause";
-  if (condition_clause.compare(
-      ts_node_type(conditional_expression)) == 0) {
-    ret += "(condition_clause ";
-    ret += AbstractConditionalExpressionString(conditional_expression);
-    ret += ")";
+inline void AppendNodeString<LEVEL_TWO, LANGUAGE_CPP>(
+    const TSNode& conditional_expression, std::string& buffer) {
+  if (NodeKinds<LANGUAGE_CPP>::Get().Is(conditional_expression,
+                                        NODE_KIND_CONDITION_CLAUSE)) {
+    buffer += "(condition_clause ";
+    AppendAbstractConditionalExpressionString<LANGUAGE_CPP>(
+      conditional_expression, buffer);
+    buffer += ")";
   } else {
     throw cf_unexpected_situation(
       "Expecting condition_clause at top-level, found:" +
       std::string(ts_node_string(conditional_expression)));
   }
-
-  return ret;
 }
 
 // Currently for level 2 representation for Verilog, we use full details.
 // May be we will need to implement a specialized version for Verilog
 // for Level 2.
 template <>
-inline std::string NodeToString<LEVEL_TWO, LANGUAGE_VERILOG>(
-  const TSNode& conditional_expression) {
-    return NodeToString<LEVEL_MIN, LANGUAGE_VERILOG>(conditional_expression);
+inline void AppendNodeString<LEVEL_TWO, LANGUAGE_VERILOG>(
+  const TSNode& conditional_expression, std::string& buffer) {
+    AppendNodeString<LEVEL_MIN, LANGUAGE_VERILOG>(conditional_expression,
+                                                  buffer);
 }
 
 template <>
-inline std::string NodeToString<LEVEL_TWO, LANGUAGE_PHP>(
-  const TSNode& conditional_expression) {
-    return NodeToString<LEVEL_MIN, LANGUAGE_PHP>(conditional_expression);
+inline void AppendNodeString<LEVEL_TWO, LANGUAGE_PHP>(
+  const TSNode& conditional_expression, std::string& buffer) {
+    AppendNodeString<LEVEL_MIN, LANGUAGE_PHP>(conditional_expression, buffer);
 }
 // -----------------------------------------------------------------------
 // Close to full-detailed level with using Tree-sitter print. Only
 // difference is in printing operators for binary and unary ops.
 //
 // For Level 1, C, C++, and Verilog have same implementation.
+//
+// AppendLevelOneTokens should match this function.
+template <Language G>
+inline void AppendLevelOneString(const TSNode& node, std::string& buffer) {
+  const NodeKinds<G>& node_kinds = NodeKinds<G>::Get();
+  auto enter_fn = [&](const TSNode& current) {
+    buffer += "(";
+
+    switch (node_kinds.Of(current)) {
+      case NODE_KIND_BINARY_EXPRESSION:
+      case NODE_KIND_UNARY_EXPRESSION:
+        buffer += ts_node_type(current);
+        buffer += " ";
+        AppendOperatorString(current, buffer);
+        break;
+      case NODE_KIND_ASSIGNMENT_EXPRESSION:
+        buffer += "binary_expression";
+        buffer += " ";
+        buffer += "(\"=\") ";
+        break;
+      default:
+        buffer += ts_node_type(current);
+        buffer += ts_node_named_child_count(current) > 0 ? " " : "";
+        break;
+    }
+  };
+  auto leave_fn = [&](const TSNode&) { buffer += ")"; };
+
+  // Named children are walked in order, as with ts_node_named_child.
+  WalkNamedSubtree(node, enter_fn, leave_fn);
+}
+
 template <>
-inline std::string NodeToString<LEVEL_ONE, LANGUAGE_C>(const TSNode& node) {
-  std::string ret = "";
-
-  ret += "(";
-
-  const std::string& binary_expression = "binary_expression";
-  const std::string& unary_expression = "unary_expression";
-  const std::string& assignment_expression = "assignment_expression";
-  if (0 == binary_expression.compare(ts_node_type(node)) ||
-      0 == unary_expression.compare(ts_node_type(node))) {
-    ret += ts_node_type(node);
-    ret += " ";
-    ret += OpToString(node);
-  } else if (0 == assignment_expression.compare(ts_node_type(node))) {
-    ret += "binary_expression";
-    ret += " ";
-    ret += "(\"=\") ";
-  } else {
-    ret += ts_node_type(node);
-    ret += ts_node_named_child_count(node) > 0 ? " " : "";
-  }
+inline void AppendNodeString<LEVEL_ONE, LANGUAGE_C>(
+  const TSNode& conditional_expression, std::string& buffer) {
+    AppendLevelOneString<LANGUAGE_C>(conditional_expression, buffer);
+}
 
-  uint32_t children = ts_node_named_child_count(node);
-  for (uint32_t i = 0; i < children; i++) {
-    const TSNode child = ts_node_named_child(node, i);
-    ret += NodeToString<LEVEL_ONE, LANGUAGE_C>(child);
+template <>
+inline void AppendNodeString<LEVEL_ONE, LANGUAGE_VERILOG>(
+  const TSNode& conditional_expression, std::string& buffer) {
+    AppendLevelOneString<LANGUAGE_VERILOG>(conditional_expression, buffer);
+}
+
+template <>
+inline void AppendNodeString<LEVEL_ONE, LANGUAGE_PHP>(
+  const TSNode& conditional_expression, std::string& buffer) {
+    AppendLevelOneString<LANGUAGE_PHP>(conditional_expression, buffer);
+}
+
+template <>
+inline void AppendNodeString<LEVEL_ONE, LANGUAGE_CPP>(
+  const TSNode& conditional_expression, std::string& buffer) {
+    AppendLevelOneString<LANGUAGE_CPP>(conditional_expression, buffer);
+}
+
+// Append tokens that AppendLevelOneString prints for node before its
+// children.
+inline void AppendLevelOneOpening(const SymbolVocabulary& vocabulary,
+                                  const TSNode& node, NodeKind kind,
+                                  bool has_children, TokenSequence& tokens) {
+  tokens.push_back('(');
+
+  switch (kind) {
+    case NODE_KIND_BINARY_EXPRESSION:
+    case NODE_KIND_UNARY_EXPRESSION:
+      vocabulary.AppendNodeType(node, tokens);
+      tokens.push_back(' ');
+      vocabulary.AppendOperator(node, tokens);
+      break;
+    case NODE_KIND_ASSIGNMENT_EXPRESSION: {
+      // Assignment is printed as binary_expression with "=" operator, which
+      // are the tokens of (binary_expression ("=") ).
+      static const TokenSequence kAssignmentTokens = [] {
+        TokenSequence assignment_tokens;
+        ExpressionCompacter::Get().Compact("binary_expression (\"=\") ",
+                                           assignment_tokens);
+        return assignment_tokens;
+      }();
+      tokens.insert(tokens.end(), kAssignmentTokens.begin(),
+                    kAssignmentTokens.end());
+      break;
+    }
+    default:
+      vocabulary.AppendNodeType(node, tokens);
+      if (has_children)
+        tokens.push_back(' ');
+      break;
   }
+}
 
-  ret += ")";
+// Token version of AppendLevelOneString.
+template <Language G>
+inline void AppendLevelOneTokens(const SymbolVocabulary& vocabulary,
+                                 const TSNode& node, TokenSequence& tokens) {
+  const NodeKinds<G>& node_kinds = NodeKinds<G>::Get();
+  WalkNamedSubtree(node,
+    [&](const TSNode& current) {
+      AppendLevelOneOpening(vocabulary, current, node_kinds.Of(current),
+                            ts_node_named_child_count(current) > 0, tokens);
+    },
+    [&](const TSNode&) { tokens.push_back(')'); });
+}
 
-  return ret;
+template <>
+inline void NodeToTokens<LEVEL_ONE, LANGUAGE_C>(
+    const TSNode& conditional_expression, TokenSequence& tokens) {
+  AppendLevelOneTokens<LANGUAGE_C>(
+    SymbolVocabulary::Get<LANGUAGE_C>(), conditional_expression, tokens);
 }
 
 template <>
-inline std::string NodeToString<LEVEL_ONE, LANGUAGE_VERILOG>(
-  const TSNode& conditional_expression) {
-    return NodeToString<LEVEL_ONE, LANGUAGE_C>(conditional_expression);
+inline void NodeToTokens<LEVEL_ONE, LANGUAGE_VERILOG>(
+    const TSNode& conditional_expression, TokenSequence& tokens) {
+  AppendLevelOneTokens<LANGUAGE_VERILOG>(
+    SymbolVocabulary::Get<LANGUAGE_VERILOG>(), conditional_expression, tokens);
 }
 
 template <>
-inline std::string NodeToString<LEVEL_ONE, LANGUAGE_PHP>(
-  const TSNode& conditional_expression) {
-    return NodeToString<LEVEL_ONE, LANGUAGE_C>(conditional_expression);
+inline void NodeToTokens<LEVEL_ONE, LANGUAGE_PHP>(
+    const TSNode& conditional_expression, TokenSequence& tokens) {
+  AppendLevelOneTokens<LANGUAGE_PHP>(
+    SymbolVocabulary::Get<LANGUAGE_PHP>(), conditional_expression, tokens);
 }
 
 template <>
-inline std::string NodeToString<LEVEL_ONE, LANGUAGE_CPP>(
-  const TSNode& conditional_expression) {
-    return NodeToString<LEVEL_ONE, LANGUAGE_C>(conditional_expression);
+inline void NodeToTokens<LEVEL_ONE, LANGUAGE_CPP>(
+    const TSNode& conditional_expression, TokenSequence& tokens) {
+  AppendLevelOneTokens<LANGUAGE_CPP>(
+    SymbolVocabulary::Get<LANGUAGE_CPP>(), conditional_expression, tokens);
 }
+
+//----------------------------------------------------------------------------
+// Level 1 and level 2 abstractions of a code block. Callers keep one instance
+// per thread and reuse it for all the code blocks, so that the buffers are
+// not reallocated for every code block.
+struct MultiLevelAbstraction {
+  TokenSequence level_one_tokens_;
+  TokenSequence level_two_tokens_;
+  // False if the code block has no level 2 abstraction, i.e., if
+  // NodeToString<LEVEL_TWO> throws an exception for it.
+  bool has_level_two_ = false;
+  // Level 2 abstraction is short, so it is built as a string and compacted.
+  std::string level_two_string_;
+};
+
+// Kind of the top-level node that level 2 abstraction expects. NODE_KIND_OTHER
+// means that level 2 abstraction is the basic tree-sitter print.
+template <Language G> constexpr NodeKind LevelTwoTopKind() {
+  return NODE_KIND_OTHER;
+}
+template <> constexpr NodeKind LevelTwoTopKind<LANGUAGE_C>() {
+  return NODE_KIND_PARENTHESIZED_EXPRESSION;
+}
+template <> constexpr NodeKind LevelTwoTopKind<LANGUAGE_CPP>() {
+  return NODE_KIND_CONDITION_CLAUSE;
+}
+
+// Compute level 1 and level 2 abstractions of a code block in a single
+// traversal of its tree. Level 1 tokens are same as those of
+// NodeToTokens<LEVEL_ONE, G>, and level 2 tokens are same as those of
+// NodeToTokens<LEVEL_TWO, G>.
+template <Language G>
+class MultiLevelAbstractor {
+ public:
+  static void Abstract(const TSNode& code_block,
+                       MultiLevelAbstraction& abstraction) {
+    MultiLevelAbstractor abstractor(abstraction);
+    abstractor.AbstractCodeBlock(code_block);
+  }
+
+ private:
+  // Level 2 abstraction only looks at the nodes from the code block down to
+  // the first operator, and at the operands of that operator. Role says how
+  // level 2 abstraction prints a node.
+  enum LevelTwoRole {
+    kNone,         // Not printed.
+    kConditional,  // As in AppendAbstractConditionalExpressionString.
+    kOperand       // As in AppendAbstractTerminalString.
+  };
+
+  explicit MultiLevelAbstractor(MultiLevelAbstraction& abstraction)
+    : vocabulary_(SymbolVocabulary::Get<G>()), kinds_(NodeKinds<G>::Get()),
+      abstraction_(abstraction) {}
+
+  void AbstractCodeBlock(const TSNode& code_block) {
+    abstraction_.level_one_tokens_.clear();
+    abstraction_.level_two_tokens_.clear();
+    abstraction_.level_two_string_.clear();
+    has_level_two_ = true;
+
+    constexpr NodeKind kTopKind = LevelTwoTopKind<G>();
+    LevelTwoRole role = kNone;
+    if (kTopKind != NODE_KIND_OTHER) {
+      if (kinds_.Of(code_block) == kTopKind)
+        role = kConditional;
+      else
+        has_level_two_ = false;
+    }
+    // Frames of the nodes being walked are reused across code blocks.
+    thread_local std::vector<Frame> frames;
+    frames.clear();
+    frames_ = &frames;
+    root_role_ = role;
+    WalkNamedSubtree(code_block,
+                     [this](const TSNode& node) { Enter(node); },
+                     [this](const TSNode&) { Leave(); });
+
+    if (kTopKind == NODE_KIND_OTHER) {
+      ExpressionCompacter::Get().AppendCompacted(
+        NodeToString<LEVEL_MIN, LANGUAGE_C>(code_block,
+                                            abstraction_.level_two_string_),
+        abstraction_.level_two_tokens_);
+    } else if (has_level_two_) {
+      ExpressionCompacter::Get().AppendCompacted(
+        abstraction_.level_two_string_, abstraction_.level_two_tokens_);
+    }
+    abstraction_.has_level_two_ = has_level_two_;
+  }
+
+  // How level 2 abstraction prints the named children of a node being
+  // walked.
+  struct Frame {
+    LevelTwoRole children_role_ = kNone;
+    size_t num_operands_ = 0;
+    size_t operand_index_ = 0;
+    bool close_level_two_ = false;
+  };
+
+  void Enter(const TSNode& node) {
+    const NodeKind kind = kinds_.Of(node);
+    const uint32_t children = ts_node_named_child_count(node);
+    AppendLevelOneOpening(vocabulary_, node, kind, children > 0,
+                          abstraction_.level_one_tokens_);
+
+    // Role of the node is decided by its parent.
+    LevelTwoRole role = root_role_;
+    const char* operand_suffix = "";
+    if (!frames_->empty()) {
+      Frame& parent = frames_->back();
+      role = kNone;
+      if (parent.children_role_ == kConditional) {
+        role = kConditional;
+      } else if (parent.children_role_ == kOperand &&
+                 !IsCommentNode<G>(node)) {
+        if (parent.operand_index_ < parent.num_operands_) {
+          role = kOperand;
+          operand_suffix =
+            parent.operand_index_ + 1 < parent.num_operands_ ? " " : "";
+        } else {
+          has_level_two_ = false;
+        }
+        parent.operand_index_++;
+      }
+    }
+
+    Frame frame;
+    std::string& level_two = abstraction_.level_two_string_;
+    if (role == kConditional) {
+      frame.close_level_two_ = OpenConditional(node, kind, children,
+                                 frame.children_role_, frame.num_operands_);
+    } else if (role == kOperand) {
+      level_two += "(";
+      level_two += children == 0 ? ts_node_type(node) :
+                                   "non_terminal_expression";
+      level_two += ")";
+      level_two += operand_suffix;
+    }
+    frames_->push_back(frame);
+  }
+
+  void Leave() {
+    const Frame& frame = frames_->back();
+    if (frame.children_role_ == kOperand &&
+        frame.operand_index_ < frame.num_operands_)
+      has_level_two_ = false;
+    if (frame.close_level_two_)
+      abstraction_.level_two_string_ += ")";
+    abstraction_.level_one_tokens_.push_back(')');
+    frames_->pop_back();
+  }
+
+  // Print the beginning of node as in AppendAbstractConditionalExpressionString
+  // and set how its children are printed. Returns true if the node needs a
+  // closing parenthesis after its children.
+  bool OpenConditional(const TSNode& node, NodeKind kind, uint32_t children,
+                       LevelTwoRole& children_role, size_t& num_operands) {
+    std::string& level_two = abstraction_.level_two_string_;
+    switch (kind) {
+      case NODE_KIND_PARENTHESIZED_EXPRESSION:
+      case NODE_KIND_CONDITION_CLAUSE:
+        level_two += "(";
+        level_two += kind == NODE_KIND_CONDITION_CLAUSE ?
+                     "condition_clause " : "parenthesized_expression ";
+        // Nested conditional is printed only if it is the only child.
+        children_role = children == 1 ? kConditional : kNone;
+        return true;
+      case NODE_KIND_BINARY_EXPRESSION:
+        level_two += "(binary_expression ";
+        AppendOperatorString(node, level_two);
+        children_role = kOperand;
+        num_operands = 2;
+        return true;
+      case NODE_KIND_ASSIGNMENT_EXPRESSION:
+        level_two += "(binary_expression (\"=\") ";
+        children_role = kOperand;
+        num_operands = 2;
+        return true;
+      case NODE_KIND_UNARY_EXPRESSION:
+        level_two += "(unary_expression ";
+        AppendOperatorString(node, level_two);
+        children_role = kOperand;
+        num_operands = 1;
+        return true;
+      case NODE_KIND_POINTER_EXPRESSION:
+        level_two += "(pointer_expression ";
+        children_role = kOperand;
+        num_operands = 1;
+        return true;
+      case NODE_KIND_CALL_EXPRESSION:
+        level_two += "(call_expression)";
+        return false;
+      case NODE_KIND_FIELD_EXPRESSION:
+        level_two +=
+          "(field_expression argument: (identifier) field: (field_identifier))";
+        return false;
+      case NODE_KIND_SUBSCRIPT_EXPRESSION:
+        level_two += "(subscript_expression ";
+        children_role = kOperand;
+        num_operands = 2;
+        return true;
+      default:
+        level_two += "(";
+        level_two += children == 0 ? ts_node_type(node) :
+                                     "non_terminal_expression";
+        level_two += ")";
+        return false;
+    }
+  }
+
+  const SymbolVocabulary& vocabulary_;
+  const NodeKinds<G>& kinds_;
+  MultiLevelAbstraction& abstraction_;
+  std::vector<Frame>* frames_ = nullptr;
+  LevelTwoRole root_role_ = kNone;
+  bool has_level_two_ = true;
+};
+
+//----------------------------------------------------------------------------
+// Structural hash of a code block. Level 1 and level 2 abstractions only look
+// at the symbols of the named nodes, the shape of the tree and the operators
+// of expressions, so code blocks with the same hash have the same
+// abstractions (barring collisions of the 64-bit hash). This lets scanner
+// reuse the verdict of a code block for all the code blocks of the same
+// shape, without abstracting them.
+//
+// Returns false if the code block cannot be hashed. That is the case for
+// languages whose level 2 abstraction is the basic tree-sitter print, which
+// also depends on field names, and for code blocks with an operator that is
+// not a plain anonymous token, since such operators are printed in full.
+template <Language G>
+inline bool HashCodeBlock(const TSNode& code_block, uint64_t& hash) {
+  if (LevelTwoTopKind<G>() == NODE_KIND_OTHER) return false;
+
+  // Symbols are 16-bit, so markers and operators use the bits above them.
+  const uint32_t kOperatorMarker = 1 << 16;
+  const uint32_t kNoOperatorMarker = 2 << 16;
+  const uint32_t kLeaveMarker = 3 << 16;
+
+  const NodeKinds<G>& node_kinds = NodeKinds<G>::Get();
+  const TSFieldId operator_field_id = node_kinds.GetOperatorFieldID();
+  bool is_hashable = true;
+  uint64_t structure_hash = kFNVOffsetBasis;
+  auto mix = [&structure_hash](uint32_t value) {
+    structure_hash = HashBytes(reinterpret_cast<const char*>(&value),
+                               sizeof(value), structure_hash);
+  };
+
+  WalkNamedSubtree(code_block,
+    [&](const TSNode& current) {
+      mix(ts_node_symbol(current));
+      NodeKind kind = node_kinds.Of(current);
+      if (kind != NODE_KIND_BINARY_EXPRESSION &&
+          kind != NODE_KIND_UNARY_EXPRESSION)
+        return;
+      if (operator_field_id == 0) {
+        mix(kNoOperatorMarker);
+        return;
+      }
+      TSNode op = ts_node_child_by_field_id(current, operator_field_id);
+      if (ts_node_is_null(op)) {
+        mix(kNoOperatorMarker);
+      } else if (!ts_node_is_named(op) && !ts_node_is_missing(op) &&
+                 ts_node_child_count(op) == 0) {
+        mix(kOperatorMarker | ts_node_symbol(op));
+      } else {
+        is_hashable = false;
+      }
+    },
+    [&](const TSNode&) { mix(kLeaveMarker); });
+
+  hash = structure_hash;
+  return is_hashable;
+}
+
 #endif  // SRC_TREE_ABSTRACTION_H_
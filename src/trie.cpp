@@ -29,16 +29,15 @@
 
 void Trie::Insert(const std::string& expression, size_t line_no,
                   size_t contributor_id) {
-  std::string short_expr =
-    ExpressionCompacter::Get().Compact(expression);
-  InsertShortExpr(short_expr, line_no, contributor_id);
+  thread_local TokenSequence tokens;
+  ExpressionCompacter::Get().Compact(expression, tokens);
+  InsertShortExpr(tokens, line_no, contributor_id);
 }
 
-void Trie::InsertShortExpr(const std::string& short_expression, size_t line_no,
+void Trie::InsertShortExpr(const TokenSequence& tokens, size_t line_no,
                            size_t contributor_id) {
   struct TrieNode *node = this->root_;
-  for (size_t i = 0; i < short_expression.length(); i++) {
-    char c = short_expression[i];
+  for (TokenID c : tokens) {
     // Increment occurrences for every node along the path
     // to keep track of number of occurrences of different prefixes.
     node->num_occurrences_++;
@@ -49,7 +48,7 @@ void Trie::InsertShortExpr(const std::string& short_expression, size_t line_no,
     } else {
       node = child_iterator->second;
     }
-    // Insert this char into the alphabet list supported by this trie.
+    // Insert this token into the alphabet list supported by this trie.
     // This info is used in auto-correction feature.
     alphabets_.insert(c);
   }
@@ -65,46 +64,53 @@ void Trie::InsertShortExpr(const std::string& short_expression, size_t line_no,
 
 bool Trie::LookUp(const std::string& expression, size_t& num_occurrences,
                   float& confidence) const {
-  std::string short_expr =
-    ExpressionCompacter::Get().Compact(expression);
-  return LookUpShortExpr(short_expr, num_occurrences, confidence);
+  thread_local TokenSequence tokens;
+  ExpressionCompacter::Get().Compact(expression, tokens);
+  return LookUpShortExpr(tokens, num_occurrences, confidence);
 }
 
-bool Trie::LookUpShortExpr(const std::string& short_expression,
-                           size_t& num_occurrences,
-                           float& confidence) const {
+Trie::TrieNode* Trie::FindNode(const TokenSequence& tokens) const {
   struct TrieNode *node = root_;
-
-  const bool kFound = true;
-  for (size_t i = 0; i < short_expression.length(); i++) {
-    auto child_iterator = node->children_.find(short_expression[i]);
+  for (TokenID token : tokens) {
+    auto child_iterator = node->children_.find(token);
     if (child_iterator == node->children_.end()) {
-      return !kFound;
+      return nullptr;
     } else {
       node = child_iterator->second;
     }
   }
+  return node;
+}
 
-  if (node->terminal_node_ == false)
-    return false;
+bool Trie::LookUpShortExpr(const TokenSequence& tokens,
+                           size_t& num_occurrences,
+                           float& confidence,
+                           NearestExpression::PatternID* pattern_id) const {
+  const TrieNode* node = FindNode(tokens);
+
+  const bool kFound = true;
+  if (node == nullptr || node->terminal_node_ == false)
+    return !kFound;
 
   num_occurrences = node->num_occurrences_;
   confidence = node->confidence_;
+  if (pattern_id != nullptr)
+    *pattern_id = node->pattern_id_;
   return kFound;
 }
 
 void Trie::VisitAllLeafNodes(VisitorCallbackFn callback_fn) const {
   // DFS based tree traversal.
-  using queue_element_t = std::pair<const TrieNode*, std::string>;
+  using queue_element_t = std::pair<const TrieNode*, TokenSequence>;
   std::queue<queue_element_t> q;
-  std::string kRootPathPrefix = "";
+  TokenSequence kRootPathPrefix;
   q.push(queue_element_t(root_, kRootPathPrefix));
 
   while (!q.empty()) {
     auto node_prefix_pair = q.front();
     q.pop();
     const TrieNode* node = node_prefix_pair.first;
-    const std::string& path_prefix = node_prefix_pair.second;
+    const TokenSequence& path_prefix = node_prefix_pair.second;
 
     if (node->terminal_node_) {
       callback_fn(path_prefix, node->num_occurrences_,
@@ -112,18 +118,20 @@ void Trie::VisitAllLeafNodes(VisitorCallbackFn callback_fn) const {
     }
 
     for (const auto& child : node->children_) {
-      q.push(queue_element_t(child.second, path_prefix + child.second->c_));
+      TokenSequence child_path = path_prefix;
+      child_path.push_back(child.second->token_);
+      q.push(queue_element_t(child.second, std::move(child_path)));
     }
   }
 }
 
 void Trie::Print(bool sorted) const {
   struct Path {
-    std::string path_string_;
+    TokenSequence path_string_;
     size_t num_occurrences_;
     PatternContributorsMap pattern_contributors_;
 
-    Path(std::string path_string, size_t num_occurrences,
+    Path(const TokenSequence& path_string, size_t num_occurrences,
          const PatternContributorsMap& pattern_contributors) {
       path_string_ = path_string;
       num_occurrences_ = num_occurrences;
@@ -132,7 +140,8 @@ void Trie::Print(bool sorted) const {
   };
 
   std::vector<struct Path> paths;
-  VisitAllLeafNodes([&](const std::string& path_string, size_t num_occurrences,
+  VisitAllLeafNodes([&](const TokenSequence& path_string,
+                        size_t num_occurrences,
                         const PatternContributorsMap& pattern_contributors) {
     Path path(path_string, num_occurrences, pattern_contributors);
     paths.push_back(path);
@@ -158,7 +167,8 @@ void Trie::Print(bool sorted) const {
 }
 
 void Trie::PrintEditDistancesInTrainingSet() const {
-  VisitAllLeafNodes([&](const std::string& path_string, size_t num_occurrences,
+  VisitAllLeafNodes([&](const TokenSequence& path_string,
+                        size_t num_occurrences,
                         const PatternContributorsMap& pattern_contributors) {
     const NearestExpression::Cost kMaxEditDistance = 3;
     const size_t kMaxThreads = 1;
@@ -171,9 +181,7 @@ void Trie::PrintEditDistancesInTrainingSet() const {
       std::cout << "Potential anomaly" << std::endl;
     }
     for (auto nearest_expression : nearest_expressions) {
-      std::string long_expression = ExpressionCompacter::Get().Expand(
-            nearest_expression.GetExpression());
-      std::cout << "Did you mean:" << long_expression
+      std::cout << "Did you mean:" << nearest_expression.GetExpression()
                << " with editing cost:" << nearest_expression.GetCost()
                << " and occurrences: " << nearest_expression.GetNumOccurrences()
                << std::endl;
@@ -23,6 +23,8 @@
 
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
 #include <functional>
 #include <iostream>
@@ -34,6 +36,7 @@
 #include <vector>
 
 #include "tree_abstraction.h"
+#include "thread_pool.h"
 
 // Data type to return nearest neighbors of a target expression based on
 // some distance metric (such as Levenshtein distance). string is for
@@ -43,12 +46,20 @@ struct NearestExpression {
     using Expression = std::string;
     using Cost = size_t;
     using NumOccurrences = size_t;
+    // Index of an expression in the training dataset (see
+    // Trie::GetExpression). Expressions that are not from the training
+    // dataset have kInvalidPatternID.
+    using PatternID = uint32_t;
+    static constexpr PatternID kInvalidPatternID = UINT32_MAX;
 
  public:
-    NearestExpression() : expression(""), cost(0), num_occurrences(0) {}
+    NearestExpression() : expression(""), cost(0), num_occurrences(0),
+                          pattern_id(kInvalidPatternID) {}
     NearestExpression(const Expression& expression, Cost cost,
-                      NumOccurrences occurrences = 1) : expression(expression),
-                      cost(cost), num_occurrences(occurrences) {}
+                      NumOccurrences occurrences = 1,
+                      PatternID pattern_id = kInvalidPatternID) :
+                      expression(expression), cost(cost),
+                      num_occurrences(occurrences), pattern_id(pattern_id) {}
 
     // hash function
     size_t operator()(const NearestExpression& e) const {
@@ -63,6 +74,7 @@ struct NearestExpression {
     const Expression& GetExpression() const { return expression; }
     Cost GetCost() const                    { return cost; }
     NumOccurrences GetNumOccurrences() const  { return num_occurrences; }
+    PatternID GetPatternID() const          { return pattern_id; }
 
  private:
     /// An expression that is near to target expression
@@ -71,15 +83,23 @@ struct NearestExpression {
     Cost cost;
     /// Number of occurrences of this expression in training dataset
     NumOccurrences num_occurrences;
+    /// Index of this expression in training dataset, if it is from there.
+    PatternID pattern_id;
 };
 using NearestExpressions = std::vector<NearestExpression>;
 using NearestExpressionKey = NearestExpression;
 using NearestExpressionHash = NearestExpression;
 using NearestExpressionSet = std::unordered_set<NearestExpressionKey,
                                                 NearestExpressionHash>;
-using ExpressionCombinationsAtCost = std::unordered_map<
-                                            NearestExpression::Expression,
-                                            NearestExpression::Cost>;
+struct TokenSequenceHash {
+  size_t operator()(const TokenSequence& tokens) const {
+    return HashBytes(reinterpret_cast<const char*>(tokens.data()),
+                     tokens.size() * sizeof(TokenID));
+  }
+};
+using ExpressionCombinationsAtCost = std::unordered_map<TokenSequence,
+                                            NearestExpression::Cost,
+                                            TokenSequenceHash>;
 // Map of GitHub accounts and their contributions of a certain pattern
 using PatternContributorsMap = std::unordered_map<size_t, size_t>;
 
@@ -87,8 +107,9 @@ class Trie {
  public:
   struct TrieNode {
    public:
-    TrieNode(char c, size_t num_occurrences = 0, bool terminal_node = false,
-              float confidence = 0) : c_(c), num_occurrences_(num_occurrences),
+    TrieNode(TokenID token, size_t num_occurrences = 0,
+              bool terminal_node = false, float confidence = 0) :
+              token_(token), num_occurrences_(num_occurrences),
               terminal_node_(terminal_node), confidence_(confidence) {
     }
 
@@ -98,12 +119,15 @@ class Trie {
       }
     }
 
-    char c_;
+    TokenID token_;
     size_t num_occurrences_;
     // Needed because internal nodes could be terminal nodes in trie.
     bool terminal_node_;
     float confidence_;
-    std::unordered_map<char, struct TrieNode*> children_;
+    // Index of the path ending at a terminal node in all_trie_paths.
+    NearestExpression::PatternID pattern_id_ =
+      NearestExpression::kInvalidPatternID;
+    std::unordered_map<TokenID, struct TrieNode*> children_;
     PatternContributorsMap pattern_contributors_;
   };
 
@@ -142,7 +166,11 @@ class Trie {
 
     std::string line;
     size_t line_no = 1;
+    model_fingerprint_ = kFNVOffsetBasis;
     while (std::getline(stream, line)) {
+      model_fingerprint_ = HashBytes(line.data(), line.length(),
+                                     model_fingerprint_);
+      model_fingerprint_ = HashBytes("\n", 1, model_fingerprint_);
       // We include original C expressions as comment for AST expression.
       // We do not want to insert C expressions in trie, just AST expressions.
       size_t comma_pos = 0;
@@ -166,15 +194,65 @@ class Trie {
 
   bool LookUp(const std::string& str, size_t& num_occurrences,
               float& confidence) const;
+  // Same as above but for an expression already compacted into tokens.
+  bool LookUp(const TokenSequence& tokens, size_t& num_occurrences,
+              float& confidence) const {
+    return LookUpShortExpr(tokens, num_occurrences, confidence);
+  }
 
   void Print(bool sorted = false) const;
   void PrintEditDistancesInTrainingSet() const;
 
   // Find expressions that are "nearest" to the input expression within the
-  // specified cost.
+  // specified cost. Search is split into chunks that run on thread_pool.
+  NearestExpressions SearchNearestExpressions(
+                  const NearestExpression::Expression& target_expression,
+                  NearestExpression::Cost max_cost,
+                  ThreadPool& thread_pool) const;
+  // Same as above but for an expression already compacted into tokens.
+  NearestExpressions SearchNearestExpressions(
+                  const TokenSequence& target_tokens,
+                  NearestExpression::Cost max_cost,
+                  ThreadPool& thread_pool) const;
+  // Same as above but using num_threads threads (including the calling
+  // thread) that are created just for this search.
   NearestExpressions SearchNearestExpressions(
                   const NearestExpression::Expression& target_expression,
                   NearestExpression::Cost max_cost, size_t num_threads) const;
+  NearestExpressions SearchNearestExpressions(
+                  const TokenSequence& target_tokens,
+                  NearestExpression::Cost max_cost, size_t num_threads) const;
+  // Find expressions that are "nearest" to every input expression within the
+  // specified cost. Every trie path is compared against all the expressions
+  // of the batch while it is hot in cache, so this is preferred over calling
+  // SearchNearestExpressions in a loop.
+  std::vector<NearestExpressions> SearchNearestExpressionsInBatch(
+                  const std::vector<NearestExpression::Expression>&
+                    target_expressions,
+                  NearestExpression::Cost max_cost) const;
+  // Same as above but for expressions already compacted into tokens.
+  std::vector<NearestExpressions> SearchNearestExpressionsInBatch(
+                  const std::vector<TokenSequence>& target_tokens,
+                  NearestExpression::Cost max_cost) const;
+  // Same as above but for the expressions from the training dataset itself,
+  // identified by their indices in [begin, end).
+  std::vector<NearestExpressions> SearchNearestExpressionsOfTrainingSet(
+                  size_t begin, size_t end,
+                  NearestExpression::Cost max_cost) const;
+
+  // Hash of the contents of the training dataset. Results computed over a
+  // trie are valid for another trie only if their fingerprints are equal.
+  uint64_t GetModelFingerprint() const { return model_fingerprint_; }
+
+  // Number of unique expressions in the training dataset
+  size_t GetNumExpressions() const { return all_trie_paths.size(); }
+  // Expression at the specified index in the training dataset along with its
+  // number of occurrences. Index should be less than GetNumExpressions().
+  NearestExpression GetExpression(size_t index) const;
+  // Number of occurrences of the expression at the specified index, without
+  // expanding the expression.
+  NearestExpression::NumOccurrences GetNumOccurrences(size_t index) const;
+
   // Sorts nearest possible expressions based on edit distance and
   // number of occurrences (ranking criteria).
   void SortAndRankResults(NearestExpressions& nearest_expressions) const;
@@ -183,30 +261,49 @@ class Trie {
   // anomaly at the percent threshold specified in anomaly_threshold?
   bool IsPotentialAnomaly(const NearestExpressions& nearest_expressions,
                           float anomaly_threshold) const;
+  // Same as above for num_expressions nearest expressions, given by cost_of
+  // and num_occurrences_of functions of their index, so that nearest
+  // expressions need not be expanded.
+  template <typename CostFn, typename NumOccurrencesFn>
+  static bool IsPotentialAnomaly(size_t num_expressions, CostFn cost_of,
+                                 NumOccurrencesFn num_occurrences_of,
+                                 float anomaly_threshold);
 
  private:
   // Interface function that accepts regular string/expression
   void Insert(const std::string& str, size_t line_no, size_t contributor_id);
 
   // Internal function that accepts compacted string/expression
-  void InsertShortExpr(const std::string& str, size_t line_no, size_t
+  void InsertShortExpr(const TokenSequence& tokens, size_t line_no, size_t
                        contributor_id);
-  bool LookUpShortExpr(const std::string& str, size_t& num_occurrences,
-                       float& confidence) const;
+  bool LookUpShortExpr(const TokenSequence& tokens, size_t& num_occurrences,
+                       float& confidence,
+                       NearestExpression::PatternID* pattern_id = nullptr)
+                       const;
+  // Node at the end of the path of tokens, or nullptr if there is no path.
+  TrieNode* FindNode(const TokenSequence& tokens) const;
 
   inline void GenerateListOfAllTriePaths() {
     // We expect to call this function only once per a trie.
     if (all_trie_paths.size() == 0) {
-      VisitAllLeafNodes([&](const std::string& trie_path,
+      VisitAllLeafNodes([&](const TokenSequence& trie_path,
           size_t num_occurrences,
           PatternContributorsMap pattern_contributors) {
         all_trie_paths.push_back(std::make_pair(trie_path, num_occurrences));
       });
+      // Order of visiting trie nodes depends on the order of elements in
+      // unordered maps. Sorting makes indices of the paths (which are used
+      // as pattern IDs) same across runs over the same training dataset.
+      std::sort(all_trie_paths.begin(), all_trie_paths.end());
+      for (size_t i = 0; i < all_trie_paths.size(); i++) {
+        FindNode(all_trie_paths[i].first)->pattern_id_ =
+          static_cast<NearestExpression::PatternID>(i);
+      }
     }
   }
 
   // Visitor that calls VisitorCallbackFn for every expression/string in trie
-  using VisitorCallbackFn = std::function<void(const std::string&, size_t,
+  using VisitorCallbackFn = std::function<void(const TokenSequence&, size_t,
                               PatternContributorsMap)>;
   void VisitAllLeafNodes(VisitorCallbackFn fn) const;
 
@@ -219,14 +316,14 @@ class Trie {
   // For more details, refer to
   // https://medium.com/@wolfgarbe/1000x-faster-spelling-correction-algorithm-2012-8701fcd87a5f
   NearestExpressions SearchNearestExpressionUsingSymmetricDelete(
-    const NearestExpression::Expression& target,
+    const TokenSequence& target,
     NearestExpression::Cost max_cost) const;
 
   // Helper function used by symmetric delete edit distance algorithm to
   // generate candidate expressions that are 'max_cost' deletes away from
   // the 'target' expression.
   void GenerateExpressionCombinationsUsingDelete(
-    const NearestExpression::Expression& target,
+    const TokenSequence& target,
     NearestExpression::Cost max_cost,
     ExpressionCombinationsAtCost& combinations) const;
 
@@ -238,14 +335,14 @@ class Trie {
   // 'target_expression'. Algorithm performance does not depend on size of
   // trie/dictionary.
   NearestExpressions SearchNearestExpressionsUsingCandidateGeneration(
-    const NearestExpression::Expression& target_expression,
+    const TokenSequence& target_expression,
     NearestExpression::Cost max_cost) const;
   // Generate expressions that are 'cost' distance away from target_expression
   // through replacement, deletion and insertion.
   void GenerateCandidateExpressions(
-    const NearestExpression::Expression& target_expression,
+    const TokenSequence& target_expression,
     NearestExpression::Cost cost,
-    NearestExpressionSet& set) const;
+    ExpressionCombinationsAtCost& candidates) const;
 
   // Algorithm to generate corrections of possibly mis-spelled expression
   // Algorithm goes over whole trie (in other words, training dataset) and
@@ -254,27 +351,93 @@ class Trie {
   //
   // Algorithm performs in O(N) time, where N is number of words in dictionary.
   NearestExpressions SearchNearestExpressionsUsingTrieTraversal(
-    const NearestExpression::Expression& target_expression,
-    NearestExpression::Cost max_cost, size_t max_threads) const;
+    const TokenSequence& target_expression,
+    NearestExpression::Cost max_cost, ThreadPool& thread_pool) const;
+
+  // Batched version of trie traversal algorithm that calculates edit distances
+  // of all the target expressions against one trie path at a time.
+  std::vector<NearestExpressions>
+  SearchNearestExpressionsInBatchUsingTrieTraversal(
+    const std::vector<TokenSequence>& target_expressions,
+    NearestExpression::Cost max_cost) const;
 
-  // Calculate edit distance between source and target expressions.
-  NearestExpression::Cost CalculateEditDistance(const std::string& source,
-    const std::string& target) const;
+  // Convert shortened nearest expressions into full expressions.
+  NearestExpressions ExpandNearestExpressions(
+    const NearestExpressions& short_nearest_expressions) const;
+
+  // Calculate edit distance (in tokens) between source and target
+  // expressions.
+  NearestExpression::Cost CalculateEditDistance(const TokenSequence& source,
+    const TokenSequence& target) const;
+  // Same as CalculateEditDistance, but stops as soon as the distance is known
+  // to exceed max_cost, in which case it returns max_cost + 1.
+  NearestExpression::Cost CalculateBoundedEditDistance(
+    const TokenSequence& source, const TokenSequence& target,
+    NearestExpression::Cost max_cost) const;
 
  private:
   /// Root of Trie
   struct TrieNode *root_;
   /// Set of alphabets from the language supported by trie. Generated while
   /// building trie.
-  std::unordered_set<char> alphabets_;
+  std::unordered_set<TokenID> alphabets_;
 
   /// Vector to store all trie paths (patterns) and their occurrences
   /// This is used to perform finding nearest expressions of a given
   /// expression in parallel.
-  std::vector<std::pair<std::string, size_t>> all_trie_paths;
+  std::vector<std::pair<TokenSequence, size_t>> all_trie_paths;
 
-  std::unordered_map<NearestExpression::Expression,
-                     std::unordered_set<size_t>>
+  uint64_t model_fingerprint_ = 0;
+
+  std::unordered_map<TokenSequence, std::unordered_set<size_t>,
+                     TokenSequenceHash>
     symmetric_delete_trie_combinations_;
 };
+
+// Expression is a potential anomaly if its occurrences at cost 0 are lesser
+// than the occurrences of all the nearest expressions at other costs.
+template <typename CostFn, typename NumOccurrencesFn>
+bool Trie::IsPotentialAnomaly(size_t num_expressions, CostFn cost_of,
+                              NumOccurrencesFn num_occurrences_of,
+                              float anomaly_threshold) {
+  const NearestExpression::Cost kZeroCost = 0;
+  size_t base_index = num_expressions;
+  for (size_t i = 0; i < num_expressions; i++) {
+    if (cost_of(i) == kZeroCost) {
+      base_index = i;
+      break;
+    }
+  }
+
+  // We should have atleast base expression and one more expression with
+  // non-zero cost.
+  if (base_index == num_expressions || num_expressions <= 1)
+    return false;
+
+  bool exprs_with_non_zero_cost_found = false;
+  for (size_t i = 0; i < num_expressions; i++) {
+    if (cost_of(i) != kZeroCost) {
+      exprs_with_non_zero_cost_found = true;
+      break;
+    }
+  }
+  if (!exprs_with_non_zero_cost_found)
+    return false;
+
+  // Perform check based on anomaly threshold.
+  NearestExpression::NumOccurrences base_occurrences =
+    num_occurrences_of(base_index);
+  for (size_t i = 0; i < num_expressions; i++) {
+    if (cost_of(i) == kZeroCost) continue;
+
+    float occurrences_percent =
+          (static_cast<float>(base_occurrences * 100)) /
+          static_cast<float>(num_occurrences_of(i));
+    if (occurrences_percent > anomaly_threshold)
+      return false;
+  }
+
+  return true;
+}
+
 #endif  // SRC_TRIE_H_
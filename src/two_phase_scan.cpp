@@ -0,0 +1,333 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT [build/c++11]
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <thread>  // NOLINT [build/c++11]
+#include <utility>
+
+#include "exception.h"
+#include "tree_abstraction.h"
+#include "two_phase_scan.h"
+
+namespace {
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+           std::chrono::steady_clock::now() - start).count();
+}
+}  // anonymous namespace
+
+uint32_t TwoPhaseScan::Expressions::Add(const TokenSequence& expression) {
+  auto result = indices_.emplace(expression,
+                                 static_cast<uint32_t>(tokens_.size()));
+  if (result.second) tokens_.push_back(expression);
+  return result.first->second;
+}
+
+void TwoPhaseScan::Run(const std::vector<std::string>& file_names,
+                       std::ostream& progress_out) {
+  files_.clear();
+  files_.resize(file_names.size());
+  for (auto* expressions : {&level_one_, &level_two_}) {
+    expressions->indices_.clear();
+    expressions->tokens_.clear();
+    expressions->verdicts_ = std::make_shared<
+      std::vector<TrainAndScanUtil::ExpressionVerdict>>();
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  switch (language_) {
+    case LANGUAGE_C: Collect<LANGUAGE_C>(file_names, progress_out); break;
+    case LANGUAGE_VERILOG:
+      Collect<LANGUAGE_VERILOG>(file_names, progress_out);
+      break;
+    case LANGUAGE_PHP: Collect<LANGUAGE_PHP>(file_names, progress_out); break;
+    case LANGUAGE_CPP: Collect<LANGUAGE_CPP>(file_names, progress_out); break;
+    default:
+      throw cf_unexpected_situation("Unsupported language:" +
+                                    std::to_string(LanguageToInt(language_)));
+  }
+  collect_seconds_ = SecondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  Resolve(progress_out);
+  resolve_seconds_ = SecondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  WriteReports(file_names, progress_out);
+  report_seconds_ = SecondsSince(start);
+}
+
+template <Language G>
+void TwoPhaseScan::Collect(const std::vector<std::string>& file_names,
+                           std::ostream& progress_out) {
+  FilePrefetcher file_prefetcher(file_names, config_.num_readers_,
+                                 config_.max_files_in_flight_);
+  ThreadPool& thread_pool = train_and_scan_util_.GetThreadPool();
+  size_t tenth_file_names = std::max<size_t>(1, file_names.size() / 10);
+  std::atomic<size_t> num_collected(0);
+  std::mutex progress_mutex;
+
+  // Every worker of the pool collects files until there are no more files.
+  size_t num_collectors = std::max<size_t>(1, thread_pool.GetNumWorkers());
+  thread_pool.ParallelFor(0, num_collectors, 1, [&](size_t, size_t) {
+    FilePrefetcher::File file;
+    while (file_prefetcher.Next(file)) {
+      CollectFile<G>(file);
+      // Report progress at every 10th % point.
+      size_t num_done = num_collected.fetch_add(1) + 1;
+      if (num_done % tenth_file_names == 0) {
+        std::unique_lock lock(progress_mutex);
+        progress_out << "Collect progress:" << num_done << "/"
+                     << file_names.size() << " ... in progress" << std::endl;
+      }
+    }
+  });
+
+  num_code_blocks_ = 0;
+  for (const auto& file : files_) {
+    num_code_blocks_ += file.code_blocks_.size();
+  }
+}
+
+template <Language G>
+void TwoPhaseScan::CollectFile(const FilePrefetcher::File& file) {
+  File& collected_file = files_[file.index_];
+  std::ostringstream log;
+  if (file.error_ != "") {
+    log << "Error:" << file.error_ << " ... skipping" << std::endl;
+    collected_file.log_ = log.str();
+    collected_file.error_ = file.error_;
+    return;
+  }
+
+  ManagedTSTree ts_tree;
+  code_blocks_t code_blocks;
+  std::string_view contents = file.contents_.contents();
+  collected_file.is_parsed_ = train_and_scan_util_.ParseFile<G>(contents,
+                                ts_tree, code_blocks, log);
+  collected_file.log_ = log.str();
+  if (!collected_file.is_parsed_) {
+    collected_file.error_ = "Parse failed";
+    return;
+  }
+
+  // Expressions are added to the shared sets once per file to keep the
+  // locks short.
+  std::vector<TokenSequence> level_one_tokens(code_blocks.size());
+  std::vector<TokenSequence> level_two_tokens(code_blocks.size());
+  std::vector<bool> has_level_two(code_blocks.size());
+  thread_local MultiLevelAbstraction abstraction;
+  collected_file.code_blocks_.resize(code_blocks.size());
+  for (size_t i = 0; i < code_blocks.size(); i++) {
+    MultiLevelAbstractor<G>::Abstract(code_blocks[i], abstraction);
+    level_one_tokens[i] = abstraction.level_one_tokens_;
+    has_level_two[i] = abstraction.has_level_two_;
+    if (abstraction.has_level_two_) {
+      level_two_tokens[i] = abstraction.level_two_tokens_;
+    }
+    TSPoint start = ts_node_start_point(code_blocks[i]);
+    collected_file.code_blocks_[i].row_ = start.row;
+    collected_file.code_blocks_[i].column_ = start.column;
+    collected_file.code_blocks_[i].source_expression_ =
+      OriginalSourceExpression(code_blocks[i], contents);
+  }
+
+  {
+    std::unique_lock lock(level_one_.mutex_);
+    for (size_t i = 0; i < code_blocks.size(); i++) {
+      collected_file.code_blocks_[i].level_one_ =
+        level_one_.Add(level_one_tokens[i]);
+    }
+  }
+  std::unique_lock lock(level_two_.mutex_);
+  for (size_t i = 0; i < code_blocks.size(); i++) {
+    if (has_level_two[i]) {
+      collected_file.code_blocks_[i].level_two_ =
+        level_two_.Add(level_two_tokens[i]);
+    }
+  }
+}
+
+void TwoPhaseScan::Resolve(std::ostream& progress_out) {
+  progress_out << "Resolving " << level_one_.tokens_.size() << " level "
+               << LevelToString<LEVEL_ONE>() << " and "
+               << level_two_.tokens_.size() << " level "
+               << LevelToString<LEVEL_TWO>() << " unique expressions of "
+               << num_code_blocks_ << " code blocks" << std::endl;
+  train_and_scan_util_.ComputeVerdicts<LEVEL_ONE>(level_one_.tokens_,
+                                                  *level_one_.verdicts_);
+  train_and_scan_util_.ComputeVerdicts<LEVEL_TWO>(level_two_.tokens_,
+                                                  *level_two_.verdicts_);
+}
+
+std::string TwoPhaseScan::FormatReport(const std::string& file_name,
+                                       const File& file) const {
+  std::ostringstream log;
+  log << "[TID=" << std::this_thread::get_id() << "] "
+      << "Scanning File: " << file_name << std::endl;
+  log << file.log_;
+  if (!file.is_parsed_) return log.str();
+
+  TrainAndScanUtil::ScanSummary summary;
+  for (const auto& code_block : file.code_blocks_) {
+    const auto& level_one_verdict =
+      (*level_one_.verdicts_)[code_block.level_one_];
+    const auto* level_two_verdict = code_block.level_two_ != kNoExpression ?
+      &(*level_two_.verdicts_)[code_block.level_two_] : nullptr;
+    bool is_level1_hit = level_one_verdict.found_in_training_dataset_;
+    bool is_level2_hit = level_two_verdict &&
+                         level_two_verdict->found_in_training_dataset_;
+    // Results of the code blocks go to the result sink, if there is one.
+    // Location is formatted only for the code blocks that are reported.
+    bool should_report =
+      train_and_scan_util_.ShouldReport(LEVEL_ONE, level_one_verdict) ||
+      (level_two_verdict &&
+       train_and_scan_util_.ShouldReport(LEVEL_TWO, *level_two_verdict));
+    if (!config_.result_sink_ && should_report) {
+      std::string location = TrainAndScanUtil::FormatSourceLocation(
+                               file_name, code_block.row_, code_block.column_,
+                               code_block.source_expression_);
+      train_and_scan_util_.ReportVerdict<LEVEL_ONE>(level_one_verdict,
+                                                    location, log);
+      if (level_two_verdict) {
+        train_and_scan_util_.ReportVerdict<LEVEL_TWO>(*level_two_verdict,
+                                                      location, log);
+      }
+    }
+    if (is_level1_hit) {
+      summary.level1_hit_++;
+    } else {
+      summary.level1_miss_++;
+    }
+    if (is_level2_hit) {
+      summary.level2_hit_++;
+    } else {
+      summary.level2_miss_++;
+    }
+    if (is_level1_hit || is_level2_hit) {
+      summary.num_expressions_found_++;
+    } else {
+      summary.num_expressions_not_found_++;
+    }
+    summary.num_total_expressions_++;
+  }
+  train_and_scan_util_.ReportScanSummary(file_name, summary, log);
+  return log.str();
+}
+
+void TwoPhaseScan::AddResults(size_t file_index,
+    const std::string& file_name, const File& file) const {
+  FileResults file_results;
+  file_results.file_index_ = file_index;
+  file_results.file_name_ = file_name;
+  file_results.error_ = file.error_;
+  using Verdict = TrainAndScanUtil::ExpressionVerdict;
+  using ExpandedVerdict = TrainAndScanUtil::ExpandedVerdict;
+  auto add_result = [&](TreeLevel level, const CodeBlock& code_block,
+                        const Expressions& expressions, uint32_t index) {
+    const Verdict& verdict = (*expressions.verdicts_)[index];
+    if (!train_and_scan_util_.ShouldReport(level, verdict)) return;
+    TrainAndScanUtil::ScanResult result;
+    result.level_ = level;
+    result.row_ = code_block.row_;
+    result.column_ = code_block.column_;
+    result.source_expression_ = code_block.source_expression_;
+    result.verdict_ = std::make_shared<const ExpandedVerdict>(
+                        train_and_scan_util_.ExpandVerdict(level, verdict));
+    result.is_potential_anomaly_ = TrainAndScanUtil::IsReportedAnomaly(level,
+                                                                     verdict);
+    file_results.results_.push_back(std::move(result));
+  };
+  for (const auto& code_block : file.code_blocks_) {
+    add_result(LEVEL_ONE, code_block, level_one_, code_block.level_one_);
+    if (code_block.level_two_ != kNoExpression) {
+      add_result(LEVEL_TWO, code_block, level_two_, code_block.level_two_);
+    }
+  }
+  config_.result_sink_->Add(std::move(file_results));
+}
+
+void TwoPhaseScan::WriteReports(const std::vector<std::string>& file_names,
+                                std::ostream& progress_out) {
+  ThreadPool& thread_pool = train_and_scan_util_.GetThreadPool();
+  const size_t num_log_files = std::max<size_t>(1,
+                                                thread_pool.GetNumWorkers());
+  std::vector<std::ofstream> log_files;
+  for (size_t i = 0; i < num_log_files; i++) {
+    std::string log_file_name = config_.log_dir_ + "/thread_" +
+                                std::to_string(i) + ".log";
+    log_files.emplace_back(log_file_name.c_str());
+    if (!log_files.back().is_open()) {
+      throw cf_file_access_exception("Open failed:" + log_file_name);
+    }
+  }
+
+  // Reports of a block of files are formatted in parallel and then written
+  // in file order. Locations of the reported files are released as we go.
+  const size_t kFilesPerBlock = 256;
+  size_t tenth_file_names = std::max<size_t>(1, file_names.size() / 10);
+  std::vector<std::string> reports;
+  for (size_t block_begin = 0; block_begin < files_.size();
+       block_begin += kFilesPerBlock) {
+    size_t block_end = std::min(block_begin + kFilesPerBlock, files_.size());
+    reports.assign(block_end - block_begin, "");
+    thread_pool.ParallelFor(block_begin, block_end, 1,
+                            [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        reports[i - block_begin] = FormatReport(file_names[i], files_[i]);
+        if (config_.result_sink_) AddResults(i, file_names[i], files_[i]);
+        files_[i] = File();
+      }
+    });
+    for (size_t i = block_begin; i < block_end; i++) {
+      log_files[i % num_log_files] << reports[i - block_begin];
+      // Report progress at every 10th % point.
+      if ((i + 1) % tenth_file_names == 0) {
+        progress_out << "Scan progress:" << i + 1 << "/"
+                     << file_names.size() << " ... in progress" << std::endl;
+      }
+    }
+  }
+  for (auto& log_file : log_files) {
+    log_file.close();
+  }
+}
+
+void TwoPhaseScan::ReportStatistics(std::ostream& out) const {
+  std::ostringstream report;
+  report << std::fixed << std::setprecision(2)
+         << "Two-phase scan: " << files_.size() << " files, "
+         << num_code_blocks_ << " code blocks, "
+         << level_one_.tokens_.size() << " unique level "
+         << LevelToString<LEVEL_ONE>() << " expressions, "
+         << level_two_.tokens_.size() << " unique level "
+         << LevelToString<LEVEL_TWO>() << " expressions" << std::endl
+         << "Phase collect: " << collect_seconds_ << "s" << std::endl
+         << "Phase resolve: " << resolve_seconds_ << "s" << std::endl
+         << "Phase report: " << report_seconds_ << "s" << std::endl;
+  out << report.str();
+}
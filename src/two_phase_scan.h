@@ -0,0 +1,141 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SRC_TWO_PHASE_SCAN_H_
+#define SRC_TWO_PHASE_SCAN_H_
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>  // NOLINT [build/c++11]
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common_util.h"
+#include "file_prefetcher.h"
+#include "result_sink.h"
+#include "train_and_scan_util.h"
+#include "trie.h"
+
+/// Scan files in two phases, so that every unique expression is searched
+/// for its nearest expressions only once, however many times it occurs:
+///
+///   1. collect: files are read (see FilePrefetcher), parsed and abstracted.
+///      Unique level one and level two expressions are collected, along with
+///      the locations of the code blocks that have them.
+///   2. resolve: verdicts of the unique expressions are computed in batches
+///      that run in parallel (see TrainAndScanUtil::ComputeVerdicts).
+///   3. report: reports of the code blocks are written in file order.
+///
+/// Unlike ScanPipeline, which searches an expression as soon as it finds it,
+/// this does not search expressions that another thread is about to search,
+/// and searches are batched. The price is keeping the locations of all the
+/// code blocks in memory until they are reported.
+class TwoPhaseScan {
+ public:
+  struct Config {
+    size_t num_readers_ = FilePrefetcher::kDefaultNumReaders;
+    size_t max_files_in_flight_ = FilePrefetcher::kDefaultMaxFilesInFlight;
+    /// Report of file i is written to log_dir_/thread_j.log, where j is i
+    /// modulo the number of threads of TrainAndScanUtil.
+    std::string log_dir_ = "/tmp/";
+    /// See ScanPipeline::Config::result_sink_.
+    ResultSink* result_sink_ = nullptr;
+  };
+
+  TwoPhaseScan(const TrainAndScanUtil& train_and_scan_util,
+               Language language, const Config& config)
+    : train_and_scan_util_(train_and_scan_util), language_(language),
+      config_(config) {}
+
+  /// Scan files and wait for the scan to complete. Progress is reported on
+  /// progress_out.
+  void Run(const std::vector<std::string>& file_names,
+           std::ostream& progress_out);
+
+  /// Print the number of code blocks and unique expressions, and the time
+  /// taken by every phase of the last run.
+  void ReportStatistics(std::ostream& out) const;
+
+ private:
+  static const uint32_t kNoExpression = UINT32_MAX;
+
+  struct CodeBlock {
+    /// Position (0-based) and source of the code block.
+    size_t row_ = 0;
+    size_t column_ = 0;
+    std::string source_expression_;
+    /// Indices of the unique expressions of the code block.
+    uint32_t level_one_ = kNoExpression;
+    uint32_t level_two_ = kNoExpression;
+  };
+  struct File {
+    bool is_parsed_ = false;
+    /// Errors found while reading or parsing.
+    std::string log_;
+    /// Error reported to the result sink, if any.
+    std::string error_;
+    std::vector<CodeBlock> code_blocks_;
+  };
+
+  /// Unique expressions of a level and their verdicts.
+  struct Expressions {
+    std::mutex mutex_;
+    std::unordered_map<TokenSequence, uint32_t, TokenSequenceHash> indices_;
+    std::vector<TokenSequence> tokens_;
+    /// Shared with the results handed over to a ResultSink, which may
+    /// outlive the scan.
+    std::shared_ptr<std::vector<TrainAndScanUtil::ExpressionVerdict>>
+      verdicts_;
+
+    /// Index of expression, which is added if it is new. Needs mutex_.
+    uint32_t Add(const TokenSequence& expression);
+  };
+
+  template <Language G>
+  void Collect(const std::vector<std::string>& file_names,
+               std::ostream& progress_out);
+  template <Language G>
+  void CollectFile(const FilePrefetcher::File& file);
+  void Resolve(std::ostream& progress_out);
+  void WriteReports(const std::vector<std::string>& file_names,
+                    std::ostream& progress_out);
+  std::string FormatReport(const std::string& file_name,
+                           const File& file) const;
+  void AddResults(size_t file_index, const std::string& file_name,
+                  const File& file) const;
+
+  const TrainAndScanUtil& train_and_scan_util_;
+  Language language_;
+  Config config_;
+
+  std::vector<File> files_;
+  Expressions level_one_;
+  Expressions level_two_;
+
+  size_t num_code_blocks_ = 0;
+  double collect_seconds_ = 0;
+  double resolve_seconds_ = 0;
+  double report_seconds_ = 0;
+};
+
+#endif  // SRC_TWO_PHASE_SCAN_H_
@@ -0,0 +1,122 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef SRC_VERDICT_TABLE_H_
+#define SRC_VERDICT_TABLE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+/// Table of verdicts of scanning code blocks, keyed by structural hashes of
+/// the code blocks (see HashCodeBlock). Code blocks of the same shape (e.g.,
+/// if (ret < 0)) repeat a lot in a codebase, and the table lets scanner
+/// threads reuse the verdict of the first one for the rest.
+///
+/// Table lives for one scan and is shared by all the scanner threads. It is
+/// split into shards, each with its own lock. Verdicts are never evicted;
+/// instead, table stops growing once it has max_entries verdicts. The shapes
+/// that repeat the most are also the ones that are likely to be seen first.
+template <typename Verdict>
+class VerdictTable {
+ public:
+  using Hash = uint64_t;
+  using VerdictPtr = std::shared_ptr<const Verdict>;
+
+  struct Statistics {
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    size_t num_entries_ = 0;
+  };
+
+  static const size_t kNumShards = 64;
+
+  /// Table with max_entries of 0 stores nothing.
+  explicit VerdictTable(size_t max_entries)
+    : max_entries_per_shard_((max_entries + kNumShards - 1) / kNumShards) {
+    for (size_t i = 0; i < kNumShards; i++)
+      shards_.push_back(std::make_unique<Shard>());
+  }
+  VerdictTable(const VerdictTable&) = delete;
+  VerdictTable& operator=(const VerdictTable&) = delete;
+
+  bool IsEnabled() const { return max_entries_per_shard_ > 0; }
+
+  /// Returns nullptr if there is no verdict for the hash.
+  VerdictPtr LookUp(Hash hash) const {
+    const Shard& shard = GetShard(hash);
+    std::shared_lock lock(shard.mutex_);
+    auto it = shard.verdicts_.find(hash);
+    if (it == shard.verdicts_.end()) {
+      shard.misses_++;
+      return nullptr;
+    }
+    shard.hits_++;
+    return it->second;
+  }
+
+  /// Insert verdict for the hash unless the table is full. If another thread
+  /// inserted a verdict for the hash already, then it is kept.
+  void Insert(Hash hash, VerdictPtr verdict) {
+    Shard& shard = GetShard(hash);
+    std::unique_lock lock(shard.mutex_);
+    if (shard.verdicts_.size() >= max_entries_per_shard_) return;
+    shard.verdicts_.emplace(hash, std::move(verdict));
+  }
+
+  Statistics GetStatistics() const {
+    Statistics statistics;
+    for (const auto& shard : shards_) {
+      std::shared_lock lock(shard->mutex_);
+      statistics.hits_ += shard->hits_;
+      statistics.misses_ += shard->misses_;
+      statistics.num_entries_ += shard->verdicts_.size();
+    }
+    return statistics;
+  }
+
+ private:
+  /// Shards are cache-line aligned so that threads working on different
+  /// shards do not share cache lines.
+  struct alignas(64) Shard {
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<Hash, VerdictPtr> verdicts_;
+    /// Updated under shared lock, hence atomic.
+    mutable std::atomic<size_t> hits_{0};
+    mutable std::atomic<size_t> misses_{0};
+  };
+
+  // Use high bits for selecting shard since low bits select the bucket in
+  // the shard's hash table. kNumShards is 2^6, hence top 6 bits.
+  const Shard& GetShard(Hash hash) const {
+    return *shards_[(hash >> 58) & (kNumShards - 1)];
+  }
+  Shard& GetShard(Hash hash) {
+    return *shards_[(hash >> 58) & (kNumShards - 1)];
+  }
+
+  size_t max_entries_per_shard_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+#endif  // SRC_VERDICT_TABLE_H_
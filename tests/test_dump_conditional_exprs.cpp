@@ -18,10 +18,20 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "test_common.h"
 #include "common_util.h"
+#include "incremental_document.h"
+#include "train_and_scan_util.h"
+#include "tree_abstraction.h"
+#include "two_phase_scan.h"
 
 namespace {
 template <Language G>
@@ -215,6 +225,473 @@ TestResult Test12() {
     " return x;\n"\
     "}", kExpectedCodeBlocks);
 }
+
+// Tokens emitted from the tree should be same as the tokens of the compacted
+// string of the tree, for each level.
+template <Language G>
+TestResult CompareNodeToTokensWithNodeToString(
+    const std::string& code_to_parse) {
+  try {
+    const bool kReportParseErrors = true;
+    ManagedTSTree ts_tree = GetTSTree<G>(code_to_parse, kReportParseErrors);
+
+    code_blocks_t code_blocks;
+    CollectCodeBlocksOfInterest<G>(ts_tree, code_blocks);
+    if (code_blocks.empty()) return TEST_FAILURE;
+    for (const auto& code_block : code_blocks) {
+      TokenSequence expected_tokens, tokens;
+      ExpressionCompacter::Get().Compact(
+        NodeToString<LEVEL_ONE, G>(code_block), expected_tokens);
+      NodeToTokens<LEVEL_ONE, G>(code_block, tokens);
+      if (tokens != expected_tokens) return TEST_FAILURE;
+
+      // Single traversal should produce same tokens for both levels.
+      MultiLevelAbstraction abstraction;
+      MultiLevelAbstractor<G>::Abstract(code_block, abstraction);
+      if (abstraction.level_one_tokens_ != expected_tokens ||
+          !abstraction.has_level_two_) return TEST_FAILURE;
+      ExpressionCompacter::Get().Compact(
+        NodeToString<LEVEL_TWO, G>(code_block), expected_tokens);
+      if (abstraction.level_two_tokens_ != expected_tokens)
+        return TEST_FAILURE;
+    }
+    return TEST_SUCCESS;
+  } catch(std::exception& e) {
+    return TEST_FAILURE;
+  }
+}
+
+// NodeToTokens for C language with binary, unary and assignment expressions
+TestResult Test13() {
+  return CompareNodeToTokensWithNodeToString<LANGUAGE_C>(
+    "int foo() {\n"\
+    " int x, y;\n" \
+    " if (x > 0 && !y) x++;\n" \
+    " if ((x = foo()) != -1) y--;\n" \
+    " return x;\n"\
+    "}");
+}
+
+// NodeToTokens for C++ language with field expressions
+TestResult Test14() {
+  return CompareNodeToTokensWithNodeToString<LANGUAGE_CPP>(
+    "int foo() {\n"\
+    " X obj_x;\n" \
+    " if (obj_x.x >= 100 || obj_x.y == nullptr) obj_x.x++;\n" \
+    " return obj_x.x;\n"\
+    "}");
+}
+
+// Level 2 abstraction classifies nodes by their symbols
+TestResult Test15() {
+  try {
+    const bool kReportParseErrors = true;
+    ManagedTSTree ts_tree = GetTSTree<LANGUAGE_C>(
+      "int foo(int x, int* p) {\n"\
+      " if (x >= 0 && !*p) x++;\n" \
+      " return x;\n"\
+      "}", kReportParseErrors);
+
+    code_blocks_t code_blocks;
+    CollectCodeBlocksOfInterest<LANGUAGE_C>(ts_tree, code_blocks);
+    if (code_blocks.size() != 1) return TEST_FAILURE;
+    const std::string kExpected =
+      "(parenthesized_expression (binary_expression (\"&&\") "
+      "(non_terminal_expression) (non_terminal_expression)))";
+    return NodeToString<LEVEL_TWO, LANGUAGE_C>(code_blocks[0]) == kExpected ?
+           TEST_SUCCESS : TEST_FAILURE;
+  } catch(std::exception& e) {
+    return TEST_FAILURE;
+  }
+}
+
+// Positive test for C language with nested and sibling if-statements
+TestResult Test16() {
+  const size_t kExpectedCodeBlocks = 4;
+  return ParseStringWithTSParser<LANGUAGE_C>(
+    "int foo(int x) {\n"\
+    " if (x > 0) {\n" \
+    "   if (x > 1) {\n" \
+    "     if (x > 2) x++;\n" \
+    "   }\n" \
+    " }\n" \
+    " if (x < 0) x--;\n" \
+    " return x;\n"\
+    "}", kExpectedCodeBlocks);
+}
+
+// Collect code blocks only from a byte range of C source
+TestResult Test17() {
+  const std::string kSource =
+    "int foo(int x) {\n"\
+    " if (x > 0) x++;\n" \
+    " if (x < 0) x--;\n" \
+    " return x;\n"\
+    "}";
+  try {
+    const bool kReportParseErrors = true;
+    ManagedTSTree ts_tree = GetTSTree<LANGUAGE_C>(kSource,
+                                                  kReportParseErrors);
+    uint32_t start_byte = static_cast<uint32_t>(kSource.find("if (x < 0)"));
+    code_blocks_t code_blocks;
+    CollectCodeBlocksOfInterest<LANGUAGE_C>(ts_tree, start_byte,
+      static_cast<uint32_t>(kSource.size()), code_blocks);
+    return code_blocks.size() == 1 &&
+           ts_node_start_byte(code_blocks[0]) > start_byte ?
+           TEST_SUCCESS : TEST_FAILURE;
+  } catch(std::exception& e) {
+    return TEST_FAILURE;
+  }
+}
+
+// Code blocks of the same shape have the same structural hash and the same
+// abstractions, and code blocks with different operators do not.
+TestResult Test18() {
+  const std::string kSource =
+    "int foo(int x, int y) {\n"\
+    " if (x > 0) x++;\n" \
+    " if (y > 1) y++;\n" \
+    " if (x < 0) x--;\n" \
+    " return x;\n"\
+    "}";
+  try {
+    const bool kReportParseErrors = true;
+    ManagedTSTree ts_tree = GetTSTree<LANGUAGE_C>(kSource,
+                                                  kReportParseErrors);
+    code_blocks_t code_blocks;
+    CollectCodeBlocksOfInterest<LANGUAGE_C>(ts_tree, code_blocks);
+    if (code_blocks.size() != 3) return TEST_FAILURE;
+
+    uint64_t hashes[3];
+    for (size_t i = 0; i < code_blocks.size(); i++) {
+      if (!HashCodeBlock<LANGUAGE_C>(code_blocks[i], hashes[i]))
+        return TEST_FAILURE;
+    }
+    MultiLevelAbstraction first, second;
+    MultiLevelAbstractor<LANGUAGE_C>::Abstract(code_blocks[0], first);
+    MultiLevelAbstractor<LANGUAGE_C>::Abstract(code_blocks[1], second);
+    return hashes[0] == hashes[1] && hashes[0] != hashes[2] &&
+           first.level_one_tokens_ == second.level_one_tokens_ &&
+           first.level_two_tokens_ == second.level_two_tokens_ ?
+           TEST_SUCCESS : TEST_FAILURE;
+  } catch(std::exception& e) {
+    return TEST_FAILURE;
+  }
+}
+
+// Scanning a file whose code blocks are split into tasks that run in
+// parallel reports the code blocks in source order, as a serial scan does.
+TestResult Test19() {
+  const char* kOperators[] = {">", "<", "==", "!="};
+  std::string source;
+  for (size_t i = 0; i < 100; i++) {
+    source += "int f" + std::to_string(i) + "(int x, int y) {\n" +
+              " if (x " + kOperators[i % 4] + " y" + std::to_string(i) +
+              ") return x;\n return y;\n}\n";
+  }
+  const std::string kTrainingDataset = "/tmp/test_dump_conditional_exprs_19";
+  {
+    std::ofstream training_dataset(kTrainingDataset.c_str());
+    training_dataset <<
+      "//if (x > y)\n" \
+      "0,AST_expression_ONE:(ifstmt (\">\")(var (x))(var (y)))\n" \
+      "//if (x > y)\n" \
+      "0,AST_expression_TWO:(ifstmt (\">\")(var (x))(var (y)))\n";
+  }
+
+  try {
+    TrainAndScanUtil::ScanConfig config;
+    config.num_threads_ = 4;
+    config.code_blocks_per_task_ = 3;
+    TrainAndScanUtil train_and_scan_util(config);
+    std::ostringstream training_log;
+    train_and_scan_util.ReadTrainingDatasetFromFile(kTrainingDataset,
+                                                    training_log);
+    remove(kTrainingDataset.c_str());
+
+    std::ostringstream parallel_report;
+    train_and_scan_util.ScanFile<LANGUAGE_C>("test.c", source,
+                                             parallel_report);
+
+    ManagedTSTree ts_tree;
+    code_blocks_t code_blocks;
+    std::ostringstream serial_report;
+    if (!train_and_scan_util.ParseFile<LANGUAGE_C>(source, ts_tree,
+                                                   code_blocks, serial_report))
+      return TEST_FAILURE;
+    TrainAndScanUtil::ScanSummary summary;
+    train_and_scan_util.ScanCodeBlocks<LANGUAGE_C>("test.c", source,
+        code_blocks, 0, code_blocks.size(), summary, serial_report);
+
+    return code_blocks.size() == 100 && summary.num_total_expressions_ == 100 &&
+           parallel_report.str() == serial_report.str() ?
+           TEST_SUCCESS : TEST_FAILURE;
+  } catch(std::exception& e) {
+    remove(kTrainingDataset.c_str());
+    return TEST_FAILURE;
+  }
+}
+
+// Two-phase scan reports every code block of every file as ScanFile does,
+// while collecting every repeated expression only once.
+TestResult Test20() {
+  char log_dir[] = "/tmp/test_dump_conditional_exprs_20.XXXXXX";
+  if (mkdtemp(log_dir) == nullptr) return TEST_FAILURE;
+  const std::string kLogDir = log_dir;
+  const std::string kTrainingDataset = kLogDir + "/training_dataset";
+  const std::string kLogFile = kLogDir + "/thread_0.log";
+  std::vector<std::string> file_names = {kLogDir + "/a.c",
+                                         kLogDir + "/b.c"};
+  {
+    std::ofstream training_dataset(kTrainingDataset.c_str());
+    training_dataset <<
+      "//if (x > y)\n" \
+      "0,AST_expression_ONE:(ifstmt (\">\")(var (x))(var (y)))\n" \
+      "//if (x > y)\n" \
+      "0,AST_expression_TWO:(ifstmt (\">\")(var (x))(var (y)))\n";
+    std::ofstream a(file_names[0].c_str());
+    a << "int f(int x, int y) {\n if (x > y) x++;\n if (x > y) y++;\n"
+      << " if (x == 0) return 1;\n return 0;\n}\n";
+    std::ofstream b(file_names[1].c_str());
+    b << "int g(int x, int y) {\n if (x > y) return x;\n return y;\n}\n";
+  }
+  auto cleanup = [&]() {
+    for (const auto& file_name : file_names) remove(file_name.c_str());
+    remove(kTrainingDataset.c_str());
+    remove(kLogFile.c_str());
+    rmdir(kLogDir.c_str());
+  };
+
+  try {
+    TrainAndScanUtil::ScanConfig config;
+    config.num_threads_ = 1;
+    TrainAndScanUtil train_and_scan_util(config);
+    std::ostringstream training_log;
+    train_and_scan_util.ReadTrainingDatasetFromFile(kTrainingDataset,
+                                                    training_log);
+
+    TwoPhaseScan::Config scan_config;
+    scan_config.log_dir_ = kLogDir;
+    TwoPhaseScan two_phase_scan(train_and_scan_util, LANGUAGE_C,
+                                scan_config);
+    std::ostringstream progress;
+    two_phase_scan.Run(file_names, progress);
+    std::ostringstream statistics;
+    two_phase_scan.ReportStatistics(statistics);
+
+    // Reports are the same except for the line naming the file.
+    std::ostringstream two_phase_report;
+    std::ifstream log_file(kLogFile.c_str());
+    std::string line;
+    while (std::getline(log_file, line)) {
+      if (line.rfind("[TID=", 0) != 0) two_phase_report << line << "\n";
+    }
+    std::ostringstream expected_report;
+    for (const auto& file_name : file_names) {
+      train_and_scan_util.ScanFile<LANGUAGE_C>(file_name, expected_report);
+    }
+    cleanup();
+
+    return two_phase_report.str() == expected_report.str() &&
+           statistics.str().find("4 code blocks, 2 unique level ONE") !=
+             std::string::npos ? TEST_SUCCESS : TEST_FAILURE;
+  } catch(std::exception& e) {
+    cleanup();
+    return TEST_FAILURE;
+  }
+}
+
+// In anomalies-only mode, a scan reports the potential anomalies that a full
+// scan reports, and nothing about the code blocks that are okay.
+TestResult Test21() {
+  char log_dir[] = "/tmp/test_dump_conditional_exprs_21.XXXXXX";
+  if (mkdtemp(log_dir) == nullptr) return TEST_FAILURE;
+  const std::string kLogDir = log_dir;
+  const std::string kTrainingDataset = kLogDir + "/training_dataset";
+  const std::string kSourceFile = kLogDir + "/a.c";
+  {
+    std::ofstream training_dataset(kTrainingDataset.c_str());
+    training_dataset <<
+      "//if (x > y)\n" \
+      "0,AST_expression_ONE:(ifstmt (\">\")(var (x))(var (y)))\n" \
+      "//if (x > y)\n" \
+      "0,AST_expression_TWO:(ifstmt (\">\")(var (x))(var (y)))\n";
+    std::ofstream a(kSourceFile.c_str());
+    a << "int f(int x, int y) {\n if (x > y) x++;\n if (x >= y) y++;\n"
+      << " if (x == 0) return 1;\n return 0;\n}\n";
+  }
+  auto cleanup = [&]() {
+    remove(kSourceFile.c_str());
+    remove(kTrainingDataset.c_str());
+    rmdir(kLogDir.c_str());
+  };
+  auto count = [](const std::string& report, const std::string& text) {
+    size_t num_found = 0;
+    for (size_t pos = report.find(text); pos != std::string::npos;
+         pos = report.find(text, pos + 1)) {
+      num_found++;
+    }
+    return num_found;
+  };
+
+  try {
+    std::string reports[2];
+    for (bool anomalies_only : {false, true}) {
+      TrainAndScanUtil::ScanConfig config;
+      config.num_threads_ = 1;
+      config.anomalies_only_ = anomalies_only;
+      TrainAndScanUtil train_and_scan_util(config);
+      std::ostringstream training_log;
+      train_and_scan_util.ReadTrainingDatasetFromFile(kTrainingDataset,
+                                                      training_log);
+      std::ostringstream report;
+      train_and_scan_util.ScanFile<LANGUAGE_C>(kSourceFile, report);
+      reports[anomalies_only] = report.str();
+    }
+    cleanup();
+
+    const std::string kAnomaly = "Expression is Potential anomaly";
+    const std::string kOkay = "Expression is Okay";
+    return count(reports[0], kOkay) > 0 &&
+           count(reports[1], kOkay) == 0 &&
+           count(reports[1], kAnomaly) == count(reports[0], kAnomaly) &&
+           count(reports[1], "Level:") == count(reports[1], kAnomaly) ?
+           TEST_SUCCESS : TEST_FAILURE;
+  } catch(std::exception& e) {
+    cleanup();
+    return TEST_FAILURE;
+  }
+}
+
+// Edits of a document are scanned incrementally: only the code blocks that
+// an edit changed are scanned again, and the results are the same as the
+// results of scanning the edited text from scratch.
+TestResult Test22() {
+  char log_dir[] = "/tmp/test_dump_conditional_exprs_22.XXXXXX";
+  if (mkdtemp(log_dir) == nullptr) return TEST_FAILURE;
+  const std::string kLogDir = log_dir;
+  const std::string kTrainingDataset = kLogDir + "/training_dataset";
+  {
+    std::ofstream training_dataset(kTrainingDataset.c_str());
+    training_dataset <<
+      "//if (x > y)\n" \
+      "0,AST_expression_ONE:(ifstmt (\">\")(var (x))(var (y)))\n" \
+      "//if (x > y)\n" \
+      "0,AST_expression_TWO:(ifstmt (\">\")(var (x))(var (y)))\n";
+  }
+  auto cleanup = [&]() {
+    remove(kTrainingDataset.c_str());
+    rmdir(kLogDir.c_str());
+  };
+  using CodeBlockResults = IncrementalDocument::CodeBlockResults;
+  auto is_same = [](const std::vector<CodeBlockResults>& a,
+                    const std::vector<CodeBlockResults>& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+      if (a[i].start_byte_ != b[i].start_byte_ ||
+          a[i].end_byte_ != b[i].end_byte_ ||
+          a[i].results_.size() != b[i].results_.size()) return false;
+      for (size_t j = 0; j < a[i].results_.size(); j++) {
+        const auto& result_a = a[i].results_[j];
+        const auto& result_b = b[i].results_[j];
+        if (result_a.level_ != result_b.level_ ||
+            result_a.is_potential_anomaly_ !=
+              result_b.is_potential_anomaly_ ||
+            result_a.verdict_->expression_ !=
+              result_b.verdict_->expression_) return false;
+      }
+    }
+    return true;
+  };
+
+  try {
+    TrainAndScanUtil::ScanConfig config;
+    config.num_threads_ = 1;
+    TrainAndScanUtil train_and_scan_util(config);
+    std::ostringstream log;
+    train_and_scan_util.ReadTrainingDatasetFromFile(kTrainingDataset, log);
+    cleanup();
+
+    IncrementalDocument document(train_and_scan_util, LANGUAGE_C, "a.c");
+    document.SetText("int f(int x, int y) {\n if (x > y) x++;\n"
+                     " if (x >= y) y++;\n if (x == 0) return 1;\n"
+                     " return 0;\n}\n", log);
+    bool is_correct = document.GetNumScannedCodeBlocks() == 3 &&
+                      document.GetCodeBlocks().size() == 3;
+
+    // Edit a token of a condition.
+    size_t offset = document.GetText().find(">=");
+    document.Edit(offset, offset + 2, ">", log);
+    is_correct = is_correct && document.GetNumScannedCodeBlocks() == 1;
+    // Insert a statement before the others, which move.
+    offset = document.GetText().find(" if");
+    document.Edit(offset, offset, " if (y > x) x--;\n", log);
+    is_correct = is_correct && document.GetCodeBlocks().size() == 4 &&
+                 document.GetNumScannedCodeBlocks() < 4;
+    // Delete a statement.
+    offset = document.GetText().find(" if (x == 0)");
+    document.Edit(offset, document.GetText().find(" return 0;"), "", log);
+    is_correct = is_correct && document.GetCodeBlocks().size() == 3;
+
+    IncrementalDocument scanned_document(train_and_scan_util, LANGUAGE_C,
+                                         "a.c");
+    scanned_document.SetText(document.GetText(), log);
+    is_correct = is_correct && is_same(document.GetCodeBlocks(),
+                                       scanned_document.GetCodeBlocks());
+    return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+  } catch(std::exception& e) {
+    cleanup();
+    return TEST_FAILURE;
+  }
+}
+// Scanning a file whose code blocks are split into parallel tasks does not
+// deadlock when the tasks search for the same expression, which is not
+// cached yet, while the search itself runs in parallel.
+TestResult Test23() {
+  const size_t kNumCodeBlocks = 600;
+  std::string source = "int f(int ret) {\n";
+  for (size_t i = 0; i < kNumCodeBlocks; i++) {
+    source += " if (ret < 0) return ret;\n";
+  }
+  source += " return 0;\n}\n";
+  // Enough expressions in the training dataset for the search to be split
+  // into chunks.
+  const std::string kTrainingDataset = "/tmp/test_dump_conditional_exprs_23";
+  {
+    std::ofstream training_dataset(kTrainingDataset.c_str());
+    for (size_t i = 0; i < 1024; i++) {
+      std::string y = "y" + std::to_string(i);
+      training_dataset <<
+        "//if (x > " << y << ")\n" <<
+        "0,AST_expression_ONE:(ifstmt (\">\")(var (x))(var (" << y <<
+        ")))\n";
+    }
+  }
+
+  try {
+    TrainAndScanUtil::ScanConfig config;
+    config.num_threads_ = 4;
+    TrainAndScanUtil train_and_scan_util(config);
+    std::ostringstream training_log;
+    train_and_scan_util.ReadTrainingDatasetFromFile(kTrainingDataset,
+                                                    training_log);
+    remove(kTrainingDataset.c_str());
+
+    std::ostringstream report;
+    train_and_scan_util.ScanFile<LANGUAGE_C>("test.c", source, report);
+    const std::string report_text = report.str();
+    const std::string kLevelOne = "Level:ONE";
+    size_t num_reported = 0;
+    for (size_t pos = report_text.find(kLevelOne); pos != std::string::npos;
+         pos = report_text.find(kLevelOne, pos + 1)) {
+      num_reported++;
+    }
+    return num_reported == kNumCodeBlocks ? TEST_SUCCESS : TEST_FAILURE;
+  } catch(std::exception& e) {
+    remove(kTrainingDataset.c_str());
+    return TEST_FAILURE;
+  }
+}
 }  // anonymous namespace
 
 int main(int argc, char* argv[]) {
@@ -232,6 +709,17 @@ int main(int argc, char* argv[]) {
     case 10: ReportTestResult(Test10()); break;
     case 11: ReportTestResult(Test11()); break;
     case 12: ReportTestResult(Test12()); break;
+    case 13: ReportTestResult(Test13()); break;
+    case 14: ReportTestResult(Test14()); break;
+    case 15: ReportTestResult(Test15()); break;
+    case 16: ReportTestResult(Test16()); break;
+    case 17: ReportTestResult(Test17()); break;
+    case 18: ReportTestResult(Test18()); break;
+    case 19: ReportTestResult(Test19()); break;
+    case 20: ReportTestResult(Test20()); break;
+    case 21: ReportTestResult(Test21()); break;
+    case 22: ReportTestResult(Test22()); break;
+    case 23: ReportTestResult(Test23()); break;
     default: assert(1 == 0);
   }
   return 0;
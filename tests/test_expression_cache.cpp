@@ -0,0 +1,369 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>  // NOLINT [build/c++11]
+#include <fstream>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "expression_cache.h"
+#include "persistent_expression_cache.h"
+#include "test_common.h"
+#include "thread_pool.h"
+
+namespace {
+CompactNearestExpressions MakeNearestExpressions(size_t id) {
+  CompactNearestExpressions nearest_expressions;
+  nearest_expressions.push_back({kBaseExpressionID, 0});
+  nearest_expressions.push_back({static_cast<uint32_t>(id), 1});
+  return nearest_expressions;
+}
+
+// Positive test for insert and lookup
+TestResult Test1() {
+  const size_t kMemoryBudget = 1024 * 1024;
+  NearestExpressionsCache cache(kMemoryBudget);
+  cache.Insert("(1 (2) (3))", MakeNearestExpressions(7));
+
+  CompactNearestExpressions nearest_expressions;
+  if (cache.LookUp("(1 (2) (4))", nearest_expressions) == true)
+    return TEST_FAILURE;
+  if (cache.LookUp("(1 (2) (3))", nearest_expressions) == false ||
+      nearest_expressions.size() != 2 ||
+      nearest_expressions[1].pattern_id_ != 7 ||
+      nearest_expressions[1].cost_ != 1)
+    return TEST_FAILURE;
+
+  auto statistics = cache.GetStatistics();
+  if (statistics.hits_ != 1 || statistics.misses_ != 1 ||
+      statistics.num_entries_ != 1 || statistics.evictions_ != 0)
+    return TEST_FAILURE;
+  return TEST_SUCCESS;
+}
+
+// Cache should stay within its memory budget by evicting entries.
+TestResult Test2() {
+  const size_t kMemoryBudget = 16 * 1024;
+  NearestExpressionsCache cache(kMemoryBudget);
+  const size_t kNumExpressions = 10000;
+  for (size_t i = 0; i < kNumExpressions; i++) {
+    cache.Insert("(" + std::to_string(i) + ")", MakeNearestExpressions(i));
+  }
+
+  auto statistics = cache.GetStatistics();
+  if (statistics.memory_used_ > kMemoryBudget ||
+      statistics.evictions_ == 0 ||
+      statistics.num_entries_ + statistics.evictions_ != kNumExpressions)
+    return TEST_FAILURE;
+  return TEST_SUCCESS;
+}
+
+// Expressions that are looked up repeatedly should survive a scan of
+// expressions that are seen only once.
+TestResult Test3() {
+  const size_t kMemoryBudget = 64 * 1024;
+  // Single shard so that the whole budget is available to all expressions.
+  const size_t kNumShards = 1;
+  NearestExpressionsCache cache(kMemoryBudget, kNumShards);
+  const size_t kNumHotExpressions = 16;
+  CompactNearestExpressions nearest_expressions;
+
+  auto hot_expression = [](size_t i) {
+    return "(hot " + std::to_string(i) + ")";
+  };
+  for (size_t i = 0; i < kNumHotExpressions; i++) {
+    cache.Insert(hot_expression(i), MakeNearestExpressions(i));
+  }
+
+  const size_t kNumColdExpressions = 100000;
+  for (size_t i = 0; i < kNumColdExpressions; i++) {
+    for (size_t j = 0; j < kNumHotExpressions; j++) {
+      if (i % 64 == 0)
+        cache.LookUp(hot_expression(j), nearest_expressions);
+    }
+    cache.Insert("(cold " + std::to_string(i) + ")",
+                 MakeNearestExpressions(i));
+  }
+
+  for (size_t i = 0; i < kNumHotExpressions; i++) {
+    if (cache.LookUp(hot_expression(i), nearest_expressions) == false)
+      return TEST_FAILURE;
+  }
+  return TEST_SUCCESS;
+}
+
+// Concurrent misses for the same expression should search only once.
+TestResult Test4() {
+  const size_t kMemoryBudget = 1024 * 1024;
+  NearestExpressionsCache cache(kMemoryBudget);
+  const std::string kExpression = "(1 (2) (3))";
+  const size_t kNumThreads = 8;
+
+  std::atomic<size_t> num_searches(0);
+  auto search_fn = [&]() {
+    num_searches++;
+    // Keep the search in flight long enough for other threads to miss.
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    return MakeNearestExpressions(7);
+  };
+
+  std::vector<CompactNearestExpressions> results(kNumThreads);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.push_back(std::thread([&, i]() {
+      cache.LookUpOrSearch(kExpression,
+          NearestExpressionsCache::Hash(kExpression), search_fn, results[i]);
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  auto statistics = cache.GetStatistics();
+  if (num_searches.load() != 1 ||
+      statistics.deduplicated_searches_ != kNumThreads - 1 ||
+      statistics.hits_ + statistics.misses_ != kNumThreads)
+    return TEST_FAILURE;
+
+  // Every lookup after the search is a hit.
+  CompactNearestExpressions nearest_expressions;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    cache.LookUpOrSearch(kExpression,
+        NearestExpressionsCache::Hash(kExpression), search_fn,
+        nearest_expressions);
+  }
+  statistics = cache.GetStatistics();
+  if (num_searches.load() != 1 ||
+      statistics.hits_ + statistics.misses_ != 2 * kNumThreads ||
+      statistics.hits_ < kNumThreads)
+    return TEST_FAILURE;
+  for (const auto& result : results) {
+    if (result.size() != 2 || result[1].pattern_id_ != 7)
+      return TEST_FAILURE;
+  }
+  return TEST_SUCCESS;
+}
+
+// Persistent cache should keep entries across instances for the same config
+// and discard them for a different config.
+TestResult Test5() {
+  char cache_file[] = "/tmp/test_expression_cache.XXXXXX";
+  int fd = mkstemp(cache_file);
+  if (fd == -1)
+    return TEST_FAILURE;
+  close(fd);
+  remove(cache_file);
+
+  PersistentExpressionCache::Config config;
+  config.model_fingerprint_ = 1234;
+  config.vocabulary_size_ = 10;
+  config.max_cost_ = 2;
+  config.max_autocorrections_ = 5;
+  auto hash = PersistentExpressionCache::Hash;
+  const TokenID kWord = ExpressionCompacter::kNumReservedIDs;
+  const std::string kExpression = NearestExpressionsCache::MakeKey(
+      {'(', kWord + 1, ' ', '(', kWord + 2, ')', ')'});
+  // Word 12 was not seen in training, so this key is not stable.
+  const std::string kUnstableExpression = NearestExpressionsCache::MakeKey(
+      {'(', kWord + 1, ' ', '(', kWord + 12, ')', ')'});
+
+  TestResult result = TEST_SUCCESS;
+  CompactNearestExpressions nearest_expressions;
+  try {
+    {
+      PersistentExpressionCache cache(cache_file, config);
+      if (cache.GetLoadStatus() !=
+          PersistentExpressionCache::LoadStatus::NOT_FOUND)
+        result = TEST_FAILURE;
+      cache.Record(LEVEL_ONE, kExpression, hash(kExpression),
+                   MakeNearestExpressions(7));
+      cache.Record(LEVEL_TWO, kExpression, hash(kExpression),
+                   MakeNearestExpressions(8));
+      cache.Record(LEVEL_ONE, kUnstableExpression, hash(kUnstableExpression),
+                   MakeNearestExpressions(9));
+      if (cache.Save() != 2)
+        result = TEST_FAILURE;
+    }
+    {
+      PersistentExpressionCache cache(cache_file, config);
+      if (cache.GetLoadStatus() !=
+            PersistentExpressionCache::LoadStatus::LOADED ||
+          cache.GetNumLoadedEntries() != 2 ||
+          cache.LookUp(LEVEL_ONE, kExpression, hash(kExpression),
+                       nearest_expressions) == false ||
+          nearest_expressions.size() != 2 ||
+          nearest_expressions[0].pattern_id_ != kBaseExpressionID ||
+          nearest_expressions[1].pattern_id_ != 7 ||
+          cache.LookUp(LEVEL_TWO, kExpression, hash(kExpression),
+                       nearest_expressions) == false ||
+          nearest_expressions[1].pattern_id_ != 8 ||
+          cache.LookUp(LEVEL_ONE, kUnstableExpression,
+                       hash(kUnstableExpression),
+                       nearest_expressions) == true)
+        result = TEST_FAILURE;
+    }
+    {
+      // Training dataset changed.
+      config.model_fingerprint_++;
+      PersistentExpressionCache cache(cache_file, config);
+      if (cache.GetLoadStatus() !=
+            PersistentExpressionCache::LoadStatus::INVALIDATED ||
+          cache.LookUp(LEVEL_ONE, kExpression, hash(kExpression),
+                       nearest_expressions) == true)
+        result = TEST_FAILURE;
+    }
+  } catch (std::exception& e) {
+    result = TEST_FAILURE;
+  }
+  remove(cache_file);
+  return result;
+}
+// Persistent cache should write duplicate entries once and drop least
+// recently used entries to stay within its maximum size.
+TestResult Test6() {
+  char cache_file[] = "/tmp/test_expression_cache.XXXXXX";
+  int fd = mkstemp(cache_file);
+  if (fd == -1)
+    return TEST_FAILURE;
+  close(fd);
+  remove(cache_file);
+  std::string other_cache_file = std::string(cache_file) + ".other";
+
+  PersistentExpressionCache::Config config;
+  config.model_fingerprint_ = 1234;
+  config.vocabulary_size_ = 10;
+  auto hash = PersistentExpressionCache::Hash;
+  const TokenID kWord = ExpressionCompacter::kNumReservedIDs;
+  auto expression = [&](TokenID word) {
+    return NearestExpressionsCache::MakeKey({'(', kWord + word, ')'});
+  };
+  auto file_size = [](const std::string& file_name) {
+    std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+    return static_cast<size_t>(file.tellg());
+  };
+
+  TestResult result = TEST_SUCCESS;
+  CompactNearestExpressions nearest_expressions;
+  try {
+    {
+      PersistentExpressionCache cache(cache_file, config);
+      cache.Record(LEVEL_ONE, expression(1), hash(expression(1)),
+                   MakeNearestExpressions(1));
+      cache.Record(LEVEL_ONE, expression(2), hash(expression(2)),
+                   MakeNearestExpressions(2));
+      if (cache.Save() != 2)
+        result = TEST_FAILURE;
+    }
+    {
+      // Expression searched again after it was evicted from memory.
+      PersistentExpressionCache cache(other_cache_file, config);
+      for (TokenID word : {1, 2, 1, 1}) {
+        cache.Record(LEVEL_ONE, expression(word), hash(expression(word)),
+                     MakeNearestExpressions(word));
+      }
+      if (cache.Save() != 2 ||
+          file_size(other_cache_file) != file_size(cache_file))
+        result = TEST_FAILURE;
+    }
+    {
+      // Room for 2 entries only: entry 2 is the least recently used.
+      PersistentExpressionCache cache(cache_file, config,
+                                      file_size(cache_file));
+      if (cache.LookUp(LEVEL_ONE, expression(1), hash(expression(1)),
+                       nearest_expressions) == false)
+        result = TEST_FAILURE;
+      cache.Record(LEVEL_ONE, expression(3), hash(expression(3)),
+                   MakeNearestExpressions(3));
+      if (cache.Save() != 2)
+        result = TEST_FAILURE;
+    }
+    {
+      PersistentExpressionCache cache(cache_file, config);
+      if (cache.GetNumLoadedEntries() != 2 ||
+          cache.LookUp(LEVEL_ONE, expression(1), hash(expression(1)),
+                       nearest_expressions) == false ||
+          nearest_expressions[1].pattern_id_ != 1 ||
+          cache.LookUp(LEVEL_ONE, expression(2), hash(expression(2)),
+                       nearest_expressions) == true ||
+          cache.LookUp(LEVEL_ONE, expression(3), hash(expression(3)),
+                       nearest_expressions) == false ||
+          nearest_expressions[1].pattern_id_ != 3)
+        result = TEST_FAILURE;
+    }
+  } catch (std::exception& e) {
+    result = TEST_FAILURE;
+  }
+  remove(cache_file);
+  remove(other_cache_file.c_str());
+  return result;
+}
+// Searches that run nested loops on a thread pool, called from chunks of a
+// loop of the same pool, do not deadlock when chunks search for the same
+// expression.
+TestResult Test7() {
+  const size_t kMemoryBudget = 1024 * 1024;
+  const size_t kNumWorkers = 4;
+  const size_t kNumChunks = 64;
+  const std::string kExpression = "(1 (2) (3))";
+  for (size_t attempt = 0; attempt < 20; attempt++) {
+    NearestExpressionsCache cache(kMemoryBudget);
+    ThreadPool thread_pool(kNumWorkers);
+    std::atomic<size_t> num_searches(0);
+    auto search_fn = [&]() {
+      num_searches++;
+      thread_pool.ParallelFor(0, 1024, 1, [&](size_t, size_t) {
+        std::this_thread::sleep_for(std::chrono::microseconds(10));
+      });
+      return MakeNearestExpressions(7);
+    };
+    std::atomic<size_t> num_found(0);
+    thread_pool.ParallelFor(0, kNumChunks, 1, [&](size_t, size_t) {
+      CompactNearestExpressions nearest_expressions;
+      cache.LookUpOrSearch(kExpression,
+          NearestExpressionsCache::Hash(kExpression), search_fn,
+          nearest_expressions);
+      if (nearest_expressions.size() == 2) num_found++;
+    });
+    if (num_searches != 1 || num_found != kNumChunks)
+      return TEST_FAILURE;
+  }
+  return TEST_SUCCESS;
+}
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  assert(argc == 2);
+  switch (atoi(argv[1])) {
+    case 1: ReportTestResult(Test1()); break;
+    case 2: ReportTestResult(Test2()); break;
+    case 3: ReportTestResult(Test3()); break;
+    case 4: ReportTestResult(Test4()); break;
+    case 5: ReportTestResult(Test5()); break;
+    case 6: ReportTestResult(Test6()); break;
+    case 7: ReportTestResult(Test7()); break;
+    default: assert(1 == 0);
+  }
+  return 0;
+}
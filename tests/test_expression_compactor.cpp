@@ -19,6 +19,8 @@
 // SOFTWARE.
 
 #include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
 
 #include "tree_abstraction.h"
 #include "test_common.h"
@@ -63,6 +65,37 @@ TestResult Test7() {
   return CompactAndExpandExpression("(if_stmt (binary_op \">\" var num))");
 }
 
+// Frozen compacter should compact known tokens as before, and assign the
+// same ID to an unseen token in all threads.
+TestResult Test8() {
+  ExpressionCompacter& compacter = ExpressionCompacter::Get();
+  const std::string kKnownExpression = "(if_stmt (binary_op \">\" var num))";
+  const std::string kUnseenExpression = "(if_stmt (unseen_op var num))";
+  auto compact_known_expression = compacter.Compact(kKnownExpression);
+  compacter.Freeze();
+  if (!compacter.IsFrozen() ||
+      compacter.Compact(kKnownExpression) != compact_known_expression ||
+      compacter.Expand(compact_known_expression) != kKnownExpression)
+    return TEST_FAILURE;
+
+  const size_t kNumThreads = 4;
+  std::vector<std::string> compact_unseen_expressions(kNumThreads);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.push_back(std::thread([&, i]() {
+      compact_unseen_expressions[i] = compacter.Compact(kUnseenExpression);
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto& compact_unseen_expression : compact_unseen_expressions) {
+    if (compact_unseen_expression != compact_unseen_expressions[0] ||
+        compacter.Expand(compact_unseen_expression) != kUnseenExpression)
+      return TEST_FAILURE;
+  }
+  return TEST_SUCCESS;
+}
 }  // anonymous namespace
 
 int main(int argc, char* argv[]) {
@@ -75,6 +108,7 @@ int main(int argc, char* argv[]) {
     case 5: ReportTestResult(Test5()); break;
     case 6: ReportTestResult(Test6()); break;
     case 7: ReportTestResult(Test7()); break;
+    case 8: ReportTestResult(Test8()); break;
     default: assert(1 == 0);
   }
   return 0;
@@ -0,0 +1,229 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "bounded_queue.h"
+#include "file_prefetcher.h"
+#include "test_common.h"
+
+namespace {
+// Create num_files files in /tmp, where contents of file i is the string i.
+std::vector<std::string> CreateFiles(size_t num_files) {
+  std::vector<std::string> file_names;
+  for (size_t i = 0; i < num_files; i++) {
+    std::string file_name = "/tmp/cf_test_file_prefetcher_" +
+                            std::to_string(getpid()) + "_" +
+                            std::to_string(i);
+    std::ofstream file(file_name.c_str());
+    file << i;
+    file_names.push_back(file_name);
+  }
+  return file_names;
+}
+
+void RemoveFiles(const std::vector<std::string>& file_names) {
+  for (const auto& file_name : file_names) {
+    remove(file_name.c_str());
+  }
+}
+
+// Every file is handed over exactly once, with its contents, to consumers
+// running in parallel.
+TestResult Test1() {
+  const size_t kNumFiles = 200;
+  const size_t kNumReaders = 3;
+  const size_t kMaxFilesInFlight = 4;
+  const size_t kNumConsumers = 4;
+  std::vector<std::string> file_names = CreateFiles(kNumFiles);
+  std::vector<std::atomic<size_t>> num_handed_over(kNumFiles);
+  std::atomic<bool> is_correct(true);
+  {
+    FilePrefetcher prefetcher(file_names, kNumReaders, kMaxFilesInFlight);
+    std::vector<std::thread> consumers;
+    for (size_t i = 0; i < kNumConsumers; i++) {
+      consumers.push_back(std::thread([&]() {
+        FilePrefetcher::File file;
+        while (prefetcher.Next(file)) {
+          if (file.index_ >= kNumFiles || file.error_ != "" ||
+              file.name_ != file_names[file.index_] ||
+              file.contents_.contents() != std::to_string(file.index_)) {
+            is_correct = false;
+            continue;
+          }
+          num_handed_over[file.index_]++;
+        }
+      }));
+    }
+    for (auto& consumer : consumers) {
+      consumer.join();
+    }
+  }
+  RemoveFiles(file_names);
+
+  if (!is_correct) return TEST_FAILURE;
+  for (const auto& count : num_handed_over) {
+    if (count != 1) return TEST_FAILURE;
+  }
+  return TEST_SUCCESS;
+}
+
+// Files that cannot be read are handed over with an error.
+TestResult Test2() {
+  std::vector<std::string> file_names = CreateFiles(2);
+  file_names.insert(file_names.begin() + 1, "/tmp/cf_file_does_not_exist");
+  size_t num_errors = 0, num_files = 0;
+  bool is_error_index_correct = true;
+  {
+    FilePrefetcher prefetcher(file_names, 2, 2);
+    FilePrefetcher::File file;
+    while (prefetcher.Next(file)) {
+      num_files++;
+      if (file.error_ != "") {
+        is_error_index_correct = is_error_index_correct && file.index_ == 1;
+        num_errors++;
+      }
+    }
+  }
+  RemoveFiles({file_names[0], file_names[2]});
+  return num_files == 3 && num_errors == 1 && is_error_index_correct ?
+         TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Destroying the prefetcher before consuming all the files stops the readers
+// that are waiting for room in the queue.
+TestResult Test3() {
+  const size_t kNumFiles = 100;
+  std::vector<std::string> file_names = CreateFiles(kNumFiles);
+  bool has_file = false;
+  {
+    FilePrefetcher prefetcher(file_names, 4, 2);
+    FilePrefetcher::File file;
+    has_file = prefetcher.Next(file);
+  }
+  RemoveFiles(file_names);
+  return has_file ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Queue preserves FIFO order, and drains remaining items after closing.
+TestResult Test4() {
+  BoundedQueue<int> queue(2);
+  int item = 0;
+  if (!queue.Push(1) || !queue.Push(2)) return TEST_FAILURE;
+
+  // Producer blocks until the consumer makes room.
+  std::thread producer([&]() { queue.Push(3); });
+  if (!queue.Pop(item) || item != 1) return TEST_FAILURE;
+  producer.join();
+
+  queue.Close();
+  if (queue.Push(4)) return TEST_FAILURE;
+  if (!queue.Pop(item) || item != 2) return TEST_FAILURE;
+  if (!queue.Pop(item) || item != 3) return TEST_FAILURE;
+  return queue.Pop(item) ? TEST_FAILURE : TEST_SUCCESS;
+}
+
+// Every item pushed by many producers is popped exactly once by many
+// consumers, even if the queue is much smaller than the number of items.
+TestResult Test5() {
+  const size_t kNumProducers = 4;
+  const size_t kNumConsumers = 4;
+  const size_t kNumItemsPerProducer = 20000;
+  BoundedQueue<size_t> queue(8);
+  std::vector<std::atomic<size_t>> num_popped(kNumProducers *
+                                              kNumItemsPerProducer);
+  std::atomic<size_t> num_running_producers(kNumProducers);
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kNumProducers; i++) {
+    threads.push_back(std::thread([&, i]() {
+      for (size_t j = 0; j < kNumItemsPerProducer; j++) {
+        queue.Push(i * kNumItemsPerProducer + j);
+      }
+      if (num_running_producers.fetch_sub(1) == 1) queue.Close();
+    }));
+  }
+  for (size_t i = 0; i < kNumConsumers; i++) {
+    threads.push_back(std::thread([&]() {
+      size_t item;
+      while (queue.Pop(item)) {
+        num_popped[item]++;
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (const auto& count : num_popped) {
+    if (count != 1) return TEST_FAILURE;
+  }
+  return TEST_SUCCESS;
+}
+
+// Files are read largest first when requested; files that cannot be read go
+// last.
+TestResult Test6() {
+  // Sizes are in no particular order.
+  const std::vector<size_t> kFileSizes = {30, 500, 10, 4000, 200, 0, 70};
+  std::vector<std::string> file_names = CreateFiles(kFileSizes.size());
+  for (size_t i = 0; i < kFileSizes.size(); i++) {
+    std::ofstream file(file_names[i].c_str(), std::ios::trunc);
+    file << std::string(kFileSizes[i], 'x');
+  }
+  file_names.push_back("/tmp/cf_test_file_prefetcher_missing_file");
+
+  std::vector<size_t> read_order;
+  {
+    // A single reader reads files in order.
+    FilePrefetcher prefetcher(file_names, 1, file_names.size(), true);
+    FilePrefetcher::File file;
+    while (prefetcher.Next(file)) {
+      read_order.push_back(file.index_);
+    }
+  }
+  RemoveFiles(file_names);
+
+  const std::vector<size_t> kExpectedOrder = {3, 1, 4, 6, 0, 2, 5, 7};
+  return read_order == kExpectedOrder ? TEST_SUCCESS : TEST_FAILURE;
+}
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  assert(argc == 2);
+  switch (atoi(argv[1])) {
+    case 1: ReportTestResult(Test1()); break;
+    case 2: ReportTestResult(Test2()); break;
+    case 3: ReportTestResult(Test3()); break;
+    case 4: ReportTestResult(Test4()); break;
+    case 5: ReportTestResult(Test5()); break;
+    case 6: ReportTestResult(Test6()); break;
+    default: assert(1 == 0);
+  }
+  return 0;
+}
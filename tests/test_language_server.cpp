@@ -0,0 +1,163 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "incremental_document.h"
+#include "json.h"
+#include "language_server.h"
+#include "test_common.h"
+
+namespace {
+std::string MakeMessage(const std::string& content) {
+  return "Content-Length: " + std::to_string(content.size()) + "\r\n\r\n" +
+         content;
+}
+
+// Run a language server on messages, and return the messages it wrote.
+std::vector<JSONValue> RunServer(const std::vector<std::string>& messages,
+                                 int& exit_code) {
+  TrainAndScanUtil::ScanConfig config;
+  TrainAndScanUtil train_and_scan_util(config);
+  LanguageServer server(train_and_scan_util, LANGUAGE_C);
+  std::string input_text;
+  for (const auto& message : messages) input_text += MakeMessage(message);
+  std::istringstream input(input_text);
+  std::stringstream output;
+  std::ostringstream log;
+  exit_code = server.Run(input, output, log);
+
+  std::vector<JSONValue> responses;
+  std::string content;
+  while (LanguageServer::ReadMessage(output, content)) {
+    responses.push_back(JSONValue::Parse(content));
+  }
+  return responses;
+}
+
+// JSON values are parsed and written back.
+TestResult Test1() {
+  const std::string kText = "{\"a\":[1,-2.5,true,false,null],"
+                            "\"b\":\"x\\\"y\\n\",\"c\":{}}";
+  JSONValue value = JSONValue::Parse(kText);
+  bool is_correct = value.ToString() == kText &&
+    value["a"].GetArray().size() == 5 &&
+    value["a"].GetArray()[1].GetNumber() == -2.5 &&
+    value["b"].GetString() == "x\"y\n" &&
+    value["c"].GetType() == JSONValue::OBJECT &&
+    value["missing"].IsNull() &&
+    // Escaped characters are decoded to UTF-8, including surrogate pairs.
+    JSONValue::Parse(" \"\\u00e9\\ud83d\\ude00\" ").GetString() ==
+      "\xc3\xa9\xf0\x9f\x98\x80";
+
+  for (const char* malformed : {"", "{", "[1,]", "{\"a\" 1}", "tru",
+                                "\"\\x\"", "1 2"}) {
+    try {
+      JSONValue::Parse(malformed);
+      is_correct = false;
+    } catch (const cf_parse_error&) {}
+  }
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Positions are converted to offsets and back, in UTF-8 and in UTF-16.
+TestResult Test2() {
+  // "\xc3\xa9" is 1 UTF-16 code unit, and "\xf0\x9f\x98\x80" is 2.
+  const std::string kText = "ab\r\n\xc3\xa9x\xf0\x9f\x98\x80y\n\nz";
+  LineIndex line_index(kText);
+  auto to_offset = [&](size_t line, size_t character,
+                       LineIndex::Encoding encoding) {
+    LineIndex::Position position;
+    position.line_ = line;
+    position.character_ = character;
+    return line_index.ToOffset(kText, position, encoding);
+  };
+  auto is_position = [&](size_t offset, LineIndex::Encoding encoding,
+                         size_t line, size_t character) {
+    auto position = line_index.ToPosition(kText, offset, encoding);
+    return position.line_ == line && position.character_ == character;
+  };
+  bool is_correct = line_index.GetNumLines() == 4 &&
+    to_offset(0, 1, LineIndex::UTF16) == 1 &&
+    // Lines end before "\r\n".
+    to_offset(0, 5, LineIndex::UTF16) == 2 &&
+    to_offset(1, 1, LineIndex::UTF16) == 6 &&
+    to_offset(1, 2, LineIndex::UTF16) == 7 &&
+    to_offset(1, 4, LineIndex::UTF16) == 11 &&
+    to_offset(1, 4, LineIndex::UTF8) == 8 &&
+    to_offset(3, 1, LineIndex::UTF16) == kText.size() &&
+    to_offset(9, 0, LineIndex::UTF16) == kText.size() &&
+    is_position(11, LineIndex::UTF16, 1, 4) &&
+    is_position(11, LineIndex::UTF8, 1, 7) &&
+    is_position(13, LineIndex::UTF16, 2, 0) &&
+    is_position(kText.size(), LineIndex::UTF16, 3, 1);
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Server answers the lifecycle requests, and reports errors for the
+// requests it cannot serve.
+TestResult Test3() {
+  int exit_code = -1;
+  auto responses = RunServer({
+    "{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"hover\"}",
+    "{\"jsonrpc\":\"2.0\",\"id\":2,\"method\":\"initialize\",\"params\":"
+      "{\"capabilities\":{\"general\":{\"positionEncodings\":"
+      "[\"utf-16\",\"utf-8\"]}}}}",
+    "{\"jsonrpc\":\"2.0\",\"method\":\"initialized\",\"params\":{}}",
+    "{\"jsonrpc\":\"2.0\",\"id\":\"3\",\"method\":\"hover\"}",
+    "{\"jsonrpc\":",
+    "{\"jsonrpc\":\"2.0\",\"id\":4,\"method\":\"shutdown\"}",
+    "{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}",
+    "{\"jsonrpc\":\"2.0\",\"id\":5,\"method\":\"shutdown\"}"}, exit_code);
+  bool is_correct = exit_code == EXIT_SUCCESS && responses.size() == 5 &&
+    responses[0]["id"].GetNumber() == 1 &&
+    responses[0]["error"]["code"].GetNumber() == -32002 &&
+    responses[1]["id"].GetNumber() == 2 &&
+    responses[1]["result"]["capabilities"]["positionEncoding"]
+      .GetString() == "utf-8" &&
+    responses[1]["result"]["capabilities"]["textDocumentSync"]["change"]
+      .GetNumber() == 2 &&
+    responses[2]["id"].GetString() == "3" &&
+    responses[2]["error"]["code"].GetNumber() == -32601 &&
+    responses[3]["id"].IsNull() &&
+    responses[3]["error"]["code"].GetNumber() == -32700 &&
+    responses[4]["id"].GetNumber() == 4 &&
+    responses[4]["result"].IsNull() && responses[4]["error"].IsNull();
+
+  // Exiting without shutdown is an error.
+  RunServer({"{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}"}, exit_code);
+  is_correct = is_correct && exit_code == EXIT_FAILURE;
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  assert(argc == 2);
+  switch (atoi(argv[1])) {
+    case 1: ReportTestResult(Test1()); break;
+    case 2: ReportTestResult(Test2()); break;
+    case 3: ReportTestResult(Test3()); break;
+    default: assert(1 == 0);
+  }
+  return 0;
+}
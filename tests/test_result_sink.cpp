@@ -0,0 +1,226 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "result_sink.h"
+#include "test_common.h"
+
+namespace {
+using ScanResult = TrainAndScanUtil::ScanResult;
+using ExpandedVerdict = TrainAndScanUtil::ExpandedVerdict;
+
+std::string OutputFileName() {
+  return "/tmp/cf_test_result_sink_" + std::to_string(getpid());
+}
+
+std::string ReadFile(const std::string& file_name) {
+  std::ifstream file(file_name.c_str());
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+std::shared_ptr<const ExpandedVerdict> MakeVerdict(
+    const std::string& expression) {
+  auto verdict = std::make_shared<ExpandedVerdict>();
+  verdict->expression_ = expression;
+  verdict->found_in_training_dataset_ = true;
+  verdict->nearest_expressions_.push_back(NearestExpression("(a == b)", 1,
+                                                            42));
+  return verdict;
+}
+
+FileResults MakeFileResults(size_t file_index, bool is_potential_anomaly) {
+  FileResults file_results;
+  file_results.file_index_ = file_index;
+  file_results.file_name_ = "file_" + std::to_string(file_index) + ".c";
+  ScanResult result;
+  result.level_ = LEVEL_ONE;
+  result.row_ = file_index;
+  result.column_ = 4;
+  result.source_expression_ = "if (a = b)";
+  result.is_potential_anomaly_ = is_potential_anomaly;
+  result.verdict_ = MakeVerdict("(a = b)");
+  file_results.results_.push_back(result);
+  return file_results;
+}
+
+// Results added out of order by many threads are written in file order.
+TestResult Test1() {
+  const size_t kNumFiles = 1000;
+  const size_t kNumThreads = 4;
+  const size_t kMaxQueuedFiles = 8;
+  std::string output_file = OutputFileName();
+  {
+    ResultSink sink(output_file, ResultSink::JSON_LINES, kMaxQueuedFiles);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < kNumThreads; i++) {
+      threads.push_back(std::thread([&, i]() {
+        // Every thread adds its files backwards.
+        for (size_t j = kNumFiles - kNumThreads + i; j < kNumFiles;
+             j -= kNumThreads) {
+          sink.Add(MakeFileResults(j, false));
+        }
+      }));
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    sink.Close();
+  }
+
+  std::ifstream output(output_file.c_str());
+  std::string line;
+  size_t num_lines = 0;
+  bool is_ordered = true;
+  while (std::getline(output, line)) {
+    std::string file = "{\"file\":\"file_" + std::to_string(num_lines) +
+                       ".c\",";
+    if (line.compare(0, file.size(), file) != 0) is_ordered = false;
+    num_lines++;
+  }
+  remove(output_file.c_str());
+  return is_ordered && num_lines == kNumFiles ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// A JSON line is written for every result and for every file with an error.
+TestResult Test2() {
+  FileResults file_results = MakeFileResults(7, true);
+  file_results.results_[0].source_expression_ = "if (s == \"x\")";
+  FileResults error_file_results;
+  error_file_results.file_name_ = "missing.c";
+  error_file_results.error_ = "Open failed";
+
+  std::string output;
+  ResultSink::FormatJSONLines(file_results, output);
+  ResultSink::FormatJSONLines(error_file_results, output);
+  const std::string kExpectedOutput =
+    "{\"file\":\"file_7.c\",\"line\":8,\"column\":5,"
+    "\"source\":\"if (s == \\\"x\\\")\",\"level\":\"ONE\","
+    "\"expression\":\"(a = b)\",\"found_in_training_dataset\":true,"
+    "\"potential_anomaly\":true,\"nearest_expressions\":"
+    "[{\"expression\":\"(a == b)\",\"cost\":1,\"occurrences\":42}]}\n"
+    "{\"file\":\"missing.c\",\"error\":\"Open failed\"}\n";
+  return output == kExpectedOutput ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// SARIF log has a result for every potential anomaly only.
+TestResult Test3() {
+  std::string output_file = OutputFileName();
+  {
+    ResultSink sink(output_file, ResultSink::SARIF);
+    sink.Add(MakeFileResults(2, true));
+    sink.Add(MakeFileResults(0, true));
+    sink.Add(MakeFileResults(1, false));
+    sink.Close();
+  }
+  std::string output = ReadFile(output_file);
+  remove(output_file.c_str());
+
+  auto count = [&](const std::string& text) {
+    size_t num_found = 0;
+    for (size_t pos = output.find(text); pos != std::string::npos;
+         pos = output.find(text, pos + 1)) {
+      num_found++;
+    }
+    return num_found;
+  };
+  bool is_correct =
+    output.compare(0, 21, "{\"version\":\"2.1.0\",\"$") == 0 &&
+    output.size() >= 5 && output.compare(output.size() - 5, 5, "]}]}\n") == 0 &&
+    count("\"ruleId\":\"potential-anomaly\"") == 2 &&
+    count("Did you mean: (a == b)") == 2 &&
+    count("\"startLine\":") == 2 &&
+    count("\"uri\":\"file_") == 2 &&
+    output.find("file_1.c") == std::string::npos &&
+    output.find("file_0.c") < output.find("file_2.c");
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+// Files that wait for a file with a smaller index are spilled to disk when
+// they do not fit in memory, and are still written in file order.
+TestResult Test4() {
+  const size_t kNumFiles = 200;
+  const size_t kMaxQueuedFiles = 8;
+  const size_t kMaxPendingBytes = 4096;
+  std::string output_file = OutputFileName();
+  size_t num_spilled_files = 0;
+  {
+    ResultSink sink(output_file, ResultSink::JSON_LINES, kMaxQueuedFiles,
+                    kMaxPendingBytes);
+    // File 0 comes last, as a small file does when files are scanned
+    // largest first.
+    for (size_t i = 1; i < kNumFiles; i++) {
+      sink.Add(MakeFileResults(i, false));
+    }
+    sink.Add(MakeFileResults(0, false));
+    sink.Close();
+    num_spilled_files = sink.GetNumSpilledFiles();
+  }
+
+  std::ifstream output(output_file.c_str());
+  std::string line;
+  size_t num_lines = 0;
+  bool is_ordered = true;
+  while (std::getline(output, line)) {
+    std::string file = "{\"file\":\"file_" + std::to_string(num_lines) +
+                       ".c\",";
+    if (line.compare(0, file.size(), file) != 0) is_ordered = false;
+    num_lines++;
+  }
+  remove(output_file.c_str());
+  return is_ordered && num_lines == kNumFiles && num_spilled_files > 0 ?
+         TEST_SUCCESS : TEST_FAILURE;
+}
+
+// SARIF artifact locations are percent-encoded URIs.
+TestResult Test5() {
+  bool is_correct =
+    ResultSink::FormatSARIFArtifactLocation("/src/my dir/a%b.c") ==
+      "{\"uri\":\"file:///src/my%20dir/a%25b.c\"}" &&
+    ResultSink::FormatSARIFArtifactLocation("lib/x\"y#1.c") ==
+      "{\"uri\":\"lib/x%22y%231.c\",\"uriBaseId\":\"%SRCROOT%\"}" &&
+    ResultSink::FormatSARIFArtifactLocation("C:\\src\\a.c") ==
+      "{\"uri\":\"file:///C:/src/a.c\"}";
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  assert(argc == 2);
+  switch (atoi(argv[1])) {
+    case 1: ReportTestResult(Test1()); break;
+    case 2: ReportTestResult(Test2()); break;
+    case 3: ReportTestResult(Test3()); break;
+    case 4: ReportTestResult(Test4()); break;
+    case 5: ReportTestResult(Test5()); break;
+    default: assert(1 == 0);
+  }
+  return 0;
+}
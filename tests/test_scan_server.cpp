@@ -0,0 +1,335 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>  // NOLINT [build/c++11]
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>  // NOLINT [build/c++11]
+
+#include "exception.h"
+#include "scan_protocol.h"
+#include "scan_server.h"
+#include "test_common.h"
+
+namespace {
+using scan_protocol::SocketStream;
+
+std::string SocketPath() {
+  return "/tmp/cf_test_scan_server_" + std::to_string(getpid()) + ".sock";
+}
+
+// Connect to a server that may not be listening yet.
+int ConnectWhenListening(const std::string& socket_path) {
+  for (size_t attempt = 0; attempt < 1000; attempt++) {
+    try {
+      return scan_protocol::ConnectToUnixSocket(socket_path);
+    } catch (cf_file_access_exception& e) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  return scan_protocol::ConnectToUnixSocket(socket_path);
+}
+
+// Lines, bytes and responses sent on one end of a socket are read on the
+// other end.
+TestResult Test1() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return TEST_FAILURE;
+  SocketStream client(fds[0]);
+  SocketStream server(fds[1]);
+
+  const std::string kSource = "int f() {\n  return 0;\n}\n";
+  std::string line1, line2, source;
+  bool is_correct =
+    client.Write("FILE a.c\nSOURCE " + std::to_string(kSource.size()) +
+                 " b.c\n" + kSource) &&
+    server.ReadLine(line1) && line1 == "FILE a.c" &&
+    server.ReadLine(line2) && server.ReadBytes(kSource.size(), source) &&
+    source == kSource;
+  std::string name, argument;
+  scan_protocol::ParseRequest(line2, name, argument);
+  is_correct = is_correct && name == "SOURCE" &&
+               argument == std::to_string(kSource.size()) + " b.c";
+
+  bool is_ok1 = false, is_ok2 = true;
+  std::string body1, body2;
+  is_correct = is_correct &&
+    server.WriteOKResponse("report\nwith lines\n") &&
+    server.WriteErrorResponse("bad\nrequest") &&
+    client.ReadResponse(is_ok1, body1) && is_ok1 &&
+    body1 == "report\nwith lines\n" &&
+    client.ReadResponse(is_ok2, body2) && !is_ok2 &&
+    body2 == "bad request";
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Server answers requests of a connection in order, and stops on SHUTDOWN.
+TestResult Test2() {
+  TrainAndScanUtil::ScanConfig scan_config;
+  TrainAndScanUtil train_and_scan_util(scan_config);
+  ScanServer::Config config;
+  config.socket_path_ = SocketPath();
+  ScanServer server(train_and_scan_util, LANGUAGE_C, config);
+  std::ostringstream log;
+  std::thread server_thread([&]() { server.Run(log); });
+
+  bool is_correct = true;
+  try {
+    SocketStream client(ConnectWhenListening(config.socket_path_));
+    bool is_ok1 = false, is_ok2 = true, is_ok3 = false;
+    std::string body1, body2, body3;
+    is_correct = client.Write("FILE /tmp/cf_test_scan_server_missing.c\n"
+                              "BOGUS request\nSHUTDOWN\n") &&
+      client.ReadResponse(is_ok1, body1) && is_ok1 &&
+      body1.find("Error:") != std::string::npos &&
+      client.ReadResponse(is_ok2, body2) && !is_ok2 &&
+      body2 == "Unknown request:BOGUS" &&
+      client.ReadResponse(is_ok3, body3) && is_ok3 && body3 == "";
+  } catch (std::exception& e) {
+    is_correct = false;
+    server.Stop();
+  }
+  server_thread.join();
+
+  struct stat socket_stat;
+  bool is_socket_removed = stat(config.socket_path_.c_str(),
+                                &socket_stat) != 0;
+  return is_correct && is_socket_removed ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Socket left behind by a server that is gone is reused, but a socket that
+// a server listens on is not.
+TestResult Test3() {
+  const std::string kSocketPath = SocketPath();
+  // Listening socket closed without removing its file.
+  close(scan_protocol::ListenOnUnixSocket(kSocketPath));
+
+  int fd = scan_protocol::ListenOnUnixSocket(kSocketPath);
+  bool is_in_use_detected = false;
+  try {
+    close(scan_protocol::ListenOnUnixSocket(kSocketPath));
+  } catch (cf_file_access_exception& e) {
+    is_in_use_detected = true;
+  }
+  close(fd);
+  unlink(kSocketPath.c_str());
+  return is_in_use_detected ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Lines longer than kMaxLineSize break the connection instead of being
+// buffered.
+TestResult Test4() {
+  // Reader stops reading before the writer is done.
+  signal(SIGPIPE, SIG_IGN);
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return TEST_FAILURE;
+  SocketStream client(fds[0]);
+  SocketStream server(fds[1]);
+
+  std::thread writer([&]() {
+    client.Write(std::string(scan_protocol::kMaxLineSize, 'x') + "\n" +
+                 std::string(scan_protocol::kMaxLineSize + 1, 'y') + "\n");
+  });
+  std::string line1, line2;
+  bool is_correct = server.ReadLine(line1) &&
+                    line1.size() == scan_protocol::kMaxLineSize &&
+                    !server.ReadLine(line2);
+  // Unblock the writer.
+  shutdown(fds[1], SHUT_RDWR);
+  writer.join();
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Default socket and its directory are accessible by the user only.
+TestResult Test5() {
+  const std::string kDirectory = "/tmp/cf_test_scan_server_dir_" +
+                                 std::to_string(getpid());
+  setenv("XDG_RUNTIME_DIR", kDirectory.c_str(), 1);
+  const std::string kSocketPath = scan_protocol::DefaultSocketPath();
+  if (kSocketPath != kDirectory + "/cf_scan_server.sock") return TEST_FAILURE;
+
+  close(scan_protocol::ListenOnUnixSocket(kSocketPath));
+  struct stat directory_stat, socket_stat;
+  bool is_correct = stat(kDirectory.c_str(), &directory_stat) == 0 &&
+                    (directory_stat.st_mode & 0777) == 0700 &&
+                    stat(kSocketPath.c_str(), &socket_stat) == 0 &&
+                    (socket_stat.st_mode & 0777) == 0600;
+
+  // Directory that other users can access is not used.
+  chmod(kDirectory.c_str(), 0755);
+  bool is_shared_directory_rejected = false;
+  try {
+    close(scan_protocol::ListenOnUnixSocket(kSocketPath));
+  } catch (cf_file_access_exception& e) {
+    is_shared_directory_rejected = true;
+  }
+  unlink(kSocketPath.c_str());
+  rmdir(kDirectory.c_str());
+
+  unsetenv("XDG_RUNTIME_DIR");
+  const std::string kUserDirectory = "/tmp/cf_scan_server-" +
+                                     std::to_string(geteuid()) + "/";
+  is_correct = is_correct && is_shared_directory_rejected &&
+    scan_protocol::DefaultSocketPath().compare(0, kUserDirectory.size(),
+                                               kUserDirectory) == 0;
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// User on the other end of a connection is found, so that the server can
+// reject other users.
+TestResult Test6() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return TEST_FAILURE;
+  SocketStream client(fds[0]);
+  SocketStream server(fds[1]);
+  uid_t uid;
+  return scan_protocol::GetPeerUID(fds[1], uid) && uid == geteuid() ?
+         TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Connections beyond max_connections_ are served once an open connection is
+// closed.
+TestResult Test7() {
+  TrainAndScanUtil::ScanConfig scan_config;
+  TrainAndScanUtil train_and_scan_util(scan_config);
+  ScanServer::Config config;
+  config.socket_path_ = SocketPath();
+  config.max_connections_ = 1;
+  ScanServer server(train_and_scan_util, LANGUAGE_C, config);
+  std::ostringstream log;
+  std::thread server_thread([&]() { server.Run(log); });
+
+  bool is_correct = true;
+  try {
+    auto first = std::make_unique<SocketStream>(
+                   ConnectWhenListening(config.socket_path_));
+    bool is_ok1 = true;
+    std::string body1;
+    // First connection is served.
+    is_correct = first->Write("BOGUS\n") &&
+                 first->ReadResponse(is_ok1, body1) && !is_ok1;
+
+    SocketStream second(scan_protocol::ConnectToUnixSocket(
+                          config.socket_path_));
+    is_correct = is_correct && second.Write("BOGUS\n");
+    pollfd second_poll = {second.GetFD(), POLLIN, 0};
+    const int kWaitMilliseconds = 200;
+    bool is_second_waiting = poll(&second_poll, 1, kWaitMilliseconds) == 0;
+
+    first.reset();
+    bool is_ok2 = true, is_ok3 = false;
+    std::string body2, body3;
+    is_correct = is_correct && is_second_waiting &&
+      second.ReadResponse(is_ok2, body2) && !is_ok2 &&
+      body2 == "Unknown request:BOGUS" &&
+      second.Write("SHUTDOWN\n") && second.ReadResponse(is_ok3, body3) &&
+      is_ok3;
+    if (!is_correct) server.Stop();
+  } catch (std::exception& e) {
+    is_correct = false;
+    server.Stop();
+  }
+  server_thread.join();
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Server rejects relative file paths, which it would resolve in its own
+// working directory. Client makes them absolute in its working directory,
+// and the file is then found from any working directory of the server.
+TestResult Test8() {
+  const std::string kDirectory = "/tmp/cf_test_scan_server_cwd_" +
+                                 std::to_string(getpid());
+  const std::string kFileName = "relative.c";
+  mkdir(kDirectory.c_str(), 0700);
+  {
+    std::ofstream file((kDirectory + "/" + kFileName).c_str());
+    file << "int f(int x) {\n  if (x == 0) return 1;\n  return 0;\n}\n";
+  }
+  char server_directory[PATH_MAX];
+  if (getcwd(server_directory, sizeof(server_directory)) == nullptr)
+    return TEST_FAILURE;
+
+  TrainAndScanUtil::ScanConfig scan_config;
+  TrainAndScanUtil train_and_scan_util(scan_config);
+  ScanServer::Config config;
+  config.socket_path_ = SocketPath();
+  ScanServer server(train_and_scan_util, LANGUAGE_C, config);
+  std::ostringstream log;
+  std::thread server_thread([&]() { server.Run(log); });
+
+  bool is_correct = true;
+  try {
+    SocketStream client(ConnectWhenListening(config.socket_path_));
+    // Path is made absolute in the working directory of the client, which
+    // is not the one of the server.
+    std::string path;
+    is_correct = chdir(kDirectory.c_str()) == 0;
+    if (is_correct) path = scan_protocol::MakeAbsolutePath(kFileName);
+    is_correct = chdir(server_directory) == 0 && is_correct &&
+                 path == kDirectory + "/" + kFileName;
+
+    bool is_ok1 = true, is_ok2 = false, is_ok3 = false;
+    std::string body1, body2, body3;
+    is_correct = is_correct &&
+      client.Write("FILE " + kFileName + "\nFILE " + path + "\nSHUTDOWN\n") &&
+      client.ReadResponse(is_ok1, body1) && !is_ok1 &&
+      body1 == "File path not absolute:" + kFileName &&
+      client.ReadResponse(is_ok2, body2) && is_ok2 &&
+      body2.find("Error:") == std::string::npos &&
+      body2.find("Source file: " + path) != std::string::npos &&
+      client.ReadResponse(is_ok3, body3) && is_ok3;
+    if (!is_correct) server.Stop();
+  } catch (std::exception& e) {
+    is_correct = false;
+    server.Stop();
+  }
+  server_thread.join();
+  unlink((kDirectory + "/" + kFileName).c_str());
+  rmdir(kDirectory.c_str());
+  return is_correct ? TEST_SUCCESS : TEST_FAILURE;
+}
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  assert(argc == 2);
+  switch (atoi(argv[1])) {
+    case 1: ReportTestResult(Test1()); break;
+    case 2: ReportTestResult(Test2()); break;
+    case 3: ReportTestResult(Test3()); break;
+    case 4: ReportTestResult(Test4()); break;
+    case 5: ReportTestResult(Test5()); break;
+    case 6: ReportTestResult(Test6()); break;
+    case 7: ReportTestResult(Test7()); break;
+    case 8: ReportTestResult(Test8()); break;
+    default: assert(1 == 0);
+  }
+  return 0;
+}
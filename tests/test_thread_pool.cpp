@@ -0,0 +1,164 @@
+// Copyright (c) 2022 Niranjan Hasabnis
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <atomic>
+#include <chrono>  // NOLINT [build/c++11]
+#include <mutex>  // NOLINT [build/c++11]
+#include <set>
+#include <stdexcept>
+#include <thread>  // NOLINT [build/c++11]
+#include <vector>
+
+#include "test_common.h"
+#include "thread_pool.h"
+
+namespace {
+// ParallelFor calls the function on every element exactly once, for pools
+// of different sizes and for grain sizes that do not divide the range.
+TestResult Test1() {
+  const size_t kNumElements = 10007;
+  for (size_t num_workers : {0, 1, 3, 8}) {
+    ThreadPool thread_pool(num_workers);
+    for (size_t grain_size : {1, 7, 1000, 20000}) {
+      std::vector<std::atomic<size_t>> num_calls(kNumElements);
+      thread_pool.ParallelFor(0, kNumElements, grain_size,
+                              [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) num_calls[i]++;
+      });
+      for (const auto& count : num_calls) {
+        if (count != 1) return TEST_FAILURE;
+      }
+    }
+  }
+  return TEST_SUCCESS;
+}
+
+// Tasks submitted from outside the pool all run, on workers of the pool,
+// before the pool is destroyed.
+TestResult Test2() {
+  const size_t kNumWorkers = 4;
+  const size_t kNumTasks = 1000;
+  std::atomic<size_t> num_run(0);
+  std::atomic<bool> is_correct(true);
+  {
+    ThreadPool thread_pool(kNumWorkers);
+    if (thread_pool.GetCurrentWorkerIndex() != ThreadPool::kNotAWorker) {
+      return TEST_FAILURE;
+    }
+    for (size_t i = 0; i < kNumTasks; i++) {
+      thread_pool.Submit([&]() {
+        if (thread_pool.GetCurrentWorkerIndex() >= kNumWorkers) {
+          is_correct = false;
+        }
+        num_run++;
+      });
+    }
+  }
+  return is_correct && num_run == kNumTasks ? TEST_SUCCESS : TEST_FAILURE;
+}
+
+// Nested ParallelFor from inside tasks completes (no deadlock even with a
+// single worker) and covers every element.
+TestResult Test3() {
+  const size_t kNumTasks = 16;
+  const size_t kNumElements = 5000;
+  for (size_t num_workers : {1, 4}) {
+    std::vector<std::atomic<size_t>> sums(kNumTasks);
+    {
+      ThreadPool thread_pool(num_workers);
+      for (size_t task = 0; task < kNumTasks; task++) {
+        thread_pool.Submit([&, task]() {
+          thread_pool.ParallelFor(0, kNumElements, 64,
+                                  [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) sums[task] += i;
+          });
+        });
+      }
+    }
+    for (const auto& sum : sums) {
+      if (sum != kNumElements * (kNumElements - 1) / 2) return TEST_FAILURE;
+    }
+  }
+  return TEST_SUCCESS;
+}
+
+// Idle workers help with the chunks of a loop started by one busy task:
+// chunks of a single ParallelFor run on more than one thread.
+TestResult Test4() {
+  const size_t kNumWorkers = 4;
+  ThreadPool thread_pool(kNumWorkers);
+  std::mutex mutex;
+  std::set<std::thread::id> chunk_threads;
+  std::atomic<bool> is_done(false);
+  thread_pool.Submit([&]() {
+    thread_pool.ParallelFor(0, 64, 1, [&](size_t, size_t) {
+      {
+        std::unique_lock lock(mutex);
+        chunk_threads.insert(std::this_thread::get_id());
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    });
+    is_done = true;
+  });
+  while (!is_done) std::this_thread::yield();
+  return chunk_threads.size() > 1 ? TEST_SUCCESS : TEST_FAILURE;
+}
+// Exception thrown by a chunk, stolen or run by the caller, is rethrown by
+// ParallelFor once all the other chunks are done; exception of a submitted
+// task does not stop the pool.
+TestResult Test5() {
+  const size_t kNumWorkers = 4;
+  const size_t kNumChunks = 64;
+  ThreadPool thread_pool(kNumWorkers);
+  for (size_t throwing_chunk : {static_cast<size_t>(0), kNumChunks - 1}) {
+    std::atomic<size_t> num_done(0);
+    bool is_thrown = false;
+    try {
+      thread_pool.ParallelFor(0, kNumChunks, 1, [&](size_t begin, size_t) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (begin == throwing_chunk) throw std::runtime_error("chunk");
+        num_done++;
+      });
+    } catch (std::runtime_error& e) {
+      is_thrown = true;
+    }
+    if (!is_thrown || num_done != kNumChunks - 1) return TEST_FAILURE;
+  }
+
+  std::atomic<bool> is_run(false);
+  thread_pool.Submit([]() { throw std::runtime_error("task"); });
+  thread_pool.Submit([&]() { is_run = true; });
+  while (!is_run) std::this_thread::yield();
+  return TEST_SUCCESS;
+}
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  assert(argc == 2);
+  switch (atoi(argv[1])) {
+    case 1: ReportTestResult(Test1()); break;
+    case 2: ReportTestResult(Test2()); break;
+    case 3: ReportTestResult(Test3()); break;
+    case 4: ReportTestResult(Test4()); break;
+    case 5: ReportTestResult(Test5()); break;
+    default: assert(1 == 0);
+  }
+  return 0;
+}
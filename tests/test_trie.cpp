@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <string>
 
+#include "expression_cache.h"
 #include "trie.h"
 #include "test_common.h"
 #include "common_util.h"
@@ -183,9 +184,107 @@ TestResult Test6() {
                                      nearest_expressions, kAnomalyThreshold50);
   bool is_assign_anomaly_at_1_pct = trie.IsPotentialAnomaly(
                                      nearest_expressions, kAnomalyThreshold1);
-  if (is_assign_anomaly_at_50_pct && !is_assign_anomaly_at_1_pct)
-    return TEST_SUCCESS;
-  return TEST_FAILURE;
+  if (!is_assign_anomaly_at_50_pct || is_assign_anomaly_at_1_pct)
+    return TEST_FAILURE;
+
+  // Compact form of nearest expressions should give the same verdicts.
+  CompactNearestExpressions compact_expressions;
+  if (!NearestExpressionsCache::Compress("(ifstmt (\"=\")(var (x))(var (y)))",
+                                         nearest_expressions,
+                                         compact_expressions) ||
+      !NearestExpressionsCache::IsPotentialAnomaly(trie, compact_expressions,
+                                                   kAnomalyThreshold50) ||
+      NearestExpressionsCache::IsPotentialAnomaly(trie, compact_expressions,
+                                                  kAnomalyThreshold1))
+    return TEST_FAILURE;
+  return TEST_SUCCESS;
+}
+
+// Batched search for nearest expressions should find the same expressions as
+// searching them one at a time.
+TestResult Test7() {
+  Trie trie;
+  if (BuildTrie<LEVEL_ONE>(
+    "//if (x = y)\n" \
+    "0,AST_expression_ONE:(ifstmt (\"=\")(var (x))(var (y)))\n" \
+    "//if (x == y)\n" \
+    "0,AST_expression_ONE:(ifstmt (\"==\")(var (x))(var (y)))\n" \
+    "//if (x == y)\n" \
+    "0,AST_expression_ONE:(ifstmt (\"==\")(var (x))(var (y)))\n" \
+    "//if (x ++ y)\n" \
+    "0,AST_expression_ONE:(ifstmt (\"++\")(var (x))(var (y)))\n" \
+    "//if (x < y)\n" \
+    "0,AST_expression_ONE:(ifstmt (\"<\")(var (x))(var (y)))\n" \
+    , trie) == TEST_FAILURE)
+    return TEST_FAILURE;
+
+  NearestExpression::Cost kMaxCost = 2;
+  size_t kNumThreads = 1;
+  std::vector<NearestExpression::Expression> targets = {
+    "(ifstmt (\"=\")(var (x))(var (y)))",
+    "(ifstmt (\"!=\")(var (x))(var (y)))",
+    "(whilestmt (var (x)))"
+  };
+  auto batch_results = trie.SearchNearestExpressionsInBatch(targets,
+                                                            kMaxCost);
+  if (batch_results.size() != targets.size())
+    return TEST_FAILURE;
+
+  for (size_t i = 0; i < targets.size(); i++) {
+    auto expected = trie.SearchNearestExpressions(targets[i], kMaxCost,
+                                                  kNumThreads);
+    trie.SortAndRankResults(expected);
+    trie.SortAndRankResults(batch_results[i]);
+    if (expected.size() != batch_results[i].size())
+      return TEST_FAILURE;
+    for (size_t j = 0; j < expected.size(); j++) {
+      if (!(expected[j] == batch_results[i][j]) ||
+          expected[j].GetCost() != batch_results[i][j].GetCost())
+        return TEST_FAILURE;
+    }
+  }
+
+  // Every expression from training set is at cost 0 from itself.
+  auto training_set_results = trie.SearchNearestExpressionsOfTrainingSet(0,
+                                trie.GetNumExpressions(), kMaxCost);
+  if (training_set_results.size() != trie.GetNumExpressions())
+    return TEST_FAILURE;
+  for (size_t i = 0; i < training_set_results.size(); i++) {
+    trie.SortAndRankResults(training_set_results[i]);
+    if (training_set_results[i].empty() ||
+        training_set_results[i][0].GetCost() != 0 ||
+        !(training_set_results[i][0] == trie.GetExpression(i)))
+      return TEST_FAILURE;
+  }
+  return TEST_SUCCESS;
+}
+
+// Edit distance is in tokens: replacing a word costs 1 no matter how long
+// the word is.
+TestResult Test8() {
+  Trie trie;
+  if (BuildTrie<LEVEL_ONE>(
+    "0,AST_expression_ONE:(ifstmt (binary_expression (identifier)))\n" \
+    "0,AST_expression_ONE:(whilestmt (call_expression (number_literal)))\n" \
+    , trie) == TEST_FAILURE)
+    return TEST_FAILURE;
+
+  NearestExpression::Cost kMaxCost = 1;
+  size_t kNumThreads = 1;
+  auto results = trie.SearchNearestExpressions(
+      "(ifstmt (binary_expression (number_literal)))", kMaxCost, kNumThreads);
+  trie.SortAndRankResults(results);
+  if (results.size() != 1 || results[0].GetCost() != 1 ||
+      results[0].GetExpression() !=
+        "(ifstmt (binary_expression (identifier)))")
+    return TEST_FAILURE;
+
+  // Word not seen in training data is a single token too.
+  results = trie.SearchNearestExpressions(
+      "(ifstmt (binary_expression (unseen_word)))", kMaxCost, kNumThreads);
+  if (results.size() != 1 || results[0].GetCost() != 1)
+    return TEST_FAILURE;
+  return TEST_SUCCESS;
 }
 }  // anonymous namespace
 
@@ -198,6 +297,8 @@ int main(int argc, char* argv[]) {
     case 4: ReportTestResult(Test4()); break;
     case 5: ReportTestResult(Test5()); break;
     case 6: ReportTestResult(Test6()); break;
+    case 7: ReportTestResult(Test7()); break;
+    case 8: ReportTestResult(Test8()); break;
     default: assert(1 == 0);
   }
   return 0;